@@ -0,0 +1,318 @@
+// Compiler throughput benchmark over synthetic programs.
+//
+//   cc -std=c11 -O2 -Isrc bench/compile_bench.c src/util.c -o compile_bench
+//   ./compile_bench ./chasmc [dimension ...] [--reps N]
+//   ./compile_bench --generate DIR [name=value ...]
+//
+// Generates ChASM programs that grow in one dimension at a time (functions,
+// locals per function, expression depth, imported modules, globals, macro
+// invocations per function) with the others held at a baseline, compiles
+// each with `chasmc --time-report=json`, and prints end-to-end and per-phase
+// time, lines/s and peak RSS. Every step doubles the dimension; the "growth"
+// column is the time ratio between steps divided by the ratio of source
+// bytes, so it stays near 1.0 while the cost per byte is flat and heads
+// towards 2.0 when something is quadratic. Fixed per-run costs pull it below
+// 1.0 for the smallest programs.
+#define _DEFAULT_SOURCE
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
+
+typedef enum {
+    DIM_FUNCTIONS,
+    DIM_LOCALS,
+    DIM_DEPTH,
+    DIM_MODULES,
+    DIM_GLOBALS,
+    DIM_MACROS,
+    DIM_COUNT,
+} Dimension;
+
+static const char* const dim_name[DIM_COUNT] = {"functions", "locals", "depth", "modules", "globals", "macros"};
+static const int baseline[DIM_COUNT] = {100, 8, 4, 4, 64, 2};
+static const int first_step[DIM_COUNT] = {100, 4, 2, 1, 64, 1};
+static const int last_step[DIM_COUNT] = {6400, 256, 128, 256, 16384, 128};
+
+typedef struct {
+    int n[DIM_COUNT];
+} Shape;
+
+typedef struct {
+    size_t lines;
+    size_t bytes;
+} Size;
+
+typedef struct {
+    FILE* f;
+    size_t lines;
+} Writer;
+
+static void line(Writer* w, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    vfprintf(w->f, fmt, ap);
+    va_end(ap);
+    fputc('\n', w->f);
+    w->lines++;
+}
+
+static FILE* open_for_write(const char* dir, const char* name) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", dir, name);
+    FILE* f = fopen(path, "w");
+    if (!f) die("cannot write generated program");
+    return f;
+}
+
+static void close_writer(Writer* w, Size* size) {
+    size->lines += w->lines;
+    size->bytes += (size_t)ftell(w->f);
+    fclose(w->f);
+}
+
+static void write_module(const char* dir, int k, Size* size) {
+    char name[64];
+    snprintf(name, sizeof(name), "mod%d.ravine", k);
+    Writer w = {open_for_write(dir, name), 0};
+    line(&w, "#module m%d", k);
+    line(&w, "");
+    line(&w, "#section data");
+    for (int g = 0; g < 4; g++) line(&w, "let m%dg%d:u64 = %d;", k, g, g + k);
+    line(&w, "");
+    line(&w, "#section program");
+    for (int h = 0; h < 4; h++) {
+        line(&w, "global func h%d(x:u64) >> u64:", h);
+        line(&w, "    let t:u64 = x + m%dg%d;", k, h);
+        line(&w, "    ret t + %d;", h);
+        line(&w, "end");
+        line(&w, "");
+    }
+    line(&w, "#section macros");
+    line(&w, "def twice, 1:");
+    line(&w, "    @asm {");
+    line(&w, "        add %%1, %%1");
+    line(&w, "    }");
+    line(&w, "enddef");
+    line(&w, "");
+    line(&w, "#endmodule");
+    close_writer(&w, size);
+}
+
+// A left-nested sum of `depth` terms over the arguments, earlier locals and
+// globals, so resolution and emission both scale with depth.
+static void write_expr(FILE* f, const Shape* s, int fn, int local, int depth) {
+    for (int d = 1; d < depth; d++) fputc('(', f);
+    fprintf(f, "a + g%d", (fn + local) % s->n[DIM_GLOBALS]);
+    for (int d = 1; d < depth; d++) {
+        if (local > 0) fprintf(f, ") + l%d", (d * 7 + fn) % local);
+        else fprintf(f, ") + b");
+        if (d % 3 == 0) fprintf(f, " - %d", d);
+    }
+}
+
+static Size generate(const char* dir, const Shape* s) {
+    if (mkdir(dir, 0755) != 0 && access(dir, W_OK) != 0) die("cannot create output directory");
+    Size size = {0, 0};
+    int modules = s->n[DIM_MODULES] > 0 ? s->n[DIM_MODULES] : 1;
+    for (int k = 0; k < modules; k++) write_module(dir, k, &size);
+
+    Writer w = {open_for_write(dir, "main.chasm"), 0};
+    for (int k = 0; k < modules; k++) line(&w, "#import mod%d.ravine", k);
+    line(&w, "");
+    line(&w, "#section data");
+    for (int g = 0; g < s->n[DIM_GLOBALS]; g++) line(&w, "let g%d:u64 = %d;", g, g);
+    line(&w, "");
+    line(&w, "#section program");
+    for (int fn = 0; fn < s->n[DIM_FUNCTIONS]; fn++) {
+        line(&w, "local func f%d(a:u64, b:u64) >> u64:", fn);
+        for (int l = 0; l < s->n[DIM_LOCALS]; l++) {
+            fprintf(w.f, "    let l%d:u64 = ", l);
+            write_expr(w.f, s, fn, l, s->n[DIM_DEPTH]);
+            line(&w, ";");
+        }
+        line(&w, "    let c:u64 = m%d::h%d(a);", fn % modules, fn % 4);
+        if (fn > 0) line(&w, "    set c = c + f%d(a, b);", fn - 1);
+        for (int x = 0; x < s->n[DIM_MACROS]; x++) line(&w, "    $m%d::twice, rax;", (fn + x) % modules);
+        line(&w, "    ret c;");
+        line(&w, "end");
+        line(&w, "");
+    }
+    line(&w, "global func main() >> u8:");
+    line(&w, "    let r:u64 = f%d(1, 2);", s->n[DIM_FUNCTIONS] - 1);
+    line(&w, "    ret 0;");
+    line(&w, "end");
+    close_writer(&w, &size);
+    return size;
+}
+
+typedef struct {
+    double wall_ms;
+    double phase_ms[5];  // lex, scan, emit, assemble, link: wall time from --time-report
+    long peak_rss_kb;
+} Sample;
+
+static const char* const phase_key[5] = {"lex", "scan", "emit", "assemble", "link"};
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1e3 + (double)ts.tv_nsec * 1e-6;
+}
+
+// Picks the program-wide phase totals out of the JSON report; they come
+// before the per-module entries.
+static void parse_report(const char* json, Sample* out) {
+    const char* phases = strstr(json, "\"phases\"");
+    if (!phases) die("chasmc did not print a time report");
+    for (int p = 0; p < 5; p++) {
+        char key[32];
+        snprintf(key, sizeof(key), "\"%s\": {\"wall_ms\": ", phase_key[p]);
+        const char* at = strstr(phases, key);
+        out->phase_ms[p] = at ? strtod(at + strlen(key), NULL) : 0.0;
+    }
+}
+
+static Sample compile_once(const char* chasmc, const char* dir) {
+    char report[4200];
+    char main_path[4200];
+    char out_path[4200];
+    snprintf(report, sizeof(report), "%s/report.json", dir);
+    snprintf(main_path, sizeof(main_path), "%s/main.chasm", dir);
+    snprintf(out_path, sizeof(out_path), "%s/main", dir);
+
+    Sample s = {0};
+    fflush(stdout);
+    double t0 = now_ms();
+    pid_t pid = fork();
+    if (pid < 0) die("fork failed");
+    if (pid == 0) {
+        if (!freopen(report, "w", stderr) || !freopen("/dev/null", "w", stdout)) _exit(127);
+        execl(chasmc, chasmc, main_path, "-o", out_path, "--time-report=json", (char*)NULL);
+        _exit(127);
+    }
+    int status = 0;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) < 0) die("wait failed");
+    s.wall_ms = now_ms() - t0;
+    s.peak_rss_kb = ru.ru_maxrss;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "chasmc failed on %s; see %s\n", main_path, report);
+        exit(1);
+    }
+    FileView view;
+    file_view_open(&view, report);
+    char* json = (char*)malloc(view.len + 1);
+    if (!json) die("oom");
+    memcpy(json, view.data, view.len);
+    json[view.len] = 0;
+    file_view_close(&view);
+    parse_report(json, &s);
+    free(json);
+    return s;
+}
+
+// Best of `reps` runs: the minimum is the least noisy estimate of the cost.
+static Sample measure(const char* chasmc, const char* dir, int reps) {
+    Sample best = compile_once(chasmc, dir);
+    for (int r = 1; r < reps; r++) {
+        Sample s = compile_once(chasmc, dir);
+        if (s.wall_ms < best.wall_ms) best = s;
+    }
+    return best;
+}
+
+static void run_dimension(const char* chasmc, const char* work, Dimension dim, int reps) {
+    printf("\n%s (others at baseline)\n", dim_name[dim]);
+    printf("%8s %9s %10s %12s %9s %9s %9s %9s %9s %10s %7s\n", "n", "lines", "total ms", "lines/s", "lex", "scan",
+           "emit", "assemble", "link", "peak KiB", "growth");
+    double prev_ms = 0.0;
+    size_t prev_bytes = 0;
+    for (int n = first_step[dim]; n <= last_step[dim]; n *= 2) {
+        Shape shape;
+        memcpy(shape.n, baseline, sizeof(shape.n));
+        shape.n[dim] = n;
+        char dir[4096];
+        snprintf(dir, sizeof(dir), "%s/%s-%d", work, dim_name[dim], n);
+        Size size = generate(dir, &shape);
+        Sample s = measure(chasmc, dir, reps);
+        printf("%8d %9zu %10.2f %12.0f %9.2f %9.2f %9.2f %9.2f %9.2f %10ld", n, size.lines, s.wall_ms,
+               (double)size.lines / (s.wall_ms / 1e3), s.phase_ms[0], s.phase_ms[1], s.phase_ms[2], s.phase_ms[3],
+               s.phase_ms[4], s.peak_rss_kb);
+        if (prev_bytes) printf(" %7.2f", (s.wall_ms / prev_ms) / ((double)size.bytes / (double)prev_bytes));
+        printf("\n");
+        prev_ms = s.wall_ms;
+        prev_bytes = size.bytes;
+    }
+}
+
+static int dimension_by_name(const char* name) {
+    for (int d = 0; d < DIM_COUNT; d++) {
+        if (strcmp(name, dim_name[d]) == 0) return d;
+    }
+    return -1;
+}
+
+static void usage(void) {
+    fprintf(stderr, "usage: compile_bench CHASMC [functions|locals|depth|modules|globals|macros ...] [--reps N]\n"
+                    "       compile_bench --generate DIR [functions=N locals=N depth=N modules=N globals=N macros=N]\n");
+    exit(1);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) usage();
+    if (strcmp(argv[1], "--generate") == 0) {
+        if (argc < 3) usage();
+        Shape shape;
+        memcpy(shape.n, baseline, sizeof(shape.n));
+        for (int i = 3; i < argc; i++) {
+            char* eq = strchr(argv[i], '=');
+            if (!eq) usage();
+            *eq = 0;
+            int d = dimension_by_name(argv[i]);
+            if (d < 0) usage();
+            shape.n[d] = atoi(eq + 1);
+        }
+        if (shape.n[DIM_FUNCTIONS] < 1 || shape.n[DIM_DEPTH] < 1 || shape.n[DIM_GLOBALS] < 1) usage();
+        Size size = generate(argv[2], &shape);
+        printf("%zu lines, %zu bytes in %s\n", size.lines, size.bytes, argv[2]);
+        return 0;
+    }
+
+    const char* chasmc = argv[1];
+    if (access(chasmc, X_OK) != 0) die("CHASMC must be the path to a chasmc binary");
+    // Measure the compiler, not the cache or a compile server.
+    unsetenv("CHASMC_CACHE_DIR");
+    unsetenv("CHASMC_SERVER");
+
+    int reps = 3;
+    bool selected[DIM_COUNT] = {false};
+    bool any = false;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--reps") == 0 && i + 1 < argc) {
+            reps = atoi(argv[++i]);
+            if (reps < 1) usage();
+            continue;
+        }
+        int d = dimension_by_name(argv[i]);
+        if (d < 0) usage();
+        selected[d] = true;
+        any = true;
+    }
+
+    char work[] = "/tmp/chasmc-bench-XXXXXX";
+    if (!mkdtemp(work)) die("cannot create work directory");
+    printf("chasmc: %s, best of %d, programs in %s\n", chasmc, reps, work);
+    for (int d = 0; d < DIM_COUNT; d++) {
+        if (!any || selected[d]) run_dimension(chasmc, work, (Dimension)d, reps);
+    }
+    return 0;
+}
@@ -0,0 +1,134 @@
+// Lexer throughput microbenchmark.
+//
+//   cc -std=c11 -O2 -Isrc bench/lex_bench.c src/lexer.c src/lexer_simd.c src/intern.c src/arena.c src/timing.c src/util.c
+//       -o lex_bench -lpthread
+//   ./lex_bench [file.chasm ...]
+//
+// Lexes the given files (or a synthetic program) with every scanning kernel
+// the CPU supports and reports MB/s, then the cost of packing the tokens into
+// a TokenBuffer. Token buffers and line indexes are compared across kernels,
+// so a mismatch in kinds, offsets or line starts fails the run.
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "lexer.h"
+#include "util.h"
+
+static const char* synthetic_unit =
+    ";;; synthetic function with comments, literals and long identifiers\n"
+    "local func accumulate_values_from_buffer(first_argument:u64, second_argument:i32) >> u64:\n"
+    "    let running_total_accumulator:u64 = first_argument + second_argument - 12345;\n"
+    "    let message_pointer:u64 = &greeting_message_text;            ;;; trailing comment\n"
+    "    set running_total_accumulator = running_total_accumulator + 0x7fff;\n"
+    "    $dummy_stddef::print_str, \"a fairly long string literal used for scanning\";\n"
+    "    push running_total_accumulator, message_pointer;\n"
+    "    pop message_pointer, running_total_accumulator;\n"
+    "    ret running_total_accumulator;\n"
+    "end\n\n";
+
+static char* make_synthetic(size_t target, size_t* out_len) {
+    size_t unit = strlen(synthetic_unit);
+    size_t count = target / unit + 1;
+    char* buf = (char*)malloc(count * unit + 1);
+    if (!buf) die("oom");
+    for (size_t i = 0; i < count; i++) memcpy(buf + i * unit, synthetic_unit, unit);
+    buf[count * unit] = 0;
+    *out_len = count * unit;
+    return buf;
+}
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static size_t lex_count(const char* src, size_t len) {
+    Lexer L;
+    lexer_init(&L, src, len);
+    size_t n = 0;
+    for (;;) {
+        Token t = next_token(&L);
+        n++;
+        if (t.kind == TK_EOF) break;
+    }
+    return n;
+}
+
+static void check_same_tokens(const char* src, size_t len, LexKernelLevel level) {
+    TokenBuffer ref, got;
+    lexer_select_kernels(LEX_KERNELS_SCALAR);
+    lex_buffer(&ref, "input", src, len);
+    lexer_select_kernels(level);
+    lex_buffer(&got, "input", src, len);
+    if (got.count != ref.count) die("token count differs between kernels");
+    if (memcmp(got.kinds, ref.kinds, ref.count) != 0 || memcmp(got.offsets, ref.offsets, ref.count * 4) != 0
+        || memcmp(got.lengths, ref.lengths, ref.count * 4) != 0) {
+        die("token stream differs between kernels");
+    }
+    if (got.nlines != ref.nlines || memcmp(got.lines, ref.lines, ref.nlines * 4) != 0) {
+        die("line index differs between kernels");
+    }
+    token_buffer_free(&ref);
+    token_buffer_free(&got);
+}
+
+static void bench_input(const char* name, const char* src, size_t len) {
+    LexKernelLevel best = lex_kernels_best();
+    double mb = (double)len / (1024.0 * 1024.0);
+    int reps = (int)(256.0 / (mb > 0.001 ? mb : 0.001));
+    if (reps < 3) reps = 3;
+    if (reps > 1000) reps = 1000;
+
+    printf("%s: %.2f MB, %d reps\n", name, mb, reps);
+    for (int level = LEX_KERNELS_SCALAR; level <= (int)best; level++) {
+        check_same_tokens(src, len, (LexKernelLevel)level);
+        lexer_select_kernels((LexKernelLevel)level);
+        size_t tokens = lex_count(src, len);
+        double best_time = 1e30;
+        for (int r = 0; r < reps; r++) {
+            double t0 = now_sec();
+            lex_count(src, len);
+            double dt = now_sec() - t0;
+            if (dt < best_time) best_time = dt;
+        }
+        printf("  %-7s %9.1f MB/s  %8.1f Mtok/s  (%zu tokens)\n",
+               lex_kernels_name((LexKernelLevel)level),
+               mb / best_time,
+               (double)tokens / best_time / 1e6,
+               tokens);
+    }
+
+    double best_time = 1e30;
+    for (int r = 0; r < reps; r++) {
+        TokenBuffer B;
+        double t0 = now_sec();
+        lex_buffer(&B, name, src, len);
+        double dt = now_sec() - t0;
+        token_buffer_free(&B);
+        if (dt < best_time) best_time = dt;
+    }
+    printf("  %-7s %9.1f MB/s  (%s kernels into a TokenBuffer)\n", "packed", mb / best_time,
+           lex_kernels_name(best));
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        size_t len = 0;
+        char* src = make_synthetic(16u * 1024u * 1024u, &len);
+        bench_input("synthetic", src, len);
+        free(src);
+        return 0;
+    }
+    for (int i = 1; i < argc; i++) {
+        FileView view;
+        file_view_open(&view, argv[i]);
+        bench_input(argv[i], view.data, view.len);
+        file_view_close(&view);
+    }
+    return 0;
+}
@@ -0,0 +1,108 @@
+#include "arena.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "timing.h"
+#include "util.h"
+
+#define ARENA_ALIGN 16
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+static size_t align_up(size_t n) {
+    return (n + (ARENA_ALIGN - 1)) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+static char* block_data(ArenaBlock* b) {
+    return (char*)b + align_up(sizeof(ArenaBlock));
+}
+
+static void arena_new_block(Arena* a, size_t min_size) {
+    size_t size = ARENA_BLOCK_SIZE;
+    if (min_size > size) size = min_size;
+    ArenaBlock* b = (ArenaBlock*)malloc(align_up(sizeof(ArenaBlock)) + size);
+    if (!b) die("oom");
+    b->next = a->blocks;
+    b->size = size;
+    a->blocks = b;
+    a->ptr = block_data(b);
+    a->end = a->ptr + size;
+}
+
+void* arena_alloc(Arena* a, size_t size) {
+    size = align_up(size ? size : 1);
+    timing_count(COUNT_ALLOCATIONS, 1);
+    timing_count(COUNT_ALLOCATED_BYTES, size);
+    if ((size_t)(a->end - a->ptr) < size) arena_new_block(a, size);
+    void* out = a->ptr;
+    a->ptr += size;
+    return out;
+}
+
+void* arena_calloc(Arena* a, size_t size) {
+    void* out = arena_alloc(a, size);
+    memset(out, 0, size);
+    return out;
+}
+
+// Resizes the most recent allocation in place when possible; otherwise copies.
+void* arena_grow(Arena* a, void* old, size_t old_size, size_t new_size) {
+    if (old) {
+        char* old_end = (char*)old + align_up(old_size ? old_size : 1);
+        if (old_end == a->ptr && (size_t)(a->end - (char*)old) >= align_up(new_size)) {
+            a->ptr = (char*)old + align_up(new_size);
+            return old;
+        }
+    }
+    void* out = arena_alloc(a, new_size);
+    if (old) memcpy(out, old, old_size < new_size ? old_size : new_size);
+    return out;
+}
+
+char* arena_strndup(Arena* a, const char* s, size_t len) {
+    char* out = (char*)arena_alloc(a, len + 1);
+    memcpy(out, s, len);
+    out[len] = 0;
+    return out;
+}
+
+// Releases every allocation but keeps the newest block for reuse, so an arena
+// reset once per function settles at one block after the first few functions.
+void arena_reset(Arena* a) {
+    if (!a->blocks) return;
+    ArenaBlock* keep = a->blocks;
+    ArenaBlock* b = keep->next;
+    while (b) {
+        ArenaBlock* next = b->next;
+        free(b);
+        b = next;
+    }
+    keep->next = NULL;
+    a->ptr = block_data(keep);
+    a->end = a->ptr + keep->size;
+}
+
+void arena_adopt(Arena* a, Arena* from) {
+    if (!from->blocks) return;
+    if (!a->blocks) {
+        *a = *from;
+    } else {
+        ArenaBlock* tail = from->blocks;
+        while (tail->next) tail = tail->next;
+        tail->next = a->blocks->next;
+        a->blocks->next = from->blocks;
+    }
+    *from = (Arena){0};
+}
+
+void arena_free(Arena* a) {
+    ArenaBlock* b = a->blocks;
+    while (b) {
+        ArenaBlock* next = b->next;
+        free(b);
+        b = next;
+    }
+    a->blocks = NULL;
+    a->ptr = NULL;
+    a->end = NULL;
+}
@@ -0,0 +1,29 @@
+#ifndef CHASMC_ARENA_H
+#define CHASMC_ARENA_H
+
+#include <stddef.h>
+
+// Bump-pointer allocator. Individual allocations are never freed; the whole
+// arena is released at once when its scope (compilation, file, function) ends.
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t size;
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* blocks;
+    char* ptr;
+    char* end;
+} Arena;
+
+void* arena_alloc(Arena* a, size_t size);
+void* arena_calloc(Arena* a, size_t size);
+void* arena_grow(Arena* a, void* old, size_t old_size, size_t new_size);
+char* arena_strndup(Arena* a, const char* s, size_t len);
+void arena_reset(Arena* a);
+// Moves every block of `from` into `a`, leaving `from` empty. Allocations
+// from either stay valid until `a` is freed; `a` keeps bumping its own block.
+void arena_adopt(Arena* a, Arena* from);
+void arena_free(Arena* a);
+
+#endif
@@ -1,68 +1,85 @@
+#define _DEFAULT_SOURCE
+
 #include "assembler.h"
 
-#include <stdarg.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-
+#include <sys/stat.h>
+
+#include "arena.h"
+#include "cache.h"
+#include "emit.h"
+#include "fold.h"
+#include "intern.h"
+#include "ir.h"
 #include "lexer.h"
+#include "peephole.h"
+#include "pool.h"
+#include "regalloc.h"
+#include "source.h"
+#include "timing.h"
 #include "util.h"
 
+// All names below are interned (see intern.h), so they compare by pointer.
 typedef struct {
-    FILE* out;
-} Out;
-
-static void outln(Out* O, const char* s) { fprintf(O->out, "%s\n", s); }
-static void outfmt(Out* O, const char* fmt, ...) {
-    va_list ap;
-    va_start(ap, fmt);
-    vfprintf(O->out, fmt, ap);
-    va_end(ap);
-}
-
-typedef struct {
-    char* name;
-    char* qualified;
+    const char* name;
+    const char* qualified;
+    bool ambiguous;
 } Symbol;
 
 typedef struct {
     Symbol* items;
     size_t count;
     size_t cap;
+    NameMap index;
+    Arena* arena;
 } SymbolTable;
 
+static void init_symbol_table(SymbolTable* table, Arena* arena) {
+    *table = (SymbolTable){0};
+    table->arena = arena;
+    table->index.arena = arena;
+}
+
+// name_map_find for name resolution, counted for --time-report.
+static size_t* find_name(const NameMap* index, const char* name) {
+    if (timing_enabled) {
+        timing_count(COUNT_LOOKUPS, 1);
+        timing_count(COUNT_PROBES, name_map_probes(index, name));
+    }
+    return name_map_find(index, name);
+}
+
 static void add_symbol(SymbolTable* table, const char* name, const char* qualified) {
+    size_t* first = name_map_find(&table->index, name);
+    if (first) {
+        table->items[*first].ambiguous = true;
+    } else {
+        name_map_put(&table->index, name, table->count);
+    }
     if (table->count + 1 > table->cap) {
+        size_t old_cap = table->cap;
         table->cap = (table->cap == 0) ? 16 : table->cap*  2;
-        table->items = (Symbol* )realloc(table->items, table->cap*  sizeof(Symbol));
-        if (!table->items) die("oom");
+        table->items = (Symbol* )arena_grow(table->arena, table->items, old_cap*  sizeof(Symbol), table->cap*  sizeof(Symbol));
     }
-    table->items[table->count++] = (Symbol){xstrdup(name), xstrdup(qualified)};
+    table->items[table->count++] = (Symbol){name, qualified, false};
 }
 
 static const char* lookup_symbol(SymbolTable* table, const char* name) {
-    const char* hit = NULL;
-    for (size_t i = 0; i < table->count; i++) {
-        if (strcmp(table->items[i].name, name) == 0) {
-            if (hit) die("ambiguous name; use namespace qualifier");
-            hit = table->items[i].qualified;
-        }
-    }
-    return hit;
-}
-
-static void free_symbol_table(SymbolTable* table) {
-    for (size_t i = 0; i < table->count; i++) {
-        free(table->items[i].name);
-        free(table->items[i].qualified);
-    }
-    free(table->items);
+    size_t* idx = find_name(&table->index, name);
+    if (!idx) return NULL;
+    if (table->items[*idx].ambiguous) die("ambiguous name; use namespace qualifier");
+    return table->items[*idx].qualified;
 }
 
 typedef struct {
-    char* name;
+    const char* name;
     int arity;
     char* body;
 } Macro;
@@ -71,62 +88,66 @@ typedef struct {
     Macro* items;
     size_t count;
     size_t cap;
+    NameMap index;
     SymbolTable symbols;
+    Arena* arena;
 } MacroTable;
 
-static void add_macro(MacroTable* table, const char* name, int arity, const char* body) {
+static void init_macro_table(MacroTable* table, Arena* arena) {
+    *table = (MacroTable){0};
+    table->arena = arena;
+    table->index.arena = arena;
+    init_symbol_table(&table->symbols, arena);
+}
+
+static void add_macro(MacroTable* table, const char* name, int arity, const char* body, size_t body_len) {
     if (table->count + 1 > table->cap) {
+        size_t old_cap = table->cap;
         table->cap = (table->cap == 0) ? 8 : table->cap*  2;
-        table->items = (Macro* )realloc(table->items, table->cap*  sizeof(Macro));
-        if (!table->items) die("oom");
+        table->items = (Macro* )arena_grow(table->arena, table->items, old_cap*  sizeof(Macro), table->cap*  sizeof(Macro));
     }
-    table->items[table->count++] = (Macro){xstrdup(name), arity, xstrdup(body)};
+    if (!name_map_find(&table->index, name)) name_map_put(&table->index, name, table->count);
+    table->items[table->count++] = (Macro){name, arity, arena_strndup(table->arena, body, body_len)};
 }
 
 static Macro* find_macro(MacroTable* table, const char* name) {
-    for (size_t i = 0; i < table->count; i++) {
-        if (strcmp(table->items[i].name, name) == 0) return &table->items[i];
-    }
-    return NULL;
+    size_t* idx = find_name(&table->index, name);
+    return idx ? &table->items[*idx] : NULL;
 }
 
-static void free_macro_table(MacroTable* table) {
-    for (size_t i = 0; i < table->count; i++) {
-        free(table->items[i].name);
-        free(table->items[i].body);
+static Type parse_type_name(const Token* t) {
+    switch (t->kind) {
+        case TK_KW_U8:
+            return (Type){TY_U8};
+        case TK_KW_U16:
+            return (Type){TY_U16};
+        case TK_KW_U32:
+            return (Type){TY_U32};
+        case TK_KW_U64:
+            return (Type){TY_U64};
+        case TK_KW_I8:
+            return (Type){TY_I8};
+        case TK_KW_I16:
+            return (Type){TY_I16};
+        case TK_KW_I32:
+            return (Type){TY_I32};
+        case TK_KW_I64:
+            return (Type){TY_I64};
+        case TK_KW_NULL:
+            return (Type){TY_NULL};
+        default:
+            return (Type){TY_UNKNOWN};
     }
-    free(table->items);
-    free_symbol_table(&table->symbols);
 }
 
-typedef enum {
-    TY_U8,
-    TY_U16,
-    TY_U32,
-    TY_U64,
-    TY_I8,
-    TY_I16,
-    TY_I32,
-    TY_I64,
-    TY_NULL,
-    TY_UNKNOWN
-} TypeKind;
-
-typedef struct {
-    TypeKind kind;
-} Type;
-
-static Type parse_type_name(const Token* t) {
-    if (token_is(t, "u8")) return (Type){TY_U8};
-    if (token_is(t, "u16")) return (Type){TY_U16};
-    if (token_is(t, "u32")) return (Type){TY_U32};
-    if (token_is(t, "u64")) return (Type){TY_U64};
-    if (token_is(t, "i8")) return (Type){TY_I8};
-    if (token_is(t, "i16")) return (Type){TY_I16};
-    if (token_is(t, "i32")) return (Type){TY_I32};
-    if (token_is(t, "i64")) return (Type){TY_I64};
-    if (token_is(t, "Null") || token_is(t, "null")) return (Type){TY_NULL};
-    return (Type){TY_UNKNOWN};
+// Decimal value of an integer token, with atoi semantics (stops at the first
+// non-digit).
+static int token_int(const Token* t) {
+    int value = 0;
+    for (const char* c = t->start; c < t->end && *c >= '0' && *c <= '9'; c++) {
+        value = value * 10 + (*c - '0');
+    }
+    return value;
 }
 
 static int type_size(Type ty) {
@@ -167,6 +188,13 @@ static const char* nasm_size(Type ty) {
     }
 }
 
+static const char* rax_by_size(int size_bytes) {
+    if (size_bytes == 1) return "al";
+    if (size_bytes == 2) return "ax";
+    if (size_bytes == 4) return "eax";
+    return "rax";
+}
+
 static const char* nasm_data_directive(Type ty) {
     switch (ty.kind) {
         case TY_U8:
@@ -186,40 +214,27 @@ static const char* nasm_data_directive(Type ty) {
     }
 }
 
+// Parse-time view of a function's frame. The slots themselves are the IR's
+// locals; the index maps a name to the first slot declared with it.
 typedef struct {
-    char* name;
-    Type ty;
-    int rbp_off;
-} Local;
-
-typedef struct {
-    Local* locals;
-    size_t nlocals, cap;
+    IrFunc* fn;
     int stack_used;
+    NameMap index;
 } FrameLayout;
 
-static void add_local(FrameLayout* F, const char* name, Type ty) {
-    if (F->nlocals + 1 > F->cap) {
-        F->cap = (F->cap == 0) ? 16 : F->cap*  2;
-        F->locals = (Local* )realloc(F->locals, F->cap*  sizeof(Local));
-        if (!F->locals) die("oom");
-    }
+static int add_local(FrameLayout* F, const char* name, Type ty) {
     int sz = type_size(ty);
     F->stack_used += sz ? sz : 8;
     if (F->stack_used % 8) F->stack_used += (8 - (F->stack_used % 8));
 
-    Local L;
-    L.name = xstrdup(name);
-    L.ty = ty;
-    L.rbp_off = -F->stack_used;
-    F->locals[F->nlocals++] = L;
+    int slot = ir_add_local(F->fn, name, ty.kind, -F->stack_used);
+    if (!name_map_find(&F->index, name)) name_map_put(&F->index, name, (size_t)slot);
+    return slot;
 }
 
-static Local* find_local(FrameLayout* F, const char* name) {
-    for (size_t i = 0; i < F->nlocals; i++) {
-        if (strcmp(F->locals[i].name, name) == 0) return &F->locals[i];
-    }
-    return NULL;
+static int find_local(FrameLayout* F, const char* name) {
+    size_t* idx = find_name(&F->index, name);
+    return idx ? (int)*idx : -1;
 }
 
 typedef enum {
@@ -232,18 +247,29 @@ typedef enum {
 } Section;
 
 typedef struct {
-    char* name;
+    const char* name;
     Type ty;
     int reserve_count;
+    bool is_const;  // readonly, initialized with a single integer literal
+    uint64_t value;
 } GlobalVar;
 
 typedef struct {
     GlobalVar* items;
     size_t count;
     size_t cap;
+    NameMap index;
     SymbolTable symbols;
+    Arena* arena;
 } GlobalTable;
 
+static void init_global_table(GlobalTable* table, Arena* arena) {
+    *table = (GlobalTable){0};
+    table->arena = arena;
+    table->index.arena = arena;
+    init_symbol_table(&table->symbols, arena);
+}
+
 static GlobalVar* find_global(GlobalTable* table, const char* name);
 
 static void add_global(GlobalTable* table,
@@ -255,91 +281,194 @@ static void add_global(GlobalTable* table,
         return;
     }
     if (table->count + 1 > table->cap) {
+        size_t old_cap = table->cap;
         table->cap = (table->cap == 0) ? 16 : table->cap*  2;
-        table->items = (GlobalVar* )realloc(table->items, table->cap*  sizeof(GlobalVar));
-        if (!table->items) die("oom");
+        table->items = (GlobalVar* )arena_grow(table->arena, table->items, old_cap*  sizeof(GlobalVar), table->cap*  sizeof(GlobalVar));
     }
-    table->items[table->count++] = (GlobalVar){xstrdup(qualified_name), ty, reserve_count};
+    name_map_put(&table->index, qualified_name, table->count);
+    table->items[table->count++] = (GlobalVar){qualified_name, ty, reserve_count, false, 0};
     add_symbol(&table->symbols, raw_name, qualified_name);
 }
 
 static GlobalVar* find_global(GlobalTable* table, const char* name) {
-    for (size_t i = 0; i < table->count; i++) {
-        if (strcmp(table->items[i].name, name) == 0) return &table->items[i];
-    }
-    return NULL;
+    size_t* idx = find_name(&table->index, name);
+    return idx ? &table->items[*idx] : NULL;
 }
 
-static void free_global_table(GlobalTable* table) {
-    for (size_t i = 0; i < table->count; i++) {
-        free(table->items[i].name);
-    }
-    free(table->items);
-    free_symbol_table(&table->symbols);
+static const char* resolve_import_path(const char* from_path, const char* import_path) {
+    if (import_path[0] == '/') return import_path;
+    const char* slash = strrchr(from_path, '/');
+    if (!slash) return import_path;
+    size_t dir_len = (size_t)(slash - from_path + 1);
+    return intern_concat(from_path, dir_len, import_path, strlen(import_path), "", 0);
 }
 
 typedef struct {
-    char* *paths;
-    size_t count;
-    size_t cap;
-} ImportSet;
+    SymbolTable funcs;
+    GlobalTable globals;
+    MacroTable macros;
+    SourceSet sources;
+    Arena arena;
+    int split_jobs;  // > 1: --split-functions, emitting bodies on this many threads
+    int opt_level;
+} CompileContext;
+
+// Each module is emitted into its own buffer, independently of the others.
+// Everything whose result depends on emission order (imports, macro
+// definitions and macro uses) is recorded as a splice at a buffer offset and
+// resolved when the buffers are stitched together in import order.
+typedef enum {
+    SPLICE_IMPORT,
+    SPLICE_MACRO_DEF,
+    SPLICE_MACRO_USE,
+} SpliceKind;
+
+typedef struct {
+    SpliceKind kind;
+    size_t offset;
+    Section section;  // imports: last section the module switched to before it
+    SourceFile* dep;
+    const char* name;
+    int arity;
+    const char* body;
+    size_t body_len;
+    char** args;
+    int argc;
+} Splice;
+
+// Symbols a module defines, for separate compilation. Data labels are always
+// visible to other modules; functions only when declared `global func`.
+typedef enum {
+    MSYM_LOCAL_FUNC,
+    MSYM_GLOBAL_FUNC,
+    MSYM_DATA,
+} ModuleSymbolKind;
+
+typedef struct {
+    const char* name;
+    ModuleSymbolKind kind;
+} ModuleSymbol;
 
-static bool import_seen(ImportSet* set, const char* path) {
-    for (size_t i = 0; i < set->count; i++) {
-        if (strcmp(set->paths[i], path) == 0) return true;
+typedef struct {
+    Out out;
+    Splice* splices;
+    size_t nsplices;
+    size_t splices_cap;
+    Section end_section;  // last section switched to after the final import
+
+    ModuleSymbol* defs;
+    size_t ndefs;
+    size_t defs_cap;
+    const char** refs;  // names used in call/lea/[rel], in first-use order
+    size_t nrefs;
+    size_t refs_cap;
+    NameMap ref_index;
+
+    Arena arena;
+    bool cached;  // restored from the cache; workers skip it
+} ModuleOut;
+
+static void add_module_def(ModuleOut* M, const char* name, ModuleSymbolKind kind) {
+    if (M->ndefs + 1 > M->defs_cap) {
+        size_t old_cap = M->defs_cap;
+        M->defs_cap = (M->defs_cap == 0) ? 16 : M->defs_cap*  2;
+        M->defs = (ModuleSymbol* )arena_grow(&M->arena, M->defs, old_cap*  sizeof(ModuleSymbol), M->defs_cap*  sizeof(ModuleSymbol));
     }
-    return false;
+    M->defs[M->ndefs++] = (ModuleSymbol){name, kind};
 }
 
-static void add_import(ImportSet* set, const char* path) {
-    if (set->count + 1 > set->cap) {
-        set->cap = (set->cap == 0) ? 16 : set->cap*  2;
-        set->paths = (char* *)realloc(set->paths, set->cap*  sizeof(char* ));
-        if (!set->paths) die("oom");
+static void add_module_ref(ModuleOut* M, const char* name) {
+    if (name_map_find(&M->ref_index, name)) return;
+    if (M->nrefs + 1 > M->refs_cap) {
+        size_t old_cap = M->refs_cap;
+        M->refs_cap = (M->refs_cap == 0) ? 16 : M->refs_cap*  2;
+        M->refs = (const char* *)arena_grow(&M->arena, M->refs, old_cap*  sizeof(char* ), M->refs_cap*  sizeof(char* ));
     }
-    set->paths[set->count++] = xstrdup(path);
+    M->ref_index.arena = &M->arena;
+    name_map_put(&M->ref_index, name, M->nrefs);
+    M->refs[M->nrefs++] = name;
 }
 
-static char* resolve_import_path(const char* from_path, const char* import_path) {
-    if (import_path[0] == '/') return xstrdup(import_path);
-    const char* slash = strrchr(from_path, '/');
-    if (!slash) return xstrdup(import_path);
-    size_t dir_len = (size_t)(slash - from_path + 1);
-    size_t rel_len = strlen(import_path);
-    char* out = (char* )malloc(dir_len + rel_len + 1);
-    if (!out) die("oom");
-    memcpy(out, from_path, dir_len);
-    memcpy(out + dir_len, import_path, rel_len);
-    out[dir_len + rel_len] = 0;
-    return out;
+static Splice* add_splice(ModuleOut* M, SpliceKind kind) {
+    if (M->nsplices + 1 > M->splices_cap) {
+        size_t old_cap = M->splices_cap;
+        M->splices_cap = (M->splices_cap == 0) ? 8 : M->splices_cap*  2;
+        M->splices = (Splice* )arena_grow(&M->arena, M->splices, old_cap*  sizeof(Splice), M->splices_cap*  sizeof(Splice));
+    }
+    Splice* sp = &M->splices[M->nsplices++];
+    *sp = (Splice){0};
+    sp->kind = kind;
+    sp->offset = M->out.len;
+    return sp;
+}
+
+// Qualified names are cached per (namespace, name) pair so repeated references
+// resolve without building the mangled string again. Module workers each keep
+// their own cache; the interned results are identical.
+static _Thread_local PairMap qualified_cache;
+
+static const char* join_namespace(const char* ns, const char* name) {
+    const char* hit = pair_map_find(&qualified_cache, ns, name);
+    if (hit) return hit;
+    const char* qualified = intern_concat(ns, strlen(ns), "__", 2, name, strlen(name));
+    pair_map_put(&qualified_cache, ns, name, qualified);
+    return qualified;
+}
+
+static const char* resolve_definition_name(const char* current_ns, const char* name) {
+    if (current_ns) return join_namespace(current_ns, name);
+    return name;
 }
 
+// While a library is compiled for its precompiled interface, every
+// program-wide lookup that shaped its code is logged. An importer replays
+// them against its own tables and only reuses the code when all agree.
+typedef enum {
+    LOOKUP_FUNC,
+    LOOKUP_GLOBAL,
+    LOOKUP_MACRO,
+    LOOKUP_GLOBAL_TYPE,
+    LOOKUP_TABLE_COUNT,
+} LookupTable;
+
 typedef struct {
-    SymbolTable funcs;
-    GlobalTable globals;
-    MacroTable macros;
-    ImportSet scanned;
-} CompileContext;
+    LookupTable table;
+    const char* name;
+    const char* result;  // qualified name, NULL when not found
+    TypeKind type;       // LOOKUP_GLOBAL_TYPE only
+} Lookup;
 
-static char* join_namespace(const char* ns, const char* name) {
-    size_t nlen = strlen(ns);
-    size_t mlen = strlen(name);
-    char* out = (char* )malloc(nlen + 2 + mlen + 1);
-    if (!out) die("oom");
-    memcpy(out, ns, nlen);
-    out[nlen] = '_';
-    out[nlen + 1] = '_';
-    memcpy(out + nlen + 2, name, mlen);
-    out[nlen + 2 + mlen] = 0;
-    return out;
+typedef struct {
+    const CompileContext* ctx;
+    Lookup* items;
+    size_t count;
+    size_t cap;
+    NameMap seen[LOOKUP_TABLE_COUNT];
+} LookupLog;
+
+static _Thread_local LookupLog* lookup_log;
+
+static void log_lookup(LookupTable table, const char* name, const char* result, TypeKind type) {
+    LookupLog* log = lookup_log;
+    if (name_map_find(&log->seen[table], name)) return;
+    name_map_put(&log->seen[table], name, log->count);
+    if (log->count == log->cap) {
+        log->cap = log->cap ? log->cap * 2 : 64;
+        log->items = (Lookup*)realloc(log->items, log->cap * sizeof(Lookup));
+        if (!log->items) die("oom");
+    }
+    log->items[log->count++] = (Lookup){table, name, result, type};
 }
 
-static char* resolve_definition_name(const char* current_ns, const char* name) {
-    if (current_ns) return join_namespace(current_ns, name);
-    return xstrdup(name);
+static void log_symbol_lookup(const SymbolTable* table, const char* name, const char* result) {
+    const CompileContext* ctx = lookup_log->ctx;
+    LookupTable id = LOOKUP_FUNC;
+    if (table == &ctx->globals.symbols) id = LOOKUP_GLOBAL;
+    if (table == &ctx->macros.symbols) id = LOOKUP_MACRO;
+    log_lookup(id, name, result, TY_UNKNOWN);
 }
 
-static char* resolve_reference_name(const char* current_ns,
+static const char* resolve_reference_name(const char* current_ns,
                                     const char* name,
                                     const char* explicit_ns,
                                     const char* *using_namespaces,
@@ -347,184 +476,254 @@ static char* resolve_reference_name(const char* current_ns,
                                     SymbolTable* table) {
     if (explicit_ns) return join_namespace(explicit_ns, name);
     const char* qualified = lookup_symbol(table, name);
-    if (qualified) return xstrdup(qualified);
+    if (lookup_log) log_symbol_lookup(table, name, qualified);
+    if (qualified) return qualified;
     if (current_ns) return join_namespace(current_ns, name);
     if (using_count == 1) return join_namespace(using_namespaces[0], name);
     if (using_count > 1) die("ambiguous namespace reference; use <ns>::<name>");
-    return xstrdup(name);
+    return name;
 }
 
-static void scan_file_for_symbols(CompileContext* ctx, const char* path);
+static void scan_file_for_symbols(CompileContext* ctx, SourceFile* file);
+static SourceFile* load_import(CompileContext* ctx, const char* path);
+static void scan_interface(CompileContext* ctx, SourceFile* file);
 
-static void scan_imports_in_file(CompileContext* ctx, const char* path, const char* src, size_t len) {
-    Lexer L;
-    lexer_init(&L, src, len);
+static void scan_imports_in_file(CompileContext* ctx, SourceFile* file) {
+    TokenStream ts = {&file->toks, 0};
+    StreamPosition where = {file->path, &ts};
+    DieContext saved = die_set_context((DieContext){describe_stream_position, &where});
     for (;;) {
-        Token t = next_token(&L);
+        Token t = token_stream_next(&ts);
         if (t.kind == TK_EOF) break;
         if (t.kind == TK_HASH) {
-            Token dir = next_token(&L);
-            if (dir.kind == TK_IDENT && token_is(&dir, "import")) {
-                Token path_tok = next_token(&L);
-                if (path_tok.kind != TK_IDENT && path_tok.kind != TK_STRING && path_tok.kind != TK_PATH) {
+            Token dir = token_stream_next(&ts);
+            if (dir.kind == TK_KW_IMPORT) {
+                Token path_tok = token_stream_next(&ts);
+                if (!token_is_name(&path_tok) && path_tok.kind != TK_STRING && path_tok.kind != TK_PATH) {
                     die("expected path after #import");
                 }
-                char* import_token = token_str(&path_tok);
-                char* resolved = resolve_import_path(path, import_token);
-                free(import_token);
-                scan_file_for_symbols(ctx, resolved);
-                free(resolved);
+                const char* resolved = resolve_import_path(file->path, token_intern(&path_tok));
+                SourceFile* dep = load_import(ctx, resolved);
+                source_add_import(file, dep);
+                scan_file_for_symbols(ctx, dep);
             }
         }
     }
+    die_set_context(saved);
 }
 
 static bool is_reserve_directive(const Token* t) {
-    return token_is(t, "resb") || token_is(t, "resw") || token_is(t, "resd") || token_is(t, "resq");
+    return t->kind >= TK_KW_RESB && t->kind <= TK_KW_RESQ;
 }
 
 static Type type_for_reserve(const Token* t) {
-    if (token_is(t, "resb")) return (Type){TY_U8};
-    if (token_is(t, "resw")) return (Type){TY_U16};
-    if (token_is(t, "resd")) return (Type){TY_U32};
-    if (token_is(t, "resq")) return (Type){TY_U64};
-    return (Type){TY_UNKNOWN};
+    switch (t->kind) {
+        case TK_KW_RESB:
+            return (Type){TY_U8};
+        case TK_KW_RESW:
+            return (Type){TY_U16};
+        case TK_KW_RESD:
+            return (Type){TY_U32};
+        case TK_KW_RESQ:
+            return (Type){TY_U64};
+        default:
+            return (Type){TY_UNKNOWN};
+    }
 }
 
-static void scan_file_for_symbols(CompileContext* ctx, const char* path) {
-    if (import_seen(&ctx->scanned, path)) return;
-    add_import(&ctx->scanned, path);
+static Section section_for_token(const Token* t) {
+    switch (t->kind) {
+        case TK_KW_PROGRAM:
+            return SEC_TEXT;
+        case TK_KW_DATA:
+            return SEC_DATA;
+        case TK_KW_BSS:
+            return SEC_BSS;
+        case TK_KW_READONLY:
+            return SEC_RODATA;
+        case TK_KW_MACROS:
+            return SEC_MACROS;
+        default:
+            return SEC_NONE;
+    }
+}
 
-    size_t len = 0;
-    char* src = read_file_all(path, &len);
-    scan_imports_in_file(ctx, path, src, len);
+// `= N;` or `= -N;` after a readonly let: a value -O1 may use in place of
+// loading it.
+static void scan_readonly_value(TokenStream* ts, Token eq, GlobalVar* G) {
+    if (eq.kind != TK_EQ || G->reserve_count != 1) return;
+    Token t = token_stream_next(ts);
+    bool negative = t.kind == TK_MINUS;
+    if (negative) t = token_stream_next(ts);
+    if (t.kind != TK_INT || token_stream_next(ts).kind != TK_SEMI) return;
+    uint64_t v = ir_parse_int(t.start, (size_t)(t.end - t.start));
+    G->is_const = true;
+    G->value = negative ? 0 - v : v;
+}
 
-    Lexer L;
-    lexer_init(&L, src, len);
+// Adds the functions, globals and macro names a file itself defines.
+static void scan_definitions(CompileContext* ctx, SourceFile* file) {
+    TokenStream ts = {&file->toks, 0};
+    StreamPosition where = {file->path, &ts};
+    DieContext saved = die_set_context((DieContext){describe_stream_position, &where});
 
-    char* current_namespace = NULL;
+    const char* current_namespace = NULL;
     Section section = SEC_NONE;
 
     for (;;) {
-        Token t = next_token(&L);
+        Token t = token_stream_next(&ts);
         if (t.kind == TK_EOF) break;
         if (t.kind == TK_HASH) {
-            Token dir = next_token(&L);
-            if (dir.kind != TK_IDENT) continue;
-            if (token_is(&dir, "module")) {
-                Token name = next_token(&L);
-                if (name.kind != TK_IDENT) die("expected module name after #module");
-                free(current_namespace);
-                current_namespace = token_str(&name);
-                continue;
-            }
-            if (token_is(&dir, "endmodule")) {
-                free(current_namespace);
-                current_namespace = NULL;
-                continue;
-            }
-            if (token_is(&dir, "section")) {
-                Token name = next_token(&L);
-                if (name.kind != TK_IDENT) die("expected section name");
-                if (token_is(&name, "program")) section = SEC_TEXT;
-                else if (token_is(&name, "data")) section = SEC_DATA;
-                else if (token_is(&name, "bss")) section = SEC_BSS;
-                else if (token_is(&name, "readonly")) section = SEC_RODATA;
-                else if (token_is(&name, "macros")) section = SEC_MACROS;
-                else section = SEC_NONE;
-                continue;
+            Token dir = token_stream_next(&ts);
+            switch (dir.kind) {
+                case TK_KW_MODULE: {
+                    Token name = token_stream_next(&ts);
+                    if (!token_is_name(&name)) die("expected module name after #module");
+                    current_namespace = token_intern(&name);
+                    break;
+                }
+                case TK_KW_ENDMODULE:
+                    current_namespace = NULL;
+                    break;
+                case TK_KW_SECTION: {
+                    Token name = token_stream_next(&ts);
+                    if (!token_is_name(&name)) die("expected section name");
+                    section = section_for_token(&name);
+                    break;
+                }
+                default:
+                    break;
             }
+            continue;
         }
 
-        if (t.kind == TK_IDENT && (token_is(&t, "local") || token_is(&t, "global"))) {
-            Token maybe_inline = next_token(&L);
-            if (maybe_inline.kind == TK_IDENT && token_is(&maybe_inline, "inline")) {
-                maybe_inline = next_token(&L);
+        if (t.kind == TK_KW_LOCAL || t.kind == TK_KW_GLOBAL) {
+            Token maybe_inline = token_stream_next(&ts);
+            if (maybe_inline.kind == TK_KW_INLINE) {
+                maybe_inline = token_stream_next(&ts);
             }
-            if (maybe_inline.kind != TK_IDENT || !token_is(&maybe_inline, "func")) {
+            if (maybe_inline.kind != TK_KW_FUNC) {
                 die("expected 'func' after local/global");
             }
-            Token name = next_token(&L);
-            if (name.kind != TK_IDENT) die("expected function name");
-            char* raw = token_str(&name);
-            char* qualified = current_namespace ? join_namespace(current_namespace, raw) : xstrdup(raw);
-            add_symbol(&ctx->funcs, raw, qualified);
-            free(raw);
-            free(qualified);
+            Token name = token_stream_next(&ts);
+            if (!token_is_name(&name)) die("expected function name");
+            const char* raw = token_intern(&name);
+            add_symbol(&ctx->funcs, raw, resolve_definition_name(current_namespace, raw));
             continue;
         }
 
         if (section == SEC_DATA || section == SEC_BSS || section == SEC_RODATA) {
-            if (t.kind == TK_IDENT && token_is(&t, "let")) {
-                Token name = next_token(&L);
-                if (name.kind != TK_IDENT && name.kind != TK_STAR) die("expected variable name after let");
+            if (t.kind == TK_KW_LET) {
+                Token name = token_stream_next(&ts);
+                if (!token_is_name(&name) && name.kind != TK_STAR) die("expected variable name after let");
                 bool pointer_name = false;
                 if (name.kind == TK_STAR) {
                     pointer_name = true;
-                    name = next_token(&L);
+                    name = token_stream_next(&ts);
                 }
-                if (name.kind != TK_IDENT) die("expected variable name after let");
-                char* raw = token_str(&name);
-                char* qualified = resolve_definition_name(current_namespace, raw);
+                if (!token_is_name(&name)) die("expected variable name after let");
+                const char* raw = token_intern(&name);
+                const char* qualified = resolve_definition_name(current_namespace, raw);
 
-                Token maybe_colon = next_token(&L);
+                Token maybe_colon = token_stream_next(&ts);
                 Type ty = (Type){TY_UNKNOWN};
                 int reserve_count = 1;
                 if (maybe_colon.kind == TK_COLON) {
-                    Token type_token = next_token(&L);
+                    Token type_token = token_stream_next(&ts);
                     ty = parse_type_name(&type_token);
                     if (ty.kind == TY_UNKNOWN && is_reserve_directive(&type_token)) {
                         ty = type_for_reserve(&type_token);
-                        Token count_tok = next_token(&L);
+                        Token count_tok = token_stream_next(&ts);
                         if (count_tok.kind != TK_INT) die("expected reserve count");
-                        char* count_str = token_str(&count_tok);
-                        reserve_count = atoi(count_str);
-                        free(count_str);
+                        reserve_count = token_int(&count_tok);
                     }
                 }
 
                 if (ty.kind == TY_UNKNOWN && pointer_name) ty.kind = TY_U64;
                 if (ty.kind == TY_UNKNOWN) ty.kind = TY_U64;
 
+                size_t count = ctx->globals.count;
                 add_global(&ctx->globals, raw, qualified, ty, reserve_count);
-                free(raw);
-                free(qualified);
+                if (section == SEC_RODATA && ctx->globals.count > count) {
+                    Token eq = maybe_colon.kind == TK_COLON ? token_stream_next(&ts) : maybe_colon;
+                    scan_readonly_value(&ts, eq, &ctx->globals.items[count]);
+                }
                 continue;
             }
         }
 
         if (section == SEC_MACROS) {
-            if (t.kind == TK_IDENT && token_is(&t, "def")) {
-                Token name = next_token(&L);
-                if (name.kind != TK_IDENT) die("expected macro name");
-                char* raw = token_str(&name);
-                char* qualified = resolve_definition_name(current_namespace, raw);
-                Token maybe_comma = next_token(&L);
+            if (t.kind == TK_KW_DEF) {
+                Token name = token_stream_next(&ts);
+                if (!token_is_name(&name)) die("expected macro name");
+                const char* raw = token_intern(&name);
+                const char* qualified = resolve_definition_name(current_namespace, raw);
+                Token maybe_comma = token_stream_next(&ts);
                 if (maybe_comma.kind == TK_COMMA) {
-                    Token count_tok = next_token(&L);
+                    Token count_tok = token_stream_next(&ts);
                     if (count_tok.kind != TK_INT) die("expected macro arity");
-                    char* count_str = token_str(&count_tok);
-                    (void)count_str;
-                    free(count_str);
                 }
                 add_symbol(&ctx->macros.symbols, raw, qualified);
-                free(raw);
-                free(qualified);
                 continue;
             }
         }
     }
+    die_set_context(saved);
+}
 
-    free(current_namespace);
-    free(src);
+static void scan_file_for_symbols(CompileContext* ctx, SourceFile* file) {
+    if (file->scanned) return;
+    file->scanned = true;
+    if (!file->toks.count) {
+        scan_interface(ctx, file);
+        return;
+    }
+    scan_imports_in_file(ctx, file);
+    TimingMark start = timing_start();
+    scan_definitions(ctx, file);
+    timing_stop(PHASE_SCAN, file->path, start);
 }
 
+// Where a module's output stands: lengths of its text and lists.
+typedef struct {
+    size_t out;
+    size_t splices;
+    size_t defs;
+    size_t refs;
+} ModuleMark;
+
+// A function body the top-level parse skipped, for --split-functions.
+typedef struct {
+    size_t pos;  // token index of the '(' after the name
+    size_t end;  // token index the top-level parse resumed at
+    const char* raw_name;
+    bool is_global;
+    bool is_inline;
+    const char* ns;
+    const char* *usings;
+    size_t using_count;
+    ModuleMark at;    // where the body goes in the module
+    ModuleMark from;  // the body's output in its chunk's fragment
+    ModuleMark to;
+    size_t top_dest;  // where the top level before it goes when stitched
+    size_t dest;      // and where the body goes
+} DeferredFunc;
+
+typedef struct {
+    DeferredFunc* items;
+    size_t count;
+    size_t cap;
+} DeferredFuncs;
+
 typedef struct {
-    Lexer* L;
+    TokenStream* ts;
     Token cur;
     Out* O;
-    char* current_namespace;
-    char* *using_namespaces;
+    ModuleOut* module;
+    Arena* file_arena;
+    Arena* func_arena;
+    const char* current_namespace;
+    const char* *using_namespaces;
     size_t using_count;
     size_t using_cap;
     SymbolTable* func_table;
@@ -532,9 +731,12 @@ typedef struct {
     MacroTable* macro_table;
     GlobalTable* globals;
     Section current_section;
+    Section out_section;  // last section line emitted since the last import
+    DeferredFuncs* deferred;  // set: function bodies are recorded, not emitted
+    int opt_level;
 } Parser;
 
-static void next(Parser* p) { p->cur = next_token(p->L); }
+static void next(Parser* p) { p->cur = token_stream_next(p->ts); }
 static void expect(Parser* p, TokenKind k, const char* msg) {
     if (p->cur.kind != k) die(msg);
     next(p);
@@ -545,18 +747,18 @@ static void skip_nl(Parser* p) {
 }
 
 typedef struct {
-    char* name;
-    char* ns;
+    const char* name;
+    const char* ns;
 } QualifiedName;
 
 static QualifiedName parse_qualified_name(Parser* p) {
-    if (p->cur.kind != TK_IDENT) die("expected identifier");
-    char* first = token_str(&p->cur);
+    if (!token_is_name(&p->cur)) die("expected identifier");
+    const char* first = token_intern(&p->cur);
     next(p);
     if (p->cur.kind == TK_SCOPE) {
         next(p);
-        if (p->cur.kind != TK_IDENT) die("expected identifier after '::'");
-        char* second = token_str(&p->cur);
+        if (!token_is_name(&p->cur)) die("expected identifier after '::'");
+        const char* second = token_intern(&p->cur);
         next(p);
         return (QualifiedName){second, first};
     }
@@ -565,45 +767,26 @@ static QualifiedName parse_qualified_name(Parser* p) {
 
 static void add_using_namespace(Parser* p, const char* name) {
     if (p->using_count + 1 > p->using_cap) {
+        size_t old_cap = p->using_cap;
         p->using_cap = (p->using_cap == 0) ? 8 : p->using_cap*  2;
-        p->using_namespaces = (char* *)realloc(p->using_namespaces, p->using_cap*  sizeof(char* ));
-        if (!p->using_namespaces) die("oom");
+        p->using_namespaces = (const char* *)arena_grow(p->file_arena,
+                                                        p->using_namespaces,
+                                                        old_cap*  sizeof(char* ),
+                                                        p->using_cap*  sizeof(char* ));
     }
-    p->using_namespaces[p->using_count++] = xstrdup(name);
+    p->using_namespaces[p->using_count++] = name;
 }
 
-static char* trim_ws(const char* start, const char* end) {
+static char* trim_ws(Arena* arena, const char* start, const char* end) {
     while (start < end && (*start == ' ' ||* start == '\t' ||* start == '\n' ||* start == '\r')) start++;
     while (end > start && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\n' || end[-1] == '\r')) end--;
-    size_t len = (size_t)(end - start);
-    char* out = (char* )malloc(len + 1);
-    if (!out) die("oom");
-    memcpy(out, start, len);
-    out[len] = 0;
-    return out;
-}
-
-static char* substring(const char* start, const char* end) {
-    size_t len = (size_t)(end - start);
-    char* out = (char* )malloc(len + 1);
-    if (!out) die("oom");
-    memcpy(out, start, len);
-    out[len] = 0;
-    return out;
+    return arena_strndup(arena, start, (size_t)(end - start));
 }
 
-static void emit_raw_block(Out* O, const char* text) {
-    if (!text || !*text) return;
-    const char* cursor = text;
-    while (*cursor) {
-        const char* line_end = strchr(cursor, '\n');
-        if (!line_end) {
-            outfmt(O, "%s\n", cursor);
-            break;
-        }
-        outfmt(O, "%.*s\n", (int)(line_end - cursor), cursor);
-        cursor = line_end + 1;
-    }
+static void emit_raw_range(Out* O, const char* start, const char* end) {
+    if (start >= end) return;
+    out_mem(O, start, (size_t)(end - start));
+    if (end[-1] != '\n') out_char(O, '\n');
 }
 
 static void emit_asm_from_text(Out* O, const char* text) {
@@ -611,14 +794,10 @@ static void emit_asm_from_text(Out* O, const char* text) {
     while (*cursor) {
         const char* asm_pos = strstr(cursor, "@asm");
         if (!asm_pos) {
-            emit_raw_block(O, cursor);
+            emit_raw_range(O, cursor, cursor + strlen(cursor));
             break;
         }
-        if (asm_pos > cursor) {
-            char* prefix = substring(cursor, asm_pos);
-            emit_raw_block(O, prefix);
-            free(prefix);
-        }
+        emit_raw_range(O, cursor, asm_pos);
         const char* brace = strchr(asm_pos, '{');
         if (!brace) die("expected '{' after @asm");
         int depth = 1;
@@ -630,65 +809,38 @@ static void emit_asm_from_text(Out* O, const char* text) {
             scan++;
         }
         if (depth != 0) die("unterminated @asm block");
-        const char* block_end = scan - 1;
-        char* block = substring(block_start, block_end);
-        emit_raw_block(O, block);
-        free(block);
+        emit_raw_range(O, block_start, scan - 1);
         cursor = scan;
     }
 }
 
-static char* parse_inline_block(Parser* p) {
+static Token parse_inline_block(Parser* p) {
     if (p->cur.kind != TK_AT) die("expected @asm");
     next(p);
-    if (p->cur.kind != TK_IDENT || !token_is(&p->cur, "asm")) die("expected asm after @");
+    if (p->cur.kind != TK_KW_ASM) die("expected asm after @");
     next(p);
     if (p->cur.kind != TK_LBRACE) die("expected '{' after @asm");
-
-    size_t start = p->L->i;
-    int depth = 1;
-    size_t i = p->L->i;
-    while (i < p->L->len && depth > 0) {
-        char c = p->L->src[i];
-        if (c == '{') depth++;
-        else if (c == '}') depth--;
-        i++;
-    }
-    if (depth != 0) die("unterminated @asm block");
-
-    size_t end = i - 1;
-    size_t j = start;
-    while (j < end) {
-        if (p->L->src[j] == '\n') {
-            p->L->line++;
-            p->L->col = 1;
-        } else {
-            p->L->col++;
-        }
-        j++;
-    }
-    p->L->i = i;
-    p->cur = next_token(p->L);
-
-    return substring(p->L->src + start, p->L->src + end);
+    next(p);
+    if (p->cur.kind != TK_ASM_BODY) die("unterminated @asm block");
+    Token body = p->cur;
+    next(p);
+    return body;
 }
 
-static char* capture_until_enddef(Parser* p) {
-    const char* body_start = p->cur.start;
+static void capture_until_enddef(Parser* p, const char** body_start, const char** body_end) {
+    *body_start = p->cur.start;
     while (p->cur.kind != TK_EOF) {
-        if (p->cur.kind == TK_IDENT && token_is(&p->cur, "enddef")) {
-            const char* body_end = p->cur.start;
-            char* body = substring(body_start, body_end);
+        if (p->cur.kind == TK_KW_ENDDEF) {
+            *body_end = p->cur.start;
             next(p);
-            return body;
+            return;
         }
         next(p);
     }
     die("unterminated macro definition");
-    return NULL;
 }
 
-static char* replace_placeholder(const char* text, const char* placeholder, const char* value) {
+static char* replace_placeholder(Arena* arena, const char* text, const char* placeholder, const char* value) {
     size_t tlen = strlen(text);
     size_t plen = strlen(placeholder);
     size_t vlen = strlen(value);
@@ -699,8 +851,7 @@ static char* replace_placeholder(const char* text, const char* placeholder, cons
         scan += plen;
     }
     size_t new_len = tlen + count*  (vlen - plen);
-    char* out = (char* )malloc(new_len + 1);
-    if (!out) die("oom");
+    char* out = (char* )arena_alloc(arena, new_len + 1);
     char* dst = out;
     scan = text;
     const char* hit;
@@ -716,76 +867,119 @@ static char* replace_placeholder(const char* text, const char* placeholder, cons
     return out;
 }
 
-static char* expand_macro_body(const char* body, char* *args, int argc) {
-    char* result = xstrdup(body);
+static const char* expand_macro_body(Arena* arena, const char* body, char* *args, int argc) {
+    const char* result = body;
     for (int i = 0; i < argc; i++) {
         char placeholder[16];
         snprintf(placeholder, sizeof(placeholder), "%%%d", i + 1);
-        char* next = replace_placeholder(result, placeholder, args[i]);
-        free(result);
-        result = next;
+        result = replace_placeholder(arena, result, placeholder, args[i]);
     }
     return result;
 }
 
-static void emit_load_local(Out* O, FrameLayout* F, const char* name) {
-    Local* L = find_local(F, name);
-    if (!L) die("unknown identifier (local not found)");
-    const char* sz = nasm_size(L->ty);
-    if (type_size(L->ty) == 8) {
-        outfmt(O, "    mov rax, %s [rbp%+d]\n", sz, L->rbp_off);
-    } else if (L->ty.kind == TY_I8 || L->ty.kind == TY_I16 || L->ty.kind == TY_I32) {
-        outfmt(O, "    movsx rax, %s [rbp%+d]\n", sz, L->rbp_off);
-    } else {
-        outfmt(O, "    movzx rax, %s [rbp%+d]\n", sz, L->rbp_off);
-    }
+// Function bodies are parsed into an IrFunc (see ir.h), which lower_function
+// turns into assembly once the body is complete. Name resolution, and every
+// error, happens while building.
+static IrValue build_const(IrFunc* fn, const char* text, size_t len) {
+    IrInst* in = ir_add(fn, IR_CONST);
+    in->imm = text ? ir_parse_int(text, len) : 0;
+    in->text = text;
+    in->len = len;
+    in->dst = ir_new_value(fn, TY_U64);
+    return in->dst;
+}
+
+static IrValue build_load_local(FrameLayout* F, const char* name) {
+    int slot = find_local(F, name);
+    if (slot < 0) die("unknown identifier (local not found)");
+    IrInst* in = ir_add(F->fn, IR_LOAD_LOCAL);
+    in->slot = slot;
+    in->ty = F->fn->locals[slot].ty;
+    in->dst = ir_new_value(F->fn, in->ty);
+    return in->dst;
 }
 
-static void emit_store_local(Out* O, FrameLayout* F, const char* name) {
-    Local* L = find_local(F, name);
-    if (!L) die("unknown identifier (local not found)");
-    const char* sz = nasm_size(L->ty);
-    if (L->ty.kind == TY_U8 || L->ty.kind == TY_I8) outfmt(O, "    mov %s [rbp%+d], al\n", sz, L->rbp_off);
-    else if (L->ty.kind == TY_U16 || L->ty.kind == TY_I16) outfmt(O, "    mov %s [rbp%+d], ax\n", sz, L->rbp_off);
-    else if (L->ty.kind == TY_U32 || L->ty.kind == TY_I32) outfmt(O, "    mov %s [rbp%+d], eax\n", sz, L->rbp_off);
-    else outfmt(O, "    mov %s [rbp%+d], rax\n", sz, L->rbp_off);
+static void build_store_local(FrameLayout* F, const char* name, IrValue v) {
+    int slot = find_local(F, name);
+    if (slot < 0) die("unknown identifier (local not found)");
+    IrInst* in = ir_add(F->fn, IR_STORE_LOCAL);
+    in->slot = slot;
+    in->ty = F->fn->locals[slot].ty;
+    in->a = v;
 }
 
-static void emit_load_global(Out* O, GlobalTable* globals, const char* name) {
-    GlobalVar* G = find_global(globals, name);
+static GlobalVar* lookup_global(Parser* p, const char* name) {
+    GlobalVar* G = find_global(p->globals, name);
     if (!G) die("unknown identifier (global not found)");
-    const char* sz = nasm_size(G->ty);
-    if (type_size(G->ty) == 8) {
-        outfmt(O, "    mov rax, %s [rel %s]\n", sz, name);
-    } else if (G->ty.kind == TY_I8 || G->ty.kind == TY_I16 || G->ty.kind == TY_I32) {
-        outfmt(O, "    movsx rax, %s [rel %s]\n", sz, name);
-    } else {
-        outfmt(O, "    movzx rax, %s [rel %s]\n", sz, name);
+    if (lookup_log) log_lookup(LOOKUP_GLOBAL_TYPE, name, NULL, G->ty.kind);
+    return G;
+}
+
+static IrValue build_load_global(Parser* p, FrameLayout* F, const char* name) {
+    GlobalVar* G = lookup_global(p, name);
+    IrInst* in = ir_add(F->fn, IR_LOAD_GLOBAL);
+    in->name = name;
+    in->ty = G->ty.kind;
+    in->has_imm = G->is_const;
+    in->imm = G->value;
+    in->dst = ir_new_value(F->fn, in->ty);
+    return in->dst;
+}
+
+static void build_store_global(Parser* p, FrameLayout* F, const char* name, IrValue v) {
+    GlobalVar* G = lookup_global(p, name);
+    IrInst* in = ir_add(F->fn, IR_STORE_GLOBAL);
+    in->name = name;
+    in->ty = G->ty.kind;
+    in->a = v;
+}
+
+// A variable named in a statement or expression: the local if there is one,
+// the global otherwise.
+static IrValue build_load_name(Parser* p, FrameLayout* F, QualifiedName qn) {
+    if (find_local(F, qn.name) >= 0) return build_load_local(F, qn.name);
+    const char* name = resolve_reference_name(p->current_namespace,
+                                              qn.name,
+                                              qn.ns,
+                                              p->using_namespaces,
+                                              p->using_count,
+                                              p->global_symbols);
+    return build_load_global(p, F, name);
+}
+
+static void build_store_name(Parser* p, FrameLayout* F, QualifiedName qn, IrValue v) {
+    if (find_local(F, qn.name) >= 0) {
+        build_store_local(F, qn.name, v);
+        return;
     }
+    const char* name = resolve_reference_name(p->current_namespace,
+                                              qn.name,
+                                              qn.ns,
+                                              p->using_namespaces,
+                                              p->using_count,
+                                              p->global_symbols);
+    build_store_global(p, F, name, v);
 }
 
-static void emit_store_global(Out* O, GlobalTable* globals, const char* name) {
-    GlobalVar* G = find_global(globals, name);
-    if (!G) die("unknown identifier (global not found)");
-    const char* sz = nasm_size(G->ty);
-    if (G->ty.kind == TY_U8 || G->ty.kind == TY_I8) outfmt(O, "    mov %s [rel %s], al\n", sz, name);
-    else if (G->ty.kind == TY_U16 || G->ty.kind == TY_I16) outfmt(O, "    mov %s [rel %s], ax\n", sz, name);
-    else if (G->ty.kind == TY_U32 || G->ty.kind == TY_I32) outfmt(O, "    mov %s [rel %s], eax\n", sz, name);
-    else outfmt(O, "    mov %s [rel %s], rax\n", sz, name);
+// `*name = v`: stores through the pointer held in the variable.
+static void build_store_through(Parser* p, FrameLayout* F, QualifiedName qn, IrValue v) {
+    IrValue ptr = build_load_name(p, F, qn);
+    IrInst* in = ir_add(F->fn, IR_STORE_PTR);
+    in->a = ptr;
+    in->b = v;
 }
 
-static void emit_expr(Parser* p, FrameLayout* F);
+static IrValue parse_expr(Parser* p, FrameLayout* F);
 
-static void emit_call(Parser* p, FrameLayout* F, const char* callee) {
-    static const char* argregs[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+static IrValue parse_call(Parser* p, FrameLayout* F, const char* callee) {
+    IrValue args[6];
     int argc = 0;
 
     if (p->cur.kind != TK_RPAREN) {
         for (;;) {
-            emit_expr(p, F);
+            IrValue v = parse_expr(p, F);
             if (argc >= 6) die("too many args (supports 6)");
-            outfmt(p->O, "    mov %s, rax\n", argregs[argc]);
-            argc++;
+            args[argc++] = v;
             if (p->cur.kind == TK_COMMA) {
                 next(p);
                 continue;
@@ -794,143 +988,118 @@ static void emit_call(Parser* p, FrameLayout* F, const char* callee) {
         }
     }
     expect(p, TK_RPAREN, "expected ')' after call args");
-    outfmt(p->O, "    call %s\n", callee);
+    IrInst* in = ir_add(F->fn, IR_CALL);
+    in->name = callee;
+    in->nargs = argc;
+    if (argc) {
+        in->args = (IrValue*)arena_alloc(F->fn->arena, (size_t)argc * sizeof(IrValue));
+        memcpy(in->args, args, (size_t)argc * sizeof(IrValue));
+    }
+    in->dst = ir_new_value(F->fn, TY_U64);
+    return in->dst;
 }
 
-static void emit_factor(Parser* p, FrameLayout* F) {
+static IrValue parse_factor(Parser* p, FrameLayout* F) {
     if (p->cur.kind == TK_MINUS) {
         next(p);
-        emit_factor(p, F);
-        outln(p->O, "    neg rax");
-        return;
+        IrValue v = parse_factor(p, F);
+        IrInst* in = ir_add(F->fn, IR_NEG);
+        in->a = v;
+        in->dst = ir_new_value(F->fn, TY_U64);
+        return in->dst;
     }
     if (p->cur.kind == TK_INT) {
-        char* n = token_str(&p->cur);
-        outfmt(p->O, "    mov rax, %s\n", n);
-        free(n);
+        IrValue v = build_const(F->fn, p->cur.start, (size_t)(p->cur.end - p->cur.start));
         next(p);
-        return;
+        return v;
     }
     if (p->cur.kind == TK_AMP) {
         next(p);
-        if (p->cur.kind != TK_IDENT) die("expected identifier after &");
+        if (!token_is_name(&p->cur)) die("expected identifier after &");
         QualifiedName qn = parse_qualified_name(p);
-        char* name = resolve_reference_name(p->current_namespace,
+        const char* name = resolve_reference_name(p->current_namespace,
                                             qn.name,
                                             qn.ns,
-                                            (const char* *)p->using_namespaces,
+                                            p->using_namespaces,
                                             p->using_count,
                                             p->global_symbols);
-        outfmt(p->O, "    lea rax, [rel %s]\n", name);
-        free(name);
-        free(qn.name);
-        free(qn.ns);
-        return;
+        IrInst* in = ir_add(F->fn, IR_ADDR);
+        in->name = name;
+        in->dst = ir_new_value(F->fn, TY_U64);
+        return in->dst;
     }
     if (p->cur.kind == TK_STAR) {
         next(p);
-        if (p->cur.kind != TK_IDENT) die("expected identifier after '*'");
+        if (!token_is_name(&p->cur)) die("expected identifier after '*'");
         QualifiedName qn = parse_qualified_name(p);
-        Local* local = find_local(F, qn.name);
-        if (local) {
-            emit_load_local(p->O, F, qn.name);
-        } else {
-            char* name = resolve_reference_name(p->current_namespace,
-                                                qn.name,
-                                                qn.ns,
-                                                (const char* *)p->using_namespaces,
-                                                p->using_count,
-                                                p->global_symbols);
-            emit_load_global(p->O, p->globals, name);
-            free(name);
-        }
-        outln(p->O, "    mov rbx, rax");
-        outln(p->O, "    mov rax, [rbx]");
-        free(qn.name);
-        free(qn.ns);
-        return;
+        IrValue ptr = build_load_name(p, F, qn);
+        IrInst* in = ir_add(F->fn, IR_LOAD_PTR);
+        in->a = ptr;
+        in->dst = ir_new_value(F->fn, TY_U64);
+        return in->dst;
     }
-    if (p->cur.kind == TK_IDENT) {
+    if (token_is_name(&p->cur)) {
         QualifiedName qn = parse_qualified_name(p);
 
         if (qn.ns) {
             if (p->cur.kind != TK_LPAREN) die("namespaced identifier must be a call");
             next(p);
-            char* fname = resolve_reference_name(p->current_namespace,
+            const char* fname = resolve_reference_name(p->current_namespace,
                                                  qn.name,
                                                  qn.ns,
-                                                 (const char* *)p->using_namespaces,
+                                                 p->using_namespaces,
                                                  p->using_count,
                                                  p->func_table);
-            emit_call(p, F, fname);
-            free(fname);
-            free(qn.name);
-            free(qn.ns);
-            return;
+            return parse_call(p, F, fname);
         }
 
         if (p->cur.kind == TK_LPAREN) {
             next(p);
-            char* fname = resolve_reference_name(p->current_namespace,
+            const char* fname = resolve_reference_name(p->current_namespace,
                                                  qn.name,
                                                  NULL,
-                                                 (const char* *)p->using_namespaces,
+                                                 p->using_namespaces,
                                                  p->using_count,
                                                  p->func_table);
-            emit_call(p, F, fname);
-            free(fname);
-            free(qn.name);
-            return;
+            return parse_call(p, F, fname);
         }
 
-        Local* local = find_local(F, qn.name);
-        if (local) {
-            emit_load_local(p->O, F, qn.name);
-        } else {
-            char* name = resolve_reference_name(p->current_namespace,
-                                                qn.name,
-                                                NULL,
-                                                (const char* *)p->using_namespaces,
-                                                p->using_count,
-                                                p->global_symbols);
-            emit_load_global(p->O, p->globals, name);
-            free(name);
-        }
-        free(qn.name);
-        return;
+        return build_load_name(p, F, qn);
     }
     if (p->cur.kind == TK_LPAREN) {
         next(p);
-        emit_expr(p, F);
+        IrValue v = parse_expr(p, F);
         expect(p, TK_RPAREN, "expected ')'");
-        return;
+        return v;
     }
     die("expected expression atom");
+    return IR_NONE;
 }
 
-static void emit_expr(Parser* p, FrameLayout* F) {
-    emit_factor(p, F);
+static IrValue parse_expr(Parser* p, FrameLayout* F) {
+    IrValue lhs = parse_factor(p, F);
     while (p->cur.kind == TK_PLUS || p->cur.kind == TK_MINUS) {
-        TokenKind op = p->cur.kind;
+        IrOp op = p->cur.kind == TK_PLUS ? IR_ADD : IR_SUB;
         next(p);
-        outln(p->O, "    mov rbx, rax");
-        emit_factor(p, F);
-        if (op == TK_PLUS) outln(p->O, "    add rax, rbx");
-        else outln(p->O, "    sub rbx, rax\n    mov rax, rbx");
+        IrValue rhs = parse_factor(p, F);
+        IrInst* in = ir_add(F->fn, op);
+        in->a = lhs;
+        in->b = rhs;
+        in->dst = ir_new_value(F->fn, TY_U64);
+        lhs = in->dst;
     }
+    return lhs;
 }
 
-static void emit_macro_invocation(Parser* p) {
-    if (p->cur.kind != TK_IDENT) die("expected macro name after '$'");
+static void parse_macro_invocation(Parser* p, FrameLayout* F) {
+    if (!token_is_name(&p->cur)) die("expected macro name after '$'");
     QualifiedName qn = parse_qualified_name(p);
-    char* macro_name = resolve_reference_name(p->current_namespace,
+    const char* macro_name = resolve_reference_name(p->current_namespace,
                                               qn.name,
                                               qn.ns,
-                                              (const char* *)p->using_namespaces,
+                                              p->using_namespaces,
                                               p->using_count,
                                               &p->macro_table->symbols);
-    free(qn.name);
-    free(qn.ns);
 
     char* args[16];
     int argc = 0;
@@ -941,15 +1110,13 @@ static void emit_macro_invocation(Parser* p) {
             const char* arg_end = p->cur.end;
             for (;;) {
                 if (p->cur.kind == TK_SEMI) {
-                    char* arg = trim_ws(arg_start, arg_end);
+                    char* arg = trim_ws(p->file_arena, arg_start, arg_end);
                     if (*arg) args[argc++] = arg;
-                    else free(arg);
                     break;
                 }
                 if (p->cur.kind == TK_COMMA) {
-                    char* arg = trim_ws(arg_start, arg_end);
+                    char* arg = trim_ws(p->file_arena, arg_start, arg_end);
                     if (*arg) args[argc++] = arg;
-                    else free(arg);
                     next(p);
                     arg_start = p->cur.start;
                     arg_end = p->cur.end;
@@ -965,24 +1132,13 @@ static void emit_macro_invocation(Parser* p) {
         expect(p, TK_SEMI, "expected ';' after macro invocation");
     }
 
-    Macro* macro = find_macro(p->macro_table, macro_name);
-    if (macro) {
-        char* expanded = expand_macro_body(macro->body, args, argc);
-        emit_asm_from_text(p->O, expanded);
-        free(expanded);
-    } else {
-        outfmt(p->O, "    %s", macro_name);
-        if (argc > 0) {
-            outfmt(p->O, " ");
-            for (int i = 0; i < argc; i++) {
-                outfmt(p->O, "%s%s", args[i], (i + 1 < argc) ? ", " : "");
-            }
-        }
-        outln(p->O, "");
-    }
+    // The arguments outlive the function: they end up in the module's splice.
+    IrInst* in = ir_add(F->fn, IR_MACRO);
+    in->name = macro_name;
+    in->nmargs = argc;
+    in->margs = (char* *)arena_alloc(p->file_arena, (size_t)argc*  sizeof(char* ));
+    memcpy(in->margs, args, (size_t)argc*  sizeof(char* ));
 
-    for (int i = 0; i < argc; i++) free(args[i]);
-    free(macro_name);
     if (p->cur.kind == TK_SEMI) next(p);
 }
 
@@ -999,15 +1155,309 @@ static const char* arg_reg_by_size(int index, int size_bytes) {
     return argregs64[index];
 }
 
+// Set by emit_ir: every function is also listed here before it is lowered.
+static _Thread_local Out* ir_listing;
+
+// Where a value is kept once computed, besides rax (see lower_function).
+enum {
+    HOME_RAX,
+    HOME_RBX,   // left operand of add/sub
+    HOME_RCX,   // value stored through a pointer
+    HOME_ARG0,  // call argument i goes to HOME_ARG0 + i
+};
+
+// "    mov rax, " with the extension a load of `ty` needs, then its size.
+static void out_load_rax(Out* O, TypeKind ty) {
+    Type t = (Type){ty};
+    if (type_size(t) == 8) out_str(O, "    mov rax, ");
+    else if (ty == TY_I8 || ty == TY_I16 || ty == TY_I32) out_str(O, "    movsx rax, ");
+    else out_str(O, "    movzx rax, ");
+    out_str(O, nasm_size(t));
+}
+
+// Moves a value of type `ty` from `src`, sized to the type, into all of `r`,
+// extended the way a load from memory would.
+static void out_extend_to_reg(Out* O, Reg r, TypeKind ty, const char* src) {
+    int size = type_size((Type){ty});
+    bool is_signed = ty == TY_I8 || ty == TY_I16 || ty == TY_I32;
+    if (size == 0 || size == 8) out_str(O, "    mov ");
+    else if (size == 4) out_str(O, is_signed ? "    movsxd " : "    mov ");
+    else out_str(O, is_signed ? "    movsx " : "    movzx ");
+    // Writing the 32-bit register clears the upper half.
+    out_str(O, reg_name(r, (size == 0 || size == 8 || is_signed) ? 8 : 4));
+    out_str(O, ", ");
+    outln(O, src);
+}
+
+// Saved registers are pushed below the frame on entry. A function that
+// pushes and pops values itself may return with rsp elsewhere, so it points
+// rsp back at them first.
+static void lower_restore_saved(const IrFunc* fn, Out* O) {
+    int nsaved = 0;
+    bool moves_rsp = false;
+    for (int r = REG_R12; r < REG_COUNT; r++) nsaved += (fn->saved_regs >> r) & 1;
+    for (size_t i = 0; i < fn->ninsts; i++) moves_rsp |= fn->insts[i].op == IR_PUSH || fn->insts[i].op == IR_POP;
+    if (moves_rsp) {
+        out_str(O, "    lea rsp, ");
+        out_rbp(O, -(fn->frame_size + 8 * nsaved));
+        out_char(O, '\n');
+    }
+    for (int r = REG_COUNT - 1; r >= REG_R12; r--) {
+        if (!(fn->saved_regs & (1u << r))) continue;
+        out_str(O, "    pop ");
+        outln(O, reg_name((Reg)r, 8));
+    }
+}
+
+static void lower_inst(Parser* p, const IrFunc* fn, const IrInst* in) {
+    Out* O = p->O;
+    switch (in->op) {
+        case IR_CONST:
+            if (in->text) {
+                out_str(O, "    mov rax, ");
+                out_mem(O, in->text, in->len);
+                out_char(O, '\n');
+            } else if (in->imm == 0) {
+                outln(O, "    xor rax, rax");
+            } else {
+                out_str(O, "    mov rax, ");
+                out_int(O, (long long)in->imm);
+                out_char(O, '\n');
+            }
+            break;
+        case IR_LOAD_LOCAL:
+            if (fn->locals[in->slot].reg != REG_NONE) {
+                out_str(O, "    mov rax, ");
+                outln(O, reg_name(fn->locals[in->slot].reg, 8));
+                break;
+            }
+            out_load_rax(O, in->ty);
+            out_char(O, ' ');
+            out_rbp(O, fn->locals[in->slot].rbp_off);
+            out_char(O, '\n');
+            break;
+        case IR_STORE_LOCAL:
+            if (fn->locals[in->slot].reg != REG_NONE) {
+                out_extend_to_reg(O, fn->locals[in->slot].reg, in->ty, rax_by_size(type_size((Type){in->ty})));
+                break;
+            }
+            out_str(O, "    mov ");
+            out_str(O, nasm_size((Type){in->ty}));
+            out_char(O, ' ');
+            out_rbp(O, fn->locals[in->slot].rbp_off);
+            out_str(O, ", ");
+            outln(O, rax_by_size(type_size((Type){in->ty})));
+            break;
+        case IR_LOAD_GLOBAL:
+            add_module_ref(p->module, in->name);
+            out_load_rax(O, in->ty);
+            out_str(O, " [rel ");
+            out_str(O, in->name);
+            outln(O, "]");
+            break;
+        case IR_STORE_GLOBAL:
+            add_module_ref(p->module, in->name);
+            out_str(O, "    mov ");
+            out_str(O, nasm_size((Type){in->ty}));
+            out_str(O, " [rel ");
+            out_str(O, in->name);
+            out_str(O, "], ");
+            outln(O, rax_by_size(type_size((Type){in->ty})));
+            break;
+        case IR_ADDR:
+            add_module_ref(p->module, in->name);
+            out_str(O, "    lea rax, [rel ");
+            out_str(O, in->name);
+            outln(O, "]");
+            break;
+        case IR_LOAD_PTR:
+            outln(O, "    mov rbx, rax");
+            outln(O, "    mov rax, [rbx]");
+            break;
+        case IR_STORE_PTR:
+            outln(O, "    mov rbx, rax");
+            outln(O, "    mov [rbx], rcx");
+            break;
+        case IR_NEG:
+            outln(O, "    neg rax");
+            break;
+        case IR_ADD:
+            outln(O, "    add rax, rbx");
+            break;
+        case IR_SUB:
+            outln(O, "    sub rbx, rax\n    mov rax, rbx");
+            break;
+        case IR_CALL:
+            add_module_ref(p->module, in->name);
+            out_str(O, "    call ");
+            outln(O, in->name);
+            break;
+        case IR_PUSH:
+            outln(O, "    push rax");
+            break;
+        case IR_POP:
+            outln(O, "    pop rax");
+            break;
+        case IR_ASM:
+            emit_raw_range(O, in->text, in->text + in->len);
+            break;
+        case IR_MACRO: {
+            // Whether the macro expands depends on definitions emitted before
+            // this point, so the decision is deferred to link_module.
+            Splice* sp = add_splice(p->module, SPLICE_MACRO_USE);
+            sp->name = in->name;
+            sp->argc = in->nmargs;
+            sp->args = in->margs;
+            break;
+        }
+        case IR_RET:
+            if (fn->saved_regs) lower_restore_saved(fn, O);
+            outln(O, "    leave");
+            outln(O, "    ret");
+            break;
+    }
+}
+
+// Runs the peephole pass over what lower_function wrote from `start` on. The
+// @asm text, at the ranges in `raw` (start and end offset pairs), and the
+// macro uses recorded since `first_splice` go in as barriers, so the text is
+// kept and the splices still land between the same lines.
+static void peephole_function(Parser* p, Arena* arena, size_t start, size_t first_splice, const size_t* raw,
+                              size_t nraw) {
+    Out* O = p->O;
+    ModuleOut* M = p->module;
+    size_t len = O->len - start;
+    char* text = (char*)arena_alloc(arena, len);
+    memcpy(text, O->data + start, len);
+
+    size_t cap = M->nsplices - first_splice + 1;
+    for (size_t i = 0; i < len; i++) cap += text[i] == '\n';
+    PeepLine* lines = (PeepLine*)arena_alloc(arena, cap * sizeof(PeepLine));
+    size_t* splice_at = (size_t*)arena_alloc(arena, cap * sizeof(size_t));  // SIZE_MAX: not a splice
+    size_t n = 0;
+    size_t pos = 0;
+    size_t s = first_splice;
+    size_t r = 0;
+    while (pos < len || s < M->nsplices) {
+        splice_at[n] = SIZE_MAX;
+        if (s < M->nsplices && M->splices[s].offset - start <= pos) {
+            splice_at[n] = s++;
+            lines[n++] = (PeepLine){"", 0, true, false};
+            continue;
+        }
+        const char* eol = (const char*)memchr(text + pos, '\n', len - pos);
+        size_t end = eol ? (size_t)(eol - text) : len;
+        bool barrier = end - pos < 4 || memcmp(text + pos, "    ", 4) != 0;
+        if (r < nraw && raw[2 * r] - start == pos) {
+            // emit_raw_range ends it with a newline, which the rewrite adds back.
+            end = raw[2 * r + 1] - start - 1;
+            barrier = true;
+            r++;
+        }
+        lines[n++] = (PeepLine){text + pos, end - pos, barrier, false};
+        pos = end + 1;
+    }
+
+    peephole(lines, n, arena);
+
+    O->len = start;
+    for (size_t i = 0; i < n; i++) {
+        if (splice_at[i] != SIZE_MAX) M->splices[splice_at[i]].offset = O->len;
+        else if (!lines[i].deleted) {
+            out_mem(O, lines[i].text, lines[i].len);
+            out_char(O, '\n');
+        }
+    }
+}
+
+// Values are computed into rax in the order they are defined. Each value is
+// used once, and every operand except the last one computed is moved to its
+// home register right after its definition.
+static void lower_function(Parser* p, const IrFunc* fn) {
+    static const char* argregs[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+    Out* O = p->O;
+    if (ir_listing) ir_dump(fn, ir_listing);
+
+    size_t start = O->len;
+    size_t first_splice = p->module->nsplices;
+    size_t* raw = NULL;
+    size_t nraw = 0;
+    uint8_t* home = (uint8_t*)arena_calloc(fn->arena, fn->nvalues + 1);
+    for (size_t i = 0; i < fn->ninsts; i++) {
+        const IrInst* in = &fn->insts[i];
+        nraw += in->op == IR_ASM && in->len > 0;
+        if (in->op == IR_ADD || in->op == IR_SUB) home[in->a] = HOME_RBX;
+        else if (in->op == IR_STORE_PTR) home[in->b] = HOME_RCX;
+        else if (in->op == IR_CALL) {
+            for (int a = 0; a < in->nargs; a++) home[in->args[a]] = (uint8_t)(HOME_ARG0 + a);
+        }
+    }
+
+    if (fn->is_global) {
+        out_str(O, "global ");
+        outln(O, fn->name);
+    }
+    out_str(O, fn->name);
+    outln(O, ":");
+    outln(O, "    push rbp");
+    outln(O, "    mov rbp, rsp");
+    if (fn->frame_size > 0) {
+        out_str(O, "    sub rsp, ");
+        out_int(O, fn->frame_size);
+        out_char(O, '\n');
+    }
+    for (int r = REG_R12; r < REG_COUNT; r++) {
+        if (!(fn->saved_regs & (1u << r))) continue;
+        out_str(O, "    push ");
+        outln(O, reg_name((Reg)r, 8));
+    }
+    for (int i = 0; i < fn->nparams; i++) {
+        const IrLocal* L = &fn->locals[i];
+        const char* src = arg_reg_by_size(i, type_size((Type){L->ty}));
+        if (L->reg != REG_NONE) {
+            out_extend_to_reg(O, L->reg, L->ty, src);
+            continue;
+        }
+        if (!L->rbp_off) continue;
+        out_str(O, "    mov ");
+        out_str(O, nasm_size((Type){L->ty}));
+        out_char(O, ' ');
+        out_rbp(O, L->rbp_off);
+        out_str(O, ", ");
+        outln(O, src);
+    }
+
+    raw = (size_t*)arena_alloc(fn->arena, 2 * nraw * sizeof(size_t) + 1);
+    nraw = 0;
+    for (size_t b = 0; b < fn->nblocks; b++) {
+        const IrBlock* B = &fn->blocks[b];
+        for (size_t i = B->first; i < B->first + B->count; i++) {
+            const IrInst* in = &fn->insts[i];
+            if (in->op == IR_ASM && in->len > 0) raw[2 * nraw++] = O->len;
+            lower_inst(p, fn, in);
+            if (in->op == IR_ASM && in->len > 0) raw[2 * nraw - 1] = O->len;
+            if (!in->dst || home[in->dst] == HOME_RAX) continue;
+            if (home[in->dst] == HOME_RBX) outln(O, "    mov rbx, rax");
+            else if (home[in->dst] == HOME_RCX) outln(O, "    mov rcx, rax");
+            else {
+                out_str(O, "    mov ");
+                out_str(O, argregs[home[in->dst] - HOME_ARG0]);
+                outln(O, ", rax");
+            }
+        }
+    }
+    if (p->opt_level >= 1) peephole_function(p, fn->arena, start, first_splice, raw, nraw);
+}
+
 static void parse_and_emit_func(Parser* p, const char* raw_name, bool is_global, bool is_inline) {
     (void)is_inline;
 
-    char* fname = resolve_definition_name(p->current_namespace, raw_name);
+    const char* fname = resolve_definition_name(p->current_namespace, raw_name);
 
     expect(p, TK_LPAREN, "expected '(' after func name");
 
     typedef struct {
-        char* name;
+        const char* name;
         Type ty;
     } Param;
     Param params[16];
@@ -1015,11 +1465,11 @@ static void parse_and_emit_func(Parser* p, const char* raw_name, bool is_global,
 
     if (p->cur.kind != TK_RPAREN) {
         for (;;) {
-            if (p->cur.kind != TK_IDENT) die("expected param name");
-            char* pn = token_str(&p->cur);
+            if (!token_is_name(&p->cur)) die("expected param name");
+            const char* pn = token_intern(&p->cur);
             next(p);
             expect(p, TK_COLON, "expected ':' in param");
-            if (p->cur.kind != TK_IDENT) die("expected type after ':'");
+            if (!token_is_name(&p->cur)) die("expected type after ':'");
             Type ty = parse_type_name(&p->cur);
             if (ty.kind == TY_UNKNOWN) die("unknown type name");
             next(p);
@@ -1036,7 +1486,7 @@ static void parse_and_emit_func(Parser* p, const char* raw_name, bool is_global,
     expect(p, TK_RPAREN, "expected ')' after params");
 
     expect(p, TK_RARROW, "expected '>>' return type");
-    if (p->cur.kind != TK_IDENT) die("expected return type name");
+    if (!token_is_name(&p->cur)) die("expected return type name");
     Type ret_ty = parse_type_name(&p->cur);
     (void)ret_ty;
     next(p);
@@ -1045,285 +1495,217 @@ static void parse_and_emit_func(Parser* p, const char* raw_name, bool is_global,
     skip_nl(p);
     expect(p, TK_INDENT, "expected indented function body");
 
-    if (is_global) outfmt(p->O, "global %s\n", fname);
-    outfmt(p->O, "%s:\n", fname);
-    outln(p->O, "    push rbp");
-    outln(p->O, "    mov rbp, rsp");
+    add_module_def(p->module, fname, is_global ? MSYM_GLOBAL_FUNC : MSYM_LOCAL_FUNC);
 
+    IrFunc fn;
+    ir_func_init(&fn, p->func_arena, fname, is_global);
     FrameLayout F = {0};
+    F.fn = &fn;
+    F.index.arena = p->func_arena;
 
     for (int i = 0; i < nparams; i++) {
         add_local(&F, params[i].name, params[i].ty);
     }
-
-    if (F.stack_used > 0) {
-        outfmt(p->O, "    sub rsp, %d\n", F.stack_used);
-    }
+    fn.nparams = nparams;
+    fn.frame_size = F.stack_used;
 
     for (int i = 0; i < nparams; i++) {
-        Local* Lc = find_local(&F, params[i].name);
-        const char* sz = nasm_size(Lc->ty);
         if (i >= 6) die("too many params (phase1 supports 6)");
-        int size_bytes = type_size(Lc->ty);
-        const char* src = arg_reg_by_size(i, size_bytes);
-        if (!src) die("unsupported parameter register");
-        outfmt(p->O, "    mov %s [rbp%+d], %s\n", sz, Lc->rbp_off, src);
+        if (!arg_reg_by_size(i, type_size(params[i].ty))) die("unsupported parameter register");
     }
 
-    for (;;) {
-        if (p->cur.kind == TK_DEDENT) {
-            next(p);
-            if (p->cur.kind == TK_IDENT && token_is(&p->cur, "end")) {
+    bool body_done = false;
+    while (!body_done) {
+        switch (p->cur.kind) {
+            case TK_DEDENT: {
                 next(p);
+                if (p->cur.kind == TK_KW_END) {
+                    next(p);
+                }
+                body_done = true;
+                break;
             }
-            break;
-        }
-        if (p->cur.kind == TK_NL) {
-            next(p);
-            continue;
-        }
-
-        if (p->cur.kind == TK_IDENT && token_is(&p->cur, "let")) {
-            next(p);
-            bool pointer_name = false;
-            if (p->cur.kind == TK_STAR) {
-                pointer_name = true;
+            case TK_NL: {
                 next(p);
+                continue;
             }
-            if (p->cur.kind != TK_IDENT) die("expected local name after let");
-            Token lname = p->cur;
-            next(p);
-
-            Type ty = (Type){TY_UNKNOWN};
-            if (p->cur.kind == TK_COLON) {
+            case TK_KW_LET: {
                 next(p);
-                if (p->cur.kind != TK_IDENT) die("expected type name");
-                ty = parse_type_name(&p->cur);
-                if (ty.kind == TY_UNKNOWN) die("unknown type name");
-                next(p);
-            }
-            if (ty.kind == TY_UNKNOWN && pointer_name) ty.kind = TY_U64;
-            if (ty.kind == TY_UNKNOWN) ty.kind = TY_U64;
-
-            if (p->cur.kind == TK_EQ) {
+                bool pointer_name = false;
+                if (p->cur.kind == TK_STAR) {
+                    pointer_name = true;
+                    next(p);
+                }
+                if (!token_is_name(&p->cur)) die("expected local name after let");
+                Token lname = p->cur;
                 next(p);
-                emit_expr(p, &F);
-            } else {
-                outln(p->O, "    xor rax, rax");
-            }
-            expect(p, TK_SEMI, "expected ';' after let");
-            next(p);
-
-            char* lname_str = token_str(&lname);
-            add_local(&F, lname_str, ty);
-            emit_store_local(p->O, &F, lname_str);
-            free(lname_str);
-            continue;
-        }
 
-        if (p->cur.kind == TK_IDENT && (token_is(&p->cur, "ret") || token_is(&p->cur, "return"))) {
-            next(p);
-            if (p->cur.kind != TK_SEMI) {
-                emit_expr(p, &F);
-            } else {
-                outln(p->O, "    xor rax, rax");
-            }
-            expect(p, TK_SEMI, "expected ';' after return");
-            next(p);
+                Type ty = (Type){TY_UNKNOWN};
+                if (p->cur.kind == TK_COLON) {
+                    next(p);
+                    if (!token_is_name(&p->cur)) die("expected type name");
+                    ty = parse_type_name(&p->cur);
+                    if (ty.kind == TY_UNKNOWN) die("unknown type name");
+                    next(p);
+                }
+                if (ty.kind == TY_UNKNOWN && pointer_name) ty.kind = TY_U64;
+                if (ty.kind == TY_UNKNOWN) ty.kind = TY_U64;
 
-            outln(p->O, "    leave");
-            outln(p->O, "    ret");
-            while (p->cur.kind != TK_DEDENT && p->cur.kind != TK_EOF) next(p);
-            if (p->cur.kind == TK_DEDENT) next(p);
-            if (p->cur.kind == TK_IDENT && token_is(&p->cur, "end")) {
+                IrValue v;
+                if (p->cur.kind == TK_EQ) {
+                    next(p);
+                    v = parse_expr(p, &F);
+                } else {
+                    v = build_const(&fn, NULL, 0);
+                }
+                expect(p, TK_SEMI, "expected ';' after let");
                 next(p);
-            }
-            break;
-        }
 
-        if (p->cur.kind == TK_IDENT && token_is(&p->cur, "set")) {
-            next(p);
-            bool deref = false;
-            if (p->cur.kind == TK_STAR) {
-                deref = true;
-                next(p);
+                const char* lname_str = token_intern(&lname);
+                add_local(&F, lname_str, ty);
+                build_store_local(&F, lname_str, v);
+                continue;
             }
-            if (p->cur.kind != TK_IDENT) die("expected name after set");
-            QualifiedName qn = parse_qualified_name(p);
-            if (p->cur.kind == TK_COLON) {
+            case TK_KW_RET:
+            case TK_KW_RETURN: {
                 next(p);
-                if (p->cur.kind != TK_IDENT) die("expected type after ':'");
-                next(p);
-            }
-            expect(p, TK_EQ, "expected '=' after set target");
-            emit_expr(p, &F);
-            expect(p, TK_SEMI, "expected ';' after set");
-            next(p);
-
-            if (deref) {
-                outln(p->O, "    mov rcx, rax");
-                Local* local = find_local(&F, qn.name);
-                if (local) {
-                    emit_load_local(p->O, &F, qn.name);
-                } else {
-                    char* name = resolve_reference_name(p->current_namespace,
-                                                        qn.name,
-                                                        qn.ns,
-                                                        (const char* *)p->using_namespaces,
-                                                        p->using_count,
-                                                        p->global_symbols);
-                    emit_load_global(p->O, p->globals, name);
-                    free(name);
-                }
-                outln(p->O, "    mov rbx, rax");
-                outln(p->O, "    mov [rbx], rcx");
-            } else {
-                Local* local = find_local(&F, qn.name);
-                if (local) {
-                    emit_store_local(p->O, &F, qn.name);
+                IrValue v;
+                if (p->cur.kind != TK_SEMI) {
+                    v = parse_expr(p, &F);
                 } else {
-                    char* name = resolve_reference_name(p->current_namespace,
-                                                        qn.name,
-                                                        qn.ns,
-                                                        (const char* *)p->using_namespaces,
-                                                        p->using_count,
-                                                        p->global_symbols);
-                    emit_store_global(p->O, p->globals, name);
-                    free(name);
+                    v = build_const(&fn, NULL, 0);
                 }
-            }
-            free(qn.name);
-            free(qn.ns);
-            continue;
-        }
+                expect(p, TK_SEMI, "expected ';' after return");
+                next(p);
 
-        if (p->cur.kind == TK_IDENT && token_is(&p->cur, "push")) {
-            next(p);
-            for (;;) {
-                emit_expr(p, &F);
-                outln(p->O, "    push rax");
-                if (p->cur.kind == TK_COMMA) {
+                ir_add(&fn, IR_RET)->a = v;
+                while (p->cur.kind != TK_DEDENT && p->cur.kind != TK_EOF) next(p);
+                if (p->cur.kind == TK_DEDENT) next(p);
+                if (p->cur.kind == TK_KW_END) {
                     next(p);
-                    continue;
                 }
+                body_done = true;
                 break;
             }
-            expect(p, TK_SEMI, "expected ';' after push");
-            next(p);
-            continue;
-        }
-
-        if (p->cur.kind == TK_IDENT && token_is(&p->cur, "pop")) {
-            next(p);
-            for (;;) {
+            case TK_KW_SET: {
+                next(p);
                 bool deref = false;
                 if (p->cur.kind == TK_STAR) {
                     deref = true;
                     next(p);
                 }
-                if (p->cur.kind != TK_IDENT) die("expected identifier after pop");
+                if (!token_is_name(&p->cur)) die("expected name after set");
                 QualifiedName qn = parse_qualified_name(p);
                 if (p->cur.kind == TK_COLON) {
                     next(p);
-                    if (p->cur.kind == TK_IDENT) next(p);
+                    if (!token_is_name(&p->cur)) die("expected type after ':'");
+                    next(p);
                 }
-                outln(p->O, "    pop rax");
-                if (deref) {
-                    outln(p->O, "    mov rcx, rax");
-                    Local* local = find_local(&F, qn.name);
-                    if (local) {
-                        emit_load_local(p->O, &F, qn.name);
-                    } else {
-                        char* name = resolve_reference_name(p->current_namespace,
-                                                            qn.name,
-                                                            qn.ns,
-                                                            (const char* *)p->using_namespaces,
-                                                            p->using_count,
-                                                            p->global_symbols);
-                        emit_load_global(p->O, p->globals, name);
-                        free(name);
-                    }
-                    outln(p->O, "    mov rbx, rax");
-                    outln(p->O, "    mov [rbx], rcx");
-                } else {
-                    Local* local = find_local(&F, qn.name);
-                    if (local) {
-                        emit_store_local(p->O, &F, qn.name);
-                    } else {
-                        char* name = resolve_reference_name(p->current_namespace,
-                                                            qn.name,
-                                                            qn.ns,
-                                                            (const char* *)p->using_namespaces,
-                                                            p->using_count,
-                                                            p->global_symbols);
-                        emit_store_global(p->O, p->globals, name);
-                        free(name);
+                expect(p, TK_EQ, "expected '=' after set target");
+                IrValue v = parse_expr(p, &F);
+                expect(p, TK_SEMI, "expected ';' after set");
+                next(p);
+
+                if (deref) build_store_through(p, &F, qn, v);
+                else build_store_name(p, &F, qn, v);
+                continue;
+            }
+            case TK_KW_PUSH: {
+                next(p);
+                for (;;) {
+                    IrValue v = parse_expr(p, &F);
+                    ir_add(&fn, IR_PUSH)->a = v;
+                    if (p->cur.kind == TK_COMMA) {
+                        next(p);
+                        continue;
                     }
+                    break;
                 }
-                free(qn.name);
-                free(qn.ns);
-                if (p->cur.kind == TK_COMMA) {
-                    next(p);
-                    continue;
+                expect(p, TK_SEMI, "expected ';' after push");
+                next(p);
+                continue;
+            }
+            case TK_KW_POP: {
+                next(p);
+                for (;;) {
+                    bool deref = false;
+                    if (p->cur.kind == TK_STAR) {
+                        deref = true;
+                        next(p);
+                    }
+                    if (!token_is_name(&p->cur)) die("expected identifier after pop");
+                    QualifiedName qn = parse_qualified_name(p);
+                    if (p->cur.kind == TK_COLON) {
+                        next(p);
+                        if (token_is_name(&p->cur)) next(p);
+                    }
+                    IrInst* pop = ir_add(&fn, IR_POP);
+                    pop->dst = ir_new_value(&fn, TY_U64);
+                    IrValue v = pop->dst;
+                    if (deref) build_store_through(p, &F, qn, v);
+                    else build_store_name(p, &F, qn, v);
+                    if (p->cur.kind == TK_COMMA) {
+                        next(p);
+                        continue;
+                    }
+                    break;
                 }
+                expect(p, TK_SEMI, "expected ';' after pop");
+                next(p);
+                continue;
+            }
+            case TK_KW_VOID: {
+                next(p);
+                while (p->cur.kind != TK_SEMI && p->cur.kind != TK_EOF) next(p);
+                expect(p, TK_SEMI, "expected ';' after void");
+                next(p);
+                continue;
+            }
+            case TK_KW_CALL: {
+                next(p);
+                if (!token_is_name(&p->cur)) die("expected function name after call");
+                QualifiedName qn = parse_qualified_name(p);
+                expect(p, TK_LPAREN, "expected '(' after call name");
+                next(p);
+                const char* fname = resolve_reference_name(p->current_namespace,
+                                                     qn.name,
+                                                     qn.ns,
+                                                     p->using_namespaces,
+                                                     p->using_count,
+                                                     p->func_table);
+                parse_call(p, &F, fname);
+                expect(p, TK_SEMI, "expected ';' after call");
+                next(p);
+                continue;
+            }
+            case TK_AT: {
+                Token block = parse_inline_block(p);
+                IrInst* in = ir_add(&fn, IR_ASM);
+                in->text = block.start;
+                in->len = block.end > block.start ? (size_t)(block.end - block.start) : 0;
+                continue;
+            }
+            case TK_DOLLAR: {
+                next(p);
+                parse_macro_invocation(p, &F);
+                continue;
+            }
+            case TK_KW_END: {
+                next(p);
+                body_done = true;
                 break;
             }
-            expect(p, TK_SEMI, "expected ';' after pop");
-            next(p);
-            continue;
-        }
-
-        if (p->cur.kind == TK_IDENT && token_is(&p->cur, "void")) {
-            next(p);
-            while (p->cur.kind != TK_SEMI && p->cur.kind != TK_EOF) next(p);
-            expect(p, TK_SEMI, "expected ';' after void");
-            next(p);
-            continue;
-        }
-
-        if (p->cur.kind == TK_IDENT && token_is(&p->cur, "call")) {
-            next(p);
-            if (p->cur.kind != TK_IDENT) die("expected function name after call");
-            QualifiedName qn = parse_qualified_name(p);
-            expect(p, TK_LPAREN, "expected '(' after call name");
-            next(p);
-            char* fname = resolve_reference_name(p->current_namespace,
-                                                 qn.name,
-                                                 qn.ns,
-                                                 (const char* *)p->using_namespaces,
-                                                 p->using_count,
-                                                 p->func_table);
-            emit_call(p, &F, fname);
-            free(fname);
-            free(qn.name);
-            free(qn.ns);
-            expect(p, TK_SEMI, "expected ';' after call");
-            next(p);
-            continue;
-        }
-
-        if (p->cur.kind == TK_AT) {
-            char* block = parse_inline_block(p);
-            emit_raw_block(p->O, block);
-            free(block);
-            continue;
-        }
-
-        if (p->cur.kind == TK_DOLLAR) {
-            next(p);
-            emit_macro_invocation(p);
-            continue;
+            default:
+                die("unsupported statement");
         }
-
-        if (p->cur.kind == TK_IDENT && token_is(&p->cur, "end")) {
-            next(p);
-            break;
-        }
-
-        die("unsupported statement");
     }
 
-    free(fname);
+    if (p->opt_level >= 1) {
+        fold_constants(&fn);
+        allocate_registers(&fn);
+    }
+    lower_function(p, &fn);
+    arena_reset(p->func_arena);
 }
 
 static void parse_global_let(Parser* p) {
@@ -1333,31 +1715,30 @@ static void parse_global_let(Parser* p) {
         pointer_name = true;
         next(p);
     }
-    if (p->cur.kind != TK_IDENT) die("expected variable name after let");
-    char* raw = token_str(&p->cur);
+    if (!token_is_name(&p->cur)) die("expected variable name after let");
+    const char* raw = token_intern(&p->cur);
     next(p);
     Type ty = (Type){TY_UNKNOWN};
     int reserve_count = 1;
 
     if (p->cur.kind == TK_COLON) {
         next(p);
-        if (p->cur.kind != TK_IDENT) die("expected type name after ':'");
+        if (!token_is_name(&p->cur)) die("expected type name after ':'");
         ty = parse_type_name(&p->cur);
         if (ty.kind == TY_UNKNOWN && is_reserve_directive(&p->cur)) {
             ty = type_for_reserve(&p->cur);
             next(p);
             if (p->cur.kind != TK_INT) die("expected reserve count");
-            char* count_str = token_str(&p->cur);
-            reserve_count = atoi(count_str);
-            free(count_str);
+            reserve_count = token_int(&p->cur);
         }
         next(p);
     }
     if (ty.kind == TY_UNKNOWN && pointer_name) ty.kind = TY_U64;
     if (ty.kind == TY_UNKNOWN) ty.kind = TY_U64;
 
-    char* qualified = resolve_definition_name(p->current_namespace, raw);
+    const char* qualified = resolve_definition_name(p->current_namespace, raw);
     add_global(p->globals, raw, qualified, ty, reserve_count);
+    add_module_def(p->module, qualified, MSYM_DATA);
 
     if (p->current_section == SEC_BSS) {
         if (reserve_count <= 0) reserve_count = 1;
@@ -1368,8 +1749,6 @@ static void parse_global_let(Parser* p) {
         outfmt(p->O, "%s: %s %d\n", qualified, directive, reserve_count);
         expect(p, TK_SEMI, "expected ';' after let");
         next(p);
-        free(raw);
-        free(qualified);
         return;
     }
 
@@ -1382,132 +1761,211 @@ static void parse_global_let(Parser* p) {
             end = p->cur.end;
             next(p);
         }
-        char* value = trim_ws(start, end);
-        if (!*value) {
-            free(value);
-            value = xstrdup("0");
-        }
+        const char* value = trim_ws(p->file_arena, start, end);
+        if (!*value) value = "0";
         outfmt(p->O, "%s: %s %s\n", qualified, nasm_data_directive(ty), value);
-        free(value);
         next(p);
     } else {
         outfmt(p->O, "%s: %s 0\n", qualified, nasm_data_directive(ty));
         expect(p, TK_SEMI, "expected ';' after let");
         next(p);
     }
-
-    free(raw);
-    free(qualified);
 }
 
 static void parse_macro_definition(Parser* p) {
     next(p);
-    if (p->cur.kind != TK_IDENT) die("expected macro name");
-    char* raw = token_str(&p->cur);
+    if (!token_is_name(&p->cur)) die("expected macro name");
+    const char* raw = token_intern(&p->cur);
     next(p);
 
     int arity = 0;
     if (p->cur.kind == TK_COMMA) {
         next(p);
         if (p->cur.kind != TK_INT) die("expected macro arity");
-        char* count_str = token_str(&p->cur);
-        arity = atoi(count_str);
-        free(count_str);
+        arity = token_int(&p->cur);
         next(p);
     }
 
     expect(p, TK_COLON, "expected ':' after macro header");
-    char* qualified = resolve_definition_name(p->current_namespace, raw);
-    char* body = capture_until_enddef(p);
-    add_macro(p->macro_table, qualified, arity, body);
-    free(body);
-    free(raw);
-    free(qualified);
+    const char* qualified = resolve_definition_name(p->current_namespace, raw);
+    const char* body_start = NULL;
+    const char* body_end = NULL;
+    capture_until_enddef(p, &body_start, &body_end);
+    Splice* sp = add_splice(p->module, SPLICE_MACRO_DEF);
+    sp->name = qualified;
+    sp->arity = arity;
+    sp->body = body_start;
+    sp->body_len = (size_t)(body_end - body_start);
 }
 
-static void compile_path(const char* path, Out* O, CompileContext* ctx, ImportSet* imports, bool emit_header);
-
-static void handle_directive(Parser* p,
-                             const char* path,
-                             Out* O,
-                             CompileContext* ctx,
-                             ImportSet* imports) {
-    if (p->cur.kind != TK_IDENT) die("expected directive after #");
-
-    if (token_is(&p->cur, "section")) {
-        next(p);
-        if (p->cur.kind != TK_IDENT) die("expected section name");
-        if (token_is(&p->cur, "program")) {
-            outln(p->O, "section .text");
-            p->current_section = SEC_TEXT;
-        } else if (token_is(&p->cur, "data")) {
-            outln(p->O, "section .data");
-            p->current_section = SEC_DATA;
-        } else if (token_is(&p->cur, "readonly")) {
-            outln(p->O, "section .rodata");
-            p->current_section = SEC_RODATA;
-        } else if (token_is(&p->cur, "bss")) {
-            outln(p->O, "section .bss");
-            p->current_section = SEC_BSS;
-        } else if (token_is(&p->cur, "macros")) {
-            p->current_section = SEC_MACROS;
-        } else {
-            die("unknown section");
+static void handle_directive(Parser* p, SourceFile* file, CompileContext* ctx) {
+    switch (p->cur.kind) {
+        case TK_KW_SECTION:
+            next(p);
+            if (!token_is_name(&p->cur)) die("expected section name");
+            switch (p->cur.kind) {
+                case TK_KW_PROGRAM:
+                    outln(p->O, "section .text");
+                    p->current_section = SEC_TEXT;
+                    p->out_section = SEC_TEXT;
+                    break;
+                case TK_KW_DATA:
+                    outln(p->O, "section .data");
+                    p->current_section = SEC_DATA;
+                    p->out_section = SEC_DATA;
+                    break;
+                case TK_KW_READONLY:
+                    outln(p->O, "section .rodata");
+                    p->current_section = SEC_RODATA;
+                    p->out_section = SEC_RODATA;
+                    break;
+                case TK_KW_BSS:
+                    outln(p->O, "section .bss");
+                    p->current_section = SEC_BSS;
+                    p->out_section = SEC_BSS;
+                    break;
+                case TK_KW_MACROS:
+                    p->current_section = SEC_MACROS;
+                    break;
+                default:
+                    die("unknown section");
+            }
+            next(p);
+            return;
+        case TK_KW_MODULE:
+            next(p);
+            if (!token_is_name(&p->cur)) die("expected module name after #module");
+            p->current_namespace = token_intern(&p->cur);
+            next(p);
+            return;
+        case TK_KW_ENDMODULE:
+            if (!p->current_namespace) die("#endmodule without active module");
+            p->current_namespace = NULL;
+            next(p);
+            return;
+        case TK_KW_IMPORT: {
+            next(p);
+            if (!token_is_name(&p->cur) && p->cur.kind != TK_STRING && p->cur.kind != TK_PATH) {
+                die("expected path after #import");
+            }
+            const char* resolved = resolve_import_path(file->path, token_intern(&p->cur));
+            next(p);
+            SourceFile* dep = source_find(&ctx->sources, resolved);
+            if (!dep) die("import was not loaded by the symbol scan");
+            Splice* sp = add_splice(p->module, SPLICE_IMPORT);
+            sp->dep = dep;
+            sp->section = p->out_section;
+            p->out_section = SEC_NONE;
+            return;
         }
-        next(p);
-        return;
-    }
-    if (token_is(&p->cur, "module")) {
-        next(p);
-        if (p->cur.kind != TK_IDENT) die("expected module name after #module");
-        free(p->current_namespace);
-        p->current_namespace = token_str(&p->cur);
-        next(p);
-        return;
+        case TK_KW_UNS:
+            next(p);
+            if (!token_is_name(&p->cur)) die("expected namespace after #uns");
+            add_using_namespace(p, token_intern(&p->cur));
+            next(p);
+            return;
+        default:
+            if (!token_is_name(&p->cur)) die("expected directive after #");
+            die("unknown #directive");
     }
-    if (token_is(&p->cur, "endmodule")) {
-        if (!p->current_namespace) die("#endmodule without active module");
-        free(p->current_namespace);
-        p->current_namespace = NULL;
+}
+
+// --split-functions: a module's function bodies only read the program
+// tables, which are complete once the symbol scan is done, so they can be
+// emitted on several threads. The top level is parsed in order first, with
+// each body skipped and recorded; contiguous runs of bodies are then emitted
+// into one fragment per run, and the fragments are stitched back in at the
+// recorded positions. The result is the same as emitting in order. Anything
+// unexpected, including any error, sends the module back to the in-order
+// path, which reports the error as usual.
+static ModuleMark mark_module(const ModuleOut* M) {
+    return (ModuleMark){M->out.len, M->nsplices, M->ndefs, M->nrefs};
+}
+
+// Mirrors parse_and_emit_func statement by statement without emitting
+// anything. Dies on a body it would not accept.
+static void skip_function(Parser* p) {
+    while (p->cur.kind != TK_INDENT) {
+        if (p->cur.kind == TK_EOF || p->cur.kind == TK_DEDENT) die("expected indented function body");
         next(p);
-        return;
     }
-    if (token_is(&p->cur, "import")) {
-        next(p);
-        if (p->cur.kind != TK_IDENT && p->cur.kind != TK_STRING && p->cur.kind != TK_PATH) {
-            die("expected path after #import");
+    next(p);
+    for (;;) {
+        switch (p->cur.kind) {
+            case TK_DEDENT:
+                next(p);
+                if (p->cur.kind == TK_KW_END) next(p);
+                return;
+            case TK_KW_END:
+                next(p);
+                return;
+            case TK_KW_RET:
+            case TK_KW_RETURN:
+                while (p->cur.kind != TK_DEDENT && p->cur.kind != TK_EOF) next(p);
+                if (p->cur.kind == TK_DEDENT) next(p);
+                if (p->cur.kind == TK_KW_END) next(p);
+                return;
+            case TK_NL:
+                next(p);
+                continue;
+            case TK_AT:
+                parse_inline_block(p);
+                continue;
+            case TK_KW_LET:
+            case TK_KW_SET:
+            case TK_KW_PUSH:
+            case TK_KW_POP:
+            case TK_KW_VOID:
+            case TK_KW_CALL:
+            case TK_DOLLAR: {
+                bool macro = p->cur.kind == TK_DOLLAR;
+                while (p->cur.kind != TK_SEMI) {
+                    if (p->cur.kind == TK_EOF) die("expected ';'");
+                    next(p);
+                }
+                next(p);
+                if (macro && p->cur.kind == TK_SEMI) next(p);
+                continue;
+            }
+            default:
+                die("unsupported statement");
         }
-        char* import_token = token_str(&p->cur);
-        char* resolved = resolve_import_path(path, import_token);
-        free(import_token);
-        next(p);
-        compile_path(resolved, O, ctx, imports, false);
-        free(resolved);
-        return;
     }
-    if (token_is(&p->cur, "uns")) {
-        next(p);
-        if (p->cur.kind != TK_IDENT) die("expected namespace after #uns");
-        char* ns = token_str(&p->cur);
-        add_using_namespace(p, ns);
-        free(ns);
-        next(p);
-        return;
+}
+
+static void defer_function(Parser* p, const char* raw_name, bool is_global, bool is_inline) {
+    DeferredFuncs* D = p->deferred;
+    if (D->count == D->cap) {
+        D->cap = D->cap ? D->cap * 2 : 64;
+        D->items = (DeferredFunc*)realloc(D->items, D->cap * sizeof(DeferredFunc));
+        if (!D->items) die("oom");
     }
-    die("unknown #directive");
+    DeferredFunc* f = &D->items[D->count++];
+    *f = (DeferredFunc){0};
+    f->pos = p->ts->pos - 1;
+    f->raw_name = raw_name;
+    f->is_global = is_global;
+    f->is_inline = is_inline;
+    f->ns = p->current_namespace;
+    f->usings = p->using_namespaces;
+    f->using_count = p->using_count;
+    f->at = mark_module(p->module);
+    skip_function(p);
+    f->end = p->ts->pos - 1;
 }
 
-static void compile_path(const char* path, Out* O, CompileContext* ctx, ImportSet* imports, bool emit_header) {
-    if (import_seen(imports, path)) return;
-    add_import(imports, path);
-
-    size_t len = 0;
-    char* src = read_file_all(path, &len);
-    Lexer L;
-    lexer_init(&L, src, len);
+static void compile_top_level(SourceFile* file, ModuleOut* M, CompileContext* ctx, Arena* func_arena,
+                              bool emit_header, DeferredFuncs* deferred) {
+    TokenStream ts = {&file->toks, 0};
+    StreamPosition where = {file->path, &ts};
+    DieContext saved = die_set_context((DieContext){describe_stream_position, &where});
+    Out* O = &M->out;
 
     Parser p = {0};
-    p.L = &L;
+    p.ts = &ts;
+    p.module = M;
+    p.file_arena = &M->arena;
+    p.func_arena = func_arena;
     p.O = O;
     p.current_namespace = NULL;
     p.using_namespaces = NULL;
@@ -1518,10 +1976,13 @@ static void compile_path(const char* path, Out* O, CompileContext* ctx, ImportSe
     p.macro_table = &ctx->macros;
     p.globals = &ctx->globals;
     p.current_section = SEC_NONE;
+    p.deferred = deferred;
+    p.opt_level = ctx->opt_level;
 
     next(&p);
 
     if (emit_header) {
+        add_module_ref(M, intern_cstr("main"));
         outln(O, "default rel");
         outln(O, "section .text");
         outln(O, "global _start");
@@ -1530,99 +1991,1373 @@ static void compile_path(const char* path, Out* O, CompileContext* ctx, ImportSe
         outln(O, "    mov rdi, rax");
         outln(O, "    mov rax, 60");
         outln(O, "    syscall");
+        p.out_section = SEC_TEXT;
     }
 
     while (p.cur.kind != TK_EOF) {
-        if (p.cur.kind == TK_NL) {
-            next(&p);
-            continue;
+        switch (p.cur.kind) {
+            case TK_NL:
+                next(&p);
+                continue;
+            case TK_HASH:
+                next(&p);
+                handle_directive(&p, file, ctx);
+                continue;
+            case TK_KW_LOCAL:
+            case TK_KW_GLOBAL: {
+                bool is_global = p.cur.kind == TK_KW_GLOBAL;
+                next(&p);
+                bool is_inline = false;
+                if (p.cur.kind == TK_KW_INLINE) {
+                    is_inline = true;
+                    next(&p);
+                }
+                if (p.cur.kind != TK_KW_FUNC) {
+                    die("expected 'func' after local/global");
+                }
+                next(&p);
+                if (!token_is_name(&p.cur)) die("expected function name");
+                const char* raw = token_intern(&p.cur);
+                next(&p);
+                if (deferred) defer_function(&p, raw, is_global, is_inline);
+                else parse_and_emit_func(&p, raw, is_global, is_inline);
+                continue;
+            }
+            case TK_KW_FUNC:
+                die("functions must be declared with 'local func' or 'global func'");
+                break;
+            case TK_KW_LET:
+                if (p.current_section != SEC_DATA && p.current_section != SEC_BSS
+                    && p.current_section != SEC_RODATA) {
+                    die("let statements must be in data/bss/readonly sections");
+                }
+                parse_global_let(&p);
+                continue;
+            case TK_KW_DEF:
+                if (p.current_section != SEC_MACROS) {
+                    die("macro definitions must be in macros section");
+                }
+                parse_macro_definition(&p);
+                continue;
+            case TK_AT: {
+                Token block = parse_inline_block(&p);
+                emit_raw_range(O, block.start, block.end);
+                continue;
+            }
+            default:
+                break;
         }
 
-        if (p.cur.kind == TK_HASH) {
-            next(&p);
-            handle_directive(&p, path, O, ctx, imports);
-            continue;
+        die("unexpected top-level token");
+    }
+    M->end_section = p.out_section;
+    die_set_context(saved);
+}
+
+typedef struct SplitModule SplitModule;
+
+typedef struct {
+    SplitModule* S;
+    size_t first;
+    size_t count;
+    ModuleOut frag;
+    Arena scratch;
+    bool failed;
+} FuncChunk;
+
+struct SplitModule {
+    SourceFile* file;
+    ModuleOut* M;
+    ModuleOut top;  // the top level, while M is stitched together
+    CompileContext* ctx;
+    bool emit_header;
+    DeferredFuncs funcs;
+    FuncChunk* chunks;
+    size_t nchunks;
+};
+
+static void compile_split_top_level(void* arg) {
+    SplitModule* S = (SplitModule*)arg;
+    compile_top_level(S->file, S->M, S->ctx, NULL, S->emit_header, &S->funcs);
+}
+
+static void compile_chunk(void* arg) {
+    FuncChunk* c = (FuncChunk*)arg;
+    CompileContext* ctx = c->S->ctx;
+    for (size_t i = c->first; i < c->first + c->count; i++) {
+        DeferredFunc* f = &c->S->funcs.items[i];
+        TokenStream ts = {&c->S->file->toks, f->pos};
+        Parser p = {0};
+        p.ts = &ts;
+        p.module = &c->frag;
+        p.file_arena = &c->frag.arena;
+        p.func_arena = &c->scratch;
+        p.O = &c->frag.out;
+        p.current_namespace = f->ns;
+        p.using_namespaces = f->usings;
+        p.using_count = f->using_count;
+        p.func_table = &ctx->funcs;
+        p.global_symbols = &ctx->globals.symbols;
+        p.macro_table = &ctx->macros;
+        p.globals = &ctx->globals;
+        p.opt_level = ctx->opt_level;
+        next(&p);
+        f->from = mark_module(&c->frag);
+        parse_and_emit_func(&p, f->raw_name, f->is_global, f->is_inline);
+        f->to = mark_module(&c->frag);
+        if (ts.pos - 1 != f->end) die("function body ends elsewhere than skipped");
+    }
+}
+
+static void chunk_task(size_t i, void* arg) {
+    FuncChunk* c = &((SplitModule*)arg)->chunks[i];
+    c->failed = !die_quietly(compile_chunk, c);
+}
+
+// Adds the splices, defs and refs of the part of src between two marks to M,
+// with its text going at dest. The splice and def lists already have room.
+static void place_fragment(ModuleOut* M, const ModuleOut* src, ModuleMark from, ModuleMark to, size_t dest) {
+    for (size_t i = from.splices; i < to.splices; i++) {
+        Splice* sp = &M->splices[M->nsplices++];
+        *sp = src->splices[i];
+        sp->offset = dest + (sp->offset - from.out);
+    }
+    memcpy(M->defs + M->ndefs, src->defs + from.defs, (to.defs - from.defs) * sizeof(ModuleSymbol));
+    M->ndefs += to.defs - from.defs;
+    for (size_t i = from.refs; i < to.refs; i++) add_module_ref(M, src->refs[i]);
+}
+
+// The text is most of the work of stitching, so each chunk copies its own.
+static void copy_chunk_task(size_t c, void* arg) {
+    SplitModule* S = (SplitModule*)arg;
+    FuncChunk* chunk = &S->chunks[c];
+    size_t at = chunk->first ? S->funcs.items[chunk->first - 1].at.out : 0;
+    for (size_t i = chunk->first; i < chunk->first + chunk->count; i++) {
+        DeferredFunc* f = &S->funcs.items[i];
+        memcpy(S->M->out.data + f->top_dest, S->top.out.data + at, f->at.out - at);
+        memcpy(S->M->out.data + f->dest, chunk->frag.out.data + f->from.out, f->to.out - f->from.out);
+        at = f->at.out;
+    }
+}
+
+// Rebuilds M from the top level with the bodies spliced back in. The
+// fragments' arenas, which hold their macro arguments, move into M's.
+static void stitch_functions(SplitModule* S) {
+    ModuleOut* M = S->M;
+    ModuleOut* top = &S->top;
+    *top = *M;
+    size_t len = top->out.len;
+    size_t nsplices = top->nsplices;
+    size_t ndefs = top->ndefs;
+    for (size_t c = 0; c < S->nchunks; c++) {
+        len += S->chunks[c].frag.out.len;
+        nsplices += S->chunks[c].frag.nsplices;
+        ndefs += S->chunks[c].frag.ndefs;
+        arena_adopt(&M->arena, &S->chunks[c].frag.arena);
+    }
+    M->out = (Out){0};
+    out_reserve(&M->out, len + 1);
+    M->splices = (Splice*)arena_alloc(&M->arena, nsplices * sizeof(Splice));
+    M->nsplices = 0;
+    M->splices_cap = nsplices;
+    M->defs = (ModuleSymbol*)arena_alloc(&M->arena, ndefs * sizeof(ModuleSymbol));
+    M->ndefs = 0;
+    M->defs_cap = ndefs;
+    M->refs = NULL;
+    M->nrefs = M->refs_cap = 0;
+    M->ref_index = (NameMap){0};
+
+    ModuleMark at = {0};
+    size_t dest = 0;
+    for (size_t c = 0; c < S->nchunks; c++) {
+        FuncChunk* chunk = &S->chunks[c];
+        for (size_t i = chunk->first; i < chunk->first + chunk->count; i++) {
+            DeferredFunc* f = &S->funcs.items[i];
+            f->top_dest = dest;
+            place_fragment(M, top, at, f->at, dest);
+            dest += f->at.out - at.out;
+            f->dest = dest;
+            place_fragment(M, &chunk->frag, f->from, f->to, dest);
+            dest += f->to.out - f->from.out;
+            at = f->at;
         }
+    }
+    place_fragment(M, top, at, mark_module(top), dest);
+    memcpy(M->out.data + dest, top->out.data + at.out, top->out.len - at.out);
+    M->out.len = len;
+    pool_run(S->nchunks, S->ctx->split_jobs, copy_chunk_task, S);
+    out_free(&top->out);
+}
 
-        if (p.cur.kind == TK_IDENT && (token_is(&p.cur, "local") || token_is(&p.cur, "global"))) {
-            bool is_global = token_is(&p.cur, "global");
-            next(&p);
-            bool is_inline = false;
-            if (p.cur.kind == TK_IDENT && token_is(&p.cur, "inline")) {
-                is_inline = true;
-                next(&p);
+static void free_split(SplitModule* S) {
+    for (size_t i = 0; i < S->nchunks; i++) {
+        out_free(&S->chunks[i].frag.out);
+        arena_free(&S->chunks[i].frag.arena);
+        arena_free(&S->chunks[i].scratch);
+    }
+    free(S->chunks);
+    free(S->funcs.items);
+}
+
+static void reset_module(ModuleOut* M) {
+    out_free(&M->out);
+    arena_free(&M->arena);
+    *M = (ModuleOut){0};
+}
+
+static bool compile_file_split(SourceFile* file, ModuleOut* M, CompileContext* ctx, bool emit_header) {
+    SplitModule S = {0};
+    S.file = file;
+    S.M = M;
+    S.ctx = ctx;
+    S.emit_header = emit_header;
+    bool ok = die_quietly(compile_split_top_level, &S);
+    if (ok && S.funcs.count > 0) {
+        size_t want = (size_t)ctx->split_jobs * 4;
+        S.nchunks = S.funcs.count < want ? S.funcs.count : want;
+        S.chunks = (FuncChunk*)calloc(S.nchunks, sizeof(FuncChunk));
+        if (!S.chunks) die("oom");
+        for (size_t i = 0; i < S.nchunks; i++) {
+            S.chunks[i].S = &S;
+            S.chunks[i].first = S.funcs.count * i / S.nchunks;
+            S.chunks[i].count = S.funcs.count * (i + 1) / S.nchunks - S.chunks[i].first;
+        }
+        pool_run(S.nchunks, ctx->split_jobs, chunk_task, &S);
+        for (size_t i = 0; i < S.nchunks; i++) ok = ok && !S.chunks[i].failed;
+        if (ok) stitch_functions(&S);
+    }
+    free_split(&S);
+    if (!ok) reset_module(M);
+    return ok;
+}
+
+// Emits one module into M. Only reads the shared tables, so modules can be
+// compiled concurrently.
+static void compile_file(SourceFile* file, ModuleOut* M, CompileContext* ctx, Arena* func_arena, bool emit_header) {
+    if (ctx->split_jobs > 1 && compile_file_split(file, M, ctx, emit_header)) return;
+    compile_top_level(file, M, ctx, func_arena, emit_header, NULL);
+}
+
+static void emit_macro_use(Out* O, MacroTable* macros, Arena* scratch, const Splice* sp) {
+    Macro* macro = find_macro(macros, sp->name);
+    if (macro) {
+        timing_count(COUNT_MACRO_EXPANSIONS, 1);
+        emit_asm_from_text(O, expand_macro_body(scratch, macro->body, sp->args, sp->argc));
+        arena_reset(scratch);
+        return;
+    }
+    out_str(O, "    ");
+    out_str(O, sp->name);
+    if (sp->argc > 0) {
+        out_char(O, ' ');
+        for (int i = 0; i < sp->argc; i++) {
+            if (i > 0) out_str(O, ", ");
+            out_str(O, sp->args[i]);
+        }
+    }
+    out_char(O, '\n');
+}
+
+static void append_module_range(Out* O, const ModuleOut* M, size_t from, size_t to) {
+    if (to > from) out_mem(O, M->out.data + from, to - from);
+}
+
+static const char* section_directive(Section sec) {
+    switch (sec) {
+        case SEC_TEXT:
+            return "section .text";
+        case SEC_DATA:
+            return "section .data";
+        case SEC_RODATA:
+            return "section .rodata";
+        case SEC_BSS:
+            return "section .bss";
+        default:
+            return NULL;
+    }
+}
+
+typedef struct {
+    CompileContext* ctx;
+    ModuleOut* modules;
+    Arena* scratch;
+    Out* outs;          // one buffer per module when separate, else just one
+    bool separate;
+    Section section;    // section the combined stream would be in here
+    NameMap owners;     // separate mode: symbol -> defining module and kind
+} Linker;
+
+static void die_local_reference(const char* name, const SourceFile* owner, const SourceFile* user) {
+    char msg[1024];
+    snprintf(msg, sizeof(msg), "'%s' is a local func of %s but is used from %s; declare it 'global func'",
+             name, owner->path, user->path);
+    die(msg);
+}
+
+// Separate mode: the declarations that stitching modules into one file used
+// to make unnecessary. Functions are exported by their own `global` line.
+static void emit_module_prologue(Linker* L, const SourceFile* file, Out* O) {
+    const ModuleOut* M = &L->modules[file->id];
+    if (file->id != 0) outln(O, "default rel");
+    for (size_t i = 0; i < M->ndefs; i++) {
+        if (M->defs[i].kind != MSYM_DATA) continue;
+        out_str(O, "global ");
+        outln(O, M->defs[i].name);
+    }
+    for (size_t i = 0; i < M->nrefs; i++) {
+        size_t* owner = name_map_find(&L->owners, M->refs[i]);
+        if (owner) {
+            size_t id = *owner >> 2;
+            if (id == file->id) continue;
+            if ((ModuleSymbolKind)(*owner & 3) == MSYM_LOCAL_FUNC) {
+                die_local_reference(M->refs[i], L->ctx->sources.files[id], file);
             }
-            if (p.cur.kind != TK_IDENT || !token_is(&p.cur, "func")) {
-                die("expected 'func' after local/global");
+        }
+        out_str(O, "extern ");
+        outln(O, M->refs[i]);
+    }
+}
+
+static void switch_section(Out* O, Section sec) {
+    const char* line = section_directive(sec);
+    if (line) outln(O, line);
+}
+
+// Replays a module's buffer, descending into each import the first time it
+// is reached. This reproduces the order a single depth-first pass would have
+// emitted, so macro visibility is the same in both modes. In separate mode
+// each module goes to its own buffer, and a section line is inserted wherever
+// the module would otherwise have continued in a section an import left open.
+static void link_module(Linker* L, SourceFile* file) {
+    if (file->emitted) return;
+    file->emitted = true;
+
+    ModuleOut* M = &L->modules[file->id];
+    Out* O = L->separate ? &L->outs[file->id] : L->outs;
+    Section file_section = SEC_TEXT;
+    if (L->separate) {
+        emit_module_prologue(L, file, O);
+        if (L->section != SEC_NONE && L->section != SEC_TEXT) {
+            switch_section(O, L->section);
+            file_section = L->section;
+        }
+    }
+
+    size_t pos = 0;
+    for (size_t i = 0; i < M->nsplices; i++) {
+        const Splice* sp = &M->splices[i];
+        append_module_range(O, M, pos, sp->offset);
+        pos = sp->offset;
+        switch (sp->kind) {
+            case SPLICE_IMPORT:
+                if (sp->section != SEC_NONE) L->section = file_section = sp->section;
+                link_module(L, sp->dep);
+                if (L->separate && L->section != SEC_NONE && L->section != file_section) {
+                    switch_section(O, L->section);
+                    file_section = L->section;
+                }
+                break;
+            case SPLICE_MACRO_DEF:
+                add_macro(&L->ctx->macros, sp->name, sp->arity, sp->body, sp->body_len);
+                break;
+            case SPLICE_MACRO_USE:
+                emit_macro_use(O, &L->ctx->macros, L->scratch, sp);
+                break;
+        }
+    }
+    append_module_range(O, M, pos, M->out.len);
+    if (M->end_section != SEC_NONE) L->section = M->end_section;
+}
+
+typedef struct {
+    CompileContext* ctx;
+    ModuleOut* modules;
+    SourceFile* root;
+    atomic_size_t next;
+} ModuleQueue;
+
+static void* module_worker(void* arg) {
+    ModuleQueue* q = (ModuleQueue*)arg;
+    Arena func_arena = {0};
+    for (;;) {
+        size_t i = atomic_fetch_add(&q->next, 1);
+        if (i >= q->ctx->sources.count) break;
+        SourceFile* file = q->ctx->sources.files[i];
+        if (q->modules[i].cached) continue;
+        TimingMark start = timing_start();
+        compile_file(file, &q->modules[i], q->ctx, &func_arena, file == q->root);
+        timing_stop(PHASE_EMIT, file->path, start);
+    }
+    arena_free(&func_arena);
+    return NULL;
+}
+
+static void compile_modules(CompileContext* ctx, ModuleOut* modules, SourceFile* root, int jobs) {
+    ModuleQueue q = {ctx, modules, root, 0};
+    size_t workers = (jobs > 1) ? (size_t)jobs : 1;
+    if (workers > ctx->sources.count) workers = ctx->sources.count;
+    size_t nthreads = (workers > 1) ? workers - 1 : 0;
+
+    pthread_t* threads = NULL;
+    if (nthreads > 0) {
+        threads = (pthread_t*)malloc(nthreads * sizeof(pthread_t));
+        if (!threads) die("oom");
+    }
+    for (size_t i = 0; i < nthreads; i++) {
+        if (pthread_create(&threads[i], NULL, module_worker, &q) != 0) die("failed to start worker thread");
+    }
+    module_worker(&q);
+    for (size_t i = 0; i < nthreads; i++) pthread_join(threads[i], NULL);
+    free(threads);
+}
+
+// Cache keys are hashes over a length-prefixed serialisation of every input,
+// so distinct inputs can never concatenate to the same byte string.
+static void key_u64(Out* K, uint64_t v) { out_mem(K, (const char*)&v, sizeof(v)); }
+
+static void key_bytes(Out* K, const void* data, size_t len) {
+    key_u64(K, len);
+    if (len) out_mem(K, (const char*)data, len);
+}
+
+static void key_str(Out* K, const char* s) { key_bytes(K, s, s ? strlen(s) : 0); }
+
+static void key_hash(Out* K, CacheKey key) {
+    key_u64(K, key.lo);
+    key_u64(K, key.hi);
+}
+
+static void key_header(Out* K, const char* kind, const TranslateOptions* opts) {
+    key_str(K, kind);
+    key_u64(K, CHASMC_CACHE_FORMAT);
+    key_str(K, CHASMC_BUILD_ID);
+    // Options that change the generated code belong here; -j does not.
+    key_u64(K, (uint64_t)opts->opt_level);
+}
+
+static CacheKey key_finish(Out* K) {
+    CacheKey key = cache_key(K->data, K->len);
+    out_free(K);
+    return key;
+}
+
+static void key_symbols(Out* K, const SymbolTable* table) {
+    key_u64(K, table->count);
+    for (size_t i = 0; i < table->count; i++) {
+        key_str(K, table->items[i].name);
+        key_str(K, table->items[i].qualified);
+        key_u64(K, table->items[i].ambiguous);
+    }
+}
+
+// A module's emitted buffer depends on its own tokens and on the
+// program-wide tables built by the symbol scan; everything that depends on
+// other modules' bodies is deferred to link_module. Hashing the tables lets a
+// module hit the cache after edits to function bodies elsewhere.
+static CacheKey tables_digest(const CompileContext* ctx) {
+    Out K = {0};
+    key_symbols(&K, &ctx->funcs);
+    key_u64(&K, ctx->globals.count);
+    for (size_t i = 0; i < ctx->globals.count; i++) {
+        key_str(&K, ctx->globals.items[i].name);
+        key_u64(&K, (uint64_t)ctx->globals.items[i].ty.kind);
+        key_u64(&K, (uint64_t)ctx->globals.items[i].reserve_count);
+        key_u64(&K, (uint64_t)ctx->globals.items[i].is_const);
+        key_u64(&K, ctx->globals.items[i].value);
+    }
+    key_symbols(&K, &ctx->globals.symbols);
+    key_symbols(&K, &ctx->macros.symbols);
+    return key_finish(&K);
+}
+
+static CacheKey module_key(const TranslateOptions* opts, const SourceFile* file, bool is_root, CacheKey digest) {
+    Out K = {0};
+    key_header(&K, "module", opts);
+    key_str(&K, file->path);
+    key_u64(&K, is_root);
+    key_hash(&K, cache_key(file->view.data, file->view.len));
+    key_hash(&K, digest);
+    return key_finish(&K);
+}
+
+static size_t import_index(const SourceFile* file, const SourceFile* dep) {
+    for (size_t i = 0; i < file->nimports; i++) {
+        if (file->imports[i] == dep) return i;
+    }
+    die("import missing from the import list");
+    return 0;
+}
+
+// Imports are stored as positions in file->imports, which the symbol scan
+// rebuilds in the same order from the same tokens or interface.
+static void write_module(Out* S, const SourceFile* file, const ModuleOut* M) {
+    key_bytes(S, M->out.data, M->out.len);
+    key_u64(S, (uint64_t)M->end_section);
+    key_u64(S, M->ndefs);
+    for (size_t i = 0; i < M->ndefs; i++) {
+        key_str(S, M->defs[i].name);
+        key_u64(S, (uint64_t)M->defs[i].kind);
+    }
+    key_u64(S, M->nrefs);
+    for (size_t i = 0; i < M->nrefs; i++) key_str(S, M->refs[i]);
+    key_u64(S, M->nsplices);
+    for (size_t i = 0; i < M->nsplices; i++) {
+        const Splice* sp = &M->splices[i];
+        key_u64(S, (uint64_t)sp->kind);
+        key_u64(S, sp->offset);
+        switch (sp->kind) {
+            case SPLICE_IMPORT:
+                key_u64(S, (uint64_t)sp->section);
+                key_u64(S, import_index(file, sp->dep));
+                break;
+            case SPLICE_MACRO_DEF:
+                key_str(S, sp->name);
+                key_u64(S, (uint64_t)(int64_t)sp->arity);
+                key_bytes(S, sp->body, sp->body_len);
+                break;
+            case SPLICE_MACRO_USE:
+                key_str(S, sp->name);
+                key_u64(S, (uint64_t)sp->argc);
+                for (int a = 0; a < sp->argc; a++) key_str(S, sp->args[a]);
+                break;
+        }
+    }
+}
+
+static void save_module(Cache* cache, CacheKey key, const SourceFile* file, const ModuleOut* M) {
+    Out S = {0};
+    write_module(&S, file, M);
+    cache_put(cache, CACHE_MODULE, key, S.data, S.len);
+    out_free(&S);
+}
+
+typedef struct {
+    const char* p;
+    const char* end;
+    bool ok;
+} EntryReader;
+
+static uint64_t read_u64(EntryReader* r) {
+    uint64_t v = 0;
+    if ((size_t)(r->end - r->p) < sizeof(v)) {
+        r->ok = false;
+        return 0;
+    }
+    memcpy(&v, r->p, sizeof(v));
+    r->p += sizeof(v);
+    return v;
+}
+
+static const char* read_bytes(EntryReader* r, size_t* len) {
+    *len = (size_t)read_u64(r);
+    if (!r->ok || (size_t)(r->end - r->p) < *len) {
+        r->ok = false;
+        *len = 0;
+        return "";
+    }
+    const char* out = r->p;
+    r->p += *len;
+    return out;
+}
+
+static const char* read_name(EntryReader* r) {
+    size_t len;
+    const char* s = read_bytes(r, &len);
+    return intern(s, len);
+}
+
+// Fills M and marks it cached; on malformed input M is left empty.
+static bool read_module(EntryReader* r, const SourceFile* file, ModuleOut* M) {
+    size_t len;
+    const char* text = read_bytes(r, &len);
+    out_mem(&M->out, text, len);
+    M->end_section = (Section)read_u64(r);
+    uint64_t ndefs = read_u64(r);
+    for (uint64_t i = 0; i < ndefs && r->ok; i++) {
+        const char* name = read_name(r);
+        add_module_def(M, name, (ModuleSymbolKind)read_u64(r));
+    }
+    uint64_t nrefs = read_u64(r);
+    for (uint64_t i = 0; i < nrefs && r->ok; i++) add_module_ref(M, read_name(r));
+    uint64_t nsplices = read_u64(r);
+    for (uint64_t i = 0; i < nsplices && r->ok; i++) {
+        SpliceKind kind = (SpliceKind)read_u64(r);
+        Splice* sp = add_splice(M, kind);
+        sp->offset = (size_t)read_u64(r);
+        if (sp->offset > M->out.len) r->ok = false;
+        switch (kind) {
+            case SPLICE_IMPORT: {
+                sp->section = (Section)read_u64(r);
+                uint64_t dep = read_u64(r);
+                if (dep < file->nimports) sp->dep = file->imports[dep];
+                else r->ok = false;
+                break;
             }
-            next(&p);
-            if (p.cur.kind != TK_IDENT) die("expected function name");
-            char* raw = token_str(&p.cur);
-            next(&p);
-            parse_and_emit_func(&p, raw, is_global, is_inline);
-            free(raw);
-            continue;
+            case SPLICE_MACRO_DEF: {
+                sp->name = read_name(r);
+                sp->arity = (int)(int64_t)read_u64(r);
+                sp->body = read_bytes(r, &sp->body_len);
+                sp->body = arena_strndup(&M->arena, sp->body, sp->body_len);
+                break;
+            }
+            case SPLICE_MACRO_USE: {
+                sp->name = read_name(r);
+                uint64_t argc = read_u64(r);
+                if (argc > 16) {
+                    r->ok = false;
+                    break;
+                }
+                sp->argc = (int)argc;
+                sp->args = (char* *)arena_alloc(&M->arena, (size_t)argc*  sizeof(char* ));
+                for (int a = 0; a < sp->argc; a++) {
+                    const char* arg = read_bytes(r, &len);
+                    sp->args[a] = arena_strndup(&M->arena, arg, len);
+                }
+                break;
+            }
+            default:
+                r->ok = false;
+                break;
         }
+    }
+    if (!r->ok || r->p != r->end) {
+        out_free(&M->out);
+        arena_free(&M->arena);
+        *M = (ModuleOut){0};
+        return false;
+    }
+    M->cached = true;
+    return true;
+}
 
-        if (p.cur.kind == TK_IDENT && token_is(&p.cur, "func")) {
-            die("functions must be declared with 'local func' or 'global func'");
+static void load_cached_modules(Cache* cache, const TranslateOptions* opts, CompileContext* ctx,
+                                ModuleOut* modules, CacheKey* keys, SourceFile* root) {
+    CacheKey digest = tables_digest(ctx);
+    for (size_t i = 0; i < ctx->sources.count; i++) {
+        SourceFile* file = ctx->sources.files[i];
+        if (modules[i].cached) continue;
+        keys[i] = module_key(opts, file, file == root, digest);
+        FileView view;
+        bool hit = cache_get(cache, CACHE_MODULE, keys[i], &view);
+        if (hit) {
+            EntryReader r = {view.data, view.data + view.len, true};
+            hit = read_module(&r, file, &modules[i]);
+            file_view_close(&view);
         }
+        cache_record(cache, CACHE_MODULE, hit);
+    }
+}
+
+// The manifest maps the root file to every file the program read, with their
+// content hashes, and to the hash of the resulting asm. Checking it needs no
+// lexing at all, only hashing the listed files.
+static CacheKey program_key(const TranslateOptions* opts, const char* root_real) {
+    Out K = {0};
+    key_header(&K, "program", opts);
+    key_str(&K, root_real);
+    return key_finish(&K);
+}
+
+static bool parse_hex_key(const char* s, CacheKey* key) {
+    char hex[33];
+    for (int i = 0; i < 32; i++) {
+        char c = s[i];
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) return false;
+    }
+    memcpy(hex, s, 32);
+    hex[32] = 0;
+    key->lo = strtoull(hex + 16, NULL, 16);
+    hex[16] = 0;
+    key->hi = strtoull(hex, NULL, 16);
+    return true;
+}
 
-        if (p.cur.kind == TK_IDENT && token_is(&p.cur, "global")) {
-            die("global is a modifier for func; use 'global func'");
+static bool manifest_fresh(Cache* cache, const char* line, const char* end) {
+    CacheKey want;
+    if (end - line < 34 || !parse_hex_key(line, &want) || line[32] != ' ') return false;
+    char path[4096];
+    size_t len = (size_t)(end - line - 33);
+    if (len >= sizeof(path)) return false;
+    memcpy(path, line + 33, len);
+    path[len] = 0;
+    cache_report_source(cache, path);
+    CacheKey got;
+    if (!source_preloaded_hash(path, &got)) {
+        FileView view;
+        if (!file_view_try_open(&view, path)) return false;
+        got = cache_key(view.data, view.len);
+        file_view_close(&view);
+    }
+    return got.lo == want.lo && got.hi == want.hi;
+}
+
+static bool load_cached_program(Cache* cache, CacheKey key, Out* out) {
+    FileView manifest;
+    if (!cache_get(cache, CACHE_PROGRAM, key, &manifest)) return false;
+
+    const char* p = manifest.data;
+    const char* end = manifest.data + manifest.len;
+    CacheKey asm_key;
+    bool ok = manifest.len >= 37 && memcmp(p, "asm ", 4) == 0 && parse_hex_key(p + 4, &asm_key) && p[36] == '\n';
+    if (ok) p += 37;
+    while (ok && p < end) {
+        const char* nl = (const char*)memchr(p, '\n', (size_t)(end - p));
+        if (!nl) nl = end;
+        ok = manifest_fresh(cache, p, nl);
+        p = nl + 1;
+    }
+    file_view_close(&manifest);
+
+    FileView asm_view;
+    if (!ok || !cache_get(cache, CACHE_ASM, asm_key, &asm_view)) return false;
+    out_mem(out, asm_view.data, asm_view.len);
+    file_view_close(&asm_view);
+    return true;
+}
+
+static bool manifest_add(Out* M, const char* path, const char* data, size_t len) {
+    char* real = xrealpath(path);
+    if (!real) return false;
+    char hex[33];
+    cache_key_hex(cache_key(data, len), hex);
+    out_str(M, hex);
+    out_char(M, ' ');
+    outln(M, real);
+    free(real);
+    return true;
+}
+
+// A library taken from its interface is listed with both files: editing the
+// source makes the interface stale, which changes what the next build reads.
+static bool manifest_add_file(Out* M, const SourceFile* file) {
+    if (file->toks.count) return manifest_add(M, file->path, file->view.data, file->view.len);
+    if (!manifest_add(M, file->iface_path, file->iface.data, file->iface.len)) return false;
+    FileView source;
+    if (!file_view_try_open(&source, file->path)) return false;
+    bool ok = manifest_add(M, file->path, source.data, source.len);
+    file_view_close(&source);
+    return ok;
+}
+
+static void save_program(Cache* cache, CacheKey key, const SourceSet* sources, const Out* O) {
+    CacheKey asm_key = cache_key(O->data, O->len);
+    char hex[33];
+    Out M = {0};
+    cache_key_hex(asm_key, hex);
+    out_str(&M, "asm ");
+    outln(&M, hex);
+    for (size_t i = 0; i < sources->count; i++) {
+        if (!manifest_add_file(&M, sources->files[i])) {
+            out_free(&M);
+            return;
         }
+    }
+    if (cache_put(cache, CACHE_ASM, asm_key, O->data, O->len)) {
+        cache_put(cache, CACHE_PROGRAM, key, M.data, M.len);
+    }
+    out_free(&M);
+}
 
-        if (p.cur.kind == TK_IDENT && token_is(&p.cur, "let")) {
-            if (p.current_section != SEC_DATA && p.current_section != SEC_BSS
-                && p.current_section != SEC_RODATA) {
-                die("let statements must be in data/bss/readonly sections");
+// Precompiled interfaces. lib.rvi, written by --emit-interface next to
+// lib.ravine, carries everything an importer would otherwise lex the library
+// for: its imports, the functions, globals and macro names it adds to the
+// program tables, its compiled module with the macro bodies split out, and
+// the lookups that compiled code depends on. The header records the -O level
+// the module was compiled at. All strings are length-prefixed, as in cache
+// entries.
+#define INTERFACE_MAGIC "chasmc interface"
+
+static void write_interface_header(Out* S, int opt_level) {
+    key_str(S, INTERFACE_MAGIC);
+    key_u64(S, CHASMC_CACHE_FORMAT);
+    key_str(S, CHASMC_BUILD_ID);
+    key_u64(S, (uint64_t)opt_level);
+}
+
+static bool read_interface_header(EntryReader* r, uint64_t* opt_level) {
+    size_t len;
+    const char* magic = read_bytes(r, &len);
+    if (len != strlen(INTERFACE_MAGIC) || memcmp(magic, INTERFACE_MAGIC, len) != 0) return false;
+    if (read_u64(r) != CHASMC_CACHE_FORMAT) return false;
+    const char* build = read_bytes(r, &len);
+    if (!r->ok || len != strlen(CHASMC_BUILD_ID) || memcmp(build, CHASMC_BUILD_ID, len) != 0) return false;
+    *opt_level = read_u64(r);
+    return r->ok;
+}
+
+static EntryReader interface_reader(const SourceFile* file, uint64_t* opt_level) {
+    EntryReader r = {file->iface.data, file->iface.data + file->iface.len, true};
+    read_interface_header(&r, opt_level);
+    return r;
+}
+
+static void die_interface(const char* iface_path, const char* what) {
+    char msg[1024];
+    snprintf(msg, sizeof(msg), "%s: %s", iface_path, what);
+    die(msg);
+}
+
+static const char* interface_path_for(const char* path) {
+    const char* slash = strrchr(path, '/');
+    const char* base = slash ? slash + 1 : path;
+    const char* dot = strrchr(base, '.');
+    size_t stem = (dot && dot != base) ? (size_t)(dot - path) : strlen(path);
+    return intern_concat(path, stem, ".rvi", 4, "", 0);
+}
+
+// Like make: the interface is current when it is at least as new as the
+// source. A library may also ship without its source.
+static bool interface_current(const char* source, const char* iface, bool* has_source) {
+    struct stat src;
+    struct stat rvi;
+    if (stat(iface, &rvi) != 0) return false;
+    *has_source = stat(source, &src) == 0;
+    if (!*has_source) return true;
+    if (rvi.st_mtim.tv_sec != src.st_mtim.tv_sec) return rvi.st_mtim.tv_sec > src.st_mtim.tv_sec;
+    return rvi.st_mtim.tv_nsec >= src.st_mtim.tv_nsec;
+}
+
+static SourceFile* load_import(CompileContext* ctx, const char* path) {
+    SourceFile* file = source_find(&ctx->sources, path);
+    if (file) return file;
+    const char* iface = interface_path_for(path);
+    bool has_source = true;
+    FileView view;
+    if (iface != path && interface_current(path, iface, &has_source) && file_view_try_open(&view, iface)) {
+        EntryReader r = {view.data, view.data + view.len, true};
+        uint64_t opt_level;
+        if (read_interface_header(&r, &opt_level)) {
+            file = source_add(&ctx->sources, path);
+            if (!file->toks.count && !file->iface.data) {
+                file->iface = view;
+                file->iface_path = iface;
+                return file;
             }
-            parse_global_let(&p);
+        }
+        file_view_close(&view);
+        if (file) return file;
+        if (!has_source) die_interface(iface, "written by a different chasmc build; rebuild it from the source");
+    }
+    return source_load(&ctx->sources, path);
+}
+
+static void skip_name_pairs(EntryReader* r, int extra_u64s) {
+    uint64_t n = read_u64(r);
+    size_t len;
+    for (uint64_t i = 0; i < n && r->ok; i++) {
+        read_bytes(r, &len);
+        read_bytes(r, &len);
+        for (int k = 0; k < extra_u64s; k++) read_u64(r);
+    }
+}
+
+// Replays the symbol scan: the imports first, then the library's own
+// definitions, in the order scanning the source would add them.
+static void scan_interface(CompileContext* ctx, SourceFile* file) {
+    uint64_t opt_level;
+    EntryReader r = interface_reader(file, &opt_level);
+    uint64_t nimports = read_u64(&r);
+    for (uint64_t i = 0; i < nimports && r.ok; i++) {
+        SourceFile* dep = load_import(ctx, resolve_import_path(file->path, read_name(&r)));
+        source_add_import(file, dep);
+        scan_file_for_symbols(ctx, dep);
+    }
+    TimingMark start = timing_start();
+    uint64_t n = read_u64(&r);
+    for (uint64_t i = 0; i < n && r.ok; i++) {
+        const char* raw = read_name(&r);
+        const char* qualified = read_name(&r);
+        if (r.ok) add_symbol(&ctx->funcs, raw, qualified);
+    }
+    n = read_u64(&r);
+    for (uint64_t i = 0; i < n && r.ok; i++) {
+        const char* raw = read_name(&r);
+        const char* qualified = read_name(&r);
+        uint64_t kind = read_u64(&r);
+        uint64_t reserve = read_u64(&r);
+        if (kind > TY_UNKNOWN || reserve > INT32_MAX) r.ok = false;
+        if (r.ok) add_global(&ctx->globals, raw, qualified, (Type){(TypeKind)kind}, (int)reserve);
+    }
+    n = read_u64(&r);
+    for (uint64_t i = 0; i < n && r.ok; i++) {
+        const char* raw = read_name(&r);
+        const char* qualified = read_name(&r);
+        if (r.ok) add_symbol(&ctx->macros.symbols, raw, qualified);
+    }
+    if (!r.ok) die_interface(file->iface_path, "corrupt interface file");
+    timing_stop(PHASE_SCAN, file->path, start);
+}
+
+static bool lookup_matches(CompileContext* ctx, uint64_t table, const char* name, const char* result, uint64_t type) {
+    if (table == LOOKUP_GLOBAL_TYPE) {
+        GlobalVar* G = find_global(&ctx->globals, name);
+        return G && (uint64_t)G->ty.kind == type;
+    }
+    const SymbolTable* t = NULL;
+    if (table == LOOKUP_FUNC) t = &ctx->funcs;
+    if (table == LOOKUP_GLOBAL) t = &ctx->globals.symbols;
+    if (table == LOOKUP_MACRO) t = &ctx->macros.symbols;
+    if (!t) return false;
+    size_t* idx = name_map_find(&t->index, name);
+    if (!idx) return result == NULL;
+    return !t->items[*idx].ambiguous && t->items[*idx].qualified == result;
+}
+
+// The compiled module is reused only if it was compiled at this program's -O
+// level and every lookup it made resolves the same way against this
+// program's tables; otherwise the caller compiles the library from source.
+static bool load_interface_module(CompileContext* ctx, SourceFile* file, ModuleOut* M) {
+    TimingMark start = timing_start();
+    uint64_t opt_level;
+    EntryReader r = interface_reader(file, &opt_level);
+    if (opt_level != (uint64_t)ctx->opt_level) return false;
+    size_t len;
+    uint64_t nimports = read_u64(&r);
+    for (uint64_t i = 0; i < nimports && r.ok; i++) read_bytes(&r, &len);
+    skip_name_pairs(&r, 0);
+    skip_name_pairs(&r, 2);
+    skip_name_pairs(&r, 0);
+    uint64_t nlookups = read_u64(&r);
+    for (uint64_t i = 0; i < nlookups && r.ok; i++) {
+        uint64_t table = read_u64(&r);
+        const char* name = read_name(&r);
+        const char* result = read_bytes(&r, &len);
+        result = len ? intern(result, len) : NULL;
+        uint64_t type = read_u64(&r);
+        if (r.ok && !lookup_matches(ctx, table, name, result, type)) return false;
+    }
+    if (!r.ok || !read_module(&r, file, M)) die_interface(file->iface_path, "corrupt interface file");
+    timing_stop(PHASE_EMIT, file->path, start);
+    return true;
+}
+
+static void key_name_pairs(Out* S, const Symbol* items, size_t count) {
+    key_u64(S, count);
+    for (size_t i = 0; i < count; i++) {
+        key_str(S, items[i].name);
+        key_str(S, items[i].qualified);
+    }
+}
+
+// Imports are stored as written, so the interface can move with its source.
+static void key_import_names(Out* S, const SourceFile* file, CompileContext* ctx) {
+    key_u64(S, file->nimports);
+    size_t found = 0;
+    TokenStream ts = {&file->toks, 0};
+    for (Token t = token_stream_next(&ts); t.kind != TK_EOF && found < file->nimports; t = token_stream_next(&ts)) {
+        if (t.kind != TK_HASH) continue;
+        t = token_stream_next(&ts);
+        if (t.kind != TK_KW_IMPORT) continue;
+        t = token_stream_next(&ts);
+        const char* written = token_intern(&t);
+        SourceFile* dep = source_find(&ctx->sources, resolve_import_path(file->path, written));
+        if (dep != file->imports[found]) continue;  // a repeated import
+        key_str(S, written);
+        found++;
+    }
+    if (found != file->nimports) die("import list does not match the source");
+}
+
+static void init_context(CompileContext* ctx) {
+    *ctx = (CompileContext){0};
+    init_symbol_table(&ctx->funcs, &ctx->arena);
+    init_global_table(&ctx->globals, &ctx->arena);
+    init_macro_table(&ctx->macros, &ctx->arena);
+}
+
+// Dependency scan for --scan-deps and depfiles. It follows the same files a
+// compilation would, interfaces included, but only lexes what can hold an
+// #import: lines with a '#' or an '@' in them. Tokens never span lines
+// except @asm bodies, which are skipped by brace depth as the lexer does.
+typedef struct {
+    NameMap seen;  // by source_identity, so each file is listed once however it is spelled
+    const char** paths;
+    size_t count;
+    size_t cap;
+} DepScan;
+
+typedef struct {
+    const char* path;
+    size_t line;
+} DepScanPosition;
+
+static void describe_dep_scan_position(const void* ctx, char* buf, size_t cap) {
+    const DepScanPosition* p = (const DepScanPosition*)ctx;
+    snprintf(buf, cap, "%s:%zu: ", p->path, p->line);
+}
+
+// `path` without "." components and without "dir/.." pairs, interned.
+static const char* normalize_path(const char* path) {
+    size_t len = strlen(path);
+    char* buf = (char*)malloc(len + 2);
+    size_t* starts = (size_t*)malloc((len / 2 + 1) * sizeof(size_t));  // of the components ".." may drop
+    if (!buf || !starts) die("oom");
+    bool absolute = path[0] == '/';
+    size_t out = absolute;
+    size_t depth = 0;
+    if (absolute) buf[0] = '/';
+    for (const char* c = path; *c;) {
+        const char* end = strchr(c, '/');
+        if (!end) end = c + strlen(c);
+        size_t n = (size_t)(end - c);
+        bool dotdot = n == 2 && c[0] == '.' && c[1] == '.';
+        if (dotdot && depth > 0) {
+            out = starts[--depth];
+        } else if (n > 0 && !(n == 1 && c[0] == '.') && !(dotdot && absolute)) {
+            if (!dotdot) starts[depth++] = out;
+            if (out > (size_t)absolute) buf[out++] = '/';
+            memcpy(buf + out, c, n);
+            out += n;
+        }
+        c = *end ? end + 1 : end;
+    }
+    if (out == 0) buf[out++] = '.';
+    const char* result = intern(buf, out);
+    free(starts);
+    free(buf);
+    return result;
+}
+
+static bool add_dependency(DepScan* S, const char* path) {
+    const char* id = source_identity(path);
+    if (name_map_find(&S->seen, id ? id : path)) return false;
+    if (S->count == S->cap) {
+        S->cap = S->cap ? S->cap * 2 : 16;
+        S->paths = (const char**)realloc(S->paths, S->cap * sizeof(const char*));
+        if (!S->paths) die("oom");
+    }
+    name_map_put(&S->seen, id ? id : path, S->count);
+    // Listed the short way unless a symlinked directory makes that another file.
+    const char* shown = normalize_path(path);
+    S->paths[S->count++] = (!id || source_identity(shown) == id) ? shown : path;
+    return true;
+}
+
+static void scan_dependencies_of(DepScan* S, const char* path);
+
+// Lexes one line, or the rest of one after an @asm body. Returns where the
+// @asm body it opens starts, or NULL when it opens none.
+static const char* scan_import_line(DepScan* S, const char* path, const char* s, const char* eol) {
+    Lexer L;
+    lexer_init(&L, s, (size_t)(eol - s));
+    Token prev[2] = {{TK_EOF, s, s}, {TK_EOF, s, s}};
+    for (Token t = next_token(&L); t.kind != TK_EOF; t = next_token(&L)) {
+        if (L.asm_state == 3) return s + L.i;
+        if (prev[0].kind == TK_HASH && prev[1].kind == TK_KW_IMPORT) {
+            if (!token_is_name(&t) && t.kind != TK_STRING && t.kind != TK_PATH) die("expected path after #import");
+            scan_dependencies_of(S, resolve_import_path(path, token_intern(&t)));
+        }
+        prev[0] = prev[1];
+        prev[1] = t;
+    }
+    if (prev[0].kind == TK_HASH && prev[1].kind == TK_KW_IMPORT) die("expected path after #import");
+    return NULL;
+}
+
+static void scan_source_imports(DepScan* S, const char* path) {
+    FileView view;
+    file_view_open(&view, path);
+    DepScanPosition where = {path, 1};
+    DieContext saved = die_set_context((DieContext){describe_dep_scan_position, &where});
+    const char* p = view.data;
+    const char* end = view.data + view.len;
+    while (p < end) {
+        const char* eol = memchr(p, '\n', (size_t)(end - p));
+        if (!eol) eol = end;
+        const char* body = NULL;
+        size_t n = (size_t)(eol - p);
+        if (memchr(p, '#', n) || memchr(p, '@', n)) body = scan_import_line(S, path, p, eol);
+        if (!body) {
+            p = eol + 1;
+            where.line++;
             continue;
         }
+        int depth = 1;
+        for (p = body; p < end; p++) {
+            if (*p == '{') depth++;
+            else if (*p == '}' && --depth == 0) break;
+            else if (*p == '\n') where.line++;
+        }
+        if (depth != 0) die("unterminated @asm block");
+        p++;
+    }
+    die_set_context(saved);
+    file_view_close(&view);
+}
 
-        if (p.cur.kind == TK_IDENT && token_is(&p.cur, "def")) {
-            if (p.current_section != SEC_MACROS) {
-                die("macro definitions must be in macros section");
+// Mirrors load_import: a current interface stands in for its source, whose
+// imports are then the ones the interface recorded.
+static void scan_dependencies_of(DepScan* S, const char* path) {
+    const char* iface = interface_path_for(path);
+    bool has_source = true;
+    FileView view;
+    if (iface != path && interface_current(path, iface, &has_source) && file_view_try_open(&view, iface)) {
+        EntryReader r = {view.data, view.data + view.len, true};
+        uint64_t opt_level;
+        if (read_interface_header(&r, &opt_level)) {
+            if (has_source && !add_dependency(S, path)) {
+                file_view_close(&view);
+                return;
             }
-            parse_macro_definition(&p);
-            continue;
+            if (add_dependency(S, iface)) {
+                uint64_t nimports = read_u64(&r);
+                for (uint64_t i = 0; i < nimports && r.ok; i++) {
+                    scan_dependencies_of(S, resolve_import_path(path, read_name(&r)));
+                }
+                if (!r.ok) die_interface(iface, "corrupt interface file");
+            }
+            file_view_close(&view);
+            return;
         }
+        file_view_close(&view);
+        if (!has_source) die_interface(iface, "written by a different chasmc build; rebuild it from the source");
+    }
+    if (add_dependency(S, path)) scan_source_imports(S, path);
+}
 
-        if (p.cur.kind == TK_AT) {
-            char* block = parse_inline_block(&p);
-            emit_raw_block(O, block);
-            free(block);
-            continue;
+size_t scan_dependencies(const char* in_path, const char*** out) {
+    DepScan S = {0};
+    TimingMark start = timing_start();
+    const char* root = intern_cstr(in_path);
+    add_dependency(&S, root);
+    scan_source_imports(&S, root);
+    timing_stop(PHASE_SCAN, root, start);
+    name_map_free(&S.seen);
+    *out = S.paths;
+    return S.count;
+}
+
+void emit_interface(const char* in_path, const char* out_path, int opt_level) {
+    CompileContext ctx;
+    init_context(&ctx);
+    ctx.opt_level = opt_level;
+    SourceFile* root = source_load(&ctx.sources, intern_cstr(in_path));
+    root->scanned = true;
+    scan_imports_in_file(&ctx, root);
+    size_t funcs0 = ctx.funcs.count;
+    size_t globals0 = ctx.globals.count;
+    size_t macros0 = ctx.macros.symbols.count;
+    scan_definitions(&ctx, root);
+
+    ModuleOut M = {0};
+    Arena func_arena = {0};
+    LookupLog log = {0};
+    log.ctx = &ctx;
+    lookup_log = &log;
+    compile_file(root, &M, &ctx, &func_arena, false);
+    lookup_log = NULL;
+
+    Out S = {0};
+    write_interface_header(&S, opt_level);
+    key_import_names(&S, root, &ctx);
+    key_name_pairs(&S, ctx.funcs.items + funcs0, ctx.funcs.count - funcs0);
+    key_u64(&S, ctx.globals.count - globals0);
+    for (size_t i = globals0; i < ctx.globals.count; i++) {
+        key_str(&S, ctx.globals.symbols.items[i].name);
+        key_str(&S, ctx.globals.items[i].name);
+        key_u64(&S, (uint64_t)ctx.globals.items[i].ty.kind);
+        key_u64(&S, (uint64_t)ctx.globals.items[i].reserve_count);
+    }
+    key_name_pairs(&S, ctx.macros.symbols.items + macros0, ctx.macros.symbols.count - macros0);
+    key_u64(&S, log.count);
+    for (size_t i = 0; i < log.count; i++) {
+        key_u64(&S, (uint64_t)log.items[i].table);
+        key_str(&S, log.items[i].name);
+        key_str(&S, log.items[i].result);
+        key_u64(&S, (uint64_t)log.items[i].type);
+    }
+    write_module(&S, root, &M);
+    out_write_file(&S, out_path);
+
+    out_free(&S);
+    free(log.items);
+    for (int t = 0; t < LOOKUP_TABLE_COUNT; t++) name_map_free(&log.seen[t]);
+    arena_free(&func_arena);
+    out_free(&M.out);
+    arena_free(&M.arena);
+    free_source_set(&ctx.sources);
+    arena_free(&ctx.arena);
+}
+
+void emit_ir(const char* in_path, int opt_level, Out* out) {
+    CompileContext ctx;
+    init_context(&ctx);
+    ctx.opt_level = opt_level;
+    SourceFile* root = source_load(&ctx.sources, intern_cstr(in_path));
+    scan_file_for_symbols(&ctx, root);
+
+    Arena func_arena = {0};
+    ir_listing = out;
+    for (size_t i = 0; i < ctx.sources.count; i++) {
+        SourceFile* file = ctx.sources.files[i];
+        ModuleOut M = {0};
+        if (file->toks.count || !load_interface_module(&ctx, file, &M)) {
+            if (!file->toks.count) source_lex(file);
+            outfmt(out, "; module %s\n", file->path);
+            compile_file(file, &M, &ctx, &func_arena, file == root);
         }
+        out_free(&M.out);
+        arena_free(&M.arena);
+    }
+    ir_listing = NULL;
 
-        die("unexpected top-level token");
+    arena_free(&func_arena);
+    free_source_set(&ctx.sources);
+    arena_free(&ctx.arena);
+}
+
+typedef struct {
+    CompileContext ctx;
+    ModuleOut* modules;
+    SourceFile* root;
+} Build;
+
+// Loads and scans the program, then fills one ModuleOut per source file,
+// from the cache where possible.
+static void build_modules(Build* b, const char* in_path, const TranslateOptions* opts) {
+    CompileContext* ctx = &b->ctx;
+    init_context(ctx);
+    b->root = source_load(&ctx->sources, intern_cstr(in_path));
+    scan_file_for_symbols(ctx, b->root);
+
+    ctx->opt_level = opts->opt_level;
+    b->modules = (ModuleOut*)calloc(ctx->sources.count, sizeof(ModuleOut));
+    CacheKey* keys = (CacheKey*)calloc(ctx->sources.count, sizeof(CacheKey));
+    if (!b->modules || !keys) die("oom");
+    for (size_t i = 0; i < ctx->sources.count; i++) {
+        SourceFile* file = ctx->sources.files[i];
+        if (!file->toks.count && !load_interface_module(ctx, file, &b->modules[i])) {
+            struct stat st;
+            if (stat(file->path, &st) != 0) die_interface(file->iface_path, "does not fit this program and has no source");
+            source_lex(file);
+        }
+        if (opts->cache && file->toks.count) cache_report_source(opts->cache, file->path);
     }
+    if (opts->cache) load_cached_modules(opts->cache, opts, ctx, b->modules, keys, b->root);
+    if (opts->split_functions) ctx->split_jobs = opts->jobs;
+    compile_modules(ctx, b->modules, b->root, opts->split_functions ? 1 : opts->jobs);
+    if (opts->cache) {
+        for (size_t i = 0; i < ctx->sources.count; i++) {
+            if (!b->modules[i].cached) save_module(opts->cache, keys[i], ctx->sources.files[i], &b->modules[i]);
+        }
+    }
+    free(keys);
+}
 
-    for (size_t i = 0; i < p.using_count; i++) free(p.using_namespaces[i]);
-    free(p.using_namespaces);
-    free(p.current_namespace);
-    free(src);
+static void free_build(Build* b) {
+    for (size_t i = 0; i < b->ctx.sources.count; i++) {
+        out_free(&b->modules[i].out);
+        arena_free(&b->modules[i].arena);
+    }
+    free(b->modules);
+    free_source_set(&b->ctx.sources);
+    arena_free(&b->ctx.arena);
 }
 
-void translate(const char* in_path, const char* out_path) {
-    CompileContext ctx = {0};
-    scan_file_for_symbols(&ctx, in_path);
+void translate(const char* in_path, Out* out, const TranslateOptions* opts) {
+    Cache* cache = opts->cache;
+    CacheKey prog_key = {0};
+    char* root_real = (cache && strcmp(in_path, "-") != 0) ? xrealpath(in_path) : NULL;
+    bool cache_program = root_real != NULL;
+    if (cache_program) {
+        prog_key = program_key(opts, root_real);
+        bool hit = load_cached_program(cache, prog_key, out);
+        cache_record(cache, CACHE_PROGRAM, hit);
+        free(root_real);
+        if (hit) return;
+    }
+
+    Build b;
+    build_modules(&b, in_path, opts);
+
+    TimingMark start = timing_start();
+    size_t emitted = out->len;
+    Arena scratch = {0};
+    Linker L = {&b.ctx, b.modules, &scratch, out, false, SEC_NONE, {0}};
+    link_module(&L, b.root);
+    timing_count(COUNT_BYTES_EMITTED, out->len - emitted);
+    timing_stop(PHASE_EMIT, NULL, start);
+    if (cache_program) save_program(cache, prog_key, &b.ctx.sources, out);
+    arena_free(&scratch);
+    free_build(&b);
+}
 
-    FILE* out = fopen(out_path, "wb");
-    if (!out) die("cannot open output file");
-    Out O = {out};
+// Module files are named after the source file plus a hash of its canonical
+// path, so they stay stable between runs and never collide.
+static char* module_artifact_path(const char* build_dir, const SourceFile* file, const char* ext) {
+    char* real = xrealpath(file->path);
+    const char* id_path = real ? real : file->path;
+    CacheKey id = cache_key(id_path, strlen(id_path));
+    const char* base = strrchr(file->path, '/');
+    base = base ? base + 1 : file->path;
+    const char* dot = strrchr(base, '.');
+    int stem_len = (int)(dot && dot != base ? (size_t)(dot - base) : strlen(base));
+    size_t cap = strlen(build_dir) + (size_t)stem_len + strlen(ext) + 32;
+    char* out = (char*)malloc(cap);
+    if (!out) die("oom");
+    snprintf(out, cap, "%s/%.*s-%08llx%s", build_dir, stem_len, base, (unsigned long long)(id.lo & 0xffffffffull), ext);
+    free(real);
+    return out;
+}
 
-    ImportSet imports = {0};
-    compile_path(in_path, &O, &ctx, &imports, true);
+// Leaves the file (and its mtime) alone when the content is unchanged.
+static bool write_if_changed(const char* path, const Out* O) {
+    FileView old;
+    if (file_view_try_open(&old, path)) {
+        bool same = old.len == O->len && (O->len == 0 || memcmp(old.data, O->data, O->len) == 0);
+        file_view_close(&old);
+        if (same) return false;
+    }
+    out_write_file(O, path);
+    return true;
+}
 
-    for (size_t i = 0; i < imports.count; i++) free(imports.paths[i]);
-    free(imports.paths);
-    fclose(out);
+size_t translate_modules(const char* in_path, const char* build_dir, const TranslateOptions* opts, ModuleArtifact** out) {
+    if (mkdir(build_dir, 0755) != 0 && errno != EEXIST) die("cannot create module build directory");
+
+    Build b;
+    build_modules(&b, in_path, opts);
+    size_t count = b.ctx.sources.count;
+
+    Out* outs = (Out*)calloc(count, sizeof(Out));
+    ModuleArtifact* arts = (ModuleArtifact*)calloc(count, sizeof(ModuleArtifact));
+    if (!outs || !arts) die("oom");
+
+    TimingMark start = timing_start();
+    Arena scratch = {0};
+    Arena owners_arena = {0};
+    Linker L = {&b.ctx, b.modules, &scratch, outs, true, SEC_NONE, {0}};
+    L.owners.arena = &owners_arena;
+    for (size_t i = 0; i < count; i++) {
+        const ModuleOut* M = &b.modules[i];
+        for (size_t d = 0; d < M->ndefs; d++) {
+            if (name_map_find(&L.owners, M->defs[d].name)) continue;
+            name_map_put(&L.owners, M->defs[d].name, (i << 2) | (size_t)M->defs[d].kind);
+        }
+    }
+    link_module(&L, b.root);
+    for (size_t i = 0; i < count; i++) timing_count(COUNT_BYTES_EMITTED, outs[i].len);
+    timing_stop(PHASE_EMIT, NULL, start);
+
+    for (size_t i = 0; i < count; i++) {
+        const SourceFile* file = b.ctx.sources.files[i];
+        arts[i].asm_path = module_artifact_path(build_dir, file, ".asm");
+        arts[i].obj_path = module_artifact_path(build_dir, file, ".o");
+        arts[i].changed = write_if_changed(arts[i].asm_path, &outs[i]);
+        out_free(&outs[i]);
+    }
+    free(outs);
+    arena_free(&scratch);
+    arena_free(&owners_arena);
+    free_build(&b);
+    *out = arts;
+    return count;
+}
 
-    for (size_t i = 0; i < ctx.scanned.count; i++) free(ctx.scanned.paths[i]);
-    free(ctx.scanned.paths);
-    free_symbol_table(&ctx.funcs);
-    free_global_table(&ctx.globals);
-    free_macro_table(&ctx.macros);
+void free_module_artifacts(ModuleArtifact* arts, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        free(arts[i].asm_path);
+        free(arts[i].obj_path);
+    }
+    free(arts);
 }
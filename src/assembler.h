@@ -1,6 +1,53 @@
 #ifndef CHASMC_ASSEMBLER_H
 #define CHASMC_ASSEMBLER_H
 
-void translate(const char* in_path, const char* out_path);
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "cache.h"
+#include "emit.h"
+
+typedef struct {
+    int jobs;      // module worker threads; output does not depend on it
+    Cache* cache;  // NULL disables caching
+    // Spend the jobs on the function bodies within each module instead, for
+    // programs dominated by one large file. Output does not depend on it.
+    bool split_functions;
+    // 0: straightforward code. 1: folds constants, keeps locals in registers
+    // and cleans up the emitted instructions (see fold.h, regalloc.h and
+    // peephole.h).
+    int opt_level;
+} TranslateOptions;
+
+// Whole program into a single assembly buffer, appended to `out`.
+void translate(const char* in_path, Out* out, const TranslateOptions* opts);
+
+// Writes the precompiled interface (.rvi) of a library module, compiled at
+// opt_level. Importers use it instead of lexing the library while it is at
+// least as new as the source; one built at another level is lexed but its
+// code is compiled afresh.
+void emit_interface(const char* in_path, const char* out_path, int opt_level);
+
+// The IR of every function compiled from source, module by module, as the
+// emitter sees it before lowering at opt_level. For debugging; appended to
+// `out`.
+void emit_ir(const char* in_path, int opt_level, Out* out);
+
+// The files compiling in_path reads: in_path itself first, then its
+// transitive imports and the interfaces standing in for them, without
+// compiling anything. Paths are interned; the array is malloc'd.
+size_t scan_dependencies(const char* in_path, const char*** out);
+
+// Separate compilation: one assembly file per module, with global/extern
+// declarations, written to build_dir. A file is only rewritten when its
+// content changes.
+typedef struct {
+    char* asm_path;
+    char* obj_path;
+    bool changed;
+} ModuleArtifact;
+
+size_t translate_modules(const char* in_path, const char* build_dir, const TranslateOptions* opts, ModuleArtifact** out);
+void free_module_artifacts(ModuleArtifact* arts, size_t count);
 
 #endif
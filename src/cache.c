@@ -0,0 +1,514 @@
+#define _DEFAULT_SOURCE
+
+#include "cache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define XXH_P1 0x9E3779B185EBCA87ull
+#define XXH_P2 0xC2B2AE3D27D4EB4Full
+#define XXH_P3 0x165667B19E3779F9ull
+#define XXH_P4 0x85EBCA77C2B2AE63ull
+#define XXH_P5 0x27D4EB2F165667C5ull
+
+static const char* const kind_suffix[CACHE_KIND_COUNT] = {"prog", "asm", "mod", "obj"};
+static const char* const kind_label[CACHE_KIND_COUNT] = {"programs", "asm", "modules", "objects"};
+
+static uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+static uint64_t read64(const unsigned char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t read32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_P2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_P1;
+}
+
+static uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+    acc ^= xxh_round(0, val);
+    return acc * XXH_P1 + XXH_P4;
+}
+
+static uint64_t xxh64(const void* data, size_t len, uint64_t seed) {
+    const unsigned char* p = (const unsigned char*)data;
+    const unsigned char* end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + XXH_P1 + XXH_P2;
+        uint64_t v2 = seed + XXH_P2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - XXH_P1;
+        do {
+            v1 = xxh_round(v1, read64(p));
+            v2 = xxh_round(v2, read64(p + 8));
+            v3 = xxh_round(v3, read64(p + 16));
+            v4 = xxh_round(v4, read64(p + 24));
+            p += 32;
+        } while (p + 32 <= end);
+        h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+        h = xxh_merge(h, v1);
+        h = xxh_merge(h, v2);
+        h = xxh_merge(h, v3);
+        h = xxh_merge(h, v4);
+    } else {
+        h = seed + XXH_P5;
+    }
+    h += (uint64_t)len;
+
+    while (p + 8 <= end) {
+        h ^= xxh_round(0, read64(p));
+        h = rotl64(h, 27) * XXH_P1 + XXH_P4;
+        p += 8;
+    }
+    if (p + 4 <= end) {
+        h ^= (uint64_t)read32(p) * XXH_P1;
+        h = rotl64(h, 23) * XXH_P2 + XXH_P3;
+        p += 4;
+    }
+    while (p < end) {
+        h ^= (*p) * XXH_P5;
+        h = rotl64(h, 11) * XXH_P1;
+        p++;
+    }
+
+    h ^= h >> 33;
+    h *= XXH_P2;
+    h ^= h >> 29;
+    h *= XXH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+CacheKey cache_key(const void* data, size_t len) {
+    return (CacheKey){xxh64(data, len, 0), xxh64(data, len, XXH_P5)};
+}
+
+void cache_key_hex(CacheKey key, char out[33]) {
+    snprintf(out, 33, "%016llx%016llx", (unsigned long long)key.hi, (unsigned long long)key.lo);
+}
+
+static void entry_path(const Cache* cache, CacheKind kind, CacheKey key, char* out, size_t cap) {
+    char hex[33];
+    cache_key_hex(key, hex);
+    snprintf(out, cap, "%s/%.2s/%s.%s", cache->dir, hex, hex + 2, kind_suffix[kind]);
+}
+
+static void make_dirs(const char* path) {
+    char buf[4096];
+    size_t len = strlen(path);
+    if (len >= sizeof(buf)) return;
+    memcpy(buf, path, len + 1);
+    for (size_t i = 1; i <= len; i++) {
+        if (buf[i] != '/' && buf[i] != 0) continue;
+        char saved = buf[i];
+        buf[i] = 0;
+        mkdir(buf, 0755);
+        buf[i] = saved;
+    }
+}
+
+// In-memory tier: open addressing over (kind, key), plus a FIFO of the same
+// entries that decides what is evicted once their total size exceeds the
+// limit. Entries are never replaced, only added and evicted, so the two
+// always hold the same set.
+typedef struct {
+    CacheKey key;
+    int kind;
+    bool used;
+    char* data;
+    size_t len;
+} MemSlot;
+
+typedef struct {
+    CacheKey key;
+    int kind;
+} MemRef;
+
+struct CacheMemory {
+    MemSlot* slots;
+    size_t cap;
+    size_t count;
+    MemRef* fifo;  // ring buffer, oldest at head
+    size_t head;
+    size_t fifo_cap;
+    uint64_t bytes;
+};
+
+static size_t mem_hash(int kind, CacheKey key) { return (size_t)(key.lo ^ rotl64(key.hi, 17) ^ (uint64_t)kind); }
+
+static MemSlot* mem_slot(const CacheMemory* mem, int kind, CacheKey key) {
+    size_t mask = mem->cap - 1;
+    size_t i = mem_hash(kind, key) & mask;
+    for (;;) {
+        MemSlot* s = &mem->slots[i];
+        if (!s->used || (s->kind == kind && s->key.lo == key.lo && s->key.hi == key.hi)) return s;
+        i = (i + 1) & mask;
+    }
+}
+
+static void mem_grow(CacheMemory* mem) {
+    CacheMemory old = *mem;
+    mem->cap = old.cap ? old.cap * 2 : 256;
+    mem->slots = (MemSlot*)calloc(mem->cap, sizeof(MemSlot));
+    if (!mem->slots) die("oom");
+    for (size_t i = 0; i < old.cap; i++) {
+        if (old.slots[i].used) *mem_slot(mem, old.slots[i].kind, old.slots[i].key) = old.slots[i];
+    }
+    free(old.slots);
+
+    MemRef* fifo = (MemRef*)malloc(mem->cap * sizeof(MemRef));
+    if (!fifo) die("oom");
+    for (size_t i = 0; i < old.count; i++) fifo[i] = old.fifo[(old.head + i) % old.fifo_cap];
+    free(old.fifo);
+    mem->fifo = fifo;
+    mem->fifo_cap = mem->cap;
+    mem->head = 0;
+}
+
+// Backward-shift deletion keeps every remaining entry reachable from its
+// home slot without tombstones.
+static void mem_remove(CacheMemory* mem, MemSlot* s) {
+    size_t mask = mem->cap - 1;
+    mem->bytes -= s->len;
+    mem->count--;
+    free(s->data);
+    s->used = false;
+    size_t hole = (size_t)(s - mem->slots);
+    for (size_t i = (hole + 1) & mask; mem->slots[i].used; i = (i + 1) & mask) {
+        size_t home = mem_hash(mem->slots[i].kind, mem->slots[i].key) & mask;
+        if (((i - home) & mask) < ((i - hole) & mask)) continue;
+        mem->slots[hole] = mem->slots[i];
+        mem->slots[i].used = false;
+        hole = i;
+    }
+}
+
+static void mem_put(Cache* cache, int kind, CacheKey key, const void* data, size_t len) {
+    CacheMemory* mem = cache->memory;
+    if (len > cache->max_size) return;
+    if ((mem->count + 1) * 2 > mem->cap) mem_grow(mem);
+    MemSlot* s = mem_slot(mem, kind, key);
+    if (s->used) return;
+    char* copy = (char*)malloc(len ? len : 1);
+    if (!copy) die("oom");
+    memcpy(copy, data, len);
+    *s = (MemSlot){key, kind, true, copy, len};
+    mem->fifo[(mem->head + mem->count) % mem->fifo_cap] = (MemRef){key, kind};
+    mem->count++;
+    mem->bytes += len;
+    while (mem->bytes > cache->max_size) {
+        MemRef oldest = mem->fifo[mem->head];
+        mem->head = (mem->head + 1) % mem->fifo_cap;
+        mem_remove(mem, mem_slot(mem, oldest.kind, oldest.key));
+    }
+}
+
+static bool mem_get(const Cache* cache, int kind, CacheKey key, FileView* view) {
+    if (!cache->memory || !cache->memory->count) return false;
+    const MemSlot* s = mem_slot(cache->memory, kind, key);
+    if (!s->used) return false;
+    char* copy = (char*)malloc(s->len ? s->len : 1);
+    if (!copy) die("oom");
+    memcpy(copy, s->data, s->len);
+    *view = (FileView){copy, s->len, 0};
+    return true;
+}
+
+static bool write_all(int fd, const void* data, size_t len) {
+    const char* p = (const char*)data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+// Worker reports: a fixed header followed by the entry (or path) bytes. A
+// header with kind == CACHE_KIND_COUNT names a source file.
+typedef struct {
+    uint32_t kind;
+    uint32_t reserved;
+    uint64_t lo;
+    uint64_t hi;
+    uint64_t len;
+} ReportHeader;
+
+static void report(Cache* cache, uint32_t kind, CacheKey key, const void* data, size_t len) {
+    if (cache->report_fd < 0) return;
+    ReportHeader h = {kind, 0, key.lo, key.hi, len};
+    if (!write_all(cache->report_fd, &h, sizeof(h)) || !write_all(cache->report_fd, data, len)) {
+        // The server went away; the compile itself can still finish.
+        close(cache->report_fd);
+        cache->report_fd = -1;
+    }
+}
+
+void cache_report_source(Cache* cache, const char* path) {
+    if (cache->report_fd < 0) return;
+    char* real = xrealpath(path);
+    if (!real) return;
+    pthread_mutex_lock(&cache->lock);
+    report(cache, CACHE_KIND_COUNT, (CacheKey){0}, real, strlen(real));
+    pthread_mutex_unlock(&cache->lock);
+    free(real);
+}
+
+void cache_absorb(Cache* cache, const char* data, size_t len, void (*on_source)(const char* real_path)) {
+    const char* end = data + len;
+    ReportHeader h;
+    pthread_mutex_lock(&cache->lock);
+    while ((size_t)(end - data) >= sizeof(h)) {
+        memcpy(&h, data, sizeof(h));
+        data += sizeof(h);
+        // A worker that died mid-report leaves a truncated tail; drop it.
+        if (h.kind > CACHE_KIND_COUNT || h.len > (uint64_t)(end - data)) break;
+        if (h.kind == CACHE_KIND_COUNT) {
+            char path[4096];
+            if (h.len < sizeof(path)) {
+                memcpy(path, data, h.len);
+                path[h.len] = 0;
+                on_source(path);
+            }
+        } else if (cache->memory) {
+            mem_put(cache, (int)h.kind, (CacheKey){h.lo, h.hi}, data, h.len);
+        }
+        data += h.len;
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void cache_open(Cache* cache, const char* dir, uint64_t max_size) {
+    *cache = (Cache){0};
+    cache->dir = dir;
+    cache->max_size = max_size;
+    cache->report_fd = -1;
+    pthread_mutex_init(&cache->lock, NULL);
+    if (dir) make_dirs(dir);
+}
+
+void cache_keep_in_memory(Cache* cache) {
+    cache->memory = (CacheMemory*)calloc(1, sizeof(CacheMemory));
+    if (!cache->memory) die("oom");
+}
+
+bool cache_get(Cache* cache, CacheKind kind, CacheKey key, FileView* view) {
+    pthread_mutex_lock(&cache->lock);
+    bool in_memory = mem_get(cache, (int)kind, key, view);
+    pthread_mutex_unlock(&cache->lock);
+    if (in_memory) return true;
+    if (!cache->dir) return false;
+    char path[4096];
+    entry_path(cache, kind, key, path, sizeof(path));
+    if (!file_view_try_open(view, path)) return false;
+    // Eviction is oldest-first by mtime, so a hit refreshes the entry.
+    utimensat(AT_FDCWD, path, NULL, 0);
+    // Promote disk hits so the server answers from memory next time.
+    pthread_mutex_lock(&cache->lock);
+    if (cache->memory) mem_put(cache, (int)kind, key, view->data, view->len);
+    report(cache, (uint32_t)kind, key, view->data, view->len);
+    pthread_mutex_unlock(&cache->lock);
+    return true;
+}
+
+void cache_record(Cache* cache, CacheKind kind, bool hit) {
+    pthread_mutex_lock(&cache->lock);
+    if (hit) cache->stats.hits[kind]++;
+    else cache->stats.misses[kind]++;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// Distinguishes the temporary files of threads writing the same entry.
+static atomic_uint tmp_seq;
+
+bool cache_put(Cache* cache, CacheKind kind, CacheKey key, const void* data, size_t len) {
+    pthread_mutex_lock(&cache->lock);
+    if (cache->memory) mem_put(cache, (int)kind, key, data, len);
+    report(cache, (uint32_t)kind, key, data, len);
+    pthread_mutex_unlock(&cache->lock);
+    if (!cache->dir) return cache->memory != NULL;
+    char path[4096];
+    char tmp[4200];
+    entry_path(cache, kind, key, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%.*s", (int)(strrchr(path, '/') - path), path);
+    mkdir(tmp, 0755);
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%ld.%u", path, (long)getpid(), atomic_fetch_add(&tmp_seq, 1));
+
+    // Write to a private name and rename, so concurrent compilers never see
+    // a partially written entry.
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    bool ok = write_all(fd, data, len);
+    if (close(fd) != 0) ok = false;
+    if (ok && rename(tmp, path) != 0) ok = false;
+    if (!ok) {
+        unlink(tmp);
+        return false;
+    }
+    pthread_mutex_lock(&cache->lock);
+    cache->dirty = true;
+    pthread_mutex_unlock(&cache->lock);
+    return true;
+}
+
+typedef struct {
+    char* path;
+    uint64_t size;
+    int64_t mtime;
+} CacheEntry;
+
+static bool is_hex_name(const char* s, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        char c = s[i];
+        if (!((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f'))) return false;
+    }
+    return true;
+}
+
+// Only names this cache could have written are ever considered for
+// eviction, so pointing --cache-dir at the wrong directory cannot delete
+// unrelated files.
+static bool is_entry_name(const char* name) {
+    size_t len = strlen(name);
+    if (len < 31 || !is_hex_name(name, 30) || name[30] != '.') return false;
+    for (int k = 0; k < CACHE_KIND_COUNT; k++) {
+        if (strcmp(name + 31, kind_suffix[k]) == 0) return true;
+    }
+    return false;
+}
+
+static int entry_older(const void* a, const void* b) {
+    const CacheEntry* x = (const CacheEntry*)a;
+    const CacheEntry* y = (const CacheEntry*)b;
+    return (x->mtime > y->mtime) - (x->mtime < y->mtime);
+}
+
+static void cache_trim(Cache* cache) {
+    CacheEntry* entries = NULL;
+    size_t count = 0;
+    size_t cap = 0;
+    uint64_t total = 0;
+
+    DIR* top = opendir(cache->dir);
+    if (!top) return;
+    struct dirent* sub;
+    while ((sub = readdir(top)) != NULL) {
+        if (strlen(sub->d_name) != 2 || !is_hex_name(sub->d_name, 2)) continue;
+        char sub_path[4096];
+        snprintf(sub_path, sizeof(sub_path), "%s/%s", cache->dir, sub->d_name);
+        DIR* d = opendir(sub_path);
+        if (!d) continue;
+        struct dirent* ent;
+        while ((ent = readdir(d)) != NULL) {
+            if (!is_entry_name(ent->d_name)) continue;
+            char path[4096 + 256];
+            snprintf(path, sizeof(path), "%s/%s", sub_path, ent->d_name);
+            struct stat st;
+            if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+            if (count + 1 > cap) {
+                cap = (cap == 0) ? 256 : cap * 2;
+                entries = (CacheEntry*)realloc(entries, cap * sizeof(CacheEntry));
+                if (!entries) die("oom");
+            }
+            entries[count++] = (CacheEntry){xstrdup(path), (uint64_t)st.st_size, (int64_t)st.st_mtime};
+            total += (uint64_t)st.st_size;
+        }
+        closedir(d);
+    }
+    closedir(top);
+
+    if (total > cache->max_size) {
+        qsort(entries, count, sizeof(CacheEntry), entry_older);
+        // Trim to 90% so the next few runs do not have to rescan immediately.
+        uint64_t target = cache->max_size / 10 * 9;
+        for (size_t i = 0; i < count && total > target; i++) {
+            if (unlink(entries[i].path) == 0) total -= entries[i].size;
+        }
+    }
+    for (size_t i = 0; i < count; i++) free(entries[i].path);
+    free(entries);
+}
+
+// Cumulative counters live in <dir>/stats as "<label> <hits> <misses>" lines.
+static void read_totals(const Cache* cache, CacheStats* totals) {
+    *totals = (CacheStats){0};
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/stats", cache->dir);
+    FILE* f = fopen(path, "r");
+    if (!f) return;
+    char label[32];
+    unsigned long long hits, misses;
+    while (fscanf(f, "%31s %llu %llu", label, &hits, &misses) == 3) {
+        for (int k = 0; k < CACHE_KIND_COUNT; k++) {
+            if (strcmp(label, kind_label[k]) != 0) continue;
+            totals->hits[k] = hits;
+            totals->misses[k] = misses;
+        }
+    }
+    fclose(f);
+}
+
+static void write_totals(Cache* cache, const CacheStats* totals) {
+    char buf[512];
+    size_t len = 0;
+    for (int k = 0; k < CACHE_KIND_COUNT; k++) {
+        len += (size_t)snprintf(buf + len, sizeof(buf) - len, "%s %llu %llu\n", kind_label[k],
+                                (unsigned long long)totals->hits[k], (unsigned long long)totals->misses[k]);
+    }
+    char path[4096];
+    char tmp[4200];
+    snprintf(path, sizeof(path), "%s/stats", cache->dir);
+    snprintf(tmp, sizeof(tmp), "%s.tmp.%ld", path, (long)getpid());
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return;
+    bool ok = write_all(fd, buf, len);
+    if (close(fd) != 0) ok = false;
+    if (!ok || rename(tmp, path) != 0) unlink(tmp);
+}
+
+void cache_close(Cache* cache) {
+    if (!cache->dir) return;
+    if (cache->dirty) cache_trim(cache);
+    CacheStats totals;
+    read_totals(cache, &totals);
+    for (int k = 0; k < CACHE_KIND_COUNT; k++) {
+        totals.hits[k] += cache->stats.hits[k];
+        totals.misses[k] += cache->stats.misses[k];
+    }
+    write_totals(cache, &totals);
+}
+
+void cache_print_stats(const Cache* cache, FILE* out) {
+    CacheStats totals = {0};
+    if (cache->dir) read_totals(cache, &totals);
+    fprintf(out, "cache: %s (limit %llu bytes)\n", cache->dir ? cache->dir : "in memory",
+            (unsigned long long)cache->max_size);
+    fprintf(out, "  %-8s %10s %10s %12s %12s\n", "", "hits", "misses", "total hits", "total misses");
+    for (int k = 0; k < CACHE_KIND_COUNT; k++) {
+        if (k == CACHE_ASM) continue;
+        fprintf(out, "  %-8s %10llu %10llu %12llu %12llu\n", kind_label[k],
+                (unsigned long long)cache->stats.hits[k], (unsigned long long)cache->stats.misses[k],
+                (unsigned long long)totals.hits[k], (unsigned long long)totals.misses[k]);
+    }
+}
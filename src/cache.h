@@ -0,0 +1,77 @@
+#ifndef CHASMC_CACHE_H
+#define CHASMC_CACHE_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "util.h"
+
+// Bumped whenever the layout of a cached entry or the generated code changes.
+// Together with the build stamp it keeps entries from a different compiler
+// from ever being reused.
+#define CHASMC_CACHE_FORMAT 4
+#define CHASMC_BUILD_ID __DATE__ " " __TIME__
+
+// 128-bit content hash (two independently seeded XXH64 lanes).
+typedef struct {
+    uint64_t lo;
+    uint64_t hi;
+} CacheKey;
+
+typedef enum {
+    CACHE_PROGRAM,  // manifest: input files + hashes -> asm
+    CACHE_ASM,      // whole-program assembly, keyed by its own hash
+    CACHE_MODULE,   // one module's emitted buffer and splices
+    CACHE_OBJECT,   // nasm output, keyed by the asm hash
+    CACHE_KIND_COUNT,
+} CacheKind;
+
+typedef struct {
+    uint64_t hits[CACHE_KIND_COUNT];
+    uint64_t misses[CACHE_KIND_COUNT];
+} CacheStats;
+
+typedef struct CacheMemory CacheMemory;
+
+// On-disk, content-addressed store. Entries are immutable files under
+// <dir>/<2 hex>/<30 hex>.<kind>; the oldest ones are evicted once the total
+// size exceeds max_size. All operations are best-effort: a failing cache
+// degrades to a miss, never to a compile error.
+//
+// The compile server also keeps entries in memory, in front of the
+// directory or (with dir == NULL) instead of it. Its forked workers report
+// every entry they store, and every source file they read, on report_fd so
+// the server can fold them in with cache_absorb.
+//
+// A cache may be shared by the threads of a batch compile; lock guards the
+// statistics and the in-memory tier.
+typedef struct {
+    const char* dir;
+    uint64_t max_size;
+    CacheStats stats;
+    bool dirty;
+    CacheMemory* memory;
+    int report_fd;
+    pthread_mutex_t lock;
+} Cache;
+
+CacheKey cache_key(const void* data, size_t len);
+void cache_key_hex(CacheKey key, char out[33]);
+
+void cache_open(Cache* cache, const char* dir, uint64_t max_size);
+// Adds the in-memory tier, bounded by the same max_size.
+void cache_keep_in_memory(Cache* cache);
+// Lookups do not count towards the statistics by themselves: a manifest that
+// is found but stale is still a miss, so callers report with cache_record.
+bool cache_get(Cache* cache, CacheKind kind, CacheKey key, FileView* view);
+void cache_record(Cache* cache, CacheKind kind, bool hit);
+bool cache_put(Cache* cache, CacheKind kind, CacheKey key, const void* data, size_t len);
+void cache_report_source(Cache* cache, const char* path);
+void cache_absorb(Cache* cache, const char* data, size_t len, void (*on_source)(const char* real_path));
+// Trims the cache to its size limit and folds this run into the totals.
+void cache_close(Cache* cache);
+void cache_print_stats(const Cache* cache, FILE* out);
+
+#endif
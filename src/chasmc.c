@@ -1,4 +1,11 @@
+#define _GNU_SOURCE
+
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -6,9 +13,47 @@
 #include <string.h>
 
 #include "assembler.h"
+#include "cache.h"
+#include "objfile.h"
+#include "pool.h"
+#include "server.h"
+#include "source.h"
+#include "static_link.h"
+#include "timing.h"
 #include "util.h"
+#include "x86_asm.h"
 
-static int run_process(const char* cmd, char* const argv[]) {
+#define DEFAULT_CACHE_SIZE (512ull * 1024 * 1024)
+#define NASM_FORMAT "elf64"
+
+// A batch caps the nasm and ld processes that run at once across all its
+// threads; 0 means no limit.
+static int process_limit;
+static int processes_running;
+static pthread_mutex_t process_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t process_done = PTHREAD_COND_INITIALIZER;
+
+// Claims a slot for a child process. Without `wait` it fails instead of
+// blocking, for callers that have children of their own to reap first.
+static bool take_process_slot(bool wait) {
+    pthread_mutex_lock(&process_lock);
+    while (wait && process_limit && processes_running >= process_limit) {
+        pthread_cond_wait(&process_done, &process_lock);
+    }
+    bool ok = !process_limit || processes_running < process_limit;
+    if (ok) processes_running++;
+    pthread_mutex_unlock(&process_lock);
+    return ok;
+}
+
+static void give_process_slot(void) {
+    pthread_mutex_lock(&process_lock);
+    processes_running--;
+    pthread_cond_signal(&process_done);
+    pthread_mutex_unlock(&process_lock);
+}
+
+static pid_t spawn_process(const char* cmd, char* const argv[]) {
     pid_t pid = fork();
     if (pid < 0) die("failed to fork");
     if (pid == 0) {
@@ -16,12 +61,31 @@ static int run_process(const char* cmd, char* const argv[]) {
         perror(cmd);
         _exit(127);
     }
-    int status = 0;
-    if (waitpid(pid, &status, 0) < 0) die("failed to wait for process");
+    return pid;
+}
+
+static void charge_child_cpu(const struct rusage* ru) {
+    timing_add_child_cpu((uint64_t)(ru->ru_utime.tv_sec + ru->ru_stime.tv_sec) * 1000000000ull +
+                         (uint64_t)(ru->ru_utime.tv_usec + ru->ru_stime.tv_usec) * 1000ull);
+}
+
+static int exit_code(int status) {
     if (WIFEXITED(status)) return WEXITSTATUS(status);
     return 1;
 }
 
+static int run_process(const char* cmd, char* const argv[]) {
+    take_process_slot(true);
+    pid_t pid = spawn_process(cmd, argv);
+    int status = 0;
+    struct rusage ru;
+    pid_t waited = wait4(pid, &status, 0, &ru);
+    give_process_slot();
+    if (waited < 0) die("failed to wait for process");
+    charge_child_cpu(&ru);
+    return exit_code(status);
+}
+
 static char* strip_extension(const char* path) {
     const char* slash = strrchr(path, '/');
     const char* dot = strrchr(path, '.');
@@ -45,58 +109,671 @@ static char* append_ext(const char* base, const char* ext) {
     return out;
 }
 
-int main(int argc, char** argv) {
-    if (argc < 2) {
-        fprintf(stderr, "usage: chasmc <input.chasm> -o <output> [-A: expose asm | -O: expose object | -p: expose both]\n");
-        return 1;
+// Accepts a byte count with an optional K, M or G suffix.
+static uint64_t parse_size(const char* s) {
+    char* end = NULL;
+    unsigned long long n = strtoull(s, &end, 10);
+    if (end == s) die("--cache-size expects a size such as 512M");
+    switch (*end) {
+        case 'G': n *= 1024;  // fall through
+        case 'M': n *= 1024;  // fall through
+        case 'K': n *= 1024; end++; break;
+        case 0: break;
+        default: die("--cache-size expects a size such as 512M");
     }
+    if (*end) die("--cache-size expects a size such as 512M");
+    return (uint64_t)n;
+}
 
-    const char* in_path = argv[1];
-    const char* out_path = "a.asm";
-    bool keep_asm = false;
-    bool keep_obj = false;
+// Objects are cached by the hash of the asm they were assembled from. On a
+// hit the object is restored to obj_path; otherwise *key is set so the fresh
+// object can be stored afterwards.
+static bool object_from_cache(Cache* cache, const char* asm_path, const char* obj_path, CacheKey* key) {
+    FileView asm_view;
+    if (!file_view_try_open(&asm_view, asm_path)) return false;
+    CacheKey asm_key = cache_key(asm_view.data, asm_view.len);
+    file_view_close(&asm_view);
+    char id[160];
+    int n = snprintf(id, sizeof(id), "object %d %s %s %016llx%016llx", CHASMC_CACHE_FORMAT, CHASMC_BUILD_ID,
+                     NASM_FORMAT, (unsigned long long)asm_key.hi, (unsigned long long)asm_key.lo);
+    *key = cache_key(id, (size_t)n);
+
+    FileView obj_view;
+    bool hit = cache_get(cache, CACHE_OBJECT, *key, &obj_view);
+    cache_record(cache, CACHE_OBJECT, hit);
+    if (hit) {
+        write_file_all(obj_path, obj_view.data, obj_view.len);
+        file_view_close(&obj_view);
+    }
+    return hit;
+}
+
+static void object_to_cache(Cache* cache, CacheKey key, const char* obj_path) {
+    FileView obj_view;
+    if (!file_view_try_open(&obj_view, obj_path)) return;
+    cache_put(cache, CACHE_OBJECT, key, obj_view.data, obj_view.len);
+    file_view_close(&obj_view);
+}
+
+static void write_object(const ObjFile* obj, const char* obj_path) {
+    Out elf = {0};
+    obj_write_elf(obj, &elf);
+    out_write_file(&elf, obj_path);
+    out_free(&elf);
+}
+
+// Assembles and writes obj_path in process; false when the text needs nasm.
+// Built-in objects are not cached: producing one costs less than a lookup.
+static bool assemble_builtin(const char* text, size_t len, const char* obj_path) {
+    ObjFile obj = {0};
+    bool ok = x86_assemble(text, len, &obj);
+    if (ok) write_object(&obj, obj_path);
+    obj_free(&obj);
+    return ok;
+}
+
+// Runs nasm unless an object for byte-identical asm is already cached.
+static void assemble(Cache* cache, const char* asm_path, const char* obj_path) {
+    CacheKey key = {0};
+    if (cache && object_from_cache(cache, asm_path, obj_path, &key)) return;
+
+    char* nasm_argv[] = {"nasm", "-f", NASM_FORMAT, "-o", (char*)obj_path, (char*)asm_path, NULL};
+    if (run_process("nasm", nasm_argv) != 0) die("nasm failed");
+    if (cache) object_to_cache(cache, key, obj_path);
+}
+
+static bool needs_assembly(const ModuleArtifact* art) {
+    if (art->changed) return true;
+    struct stat asm_st;
+    struct stat obj_st;
+    if (stat(art->obj_path, &obj_st) != 0 || stat(art->asm_path, &asm_st) != 0) return true;
+    return obj_st.st_mtime < asm_st.st_mtime;
+}
+
+typedef struct {
+    pid_t pid;
+    CacheKey key;
+} NasmJob;
+
+// Waits for one of this compilation's nasm processes: whichever has already
+// exited, else the oldest. Never wait() for any child, since the other
+// threads of a batch have children of their own.
+static void reap_nasm(Cache* cache, ModuleArtifact* arts, NasmJob* jobs, size_t count, size_t* running) {
+    int status = 0;
+    struct rusage ru;
+    size_t done = count;
+    for (size_t i = 0; i < count && done == count; i++) {
+        if (jobs[i].pid && wait4(jobs[i].pid, &status, WNOHANG, &ru) == jobs[i].pid) done = i;
+    }
+    for (size_t i = 0; i < count && done == count; i++) {
+        if (!jobs[i].pid) continue;
+        if (wait4(jobs[i].pid, &status, 0, &ru) < 0) die("failed to wait for process");
+        done = i;
+    }
+    if (done == count) die("failed to wait for process");
+    charge_child_cpu(&ru);
+    jobs[done].pid = 0;
+    (*running)--;
+    give_process_slot();
+    if (exit_code(status) != 0) die("nasm failed");
+    if (cache) object_to_cache(cache, jobs[done].key, arts[done].obj_path);
+}
 
-    for (int i = 2; i < argc; i++) {
+// Assembles the modules whose asm changed: in process where possible, the
+// rest with up to max_jobs nasm processes at a time.
+static void assemble_modules(Cache* cache, ModuleArtifact* arts, size_t count, int max_jobs, bool use_nasm) {
+    NasmJob* jobs = (NasmJob*)calloc(count, sizeof(NasmJob));
+    if (!jobs) die("oom");
+    size_t running = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (!needs_assembly(&arts[i])) continue;
+        if (!use_nasm) {
+            FileView view;
+            file_view_open(&view, arts[i].asm_path);
+            bool done = assemble_builtin(view.data, view.len, arts[i].obj_path);
+            file_view_close(&view);
+            if (done) continue;
+        }
+        if (cache && object_from_cache(cache, arts[i].asm_path, arts[i].obj_path, &jobs[i].key)) continue;
+        while (running >= (size_t)max_jobs || !take_process_slot(running == 0)) {
+            reap_nasm(cache, arts, jobs, count, &running);
+        }
+        char* nasm_argv[] = {"nasm", "-f", NASM_FORMAT, "-o", arts[i].obj_path, arts[i].asm_path, NULL};
+        jobs[i].pid = spawn_process("nasm", nasm_argv);
+        running++;
+    }
+    while (running > 0) reap_nasm(cache, arts, jobs, count, &running);
+    free(jobs);
+}
+
+// In-memory stand-in for an intermediate file that nasm or ld must open by
+// name. A memfd is inherited by the child processes and reopened through
+// /dev/fd, so it can be read more than once, as nasm does on every pass; a
+// pipe could not. Without memfd support the real path is used instead.
+typedef struct {
+    int fd;
+    char path[32];
+} ScratchFile;
+
+static const char* scratch_open(ScratchFile* f, const char* fallback_path) {
+    f->fd = memfd_create("chasmc", 0);
+    if (f->fd < 0) return fallback_path;
+    snprintf(f->path, sizeof(f->path), "/dev/fd/%d", f->fd);
+    return f->path;
+}
+
+static void scratch_close(ScratchFile* f) {
+    if (f->fd >= 0) close(f->fd);
+    f->fd = -1;
+}
+
+static void link_in_process(const ObjFile* obj, const char* out_path) {
+    Out exe = {0};
+    link_static(obj, 1, &exe);
+    write_executable(out_path, exe.data, exe.len);
+    out_free(&exe);
+}
+
+static void link_objects(const char* out_path, char** objs, size_t nobjs) {
+    char** ld_argv = (char**)malloc((nobjs + 4) * sizeof(char*));
+    if (!ld_argv) die("oom");
+    ld_argv[0] = "ld";
+    ld_argv[1] = "-o";
+    ld_argv[2] = (char*)out_path;
+    for (size_t i = 0; i < nobjs; i++) ld_argv[3 + i] = objs[i];
+    ld_argv[3 + nobjs] = NULL;
+    if (run_process("ld", ld_argv) != 0) die("ld failed");
+    free(ld_argv);
+}
+
+static int parse_jobs(const char* s) {
+    char* end = NULL;
+    long n = strtol(s, &end, 10);
+    if (!*s || *end || n < 1 || n > 1024) die("-j expects a thread count between 1 and 1024");
+    return (int)n;
+}
+
+typedef struct {
+    const char* out_path;
+    bool have_out;
+    bool keep_asm;
+    bool keep_obj;
+    bool separate;
+    bool split_functions;
+    int opt_level;
+    bool use_nasm;
+    bool use_ld;
+    bool emit_iface;
+    bool emit_ir;
+    bool scan_deps;
+    bool depfile;              // -MD: also write a make/ninja depfile
+    const char* depfile_path;  // -MF; next to the output by default
+    bool cache_stats;
+    bool time_report;
+    bool time_report_json;
+    bool have_jobs;
+    int jobs;
+    const char* cache_dir;
+    uint64_t cache_size;
+    const char* out_dir;  // --batch only
+    char** inputs;        // --batch only: positional arguments
+    size_t ninputs;
+    size_t inputs_cap;
+} DriverOptions;
+
+static void add_input(DriverOptions* d, const char* path) {
+    if (d->ninputs == d->inputs_cap) {
+        d->inputs_cap = d->inputs_cap ? d->inputs_cap * 2 : 16;
+        d->inputs = (char**)realloc(d->inputs, d->inputs_cap * sizeof(char*));
+        if (!d->inputs) die("oom");
+    }
+    d->inputs[d->ninputs++] = xstrdup(path);
+}
+
+// @FILE names a manifest: one input per line; blank lines and lines
+// starting with '#' are skipped.
+static void add_manifest_inputs(DriverOptions* d, const char* manifest) {
+    FileView view;
+    if (!file_view_try_open(&view, manifest)) die("cannot open batch manifest");
+    const char* p = view.data;
+    const char* end = view.data + view.len;
+    while (p < end) {
+        const char* eol = memchr(p, '\n', (size_t)(end - p));
+        if (!eol) eol = end;
+        const char* q = eol;
+        while (q > p && (q[-1] == '\r' || q[-1] == ' ' || q[-1] == '\t')) q--;
+        while (p < q && (*p == ' ' || *p == '\t')) p++;
+        if (p < q && *p != '#') {
+            char path[4096];
+            if ((size_t)(q - p) >= sizeof(path)) die("batch manifest line too long");
+            memcpy(path, p, (size_t)(q - p));
+            path[q - p] = 0;
+            add_input(d, path);
+        }
+        p = eol + 1;
+    }
+    file_view_close(&view);
+}
+
+// Parses argv[first..]. Unknown arguments are ignored, except that a batch
+// takes every non-option argument as an input.
+static void parse_options(int argc, char** argv, int first, bool batch, DriverOptions* d) {
+    *d = (DriverOptions){0};
+    d->out_path = "a.asm";
+    d->jobs = 1;
+    d->cache_dir = getenv("CHASMC_CACHE_DIR");
+    d->cache_size = DEFAULT_CACHE_SIZE;
+
+    for (int i = first; i < argc; i++) {
         if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
-            out_path = argv[i + 1];
+            d->out_path = argv[i + 1];
+            d->have_out = true;
             i++;
             continue;
         }
         if (strcmp(argv[i], "-A") == 0) {
-            keep_asm = true;
+            d->keep_asm = true;
             continue;
         }
         if (strcmp(argv[i], "-O") == 0) {
-            keep_obj = true;
+            d->keep_obj = true;
+            continue;
+        }
+        if (strcmp(argv[i], "-O0") == 0 || strcmp(argv[i], "-O1") == 0) {
+            d->opt_level = argv[i][2] - '0';
+            continue;
+        }
+        if (strncmp(argv[i], "-O", 2) == 0) die("unknown optimization level (use -O0 or -O1)");
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc) {
+            d->jobs = parse_jobs(argv[i + 1]);
+            d->have_jobs = true;
+            i++;
+            continue;
+        }
+        if (strncmp(argv[i], "-j", 2) == 0 && argv[i][2]) {
+            d->jobs = parse_jobs(argv[i] + 2);
+            d->have_jobs = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--cache-dir") == 0 && i + 1 < argc) {
+            d->cache_dir = argv[i + 1];
+            i++;
+            continue;
+        }
+        if (strcmp(argv[i], "--cache-size") == 0 && i + 1 < argc) {
+            d->cache_size = parse_size(argv[i + 1]);
+            i++;
+            continue;
+        }
+        if (strcmp(argv[i], "--separate") == 0) {
+            d->separate = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--split-functions") == 0) {
+            d->split_functions = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--nasm") == 0) {
+            d->use_nasm = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--ld") == 0) {
+            d->use_ld = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--cache-stats") == 0) {
+            d->cache_stats = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--time-report") == 0 || strcmp(argv[i], "--time-report=json") == 0) {
+            d->time_report = true;
+            d->time_report_json = argv[i][13] == '=';
+            continue;
+        }
+        if (strcmp(argv[i], "--emit-interface") == 0) {
+            d->emit_iface = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--emit-ir") == 0) {
+            d->emit_ir = true;
+            continue;
+        }
+        if (strcmp(argv[i], "--scan-deps") == 0) {
+            d->scan_deps = true;
+            continue;
+        }
+        if (strcmp(argv[i], "-MD") == 0) {
+            d->depfile = true;
+            continue;
+        }
+        if (strcmp(argv[i], "-MF") == 0 && i + 1 < argc) {
+            d->depfile = true;
+            d->depfile_path = argv[i + 1];
+            i++;
             continue;
         }
         if (strcmp(argv[i], "-p") == 0) {
-            keep_asm = true;
-            keep_obj = true;
+            d->keep_asm = true;
+            d->keep_obj = true;
+            continue;
+        }
+        if (batch && strcmp(argv[i], "--out-dir") == 0 && i + 1 < argc) {
+            d->out_dir = argv[i + 1];
+            i++;
             continue;
         }
+        if (batch && argv[i][0] == '@') {
+            add_manifest_inputs(d, argv[i] + 1);
+            continue;
+        }
+        if (batch && argv[i][0] != '-') add_input(d, argv[i]);
     }
-    
-    char* base = strip_extension(out_path);
-    char* asm_path = append_ext(base, ".asm");
-    char* obj_path = append_ext(base, ".o");
+}
 
-    translate(in_path, out_path);
+static void free_options(DriverOptions* d) {
+    for (size_t i = 0; i < d->ninputs; i++) free(d->inputs[i]);
+    free(d->inputs);
+}
 
-    char* nasm_argv[] = {"nasm", "-f", "elf64", "-o", obj_path, asm_path, NULL};
-    if (run_process("nasm", nasm_argv) != 0) die("nasm failed");
+static void out_make_path(Out* O, const char* path) {
+    for (const char* c = path; *c; c++) {
+        if (*c == ' ' || *c == '#') out_char(O, '\\');
+        else if (*c == '$') out_char(O, '$');
+        out_char(O, *c);
+    }
+}
 
-    char* ld_argv[] = {"ld", "-o", (char*)out_path, obj_path, NULL};
-    if (run_process("ld", ld_argv) != 0) die("ld failed");
+// In make syntax, which ninja reads as well. As with gcc -MP, every import
+// also gets an empty rule, so make does not fail once one is deleted.
+static void write_depfile(const DriverOptions* d, const char* in_path, const char* target, const char* base) {
+    const char** deps = NULL;
+    size_t count = scan_dependencies(in_path, &deps);
+    Out O = {0};
+    out_make_path(&O, target);
+    out_char(&O, ':');
+    for (size_t i = 0; i < count; i++) {
+        out_str(&O, " \\\n  ");
+        out_make_path(&O, deps[i]);
+    }
+    out_char(&O, '\n');
+    for (size_t i = 1; i < count; i++) {
+        out_char(&O, '\n');
+        out_make_path(&O, deps[i]);
+        out_str(&O, ":\n");
+    }
+    char* path = d->depfile_path ? xstrdup(d->depfile_path) : append_ext(base, ".d");
+    out_write_file(&O, path);
+    free(path);
+    out_free(&O);
+    free(deps);
+}
+
+// Translates, assembles and links one program; errors die().
+static void build_program(const DriverOptions* d, const char* in_path, const char* out_path, Cache* cache,
+                          int jobs) {
+    TranslateOptions opts = {jobs, cache, d->split_functions, d->opt_level};
+    char* base = strip_extension(out_path);
+    char* asm_path = append_ext(base, ".asm");
+    char* obj_path = append_ext(base, ".o");
 
-    if (!keep_asm) remove(asm_path);
-    if (!keep_obj) remove(obj_path);
+    if (d->separate) {
+        // The per-module files are the state incremental rebuilds compare
+        // against, so they are kept regardless of -A/-O.
+        char* build_dir = append_ext(base, ".modules");
+        ModuleArtifact* arts = NULL;
+        size_t count = translate_modules(in_path, build_dir, &opts, &arts);
+        TimingMark start = timing_start();
+        assemble_modules(cache, arts, count, d->jobs, d->use_nasm);
+        timing_stop(PHASE_ASSEMBLE, NULL, start);
+        char** objs = (char**)malloc(count * sizeof(char*));
+        if (!objs) die("oom");
+        for (size_t i = 0; i < count; i++) objs[i] = arts[i].obj_path;
+        start = timing_start();
+        link_objects(out_path, objs, count);
+        timing_stop(PHASE_LINK, NULL, start);
+        free(objs);
+        free_module_artifacts(arts, count);
+        free(build_dir);
+    } else {
+        Out asm_text = {0};
+        translate(in_path, &asm_text, &opts);
+        // The asm and object only touch the disk when they are kept.
+        if (d->keep_asm) out_write_file(&asm_text, asm_path);
+        ObjFile obj = {0};
+        TimingMark start = timing_start();
+        bool builtin = !d->use_nasm && x86_assemble(asm_text.data, asm_text.len, &obj);
+        if (builtin && !d->use_ld) {
+            if (d->keep_obj) write_object(&obj, obj_path);
+            timing_stop(PHASE_ASSEMBLE, NULL, start);
+            start = timing_start();
+            link_in_process(&obj, out_path);
+            timing_stop(PHASE_LINK, NULL, start);
+        } else {
+            ScratchFile asm_tmp = {-1, ""};
+            ScratchFile obj_tmp = {-1, ""};
+            const char* asm_file = d->keep_asm ? asm_path : scratch_open(&asm_tmp, asm_path);
+            char* obj_file = d->keep_obj ? obj_path : (char*)scratch_open(&obj_tmp, obj_path);
+            if (builtin) {
+                write_object(&obj, obj_file);
+            } else {
+                if (!d->keep_asm) out_write_file(&asm_text, asm_file);
+                assemble(cache, asm_file, obj_file);
+            }
+            timing_stop(PHASE_ASSEMBLE, NULL, start);
+            start = timing_start();
+            link_objects(out_path, &obj_file, 1);
+            timing_stop(PHASE_LINK, NULL, start);
+            if (!d->keep_asm && !builtin && asm_file == asm_path) remove(asm_path);
+            if (!d->keep_obj && obj_file == obj_path) remove(obj_path);
+            scratch_close(&asm_tmp);
+            scratch_close(&obj_tmp);
+        }
+        obj_free(&obj);
+        out_free(&asm_text);
+    }
 
+    if (d->depfile) write_depfile(d, in_path, out_path, base);
     printf("wrote %s\n", out_path);
-
     free(base);
     free(asm_path);
     free(obj_path);
+}
+
+// One compilation. A compile-server worker passes the server's cache, which
+// replaces --cache-dir and --cache-size.
+static int compile(int argc, char** argv, Cache* shared) {
+    const char* in_path = argv[1];
+    DriverOptions d;
+    parse_options(argc, argv, 2, false, &d);
+    if (d.time_report) timing_enable();
+
+    if (d.scan_deps) {
+        const char** deps = NULL;
+        size_t count = scan_dependencies(in_path, &deps);
+        for (size_t i = 1; i < count; i++) printf("%s\n", deps[i]);
+        free(deps);
+        if (d.time_report) timing_print(stderr, d.time_report_json);
+        return 0;
+    }
+
+    if (d.emit_iface) {
+        char* in_base = strip_extension(in_path);
+        char* iface_path = d.have_out ? xstrdup(d.out_path) : append_ext(in_base, ".rvi");
+        emit_interface(in_path, iface_path, d.opt_level);
+        if (d.depfile) write_depfile(&d, in_path, iface_path, in_base);
+        printf("wrote %s\n", iface_path);
+        free(iface_path);
+        free(in_base);
+        return 0;
+    }
+
+    if (d.emit_ir) {
+        char* in_base = strip_extension(in_path);
+        char* ir_path = d.have_out ? xstrdup(d.out_path) : append_ext(in_base, ".ir");
+        Out ir = {0};
+        emit_ir(in_path, d.opt_level, &ir);
+        out_write_file(&ir, ir_path);
+        printf("wrote %s\n", ir_path);
+        out_free(&ir);
+        free(ir_path);
+        free(in_base);
+        return 0;
+    }
+
+    Cache cache;
+    Cache* use = NULL;
+    if (shared) {
+        use = shared;
+    } else if (d.cache_dir && *d.cache_dir) {
+        cache_open(&cache, d.cache_dir, d.cache_size);
+        use = &cache;
+    }
 
+    build_program(&d, in_path, d.out_path, use, d.jobs);
+
+    if (use) {
+        cache_close(use);
+        if (d.cache_stats) cache_print_stats(use, stderr);
+    }
+    if (d.time_report) timing_print(stderr, d.time_report_json);
     return 0;
 }
+
+typedef struct {
+    const DriverOptions* d;
+    Cache* cache;
+    bool* failed;
+} Batch;
+
+static char* batch_output(const DriverOptions* d, const char* in_path) {
+    char* base = strip_extension(in_path);
+    if (!d->out_dir) return base;
+    const char* slash = strrchr(base, '/');
+    size_t dlen = strlen(d->out_dir);
+    char* dir = (char*)malloc(dlen + 2);
+    if (!dir) die("oom");
+    memcpy(dir, d->out_dir, dlen);
+    memcpy(dir + dlen, "/", 2);
+    char* out = append_ext(dir, slash ? slash + 1 : base);
+    free(dir);
+    free(base);
+    return out;
+}
+
+// A failure is reported and abandoned through the die trap, so the other
+// programs of the batch carry on.
+static bool try_build_program(const DriverOptions* d, const char* in_path, const char* out_path, Cache* cache) {
+    jmp_buf trap;
+    if (setjmp(trap) != 0) {
+        die_set_trap(NULL);
+        return false;
+    }
+    die_set_trap(&trap);
+    build_program(d, in_path, out_path, cache, 1);
+    die_set_trap(NULL);
+    return true;
+}
+
+static void batch_task(size_t i, void* arg) {
+    Batch* b = (Batch*)arg;
+    const char* in_path = b->d->inputs[i];
+    char* out_path = batch_output(b->d, in_path);
+    if (!try_build_program(b->d, in_path, out_path, b->cache)) {
+        fprintf(stderr, "chasmc: %s: failed\n", in_path);
+        b->failed[i] = true;
+    }
+    free(out_path);
+}
+
+// chasmc --batch [options] INPUT... [@MANIFEST]...
+//
+// Compiles every input in one process on a work-stealing pool of -j threads
+// (one per CPU by default); the same -j caps the nasm and ld processes
+// running at once. The jobs share one cache, in memory and in --cache-dir if
+// given, and one table of lexed source files, so a library imported by many
+// programs is read, lexed and compiled once.
+static int batch(int argc, char** argv) {
+    DriverOptions d;
+    parse_options(argc, argv, 2, true, &d);
+    if (d.time_report) timing_enable();
+    if (d.ninputs == 0) die("--batch needs at least one input");
+    if (d.have_out || d.emit_iface || d.emit_ir) die("--batch writes each program next to its input or into --out-dir");
+    if (d.scan_deps || d.depfile_path) die("--batch writes each depfile next to its program; use -MD");
+    if (!d.have_jobs) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        d.jobs = (cpus > 1) ? (int)(cpus < 1024 ? cpus : 1024) : 1;
+    }
+
+    Cache cache;
+    cache_open(&cache, (d.cache_dir && *d.cache_dir) ? d.cache_dir : NULL, d.cache_size);
+    cache_keep_in_memory(&cache);
+    source_share_lexed();
+    process_limit = d.jobs;
+
+    Batch b = {&d, &cache, (bool*)calloc(d.ninputs, sizeof(bool))};
+    if (!b.failed) die("oom");
+    pool_run(d.ninputs, d.jobs, batch_task, &b);
+
+    size_t failures = 0;
+    for (size_t i = 0; i < d.ninputs; i++) failures += b.failed[i];
+    if (failures) fprintf(stderr, "chasmc: %zu of %zu programs failed\n", failures, d.ninputs);
+    cache_close(&cache);
+    if (d.cache_stats) cache_print_stats(&cache, stderr);
+    if (d.time_report) timing_print(stderr, d.time_report_json);
+    free(b.failed);
+    free_options(&d);
+    return failures ? 1 : 0;
+}
+
+// chasmc --server SOCKET [--cache-dir DIR] [--cache-size SIZE]
+static int serve(int argc, char** argv) {
+    const char* socket_path = argv[2];
+    const char* cache_dir = getenv("CHASMC_CACHE_DIR");
+    uint64_t cache_size = DEFAULT_CACHE_SIZE;
+    for (int i = 3; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "--cache-dir") == 0) cache_dir = argv[i + 1];
+        else if (strcmp(argv[i], "--cache-size") == 0) cache_size = parse_size(argv[i + 1]);
+        else die("--server only takes --cache-dir and --cache-size");
+    }
+    Cache cache;
+    cache_open(&cache, (cache_dir && *cache_dir) ? cache_dir : NULL, cache_size);
+    cache_keep_in_memory(&cache);
+    int status = server_run(socket_path, &cache, compile);
+    cache_close(&cache);
+    return status;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2 || (strcmp(argv[1], "--server") == 0 && argc < 3)) {
+        fprintf(stderr, "usage: chasmc <input.chasm> -o <output> [-A: expose asm | -O: expose object | -p: expose both] [-j N]\n"
+                        "              [--separate] [--split-functions] [--nasm] [--ld] [--cache-dir DIR] [--cache-size SIZE]\n"
+                        "              [-O0 | -O1] [--cache-stats] [--time-report[=json]] [--connect SOCKET] [-MD] [-MF DEPFILE]\n"
+                        "       chasmc <library.ravine> --emit-interface [-O1] [-o <library.rvi>] [-MD] [-MF DEPFILE]\n"
+                        "       chasmc <input.chasm> --emit-ir [-O1] [-o <output.ir>]\n"
+                        "       chasmc <input.chasm> --scan-deps\n"
+                        "       chasmc --batch [options] [--out-dir DIR] <input.chasm>... [@MANIFEST]...\n"
+                        "       chasmc --server SOCKET [--cache-dir DIR] [--cache-size SIZE]\n");
+        return 1;
+    }
+    if (strcmp(argv[1], "--server") == 0) return serve(argc, argv);
+    if (strcmp(argv[1], "--batch") == 0) return batch(argc, argv);
+
+    // --connect (or CHASMC_SERVER) hands the compile to a running server,
+    // falling back to compiling here when none is listening.
+    const char* server = getenv("CHASMC_SERVER");
+    char** args = (char**)malloc(((size_t)argc + 1) * sizeof(char*));
+    if (!args) die("oom");
+    int nargs = 0;
+    for (int i = 0; i < argc; i++) {
+        if (i > 1 && strcmp(argv[i], "--connect") == 0 && i + 1 < argc) {
+            server = argv[++i];
+            continue;
+        }
+        args[nargs++] = argv[i];
+    }
+    args[nargs] = NULL;
+    int status = 0;
+    if (!(server && *server && server_forward(server, nargs, args, &status))) status = compile(nargs, args, NULL);
+    free(args);
+    return status;
+}
@@ -0,0 +1,69 @@
+#include "emit.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "util.h"
+
+// Large enough that a typical module never reallocates.
+#define OUT_INITIAL_CAP (256 * 1024)
+
+void out_reserve(Out* O, size_t extra) {
+    if (O->len + extra <= O->cap) return;
+    size_t cap = O->cap ? O->cap : OUT_INITIAL_CAP;
+    while (cap < O->len + extra) cap *= 2;
+    char* data = (char*)realloc(O->data, cap);
+    if (!data) die("Fatal: Out of Memory");
+    O->data = data;
+    O->cap = cap;
+}
+
+void out_free(Out* O) {
+    free(O->data);
+    *O = (Out){0};
+}
+
+void out_int(Out* O, long long v) {
+    char buf[24];
+    char* end = buf + sizeof(buf);
+    char* p = end;
+    unsigned long long u = (v < 0) ? 0ull - (unsigned long long)v : (unsigned long long)v;
+    do {
+        *--p = (char)('0' + u % 10);
+        u /= 10;
+    } while (u);
+    if (v < 0) *--p = '-';
+    out_mem(O, p, (size_t)(end - p));
+}
+
+void out_rbp(Out* O, int off) {
+    out_mem(O, "[rbp", 4);
+    if (off >= 0) out_char(O, '+');
+    out_int(O, off);
+    out_char(O, ']');
+}
+
+void outfmt(Out* O, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    size_t room = O->cap - O->len;
+    int n = vsnprintf(O->data ? O->data + O->len : NULL, room, fmt, ap);
+    va_end(ap);
+    if (n < 0) die("output formatting failed");
+    if ((size_t)n >= room) {
+        out_reserve(O, (size_t)n + 1);
+        va_start(ap, fmt);
+        vsnprintf(O->data + O->len, (size_t)n + 1, fmt, ap);
+        va_end(ap);
+    }
+    O->len += (size_t)n;
+}
+
+void out_write_fd(const Out* O, int fd) {
+    write_fd_all(fd, O->data, O->len);
+}
+
+void out_write_file(const Out* O, const char* path) {
+    write_file_all(path, O->data, O->len);
+}
@@ -0,0 +1,46 @@
+#ifndef CHASMC_EMIT_H
+#define CHASMC_EMIT_H
+
+#include <stddef.h>
+#include <string.h>
+
+// Growable assembly output buffer. Everything is appended in memory and
+// written out once with out_write_file/out_write_fd, so emission never goes
+// through stdio or format-string parsing on the hot path.
+typedef struct {
+    char* data;
+    size_t len;
+    size_t cap;
+} Out;
+
+void out_reserve(Out* O, size_t extra);
+void out_free(Out* O);
+
+static inline void out_mem(Out* O, const char* s, size_t n) {
+    if (O->len + n > O->cap) out_reserve(O, n);
+    memcpy(O->data + O->len, s, n);
+    O->len += n;
+}
+
+static inline void out_char(Out* O, char c) {
+    if (O->len + 1 > O->cap) out_reserve(O, 1);
+    O->data[O->len++] = c;
+}
+
+static inline void out_str(Out* O, const char* s) { out_mem(O, s, strlen(s)); }
+
+static inline void outln(Out* O, const char* s) {
+    out_str(O, s);
+    out_char(O, '\n');
+}
+
+void out_int(Out* O, long long v);
+// Appends "[rbp+N]" / "[rbp-N]", matching printf's "[rbp%+d]".
+void out_rbp(Out* O, int off);
+// Slow path for rare, irregular lines.
+void outfmt(Out* O, const char* fmt, ...);
+
+void out_write_fd(const Out* O, int fd);
+void out_write_file(const Out* O, const char* path);
+
+#endif
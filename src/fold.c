@@ -0,0 +1,132 @@
+#include "fold.h"
+
+typedef struct {
+    IrValue* alias;  // by value: what it was simplified to, or itself
+    bool* known;     // by value
+    uint64_t* value;
+    bool* dead;  // by instruction
+} Fold;
+
+static IrValue resolve(const Fold* F, IrValue v) { return v ? F->alias[v] : v; }
+
+static void make_const(Fold* F, IrInst* in, uint64_t v) {
+    in->op = IR_CONST;
+    in->imm = v;
+    in->has_imm = false;
+    in->text = NULL;
+    in->len = 0;
+    in->name = NULL;
+    in->a = in->b = IR_NONE;
+    F->known[in->dst] = true;
+    F->value[in->dst] = v;
+}
+
+// Operands that become unused here, and the identities x + 0, x - 0 and
+// 0 + x once their uses read x directly, are left for sweep_dead. The value
+// replacing an identity is still the latest one computed when its use comes,
+// so the emitter's rax discipline holds.
+static void fold_forward(IrFunc* fn, Fold* F) {
+    bool* slot_known = (bool*)arena_calloc(fn->arena, fn->nlocals + 1);
+    uint64_t* slot_value = (uint64_t*)arena_calloc(fn->arena, (fn->nlocals + 1) * sizeof(uint64_t));
+
+    for (size_t i = 0; i < fn->ninsts; i++) {
+        IrInst* in = &fn->insts[i];
+        in->a = resolve(F, in->a);
+        in->b = resolve(F, in->b);
+        for (int k = 0; k < in->nargs; k++) in->args[k] = resolve(F, in->args[k]);
+        if (in->dst) F->alias[in->dst] = in->dst;
+        bool ka = in->a && F->known[in->a];
+        bool kb = in->b && F->known[in->b];
+        uint64_t va = ka ? F->value[in->a] : 0;
+        uint64_t vb = kb ? F->value[in->b] : 0;
+
+        switch (in->op) {
+            case IR_CONST:
+                F->known[in->dst] = true;
+                F->value[in->dst] = in->imm;
+                break;
+            case IR_LOAD_LOCAL:
+                if (slot_known[in->slot]) make_const(F, in, slot_value[in->slot]);
+                break;
+            case IR_STORE_LOCAL:
+                slot_known[in->slot] = ka;
+                slot_value[in->slot] = ir_wrap(in->ty, va);
+                break;
+            case IR_LOAD_GLOBAL:
+                if (in->has_imm) make_const(F, in, ir_wrap(in->ty, in->imm));
+                break;
+            case IR_NEG:
+                if (ka) make_const(F, in, 0 - va);
+                break;
+            case IR_ADD:
+            case IR_SUB:
+                if (ka && kb) make_const(F, in, in->op == IR_ADD ? va + vb : va - vb);
+                else if (kb && vb == 0) F->alias[in->dst] = in->a;
+                else if (in->op == IR_ADD && ka && va == 0) F->alias[in->dst] = in->b;
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+static bool is_pure(IrOp op) {
+    return op == IR_CONST || op == IR_LOAD_LOCAL || op == IR_LOAD_GLOBAL || op == IR_ADDR || op == IR_NEG
+           || op == IR_ADD || op == IR_SUB;
+}
+
+// Backwards: a store is dead when no load reads the slot before the next
+// store or the end of the function (locals cannot be addressed); a pure
+// instruction is dead when nothing live uses its value.
+static void sweep_dead(IrFunc* fn, Fold* F) {
+    bool* used = (bool*)arena_calloc(fn->arena, fn->nvalues + 1);
+    bool* slot_read = (bool*)arena_calloc(fn->arena, fn->nlocals + 1);
+    for (size_t i = fn->ninsts; i-- > 0;) {
+        IrInst* in = &fn->insts[i];
+        if (F->dead[i]) continue;
+        if (in->op == IR_STORE_LOCAL) {
+            if (!slot_read[in->slot]) {
+                F->dead[i] = true;
+                continue;
+            }
+            slot_read[in->slot] = false;
+        } else if (is_pure(in->op) && !used[in->dst]) {
+            F->dead[i] = true;
+            continue;
+        }
+        if (in->op == IR_LOAD_LOCAL) slot_read[in->slot] = true;
+        if (in->a) used[in->a] = true;
+        if (in->b) used[in->b] = true;
+        for (int k = 0; k < in->nargs; k++) used[in->args[k]] = true;
+    }
+}
+
+static void compact(IrFunc* fn, const Fold* F) {
+    size_t out = 0;
+    for (size_t b = 0; b < fn->nblocks; b++) {
+        IrBlock* B = &fn->blocks[b];
+        size_t first = out;
+        for (size_t i = B->first; i < B->first + B->count; i++) {
+            if (!F->dead[i]) fn->insts[out++] = fn->insts[i];
+        }
+        B->first = first;
+        B->count = out - first;
+    }
+    fn->ninsts = out;
+}
+
+void fold_constants(IrFunc* fn) {
+    for (size_t i = 0; i < fn->ninsts; i++) {
+        if (fn->insts[i].op == IR_ASM || fn->insts[i].op == IR_MACRO) return;
+    }
+    size_t nv = fn->nvalues + 1;
+    Fold F;
+    F.alias = (IrValue*)arena_calloc(fn->arena, nv * sizeof(IrValue));
+    F.known = (bool*)arena_calloc(fn->arena, nv);
+    F.value = (uint64_t*)arena_calloc(fn->arena, nv * sizeof(uint64_t));
+    F.dead = (bool*)arena_calloc(fn->arena, fn->ninsts + 1);
+
+    fold_forward(fn, &F);
+    sweep_dead(fn, &F);
+    compact(fn, &F);
+}
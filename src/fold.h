@@ -0,0 +1,16 @@
+#ifndef CHASMC_FOLD_H
+#define CHASMC_FOLD_H
+
+#include "ir.h"
+
+// Constant folding and propagation over a function's IR, at -O1. Arithmetic
+// on known values is done at compile time with 64-bit wraparound; a local
+// holding a known value, or a readonly global with a literal initializer,
+// is replaced by that value as its type would load it back. Stores no load
+// reads and values nothing uses are dropped afterwards.
+//
+// Functions with inline asm or macro uses are left alone: their text may
+// read rax, or locals, at any point.
+void fold_constants(IrFunc* fn);
+
+#endif
@@ -0,0 +1,253 @@
+#include "intern.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+typedef struct {
+    const char* str;
+    size_t len;
+    uint64_t hash;
+} InternSlot;
+
+typedef struct {
+    InternSlot* slots;
+    size_t cap;
+    size_t count;
+
+    char* chunk;
+    size_t chunk_used;
+    size_t chunk_cap;
+} Interner;
+
+static Interner interner;
+// Module workers intern names concurrently; the table is small and lookups
+// are short, so a single lock is enough.
+static pthread_mutex_t interner_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t hash_bytes(const char* s, size_t len) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char)s[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+static size_t hash_ptr(const void* p) {
+    uint64_t x = (uint64_t)(uintptr_t)p;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 33;
+    return (size_t)x;
+}
+
+static char* intern_store(const char* s, size_t len) {
+    if (interner.chunk_used + len + 1 > interner.chunk_cap) {
+        size_t cap = 64 * 1024;
+        if (len + 1 > cap) cap = len + 1;
+        interner.chunk = (char*)malloc(cap);
+        if (!interner.chunk) die("oom");
+        interner.chunk_used = 0;
+        interner.chunk_cap = cap;
+    }
+    char* out = interner.chunk + interner.chunk_used;
+    memcpy(out, s, len);
+    out[len] = 0;
+    interner.chunk_used += len + 1;
+    return out;
+}
+
+static void intern_grow(void) {
+    size_t cap = (interner.cap == 0) ? 1024 : interner.cap * 2;
+    InternSlot* slots = (InternSlot*)calloc(cap, sizeof(InternSlot));
+    if (!slots) die("oom");
+    for (size_t i = 0; i < interner.cap; i++) {
+        InternSlot* old = &interner.slots[i];
+        if (!old->str) continue;
+        size_t j = (size_t)old->hash & (cap - 1);
+        while (slots[j].str) j = (j + 1) & (cap - 1);
+        slots[j] = *old;
+    }
+    free(interner.slots);
+    interner.slots = slots;
+    interner.cap = cap;
+}
+
+const char* intern(const char* s, size_t len) {
+    uint64_t h = hash_bytes(s, len);
+    pthread_mutex_lock(&interner_lock);
+    if ((interner.count + 1) * 4 > interner.cap * 3) intern_grow();
+    size_t mask = interner.cap - 1;
+    size_t i = (size_t)h & mask;
+    while (interner.slots[i].str) {
+        InternSlot* slot = &interner.slots[i];
+        if (slot->hash == h && slot->len == len && memcmp(slot->str, s, len) == 0) {
+            pthread_mutex_unlock(&interner_lock);
+            return slot->str;
+        }
+        i = (i + 1) & mask;
+    }
+    const char* stored = intern_store(s, len);
+    interner.slots[i] = (InternSlot){stored, len, h};
+    interner.count++;
+    pthread_mutex_unlock(&interner_lock);
+    return stored;
+}
+
+const char* intern_cstr(const char* s) {
+    return intern(s, strlen(s));
+}
+
+const char* intern_concat(const char* a, size_t alen, const char* b, size_t blen, const char* c, size_t clen) {
+    char stack_buf[256];
+    size_t len = alen + blen + clen;
+    char* buf = (len <= sizeof(stack_buf)) ? stack_buf : (char*)malloc(len);
+    if (!buf) die("oom");
+    memcpy(buf, a, alen);
+    memcpy(buf + alen, b, blen);
+    memcpy(buf + alen + blen, c, clen);
+    const char* out = intern(buf, len);
+    if (buf != stack_buf) free(buf);
+    return out;
+}
+
+static void name_map_grow(NameMap* map) {
+    size_t cap = (map->cap == 0) ? 16 : map->cap * 2;
+    const char** keys;
+    size_t* vals;
+    if (map->arena) {
+        keys = (const char**)arena_calloc(map->arena, cap * sizeof(const char*));
+        vals = (size_t*)arena_alloc(map->arena, cap * sizeof(size_t));
+    } else {
+        keys = (const char**)calloc(cap, sizeof(const char*));
+        vals = (size_t*)malloc(cap * sizeof(size_t));
+        if (!keys || !vals) die("oom");
+    }
+    for (size_t i = 0; i < map->cap; i++) {
+        if (!map->keys[i]) continue;
+        size_t j = hash_ptr(map->keys[i]) & (cap - 1);
+        while (keys[j]) j = (j + 1) & (cap - 1);
+        keys[j] = map->keys[i];
+        vals[j] = map->vals[i];
+    }
+    if (!map->arena) {
+        free(map->keys);
+        free(map->vals);
+    }
+    map->keys = keys;
+    map->vals = vals;
+    map->cap = cap;
+}
+
+size_t* name_map_find(const NameMap* map, const char* key) {
+    if (map->cap == 0) return NULL;
+    size_t mask = map->cap - 1;
+    size_t i = hash_ptr(key) & mask;
+    while (map->keys[i]) {
+        if (map->keys[i] == key) return &map->vals[i];
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+size_t name_map_probes(const NameMap* map, const char* key) {
+    if (map->cap == 0) return 1;
+    size_t mask = map->cap - 1;
+    size_t i = hash_ptr(key) & mask;
+    size_t probes = 1;
+    while (map->keys[i] && map->keys[i] != key) {
+        i = (i + 1) & mask;
+        probes++;
+    }
+    return probes;
+}
+
+void name_map_put(NameMap* map, const char* key, size_t val) {
+    if ((map->count + 1) * 4 > map->cap * 3) name_map_grow(map);
+    size_t mask = map->cap - 1;
+    size_t i = hash_ptr(key) & mask;
+    while (map->keys[i]) {
+        if (map->keys[i] == key) {
+            map->vals[i] = val;
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+    map->keys[i] = key;
+    map->vals[i] = val;
+    map->count++;
+}
+
+void name_map_free(NameMap* map) {
+    if (!map->arena) {
+        free(map->keys);
+        free(map->vals);
+    }
+    *map = (NameMap){0};
+}
+
+static size_t hash_pair(const char* a, const char* b) {
+    return hash_ptr(a) ^ (hash_ptr(b) * 31);
+}
+
+static void pair_map_grow(PairMap* map) {
+    size_t cap = (map->cap == 0) ? 64 : map->cap * 2;
+    const char** a = (const char**)calloc(cap, sizeof(const char*));
+    const char** b = (const char**)malloc(cap * sizeof(const char*));
+    const char** vals = (const char**)malloc(cap * sizeof(const char*));
+    if (!a || !b || !vals) die("oom");
+    for (size_t i = 0; i < map->cap; i++) {
+        if (!map->a[i]) continue;
+        size_t j = hash_pair(map->a[i], map->b[i]) & (cap - 1);
+        while (a[j]) j = (j + 1) & (cap - 1);
+        a[j] = map->a[i];
+        b[j] = map->b[i];
+        vals[j] = map->vals[i];
+    }
+    free(map->a);
+    free(map->b);
+    free(map->vals);
+    map->a = a;
+    map->b = b;
+    map->vals = vals;
+    map->cap = cap;
+}
+
+const char* pair_map_find(const PairMap* map, const char* a, const char* b) {
+    if (map->cap == 0) return NULL;
+    size_t mask = map->cap - 1;
+    size_t i = hash_pair(a, b) & mask;
+    while (map->a[i]) {
+        if (map->a[i] == a && map->b[i] == b) return map->vals[i];
+        i = (i + 1) & mask;
+    }
+    return NULL;
+}
+
+void pair_map_put(PairMap* map, const char* a, const char* b, const char* val) {
+    if ((map->count + 1) * 4 > map->cap * 3) pair_map_grow(map);
+    size_t mask = map->cap - 1;
+    size_t i = hash_pair(a, b) & mask;
+    while (map->a[i]) {
+        if (map->a[i] == a && map->b[i] == b) {
+            map->vals[i] = val;
+            return;
+        }
+        i = (i + 1) & mask;
+    }
+    map->a[i] = a;
+    map->b[i] = b;
+    map->vals[i] = val;
+    map->count++;
+}
+
+void pair_map_free(PairMap* map) {
+    free(map->a);
+    free(map->b);
+    free(map->vals);
+    *map = (PairMap){0};
+}
@@ -0,0 +1,46 @@
+#ifndef CHASMC_INTERN_H
+#define CHASMC_INTERN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "arena.h"
+
+// Interned strings are unique per content, so two names are equal iff their
+// pointers are equal. They live for the whole process. intern() is
+// thread-safe; the maps below are not, but concurrent lookups are fine.
+const char* intern(const char* s, size_t len);
+const char* intern_cstr(const char* s);
+const char* intern_concat(const char* a, size_t alen, const char* b, size_t blen, const char* c, size_t clen);
+
+// Open-addressing index keyed by interned string pointers. When `arena` is
+// set the slots are allocated from it and name_map_free is a no-op.
+typedef struct {
+    const char** keys;
+    size_t* vals;
+    size_t cap;
+    size_t count;
+    Arena* arena;
+} NameMap;
+
+size_t* name_map_find(const NameMap* map, const char* key);
+// Slots name_map_find checks for key, hit or miss (an empty map counts as
+// one); for --time-report.
+size_t name_map_probes(const NameMap* map, const char* key);
+void name_map_put(NameMap* map, const char* key, size_t val);
+void name_map_free(NameMap* map);
+
+// Open-addressing cache keyed by a pair of interned string pointers.
+typedef struct {
+    const char** a;
+    const char** b;
+    const char** vals;
+    size_t cap;
+    size_t count;
+} PairMap;
+
+const char* pair_map_find(const PairMap* map, const char* a, const char* b);
+void pair_map_put(PairMap* map, const char* a, const char* b, const char* val);
+void pair_map_free(PairMap* map);
+
+#endif
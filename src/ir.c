@@ -0,0 +1,260 @@
+#include "ir.h"
+
+#include <string.h>
+
+#include "util.h"
+
+void ir_func_init(IrFunc* fn, Arena* arena, const char* name, bool is_global) {
+    *fn = (IrFunc){0};
+    fn->arena = arena;
+    fn->name = name;
+    fn->is_global = is_global;
+    ir_begin_block(fn);
+}
+
+int ir_add_local(IrFunc* fn, const char* name, TypeKind ty, int rbp_off) {
+    if (fn->nlocals == fn->locals_cap) {
+        size_t old_cap = fn->locals_cap;
+        fn->locals_cap = old_cap ? old_cap * 2 : 16;
+        fn->locals = (IrLocal*)arena_grow(fn->arena, fn->locals, old_cap * sizeof(IrLocal),
+                                          fn->locals_cap * sizeof(IrLocal));
+    }
+    fn->locals[fn->nlocals] = (IrLocal){name, ty, rbp_off, REG_NONE};
+    return (int)fn->nlocals++;
+}
+
+IrValue ir_new_value(IrFunc* fn, TypeKind ty) {
+    if (fn->nvalues + 1 >= fn->types_cap) {
+        size_t old_cap = fn->types_cap;
+        fn->types_cap = old_cap ? old_cap * 2 : 64;
+        fn->types = (TypeKind*)arena_grow(fn->arena, fn->types, old_cap * sizeof(TypeKind),
+                                          fn->types_cap * sizeof(TypeKind));
+    }
+    fn->types[++fn->nvalues] = ty;
+    return (IrValue)fn->nvalues;
+}
+
+IrInst* ir_add(IrFunc* fn, IrOp op) {
+    if (fn->ninsts == fn->insts_cap) {
+        size_t old_cap = fn->insts_cap;
+        fn->insts_cap = old_cap ? old_cap * 2 : 64;
+        fn->insts = (IrInst*)arena_grow(fn->arena, fn->insts, old_cap * sizeof(IrInst),
+                                        fn->insts_cap * sizeof(IrInst));
+    }
+    IrInst* in = &fn->insts[fn->ninsts++];
+    *in = (IrInst){0};
+    in->op = op;
+    fn->blocks[fn->nblocks - 1].count++;
+    return in;
+}
+
+size_t ir_begin_block(IrFunc* fn) {
+    if (fn->nblocks == fn->blocks_cap) {
+        size_t old_cap = fn->blocks_cap;
+        fn->blocks_cap = old_cap ? old_cap * 2 : 4;
+        fn->blocks = (IrBlock*)arena_grow(fn->arena, fn->blocks, old_cap * sizeof(IrBlock),
+                                          fn->blocks_cap * sizeof(IrBlock));
+    }
+    fn->blocks[fn->nblocks] = (IrBlock){fn->ninsts, 0};
+    return fn->nblocks++;
+}
+
+uint64_t ir_parse_int(const char* s, size_t len) {
+    uint64_t v = 0;
+    if (len > 2 && s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) {
+        for (size_t i = 2; i < len; i++) {
+            char c = s[i];
+            int d = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 : c - 'A' + 10;
+            v = v * 16 + (uint64_t)d;
+        }
+        return v;
+    }
+    for (size_t i = 0; i < len; i++) v = v * 10 + (uint64_t)(s[i] - '0');
+    return v;
+}
+
+uint64_t ir_wrap(TypeKind ty, uint64_t v) {
+    switch (ty) {
+        case TY_U8:
+            return (uint8_t)v;
+        case TY_U16:
+            return (uint16_t)v;
+        case TY_U32:
+            return (uint32_t)v;
+        case TY_I8:
+            return (uint64_t)(int64_t)(int8_t)v;
+        case TY_I16:
+            return (uint64_t)(int64_t)(int16_t)v;
+        case TY_I32:
+            return (uint64_t)(int64_t)(int32_t)v;
+        default:
+            return v;
+    }
+}
+
+const char* reg_name(Reg r, int size_bytes) {
+    static const char* names[REG_COUNT][4] = {
+        {"r10b", "r10w", "r10d", "r10"},
+        {"r11b", "r11w", "r11d", "r11"},
+        {"r12b", "r12w", "r12d", "r12"},
+        {"r13b", "r13w", "r13d", "r13"},
+        {"r14b", "r14w", "r14d", "r14"},
+        {"r15b", "r15w", "r15d", "r15"},
+    };
+    int i = size_bytes == 1 ? 0 : size_bytes == 2 ? 1 : size_bytes == 4 ? 2 : 3;
+    return names[r][i];
+}
+
+const char* ir_type_name(TypeKind ty) {
+    switch (ty) {
+        case TY_U8:
+            return "u8";
+        case TY_U16:
+            return "u16";
+        case TY_U32:
+            return "u32";
+        case TY_U64:
+            return "u64";
+        case TY_I8:
+            return "i8";
+        case TY_I16:
+            return "i16";
+        case TY_I32:
+            return "i32";
+        case TY_I64:
+            return "i64";
+        case TY_NULL:
+            return "null";
+        default:
+            return "?";
+    }
+}
+
+static void dump_value(Out* O, IrValue v) {
+    out_char(O, '%');
+    out_int(O, (long long)v);
+}
+
+static void dump_def(Out* O, const IrFunc* fn, IrValue v, const char* op) {
+    out_str(O, "    ");
+    dump_value(O, v);
+    out_char(O, ':');
+    out_str(O, ir_type_name(fn->types[v]));
+    out_str(O, " = ");
+    out_str(O, op);
+}
+
+static void dump_local(Out* O, const IrFunc* fn, int slot) {
+    out_str(O, fn->locals[slot].name);
+    out_char(O, '.');
+    out_int(O, slot);
+}
+
+static void dump_inst(Out* O, const IrFunc* fn, const IrInst* in) {
+    switch (in->op) {
+        case IR_CONST:
+            dump_def(O, fn, in->dst, "const ");
+            if (in->text) out_mem(O, in->text, in->len);
+            else out_int(O, (long long)in->imm);
+            break;
+        case IR_LOAD_LOCAL:
+            dump_def(O, fn, in->dst, "load ");
+            dump_local(O, fn, in->slot);
+            break;
+        case IR_STORE_LOCAL:
+            out_str(O, "    store ");
+            dump_local(O, fn, in->slot);
+            out_str(O, ", ");
+            dump_value(O, in->a);
+            break;
+        case IR_LOAD_GLOBAL:
+            dump_def(O, fn, in->dst, "load @");
+            out_str(O, in->name);
+            if (in->has_imm) outfmt(O, " (readonly %lld)", (long long)in->imm);
+            break;
+        case IR_STORE_GLOBAL:
+            outfmt(O, "    store @%s:%s, ", in->name, ir_type_name(in->ty));
+            dump_value(O, in->a);
+            break;
+        case IR_ADDR:
+            dump_def(O, fn, in->dst, "addr @");
+            out_str(O, in->name);
+            break;
+        case IR_LOAD_PTR:
+            dump_def(O, fn, in->dst, "load [");
+            dump_value(O, in->a);
+            out_char(O, ']');
+            break;
+        case IR_STORE_PTR:
+            out_str(O, "    store [");
+            dump_value(O, in->a);
+            out_str(O, "], ");
+            dump_value(O, in->b);
+            break;
+        case IR_NEG:
+            dump_def(O, fn, in->dst, "neg ");
+            dump_value(O, in->a);
+            break;
+        case IR_ADD:
+        case IR_SUB:
+            dump_def(O, fn, in->dst, in->op == IR_ADD ? "add " : "sub ");
+            dump_value(O, in->a);
+            out_str(O, ", ");
+            dump_value(O, in->b);
+            break;
+        case IR_CALL:
+            if (in->dst) dump_def(O, fn, in->dst, "call ");
+            else out_str(O, "    call ");
+            out_str(O, in->name);
+            out_char(O, '(');
+            for (int i = 0; i < in->nargs; i++) {
+                if (i) out_str(O, ", ");
+                dump_value(O, in->args[i]);
+            }
+            out_char(O, ')');
+            break;
+        case IR_PUSH:
+            out_str(O, "    push ");
+            dump_value(O, in->a);
+            break;
+        case IR_POP:
+            dump_def(O, fn, in->dst, "pop");
+            break;
+        case IR_ASM: {
+            out_str(O, "    asm {");
+            out_mem(O, in->text, in->len);
+            out_char(O, '}');
+            break;
+        }
+        case IR_MACRO:
+            out_str(O, "    macro ");
+            out_str(O, in->name);
+            for (int i = 0; i < in->nmargs; i++) {
+                out_str(O, i ? ", " : " ");
+                out_str(O, in->margs[i]);
+            }
+            break;
+        case IR_RET:
+            out_str(O, "    ret ");
+            dump_value(O, in->a);
+            break;
+    }
+    out_char(O, '\n');
+}
+
+void ir_dump(const IrFunc* fn, Out* O) {
+    outfmt(O, "func %s%s frame %d\n", fn->is_global ? "global " : "", fn->name, fn->frame_size);
+    for (size_t i = 0; i < fn->nlocals; i++) {
+        const IrLocal* L = &fn->locals[i];
+        outfmt(O, "    %s %s.%zu:%s ", (int)i < fn->nparams ? "param" : "local", L->name, i, ir_type_name(L->ty));
+        if (L->reg != REG_NONE) outln(O, reg_name(L->reg, 8));
+        else if (!L->rbp_off) outln(O, "unused");
+        else outfmt(O, "[rbp%+d]\n", L->rbp_off);
+    }
+    for (size_t b = 0; b < fn->nblocks; b++) {
+        outfmt(O, "b%zu:\n", b);
+        const IrBlock* B = &fn->blocks[b];
+        for (size_t i = B->first; i < B->first + B->count; i++) dump_inst(O, fn, &fn->insts[i]);
+    }
+    out_char(O, '\n');
+}
@@ -0,0 +1,152 @@
+#ifndef CHASMC_IR_H
+#define CHASMC_IR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "arena.h"
+#include "emit.h"
+
+typedef enum {
+    TY_U8,
+    TY_U16,
+    TY_U32,
+    TY_U64,
+    TY_I8,
+    TY_I16,
+    TY_I32,
+    TY_I64,
+    TY_NULL,
+    TY_UNKNOWN
+} TypeKind;
+
+typedef struct {
+    TypeKind kind;
+} Type;
+
+// Per-function intermediate form: three-address instructions over virtual
+// registers, grouped into basic blocks. The parser builds it and the
+// emitter lowers it to NASM once the whole function has been seen.
+//
+// Values are numbered from 1 and each is defined exactly once. A value is
+// held as 64 bits; its type is the width it was loaded at (and extended
+// from), or u64 for anything computed.
+typedef uint32_t IrValue;
+
+#define IR_NONE ((IrValue)0)
+
+typedef enum {
+    IR_CONST,         // dst = imm; text is the literal as written, if any
+    IR_LOAD_LOCAL,    // dst = locals[slot], extended from ty
+    IR_STORE_LOCAL,   // locals[slot] = a, truncated to ty
+    IR_LOAD_GLOBAL,   // dst = [name], extended from ty; has_imm: a readonly constant of value imm
+    IR_STORE_GLOBAL,  // [name] = a, truncated to ty
+    IR_ADDR,          // dst = &name
+    IR_LOAD_PTR,      // dst = qword [a]
+    IR_STORE_PTR,     // qword [a] = b
+    IR_NEG,           // dst = -a
+    IR_ADD,           // dst = a + b
+    IR_SUB,           // dst = a - b
+    IR_CALL,          // dst = name(args)
+    IR_PUSH,          // push a
+    IR_POP,           // dst = pop
+    IR_ASM,           // text[0, len) passed through verbatim
+    IR_MACRO,         // use of macro name with margs, expanded at link time
+    IR_RET,           // return a; ends its block
+} IrOp;
+
+typedef struct {
+    IrOp op;
+    TypeKind ty;
+    IrValue dst;
+    IrValue a;
+    IrValue b;
+    int slot;
+    uint64_t imm;
+    bool has_imm;
+    const char* name;  // interned
+    const char* text;
+    size_t len;
+    IrValue* args;
+    int nargs;
+    char** margs;
+    int nmargs;
+} IrInst;
+
+typedef struct {
+    size_t first;  // index into insts
+    size_t count;
+} IrBlock;
+
+// Registers the allocator hands out to locals (see regalloc.h). The
+// emitter's scratch registers, rax, rbx, rcx and the argument registers, are
+// never among them.
+typedef enum {
+    REG_R10,
+    REG_R11,
+    REG_R12,  // r12 and up are callee-saved
+    REG_R13,
+    REG_R14,
+    REG_R15,
+    REG_COUNT,
+    REG_NONE = -1,
+} Reg;
+
+static inline bool reg_callee_saved(Reg r) { return r >= REG_R12; }
+
+typedef struct {
+    const char* name;
+    TypeKind ty;
+    int rbp_off;  // 0: never used
+    Reg reg;      // REG_NONE: lives at rbp_off
+} IrLocal;
+
+typedef struct {
+    const char* name;
+    bool is_global;
+    int nparams;     // the first locals
+    int frame_size;  // bytes reserved below rbp on entry
+    unsigned saved_regs;  // callee-saved registers used, by bit (1u << Reg)
+
+    IrLocal* locals;
+    size_t nlocals;
+    size_t locals_cap;
+
+    IrInst* insts;
+    size_t ninsts;
+    size_t insts_cap;
+
+    IrBlock* blocks;
+    size_t nblocks;
+    size_t blocks_cap;
+
+    TypeKind* types;  // by value; [0] is unused
+    size_t nvalues;
+    size_t types_cap;
+
+    Arena* arena;  // everything above lives here
+} IrFunc;
+
+void ir_func_init(IrFunc* fn, Arena* arena, const char* name, bool is_global);
+int ir_add_local(IrFunc* fn, const char* name, TypeKind ty, int rbp_off);
+IrValue ir_new_value(IrFunc* fn, TypeKind ty);
+// Appends a zeroed instruction to the current (last) block.
+IrInst* ir_add(IrFunc* fn, IrOp op);
+// Starts a new block; instructions go there from now on.
+size_t ir_begin_block(IrFunc* fn);
+
+// Value of an integer literal (decimal, or hex with 0x), modulo 2^64.
+uint64_t ir_parse_int(const char* s, size_t len);
+// v as stored into `ty` and loaded back: truncated, then sign- or
+// zero-extended to 64 bits.
+uint64_t ir_wrap(TypeKind ty, uint64_t v);
+
+// r12, r12d, r12w or r12b.
+const char* reg_name(Reg r, int size_bytes);
+
+const char* ir_type_name(TypeKind ty);
+// Readable listing, for --emit-ir.
+void ir_dump(const IrFunc* fn, Out* O);
+
+#endif
@@ -1,87 +1,153 @@
 #include "lexer.h"
 
-#include <ctype.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "intern.h"
 #include "util.h"
 
-static bool is_ident_start(int c) {
-    return isalpha(c) || c == '_';
+static inline bool char_is(int c, unsigned char cls) {
+    return (lex_char_class[(unsigned char)c] & cls) != 0;
 }
 
-static bool is_ident(int c) {
-    return isalnum(c) || c == '_';
+typedef struct {
+    const char* text;
+    unsigned char len;
+    TokenKind kind;
+} Keyword;
+
+// Perfect hash over the keyword set: (s[0] + 8*s[1] + 10*s[n-1] + n) & 127 is
+// collision-free for every keyword, so a lookup is one probe and one memcmp.
+// Regenerate the slots if a keyword is added.
+#define KEYWORD_SLOTS 128
+#define KEYWORD_MAX_LEN 9
+
+static const Keyword keyword_table[KEYWORD_SLOTS] = {
+    [4] = {"u32", 3, TK_KW_U32},
+    [5] = {"global", 6, TK_KW_GLOBAL},
+    [6] = {"resd", 4, TK_KW_RESD},
+    [8] = {"resq", 4, TK_KW_RESQ},
+    [11] = {"def", 3, TK_KW_DEF},
+    [16] = {"i16", 3, TK_KW_I16},
+    [28] = {"u16", 3, TK_KW_U16},
+    [31] = {"let", 3, TK_KW_LET},
+    [33] = {"local", 5, TK_KW_LOCAL},
+    [36] = {"i64", 3, TK_KW_I64},
+    [37] = {"ret", 3, TK_KW_RET},
+    [38] = {"set", 3, TK_KW_SET},
+    [39] = {"call", 4, TK_KW_CALL},
+    [44] = {"push", 4, TK_KW_PUSH},
+    [48] = {"u64", 3, TK_KW_U64},
+    [50] = {"Null", 4, TK_KW_NULL},
+    [58] = {"data", 4, TK_KW_DATA},
+    [62] = {"asm", 3, TK_KW_ASM},
+    [64] = {"end", 3, TK_KW_END},
+    [68] = {"resw", 4, TK_KW_RESW},
+    [73] = {"program", 7, TK_KW_PROGRAM},
+    [75] = {"pop", 3, TK_KW_POP},
+    [80] = {"endmodule", 9, TK_KW_ENDMODULE},
+    [81] = {"inline", 6, TK_KW_INLINE},
+    [82] = {"null", 4, TK_KW_NULL},
+    [87] = {"enddef", 6, TK_KW_ENDDEF},
+    [90] = {"void", 4, TK_KW_VOID},
+    [91] = {"i8", 2, TK_KW_I8},
+    [92] = {"readonly", 8, TK_KW_READONLY},
+    [93] = {"module", 6, TK_KW_MODULE},
+    [95] = {"import", 6, TK_KW_IMPORT},
+    [102] = {"uns", 3, TK_KW_UNS},
+    [103] = {"u8", 2, TK_KW_U8},
+    [108] = {"return", 6, TK_KW_RETURN},
+    [110] = {"section", 7, TK_KW_SECTION},
+    [112] = {"func", 4, TK_KW_FUNC},
+    [114] = {"resb", 4, TK_KW_RESB},
+    [120] = {"i32", 3, TK_KW_I32},
+    [121] = {"macros", 6, TK_KW_MACROS},
+    [123] = {"bss", 3, TK_KW_BSS},
+};
+
+static TokenKind classify_ident(const char* s, size_t len) {
+    if (len < 2 || len > KEYWORD_MAX_LEN) return TK_IDENT;
+    unsigned h = ((unsigned char)s[0] + (unsigned char)s[1] * 8u + (unsigned char)s[len - 1] * 10u
+                  + (unsigned)len) & (KEYWORD_SLOTS - 1);
+    const Keyword* kw = &keyword_table[h];
+    if (kw->len == len && memcmp(kw->text, s, len) == 0) return kw->kind;
+    return TK_IDENT;
 }
 
-static bool is_path_char(int c) {
-    return isalnum(c) || c == '_' || c == '/' || c == '.' || c == '-';
-}
-
-static bool is_percent_ident_char(int c) {
-    return isalnum(c) || c == '_' || c == '%';
-}
+_Static_assert(TK_KW_RESQ <= UINT8_MAX, "token kinds are stored in one byte");
 
-static Token make_token(TokenKind k, const char* s, const char* e, int line, int col) {
+static Token make_token(TokenKind k, const char* s, const char* e) {
     Token t;
     t.kind = k;
     t.start = s;
     t.end = e;
-    t.line = line;
-    t.col = col;
     return t;
 }
 
+static const LexKernels* active_kernels;
+
+void lexer_select_kernels(LexKernelLevel level) {
+    active_kernels = lex_kernels_for(level);
+}
+
 void lexer_init(Lexer* L, const char* src, size_t len) {
+    if (!active_kernels) lexer_select_kernels(lex_kernels_best());
+    L->scan = active_kernels;
     L->src = src;
     L->len = len;
     L->i = 0;
-    L->line = 1;
-    L->col = 1;
     L->indent_top = 0;
     L->indent_stack[0] = 0;
     L->at_line_start = true;
     L->pending_dedents = 0;
+    L->asm_state = 0;
+}
+
+// Most whitespace and identifier runs are short, so the first bytes are
+// classified inline and only longer runs are handed to the bulk kernels.
+#define SHORT_RUN 16
+
+static size_t span_run(Lexer* L, unsigned char cls, size_t (*bulk)(const char*, size_t)) {
+    const char* s = L->src + L->i;
+    size_t avail = L->len - L->i;
+    size_t limit = avail < SHORT_RUN ? avail : SHORT_RUN;
+    size_t n = 0;
+    while (n < limit && char_is(s[n], cls)) n++;
+    if (n == SHORT_RUN) n += bulk(s + n, avail - n);
+    return n;
 }
 
 static void skip_ws_inline(Lexer* L) {
-    while (L->i < L->len) {
-        char c = L->src[L->i];
-        if (c == ' ' || c == '\t' || c == '\r') {
-            L->i++;
-            L->col++;
-            continue;
-        }
-        break;
-    }
+    L->i += span_run(L, CC_SPACE, L->scan->span_space);
 }
 
 static void skip_comment(Lexer* L) {
     if (L->i + 2 < L->len && L->src[L->i] == ';' && L->src[L->i + 1] == ';'
         && L->src[L->i + 2] == ';') {
-        while (L->i < L->len && L->src[L->i] != '\n') {
-            L->i++;
-            L->col++;
-        }
+        L->i += L->scan->find_eol(L->src + L->i, L->len - L->i);
     }
 }
 
-Token next_token(Lexer* L) {
+static void advance_while(Lexer* L, unsigned char cls) {
+    while (L->i < L->len && char_is(L->src[L->i], cls)) L->i++;
+}
+
+static Token lex_token(Lexer* L) {
     if (L->pending_dedents > 0) {
         L->pending_dedents--;
-        return make_token(TK_DEDENT, L->src + L->i, L->src + L->i, L->line, L->col);
+        return make_token(TK_DEDENT, L->src + L->i, L->src + L->i);
     }
 
     if (L->i >= L->len) {
         if (L->indent_top > 0) {
             L->indent_top--;
-            return make_token(TK_DEDENT, L->src + L->i, L->src + L->i, L->line, L->col);
+            return make_token(TK_DEDENT, L->src + L->i, L->src + L->i);
         }
-        return make_token(TK_EOF, L->src + L->i, L->src + L->i, L->line, L->col);
+        return make_token(TK_EOF, L->src + L->i, L->src + L->i);
     }
 
     if (L->at_line_start) {
-        int line = L->line, col = L->col;
         int indent = 0;
         size_t j = L->i;
 
@@ -105,10 +171,9 @@ Token next_token(Lexer* L) {
             if (indent > cur) {
                 L->indent_top++;
                 L->indent_stack[L->indent_top] = indent;
-                L->col += (int)(j - L->i);
                 L->i = j;
                 L->at_line_start = false;
-                return make_token(TK_INDENT, L->src + L->i, L->src + L->i, line, col);
+                return make_token(TK_INDENT, L->src + L->i, L->src + L->i);
             } else if (indent < cur) {
                 int pops = 0;
                 while (L->indent_top > 0 && indent < L->indent_stack[L->indent_top]) {
@@ -118,15 +183,13 @@ Token next_token(Lexer* L) {
                 if (indent != L->indent_stack[L->indent_top]) {
                     die("indentation error (misaligned dedent)");
                 }
-                L->col += (int)(j - L->i);
                 L->i = j;
                 L->at_line_start = false;
 
                 L->pending_dedents = pops - 1;
-                return make_token(TK_DEDENT, L->src + L->i, L->src + L->i, line, col);
+                return make_token(TK_DEDENT, L->src + L->i, L->src + L->i);
             }
 
-            L->col += (int)(j - L->i);
             L->i = j;
         }
 
@@ -139,148 +202,246 @@ Token next_token(Lexer* L) {
     if (L->i < L->len && L->src[L->i] == '\n') {
         const char* s = L->src + L->i;
         L->i++;
-        L->line++;
-        L->col = 1;
         L->at_line_start = true;
-        return make_token(TK_NL, s, s + 1, L->line - 1, 1);
+        return make_token(TK_NL, s, s + 1);
     }
 
-    if (L->i >= L->len) return next_token(L);
+    if (L->i >= L->len) return lex_token(L);
 
-    int line = L->line, col = L->col;
     const char* s = L->src + L->i;
     char c = L->src[L->i++];
-    L->col++;
 
     switch (c) {
         case '#':
-            return make_token(TK_HASH, s, s + 1, line, col);
+            return make_token(TK_HASH, s, s + 1);
         case ':':
             if (L->i < L->len && L->src[L->i] == ':') {
                 L->i++;
-                L->col++;
-                return make_token(TK_SCOPE, s, s + 2, line, col);
+                return make_token(TK_SCOPE, s, s + 2);
             }
-            return make_token(TK_COLON, s, s + 1, line, col);
+            return make_token(TK_COLON, s, s + 1);
         case ';':
-            return make_token(TK_SEMI, s, s + 1, line, col);
+            return make_token(TK_SEMI, s, s + 1);
         case ',':
-            return make_token(TK_COMMA, s, s + 1, line, col);
+            return make_token(TK_COMMA, s, s + 1);
         case '(':
-            return make_token(TK_LPAREN, s, s + 1, line, col);
+            return make_token(TK_LPAREN, s, s + 1);
         case ')':
-            return make_token(TK_RPAREN, s, s + 1, line, col);
+            return make_token(TK_RPAREN, s, s + 1);
         case '{':
-            return make_token(TK_LBRACE, s, s + 1, line, col);
+            return make_token(TK_LBRACE, s, s + 1);
         case '}':
-            return make_token(TK_RBRACE, s, s + 1, line, col);
+            return make_token(TK_RBRACE, s, s + 1);
         case '[':
-            return make_token(TK_LBRACKET, s, s + 1, line, col);
+            return make_token(TK_LBRACKET, s, s + 1);
         case ']':
-            return make_token(TK_RBRACKET, s, s + 1, line, col);
+            return make_token(TK_RBRACKET, s, s + 1);
         case '=':
-            return make_token(TK_EQ, s, s + 1, line, col);
+            return make_token(TK_EQ, s, s + 1);
         case '+':
-            return make_token(TK_PLUS, s, s + 1, line, col);
+            return make_token(TK_PLUS, s, s + 1);
         case '-':
-            return make_token(TK_MINUS, s, s + 1, line, col);
+            return make_token(TK_MINUS, s, s + 1);
         case '*':
-            return make_token(TK_STAR, s, s + 1, line, col);
+            return make_token(TK_STAR, s, s + 1);
         case '/':
-            return make_token(TK_SLASH, s, s + 1, line, col);
+            return make_token(TK_SLASH, s, s + 1);
         case '&':
-            return make_token(TK_AMP, s, s + 1, line, col);
+            return make_token(TK_AMP, s, s + 1);
         case '$':
-            return make_token(TK_DOLLAR, s, s + 1, line, col);
+            return make_token(TK_DOLLAR, s, s + 1);
         case '@':
-            return make_token(TK_AT, s, s + 1, line, col);
+            return make_token(TK_AT, s, s + 1);
         case '%': {
-            while (L->i < L->len && is_percent_ident_char((unsigned char)L->src[L->i])) {
-                L->i++;
-                L->col++;
-            }
-            return make_token(TK_PERCENT_IDENT, s, L->src + L->i, line, col);
+            advance_while(L, CC_PERCENT);
+            return make_token(TK_PERCENT_IDENT, s, L->src + L->i);
         }
         case '>':
             if (L->i < L->len && L->src[L->i] == '>') {
                 L->i++;
-                L->col++;
-                return make_token(TK_RARROW, s, s + 2, line, col);
+                return make_token(TK_RARROW, s, s + 2);
             }
             break;
         case '"': {
             const char* start = L->src + L->i;
-            while (L->i < L->len && L->src[L->i] != '"') {
-                if (L->src[L->i] == '\n') die("unterminated string literal");
-                L->i++;
-                L->col++;
-            }
-            if (L->i >= L->len) die("unterminated string literal");
+            L->i += L->scan->find_quote(start, L->len - L->i, '"');
+            if (L->i >= L->len || L->src[L->i] == '\n') die("unterminated string literal");
             const char* end = L->src + L->i;
 
             L->i++;
-            L->col++;
 
-            return make_token(TK_STRING, start, end, line, col);
+            return make_token(TK_STRING, start, end);
         }
         case '\'': {
             const char* start = L->src + L->i;
-            while (L->i < L->len && L->src[L->i] != '\'') {
-                if (L->src[L->i] == '\n') die("unterminated char literal");
-                L->i++;
-                L->col++;
-            }
-            if (L->i >= L->len) die("unterminated char literal");
+            L->i += L->scan->find_quote(start, L->len - L->i, '\'');
+            if (L->i >= L->len || L->src[L->i] == '\n') die("unterminated char literal");
             const char* end = L->src + L->i;
             L->i++;
-            L->col++;
-            return make_token(TK_CHAR, start, end, line, col);
+            return make_token(TK_CHAR, start, end);
         }
         default:
             break;
     }
 
     if (c == '.' || c == '/') {
-        while (L->i < L->len && is_path_char((unsigned char)L->src[L->i])) {
-            L->i++;
-            L->col++;
-        }
-        return make_token(TK_PATH, s, L->src + L->i, line, col);
+        advance_while(L, CC_PATH);
+        return make_token(TK_PATH, s, L->src + L->i);
     }
 
-    if (isdigit((unsigned char)c)) {
+    if (char_is(c, CC_DIGIT)) {
         if (c == '0' && L->i < L->len && (L->src[L->i] == 'x' || L->src[L->i] == 'X')) {
             L->i++;
-            L->col++;
-            while (L->i < L->len && isxdigit((unsigned char)L->src[L->i])) {
-                L->i++;
-                L->col++;
-            }
+            advance_while(L, CC_XDIGIT);
         } else {
-            while (L->i < L->len && isdigit((unsigned char)L->src[L->i])) {
-                L->i++;
-                L->col++;
-            }
+            advance_while(L, CC_DIGIT);
         }
-        return make_token(TK_INT, s, L->src + L->i, line, col);
+        return make_token(TK_INT, s, L->src + L->i);
     }
 
-    if (is_ident_start((unsigned char)c)) {
+    if (char_is(c, CC_IDENT_START)) {
         bool has_path = false;
-        while (L->i < L->len && is_ident((unsigned char)L->src[L->i])) {
-            L->i++;
-            L->col++;
-        }
-        while (L->i < L->len && is_path_char((unsigned char)L->src[L->i])) {
+        L->i += span_run(L, CC_IDENT, L->scan->span_ident);
+        while (L->i < L->len && char_is(L->src[L->i], CC_PATH)) {
             has_path = true;
             L->i++;
-            L->col++;
         }
-        return make_token(has_path ? TK_PATH : TK_IDENT, s, L->src + L->i, line, col);
+        if (has_path) return make_token(TK_PATH, s, L->src + L->i);
+        TokenKind kind = classify_ident(s, (size_t)(L->src + L->i - s));
+        return make_token(kind, s, L->src + L->i);
     }
 
     die("invalid character");
-    return make_token(TK_EOF, s, s, line, col);
+    return make_token(TK_EOF, s, s);
+}
+
+// The body of an `@asm { ... }` block is passed through verbatim, so it is
+// returned as one TK_ASM_BODY token (without the closing brace) rather than
+// being tokenized.
+static Token lex_asm_body(Lexer* L) {
+    const char* s = L->src + L->i;
+    int depth = 1;
+    while (L->i < L->len) {
+        char c = L->src[L->i];
+        if (c == '{') depth++;
+        else if (c == '}' && --depth == 0) break;
+        L->i++;
+    }
+    if (depth != 0) die("unterminated @asm block");
+    const char* e = L->src + L->i;
+    L->i++;
+    return make_token(TK_ASM_BODY, s, e);
+}
+
+Token next_token(Lexer* L) {
+    if (L->asm_state == 3) {
+        L->asm_state = 0;
+        return lex_asm_body(L);
+    }
+    Token t = lex_token(L);
+    if (t.kind == TK_AT) L->asm_state = 1;
+    else if (t.kind == TK_KW_ASM && L->asm_state == 1) L->asm_state = 2;
+    else if (t.kind == TK_LBRACE && L->asm_state == 2) L->asm_state = 3;
+    else L->asm_state = 0;
+    return t;
+}
+
+static void add_line(TokenBuffer* B, size_t* cap, size_t offset) {
+    if (B->nlines == *cap) {
+        *cap *= 2;
+        B->lines = (uint32_t*)realloc(B->lines, *cap * sizeof(uint32_t));
+        if (!B->lines) die("oom");
+    }
+    B->lines[B->nlines++] = (uint32_t)offset;
+}
+
+typedef struct {
+    const char* path;
+    const TokenBuffer* buf;
+    const Lexer* lexer;
+} LexPosition;
+
+static void describe_lex_position(const void* ctx, char* buf, size_t cap) {
+    const LexPosition* p = (const LexPosition*)ctx;
+    int line, col;
+    token_buffer_position(p->buf, p->lexer->i, &line, &col);
+    snprintf(buf, cap, "%s:%d:%d: ", p->path, line, col);
+}
+
+// Newlines reach the parser only as TK_NL tokens or inside @asm bodies, so
+// those are the only tokens the line index has to look at.
+void lex_buffer(TokenBuffer* B, const char* path, const char* src, size_t len) {
+    if (len >= UINT32_MAX) die("source file too large");
+    Lexer L;
+    lexer_init(&L, src, len);
+    size_t cap = len / 4 + 16;
+    size_t lines_cap = len / 32 + 16;
+    *B = (TokenBuffer){0};
+    B->src = src;
+    B->kinds = (uint8_t*)malloc(cap);
+    B->offsets = (uint32_t*)malloc(cap * sizeof(uint32_t));
+    B->lengths = (uint32_t*)malloc(cap * sizeof(uint32_t));
+    B->lines = (uint32_t*)malloc(lines_cap * sizeof(uint32_t));
+    if (!B->kinds || !B->offsets || !B->lengths || !B->lines) die("oom");
+    B->lines[B->nlines++] = 0;
+
+    LexPosition where = {path, B, &L};
+    DieContext saved = die_set_context((DieContext){describe_lex_position, &where});
+    for (;;) {
+        if (B->count == cap) {
+            cap *= 2;
+            B->kinds = (uint8_t*)realloc(B->kinds, cap);
+            B->offsets = (uint32_t*)realloc(B->offsets, cap * sizeof(uint32_t));
+            B->lengths = (uint32_t*)realloc(B->lengths, cap * sizeof(uint32_t));
+            if (!B->kinds || !B->offsets || !B->lengths) die("oom");
+        }
+        Token t = next_token(&L);
+        size_t offset = (size_t)(t.start - src);
+        B->kinds[B->count] = (uint8_t)t.kind;
+        B->offsets[B->count] = (uint32_t)offset;
+        B->lengths[B->count] = (uint32_t)(t.end - t.start);
+        B->count++;
+        if (t.kind == TK_NL) {
+            add_line(B, &lines_cap, offset + 1);
+        } else if (t.kind == TK_ASM_BODY) {
+            const char* nl = t.start;
+            while ((nl = memchr(nl, '\n', (size_t)(t.end - nl))) != NULL) {
+                nl++;
+                add_line(B, &lines_cap, (size_t)(nl - src));
+            }
+        } else if (t.kind == TK_EOF) {
+            break;
+        }
+    }
+    die_set_context(saved);
+}
+
+void token_buffer_free(TokenBuffer* B) {
+    free(B->kinds);
+    free(B->offsets);
+    free(B->lengths);
+    free(B->lines);
+    *B = (TokenBuffer){0};
+}
+
+void token_buffer_position(const TokenBuffer* B, size_t offset, int* line, int* col) {
+    size_t lo = 0;
+    size_t hi = B->nlines;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (B->lines[mid] <= offset) lo = mid;
+        else hi = mid;
+    }
+    *line = (int)lo + 1;
+    *col = (int)(offset - B->lines[lo]) + 1;
+}
+
+void describe_stream_position(const void* ctx, char* buf, size_t cap) {
+    const StreamPosition* p = (const StreamPosition*)ctx;
+    size_t last = p->ts->pos ? p->ts->pos - 1 : 0;
+    int line, col;
+    token_buffer_position(p->ts->buf, p->ts->buf->offsets[last], &line, &col);
+    snprintf(buf, cap, "%s:%d:%d: ", p->path, line, col);
 }
 
 bool token_is(const Token* t, const char* lit) {
@@ -298,3 +459,7 @@ char* token_str(const Token* t) {
 }
 
  
+
+const char* token_intern(const Token* t) {
+    return intern(t->start, (size_t)(t->end - t->start));
+}
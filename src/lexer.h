@@ -3,6 +3,9 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+
+#include "lexer_simd.h"
 
 typedef enum {
     TK_EOF = 0,
@@ -40,32 +43,131 @@ typedef enum {
     TK_PATH,
     TK_CHAR,
     TK_PERCENT_IDENT,
+    TK_ASM_BODY,
+
+    // Keywords. Identifiers matching one of these are classified by the lexer,
+    // but every keyword still works wherever a plain name is expected.
+    TK_KW_LET,
+    TK_KW_SET,
+    TK_KW_RET,
+    TK_KW_RETURN,
+    TK_KW_PUSH,
+    TK_KW_POP,
+    TK_KW_CALL,
+    TK_KW_VOID,
+    TK_KW_END,
+    TK_KW_FUNC,
+    TK_KW_LOCAL,
+    TK_KW_GLOBAL,
+    TK_KW_INLINE,
+    TK_KW_DEF,
+    TK_KW_ENDDEF,
+    TK_KW_ASM,
+
+    TK_KW_SECTION,
+    TK_KW_MODULE,
+    TK_KW_ENDMODULE,
+    TK_KW_IMPORT,
+    TK_KW_UNS,
+
+    TK_KW_PROGRAM,
+    TK_KW_DATA,
+    TK_KW_BSS,
+    TK_KW_READONLY,
+    TK_KW_MACROS,
+
+    TK_KW_U8,
+    TK_KW_U16,
+    TK_KW_U32,
+    TK_KW_U64,
+    TK_KW_I8,
+    TK_KW_I16,
+    TK_KW_I32,
+    TK_KW_I64,
+    TK_KW_NULL,
+
+    TK_KW_RESB,
+    TK_KW_RESW,
+    TK_KW_RESD,
+    TK_KW_RESQ,
 } TokenKind;
 
+// Tokens point into the source text. Positions are not tracked while lexing;
+// token_buffer_position recovers line and column when an error needs them.
 typedef struct {
     TokenKind kind;
     const char* start;
     const char* end;
-    int line;
-    int col;
 } Token;
 
 typedef struct {
     const char* src;
     size_t len;
     size_t i;
-    int line;
-    int col;
 
     int indent_stack[128];
     int indent_top;
     bool at_line_start;
     int pending_dedents;
+    int asm_state;
+    const LexKernels* scan;
 } Lexer;
 
+// A whole file lexed into parallel arrays: one byte of kind and 32-bit
+// offset and length per token, 9 bytes instead of a 24-byte Token. The last
+// token is TK_EOF. `lines` holds the offset at which each line starts.
+typedef struct {
+    const char* src;
+    uint8_t* kinds;
+    uint32_t* offsets;
+    uint32_t* lengths;
+    size_t count;
+    uint32_t* lines;
+    size_t nlines;
+} TokenBuffer;
+
+// path is only used to prefix lexing errors. Files must be under 4 GiB.
+void lex_buffer(TokenBuffer* B, const char* path, const char* src, size_t len);
+void token_buffer_free(TokenBuffer* B);
+// 1-based line and byte column of a source offset, by binary search.
+void token_buffer_position(const TokenBuffer* B, size_t offset, int* line, int* col);
+
+static inline Token token_at(const TokenBuffer* B, size_t i) {
+    const char* s = B->src + B->offsets[i];
+    return (Token){(TokenKind)B->kinds[i], s, s + B->lengths[i]};
+}
+
+// Cursor over a token buffer. TK_EOF is returned again on every read past
+// the end.
+typedef struct {
+    const TokenBuffer* buf;
+    size_t pos;
+} TokenStream;
+
+static inline Token token_stream_next(TokenStream* ts) {
+    Token t = token_at(ts->buf, ts->pos);
+    if (ts->pos + 1 < ts->buf->count) ts->pos++;
+    return t;
+}
+
+// die() context naming the last token read from a stream, as
+// "path:line:col: "; see die_set_context.
+typedef struct {
+    const char* path;
+    const TokenStream* ts;
+} StreamPosition;
+
+void describe_stream_position(const void* ctx, char* buf, size_t cap);
+
+static inline bool token_is_name(const Token* t) {
+    return t->kind == TK_IDENT || (t->kind >= TK_KW_LET && t->kind <= TK_KW_RESQ);
+}
+
+void lexer_select_kernels(LexKernelLevel level);
 void lexer_init(Lexer* L, const char* src, size_t len);
 Token next_token(Lexer* L);
 bool token_is(const Token* t, const char* lit);
 char* token_str(const Token* t);
+const char* token_intern(const Token* t);
 
 #endif
@@ -0,0 +1,215 @@
+#include "lexer_simd.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#define LEX_HAVE_X86 1
+#include <immintrin.h>
+#endif
+
+const unsigned char lex_char_class[256] = {
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   1,   0,   0,   0,   1,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0,
+      1,   0,   0,   0,   0,  64,   0,   0,   0,   0,   0,   0,   0,   8,   8,   8,
+    124, 124, 124, 124, 124, 124, 124, 124, 124, 124,   0,   0,   0,   0,   0,   0,
+      0, 110, 110, 110, 110, 110, 110,  78,  78,  78,  78,  78,  78,  78,  78,  78,
+     78,  78,  78,  78,  78,  78,  78,  78,  78,  78,  78,   0,   0,   0,   0,  78,
+      0, 110, 110, 110, 110, 110, 110,  78,  78,  78,  78,  78,  78,  78,  78,  78,
+     78,  78,  78,  78,  78,  78,  78,  78,  78,  78,  78,   0,   0,   0,   0,   0,
+};
+
+static size_t span_space_scalar(const char* s, size_t n) {
+    size_t i = 0;
+    while (i < n && (lex_char_class[(unsigned char)s[i]] & CC_SPACE)) i++;
+    return i;
+}
+
+static size_t span_ident_scalar(const char* s, size_t n) {
+    size_t i = 0;
+    while (i < n && (lex_char_class[(unsigned char)s[i]] & CC_IDENT)) i++;
+    return i;
+}
+
+static size_t find_eol_scalar(const char* s, size_t n) {
+    const char* hit = (const char*)memchr(s, '\n', n);
+    return hit ? (size_t)(hit - s) : n;
+}
+
+static size_t find_quote_scalar(const char* s, size_t n, char quote) {
+    size_t i = 0;
+    while (i < n && s[i] != quote && s[i] != '\n') i++;
+    return i;
+}
+
+static const LexKernels kernels_scalar = {
+    span_space_scalar,
+    span_ident_scalar,
+    find_eol_scalar,
+    find_quote_scalar,
+};
+
+#ifdef LEX_HAVE_X86
+
+// Byte-wise lo <= x <= hi for ASCII bounds. Bytes >= 0x80 compare as negative
+// and therefore never match.
+static inline __m128i in_range_sse2(__m128i x, char lo, char hi) {
+    return _mm_and_si128(_mm_cmpgt_epi8(x, _mm_set1_epi8((char)(lo - 1))),
+                         _mm_cmpgt_epi8(_mm_set1_epi8((char)(hi + 1)), x));
+}
+
+static inline __m128i space_mask_sse2(__m128i x) {
+    return _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(x, _mm_set1_epi8(' ')), _mm_cmpeq_epi8(x, _mm_set1_epi8('\t'))),
+                        _mm_cmpeq_epi8(x, _mm_set1_epi8('\r')));
+}
+
+static inline __m128i ident_mask_sse2(__m128i x) {
+    __m128i lower = _mm_or_si128(x, _mm_set1_epi8(0x20));
+    return _mm_or_si128(_mm_or_si128(in_range_sse2(lower, 'a', 'z'), in_range_sse2(x, '0', '9')),
+                        _mm_cmpeq_epi8(x, _mm_set1_epi8('_')));
+}
+
+static size_t span_space_sse2(const char* s, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(s + i));
+        unsigned miss = ~(unsigned)_mm_movemask_epi8(space_mask_sse2(x)) & 0xFFFFu;
+        if (miss) return i + (size_t)__builtin_ctz(miss);
+    }
+    return i + span_space_scalar(s + i, n - i);
+}
+
+static size_t span_ident_sse2(const char* s, size_t n) {
+    size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(s + i));
+        unsigned miss = ~(unsigned)_mm_movemask_epi8(ident_mask_sse2(x)) & 0xFFFFu;
+        if (miss) return i + (size_t)__builtin_ctz(miss);
+    }
+    return i + span_ident_scalar(s + i, n - i);
+}
+
+static size_t find_eol_sse2(const char* s, size_t n) {
+    size_t i = 0;
+    __m128i nl = _mm_set1_epi8('\n');
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(s + i));
+        unsigned hit = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, nl));
+        if (hit) return i + (size_t)__builtin_ctz(hit);
+    }
+    return i + find_eol_scalar(s + i, n - i);
+}
+
+static size_t find_quote_sse2(const char* s, size_t n, char quote) {
+    size_t i = 0;
+    __m128i nl = _mm_set1_epi8('\n');
+    __m128i q = _mm_set1_epi8(quote);
+    for (; i + 16 <= n; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i*)(s + i));
+        unsigned hit = (unsigned)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(x, nl), _mm_cmpeq_epi8(x, q)));
+        if (hit) return i + (size_t)__builtin_ctz(hit);
+    }
+    return i + find_quote_scalar(s + i, n - i, quote);
+}
+
+static const LexKernels kernels_sse2 = {
+    span_space_sse2,
+    span_ident_sse2,
+    find_eol_sse2,
+    find_quote_sse2,
+};
+
+#define LEX_AVX2 __attribute__((target("avx2")))
+
+LEX_AVX2 static inline __m256i in_range_avx2(__m256i x, char lo, char hi) {
+    return _mm256_and_si256(_mm256_cmpgt_epi8(x, _mm256_set1_epi8((char)(lo - 1))),
+                            _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(hi + 1)), x));
+}
+
+LEX_AVX2 static size_t span_space_avx2(const char* s, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(s + i));
+        __m256i m = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(x, _mm256_set1_epi8(' ')),
+                                                    _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\t'))),
+                                    _mm256_cmpeq_epi8(x, _mm256_set1_epi8('\r')));
+        uint32_t miss = ~(uint32_t)_mm256_movemask_epi8(m);
+        if (miss) return i + (size_t)__builtin_ctz(miss);
+    }
+    return i + span_space_sse2(s + i, n - i);
+}
+
+LEX_AVX2 static size_t span_ident_avx2(const char* s, size_t n) {
+    size_t i = 0;
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(s + i));
+        __m256i lower = _mm256_or_si256(x, _mm256_set1_epi8(0x20));
+        __m256i m = _mm256_or_si256(_mm256_or_si256(in_range_avx2(lower, 'a', 'z'), in_range_avx2(x, '0', '9')),
+                                    _mm256_cmpeq_epi8(x, _mm256_set1_epi8('_')));
+        uint32_t miss = ~(uint32_t)_mm256_movemask_epi8(m);
+        if (miss) return i + (size_t)__builtin_ctz(miss);
+    }
+    return i + span_ident_sse2(s + i, n - i);
+}
+
+LEX_AVX2 static size_t find_eol_avx2(const char* s, size_t n) {
+    size_t i = 0;
+    __m256i nl = _mm256_set1_epi8('\n');
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(s + i));
+        uint32_t hit = (uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, nl));
+        if (hit) return i + (size_t)__builtin_ctz(hit);
+    }
+    return i + find_eol_sse2(s + i, n - i);
+}
+
+LEX_AVX2 static size_t find_quote_avx2(const char* s, size_t n, char quote) {
+    size_t i = 0;
+    __m256i nl = _mm256_set1_epi8('\n');
+    __m256i q = _mm256_set1_epi8(quote);
+    for (; i + 32 <= n; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i*)(s + i));
+        uint32_t hit = (uint32_t)_mm256_movemask_epi8(_mm256_or_si256(_mm256_cmpeq_epi8(x, nl),
+                                                                      _mm256_cmpeq_epi8(x, q)));
+        if (hit) return i + (size_t)__builtin_ctz(hit);
+    }
+    return i + find_quote_sse2(s + i, n - i, quote);
+}
+
+static const LexKernels kernels_avx2 = {
+    span_space_avx2,
+    span_ident_avx2,
+    find_eol_avx2,
+    find_quote_avx2,
+};
+
+#endif
+
+LexKernelLevel lex_kernels_best(void) {
+#ifdef LEX_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return LEX_KERNELS_AVX2;
+    if (__builtin_cpu_supports("sse2")) return LEX_KERNELS_SSE2;
+#endif
+    return LEX_KERNELS_SCALAR;
+}
+
+const LexKernels* lex_kernels_for(LexKernelLevel level) {
+#ifdef LEX_HAVE_X86
+    if (level == LEX_KERNELS_AVX2) return &kernels_avx2;
+    if (level == LEX_KERNELS_SSE2) return &kernels_sse2;
+#endif
+    (void)level;
+    return &kernels_scalar;
+}
+
+const char* lex_kernels_name(LexKernelLevel level) {
+    switch (level) {
+        case LEX_KERNELS_AVX2:
+            return "avx2";
+        case LEX_KERNELS_SSE2:
+            return "sse2";
+        default:
+            return "scalar";
+    }
+}
@@ -0,0 +1,40 @@
+#ifndef CHASMC_LEXER_SIMD_H
+#define CHASMC_LEXER_SIMD_H
+
+#include <stddef.h>
+
+// Character classes used by the lexer, indexed by unsigned byte. Only ASCII
+// letters and digits count as identifier characters.
+enum {
+    CC_SPACE = 1,        // ' ', '\t', '\r'
+    CC_IDENT_START = 2,  // [A-Za-z_]
+    CC_IDENT = 4,        // [A-Za-z0-9_]
+    CC_PATH = 8,         // [A-Za-z0-9_/.-]
+    CC_DIGIT = 16,       // [0-9]
+    CC_XDIGIT = 32,      // [0-9A-Fa-f]
+    CC_PERCENT = 64,     // [A-Za-z0-9_%]
+};
+
+extern const unsigned char lex_char_class[256];
+
+typedef enum {
+    LEX_KERNELS_SCALAR,
+    LEX_KERNELS_SSE2,
+    LEX_KERNELS_AVX2,
+} LexKernelLevel;
+
+// Bulk scanners for the lexer's inner loops. Each returns a byte count from
+// `s`, never more than `n`; none of the runs they measure contain a newline,
+// so callers can advance the column by the returned count.
+typedef struct {
+    size_t (*span_space)(const char* s, size_t n);
+    size_t (*span_ident)(const char* s, size_t n);
+    size_t (*find_eol)(const char* s, size_t n);
+    size_t (*find_quote)(const char* s, size_t n, char quote);
+} LexKernels;
+
+LexKernelLevel lex_kernels_best(void);
+const LexKernels* lex_kernels_for(LexKernelLevel level);
+const char* lex_kernels_name(LexKernelLevel level);
+
+#endif
@@ -0,0 +1,237 @@
+#include "objfile.h"
+
+#include <elf.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+static const char* const section_name[OBJ_NSECTIONS] = {".text", ".data", ".rodata", ".bss"};
+static const char* const rela_name[OBJ_NSECTIONS] = {".rela.text", ".rela.data", ".rela.rodata", ".rela.bss"};
+// Same flags and alignment nasm gives its default sections.
+static const uint64_t section_flags[OBJ_NSECTIONS] = {
+    SHF_ALLOC | SHF_EXECINSTR,
+    SHF_ALLOC | SHF_WRITE,
+    SHF_ALLOC,
+    SHF_ALLOC | SHF_WRITE,
+};
+static const uint64_t section_align[OBJ_NSECTIONS] = {16, 4, 4, 4};
+
+const char* obj_section_name(int section) { return section_name[section]; }
+
+uint64_t obj_section_align(int section) { return section_align[section]; }
+
+size_t obj_symbol(ObjFile* obj, const char* name) {
+    size_t* idx = name_map_find(&obj->sym_index, name);
+    if (idx) return *idx;
+    if (obj->nsyms == obj->syms_cap) {
+        obj->syms_cap = obj->syms_cap ? obj->syms_cap * 2 : 64;
+        obj->syms = (ObjSymbol*)realloc(obj->syms, obj->syms_cap * sizeof(ObjSymbol));
+        if (!obj->syms) die("oom");
+    }
+    obj->syms[obj->nsyms] = (ObjSymbol){.name = name, .section = -1};
+    name_map_put(&obj->sym_index, name, obj->nsyms);
+    return obj->nsyms++;
+}
+
+ObjSymbol* obj_find_symbol(const ObjFile* obj, const char* name) {
+    size_t* idx = name_map_find(&obj->sym_index, name);
+    return idx ? &obj->syms[*idx] : NULL;
+}
+
+void obj_add_reloc(ObjFile* obj, ObjReloc reloc) {
+    if (obj->nrelocs == obj->relocs_cap) {
+        obj->relocs_cap = obj->relocs_cap ? obj->relocs_cap * 2 : 64;
+        obj->relocs = (ObjReloc*)realloc(obj->relocs, obj->relocs_cap * sizeof(ObjReloc));
+        if (!obj->relocs) die("oom");
+    }
+    obj->relocs[obj->nrelocs++] = reloc;
+}
+
+void obj_free(ObjFile* obj) {
+    for (int i = 0; i < OBJ_NSECTIONS; i++) out_free(&obj->sections[i].data);
+    free(obj->syms);
+    free(obj->relocs);
+    name_map_free(&obj->sym_index);
+    *obj = (ObjFile){0};
+}
+
+static void pad_to(Out* out, size_t align) {
+    static const char zeros[16];
+    size_t rem = out->len % align;
+    if (rem) out_mem(out, zeros, align - rem);
+}
+
+static uint32_t add_string(Out* strtab, const char* s) {
+    uint32_t off = (uint32_t)strtab->len;
+    out_mem(strtab, s, strlen(s) + 1);
+    return off;
+}
+
+static bool symbol_is_global(const ObjSymbol* sym) { return sym->global || sym->is_extern; }
+
+void obj_write_elf(const ObjFile* obj, Out* out) {
+    // Section header indices: null, the used content sections, one .rela per
+    // content section with relocations, then the symbol and string tables.
+    int shndx[OBJ_NSECTIONS];
+    int rela_shndx[OBJ_NSECTIONS];
+    size_t rela_count[OBJ_NSECTIONS] = {0};
+    for (size_t i = 0; i < obj->nrelocs; i++) rela_count[obj->relocs[i].section]++;
+    int nsh = 1;
+    for (int s = 0; s < OBJ_NSECTIONS; s++) {
+        bool used = obj->sections[s].used || obj->sections[s].size > 0 || rela_count[s] > 0;
+        shndx[s] = used ? nsh++ : 0;
+    }
+    for (int s = 0; s < OBJ_NSECTIONS; s++) rela_shndx[s] = rela_count[s] ? nsh++ : 0;
+    int symtab_shndx = nsh++;
+    int strtab_shndx = nsh++;
+    int shstrtab_shndx = nsh++;
+
+    // Symbol table: section symbols and locals first, as ELF requires, then
+    // globals and externs. Relocations against locals go through their
+    // section symbol, the way nasm emits them.
+    Out strtab = {0};
+    out_char(&strtab, 0);
+    Out symtab = {0};
+    Elf64_Sym null_sym = {0};
+    out_mem(&symtab, (const char*)&null_sym, sizeof(null_sym));
+    uint32_t nsym = 1;
+    uint32_t section_sym[OBJ_NSECTIONS] = {0};
+    for (int s = 0; s < OBJ_NSECTIONS; s++) {
+        if (!shndx[s]) continue;
+        Elf64_Sym sym = {0};
+        sym.st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+        sym.st_shndx = (uint16_t)shndx[s];
+        out_mem(&symtab, (const char*)&sym, sizeof(sym));
+        section_sym[s] = nsym++;
+    }
+    uint32_t* elf_index = (uint32_t*)calloc(obj->nsyms ? obj->nsyms : 1, sizeof(uint32_t));
+    if (!elf_index) die("oom");
+    uint32_t nlocal = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        for (size_t i = 0; i < obj->nsyms; i++) {
+            const ObjSymbol* s = &obj->syms[i];
+            if (symbol_is_global(s) != (pass == 1)) continue;
+            if (s->section < 0 && !s->is_extern) continue;
+            Elf64_Sym sym = {0};
+            sym.st_name = add_string(&strtab, s->name);
+            sym.st_info = ELF64_ST_INFO(pass ? STB_GLOBAL : STB_LOCAL, STT_NOTYPE);
+            sym.st_shndx = (s->section < 0) ? SHN_UNDEF : (uint16_t)shndx[s->section];
+            sym.st_value = (s->section < 0) ? 0 : s->value;
+            out_mem(&symtab, (const char*)&sym, sizeof(sym));
+            elf_index[i] = nsym++;
+        }
+        if (pass == 0) nlocal = nsym;
+    }
+
+    Out rela[OBJ_NSECTIONS] = {{0}};
+    for (size_t i = 0; i < obj->nrelocs; i++) {
+        const ObjReloc* r = &obj->relocs[i];
+        const ObjSymbol* target = &obj->syms[r->symbol];
+        uint32_t sym_idx = elf_index[r->symbol];
+        int64_t addend = r->addend;
+        if (!symbol_is_global(target)) {
+            sym_idx = section_sym[target->section];
+            addend += (int64_t)target->value;
+        }
+        uint32_t type = R_X86_64_PC32;
+        if (r->kind == OBJ_RELOC_ABS32) type = R_X86_64_32;
+        if (r->kind == OBJ_RELOC_ABS64) type = R_X86_64_64;
+        Elf64_Rela rel = {0};
+        rel.r_offset = r->offset;
+        rel.r_info = ELF64_R_INFO(sym_idx, type);
+        rel.r_addend = addend;
+        out_mem(&rela[r->section], (const char*)&rel, sizeof(rel));
+    }
+    free(elf_index);
+
+    Out shstrtab = {0};
+    out_char(&shstrtab, 0);
+    Elf64_Shdr* sh = (Elf64_Shdr*)calloc((size_t)nsh, sizeof(Elf64_Shdr));
+    if (!sh) die("oom");
+
+    out->len = 0;
+    Elf64_Ehdr eh = {0};
+    out_mem(out, (const char*)&eh, sizeof(eh));
+    for (int s = 0; s < OBJ_NSECTIONS; s++) {
+        if (!shndx[s]) continue;
+        const ObjSection* sec = &obj->sections[s];
+        Elf64_Shdr* h = &sh[shndx[s]];
+        pad_to(out, section_align[s]);
+        h->sh_name = add_string(&shstrtab, section_name[s]);
+        h->sh_type = (s == OBJ_BSS) ? SHT_NOBITS : SHT_PROGBITS;
+        h->sh_flags = section_flags[s];
+        h->sh_offset = out->len;
+        h->sh_size = sec->size;
+        h->sh_addralign = section_align[s];
+        if (s != OBJ_BSS) out_mem(out, sec->data.data, sec->data.len);
+    }
+    for (int s = 0; s < OBJ_NSECTIONS; s++) {
+        if (!rela_shndx[s]) continue;
+        Elf64_Shdr* h = &sh[rela_shndx[s]];
+        pad_to(out, 8);
+        h->sh_name = add_string(&shstrtab, rela_name[s]);
+        h->sh_type = SHT_RELA;
+        h->sh_flags = SHF_INFO_LINK;
+        h->sh_offset = out->len;
+        h->sh_size = rela[s].len;
+        h->sh_link = (uint32_t)symtab_shndx;
+        h->sh_info = (uint32_t)shndx[s];
+        h->sh_addralign = 8;
+        h->sh_entsize = sizeof(Elf64_Rela);
+        out_mem(out, rela[s].data, rela[s].len);
+        out_free(&rela[s]);
+    }
+
+    pad_to(out, 8);
+    Elf64_Shdr* h = &sh[symtab_shndx];
+    h->sh_name = add_string(&shstrtab, ".symtab");
+    h->sh_type = SHT_SYMTAB;
+    h->sh_offset = out->len;
+    h->sh_size = symtab.len;
+    h->sh_link = (uint32_t)strtab_shndx;
+    h->sh_info = nlocal;
+    h->sh_addralign = 8;
+    h->sh_entsize = sizeof(Elf64_Sym);
+    out_mem(out, symtab.data, symtab.len);
+
+    h = &sh[strtab_shndx];
+    h->sh_name = add_string(&shstrtab, ".strtab");
+    h->sh_type = SHT_STRTAB;
+    h->sh_offset = out->len;
+    h->sh_size = strtab.len;
+    h->sh_addralign = 1;
+    out_mem(out, strtab.data, strtab.len);
+
+    h = &sh[shstrtab_shndx];
+    h->sh_name = add_string(&shstrtab, ".shstrtab");
+    h->sh_type = SHT_STRTAB;
+    h->sh_offset = out->len;
+    h->sh_size = shstrtab.len;
+    h->sh_addralign = 1;
+    out_mem(out, shstrtab.data, shstrtab.len);
+
+    pad_to(out, 8);
+    uint64_t shoff = out->len;
+    out_mem(out, (const char*)sh, (size_t)nsh * sizeof(Elf64_Shdr));
+
+    Elf64_Ehdr* ehdr = (Elf64_Ehdr*)out->data;
+    memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+    ehdr->e_ident[EI_CLASS] = ELFCLASS64;
+    ehdr->e_ident[EI_DATA] = ELFDATA2LSB;
+    ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+    ehdr->e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    ehdr->e_type = ET_REL;
+    ehdr->e_machine = EM_X86_64;
+    ehdr->e_version = EV_CURRENT;
+    ehdr->e_shoff = shoff;
+    ehdr->e_ehsize = sizeof(Elf64_Ehdr);
+    ehdr->e_shentsize = sizeof(Elf64_Shdr);
+    ehdr->e_shnum = (uint16_t)nsh;
+    ehdr->e_shstrndx = (uint16_t)shstrtab_shndx;
+
+    free(sh);
+    out_free(&symtab);
+    out_free(&strtab);
+    out_free(&shstrtab);
+}
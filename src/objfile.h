@@ -0,0 +1,71 @@
+#ifndef CHASMC_OBJFILE_H
+#define CHASMC_OBJFILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "emit.h"
+#include "intern.h"
+
+// In-memory relocatable object: the four sections chasmc emits, a symbol
+// table and relocations. Produced by the built-in assembler (x86_asm.h) and
+// serialised as an ELF64 relocatable file by obj_write_elf.
+typedef enum {
+    OBJ_TEXT,
+    OBJ_DATA,
+    OBJ_RODATA,
+    OBJ_BSS,
+    OBJ_NSECTIONS,
+} ObjSectionId;
+
+typedef struct {
+    Out data;       // contents; always empty for .bss
+    uint64_t size;  // equals data.len except for .bss
+    bool used;      // declared or written to; unused sections are not emitted
+} ObjSection;
+
+typedef struct {
+    const char* name;  // interned
+    int section;       // ObjSectionId, or -1 while undefined
+    uint64_t value;
+    bool global;       // named in a global directive
+    bool is_extern;    // named in an extern directive
+} ObjSymbol;
+
+typedef enum {
+    OBJ_RELOC_PC32,   // R_X86_64_PC32
+    OBJ_RELOC_ABS32,  // R_X86_64_32
+    OBJ_RELOC_ABS64,  // R_X86_64_64
+} ObjRelocKind;
+
+typedef struct {
+    int section;  // section being patched
+    uint64_t offset;
+    size_t symbol;  // index into ObjFile.syms
+    ObjRelocKind kind;
+    int64_t addend;
+} ObjReloc;
+
+typedef struct {
+    ObjSection sections[OBJ_NSECTIONS];
+    ObjSymbol* syms;
+    size_t nsyms;
+    size_t syms_cap;
+    NameMap sym_index;
+    ObjReloc* relocs;
+    size_t nrelocs;
+    size_t relocs_cap;
+} ObjFile;
+
+const char* obj_section_name(int section);
+uint64_t obj_section_align(int section);
+
+// Returns the index of the symbol called `name`, creating it undefined.
+size_t obj_symbol(ObjFile* obj, const char* name);
+ObjSymbol* obj_find_symbol(const ObjFile* obj, const char* name);
+void obj_add_reloc(ObjFile* obj, ObjReloc reloc);
+void obj_write_elf(const ObjFile* obj, Out* out);
+void obj_free(ObjFile* obj);
+
+#endif
@@ -0,0 +1,431 @@
+#include "peephole.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "timing.h"
+
+typedef struct {
+    const char* s;
+    size_t n;
+} Span;
+
+// "    mnemonic a, b", split up.
+typedef struct {
+    Span mn;
+    Span op[2];
+    int nops;
+} Insn;
+
+enum { RAX, RBX, NREGS = 16 };
+
+// By family, then by size: 8, 4, 2, 1 bytes.
+static const char* const reg_names[NREGS][4] = {
+    {"rax", "eax", "ax", "al"},     {"rbx", "ebx", "bx", "bl"},     {"rcx", "ecx", "cx", "cl"},
+    {"rdx", "edx", "dx", "dl"},     {"rsi", "esi", "si", "sil"},    {"rdi", "edi", "di", "dil"},
+    {"rbp", "ebp", "bp", "bpl"},    {"rsp", "esp", "sp", "spl"},    {"r8", "r8d", "r8w", "r8b"},
+    {"r9", "r9d", "r9w", "r9b"},    {"r10", "r10d", "r10w", "r10b"}, {"r11", "r11d", "r11w", "r11b"},
+    {"r12", "r12d", "r12w", "r12b"}, {"r13", "r13d", "r13w", "r13b"}, {"r14", "r14d", "r14w", "r14b"},
+    {"r15", "r15d", "r15w", "r15b"},
+};
+static const char* const size_keyword[4] = {"qword", "dword", "word", "byte"};
+
+static int size_index(int size) { return size == 8 ? 0 : size == 4 ? 1 : size == 2 ? 2 : 3; }
+
+static bool is(Span a, const char* s) { return a.n == strlen(s) && memcmp(a.s, s, a.n) == 0; }
+static bool same(Span a, Span b) { return a.n == b.n && memcmp(a.s, b.s, a.n) == 0; }
+
+static Span span(const char* s) { return (Span){s, strlen(s)}; }
+static Span reg(int family, int size) { return span(reg_names[family][size_index(size)]); }
+
+// rax to rsp in reg_names order, by the two letters they share.
+static int legacy_family(char a, char b) {
+    static const char pairs[8][2] = {{'a', 'x'}, {'b', 'x'}, {'c', 'x'}, {'d', 'x'},
+                                     {'s', 'i'}, {'d', 'i'}, {'b', 'p'}, {'s', 'p'}};
+    for (int r = 0; r < 8; r++) {
+        if (pairs[r][0] == a && pairs[r][1] == b) return r;
+    }
+    return -1;
+}
+
+// Family of a register operand, with its size in bytes; -1 otherwise. Runs
+// on every identifier the pass looks at, so it decodes instead of searching
+// reg_names.
+static int reg_of(Span op, int* size) {
+    const char* s = op.s;
+    size_t n = op.n;
+    if (n < 2 || n > 4) return -1;
+    if (s[0] == 'r' && s[1] >= '1' && s[1] <= '9') {
+        int num = 0;
+        size_t i = 1;
+        while (i < n && s[i] >= '0' && s[i] <= '9') num = num * 10 + (s[i++] - '0');
+        if (num < 8 || num >= NREGS) return -1;
+        if (i == n) *size = 8;
+        else if (i + 1 == n && (s[i] == 'd' || s[i] == 'w' || s[i] == 'b')) *size = s[i] == 'd' ? 4 : s[i] == 'w' ? 2 : 1;
+        else return -1;
+        return num;
+    }
+    int r;
+    if (n == 3 && (s[0] == 'r' || s[0] == 'e') && (r = legacy_family(s[1], s[2])) >= 0) {
+        *size = s[0] == 'r' ? 8 : 4;
+        return r;
+    }
+    if (n == 2 && s[1] == 'l' && s[0] >= 'a' && s[0] <= 'd') {
+        *size = 1;
+        return s[0] - 'a';
+    }
+    if (n == 2 && (r = legacy_family(s[0], s[1])) >= 0) {
+        *size = 2;
+        return r;
+    }
+    if (n == 3 && s[2] == 'l' && (r = legacy_family(s[0], s[1])) >= 4) {
+        *size = 1;
+        return r;
+    }
+    return -1;
+}
+
+static bool ident_char(char c) { return (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_'; }
+
+// Whether any part of an operand, such as an address, names the register.
+static bool mentions(Span op, int family) {
+    size_t i = 0;
+    while (i < op.n) {
+        if (!ident_char(op.s[i])) {
+            i++;
+            continue;
+        }
+        size_t start = i;
+        while (i < op.n && ident_char(op.s[i])) i++;
+        int sz;
+        if ((start == 0 || op.s[start - 1] != '.') && reg_of((Span){op.s + start, i - start}, &sz) == family) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// "byte [..]" and the like: the size, and the address after the keyword.
+static int mem_size(Span op, Span* addr) {
+    for (int k = 0; k < 4; k++) {
+        size_t n = strlen(size_keyword[k]);
+        if (op.n > n + 1 && memcmp(op.s, size_keyword[k], n) == 0 && op.s[n] == ' ' && op.s[n + 1] == '[') {
+            *addr = (Span){op.s + n + 1, op.n - n - 1};
+            return 8 >> k;
+        }
+    }
+    return 0;
+}
+
+// A source add and sub take with a 64-bit destination: a register, a qword
+// in memory, or a signed 32-bit immediate.
+static bool plain_source(Span op) {
+    int sz;
+    Span addr;
+    if (reg_of(op, &sz) >= 0) return sz == 8;
+    int msz = mem_size(op, &addr);
+    if (msz) return msz == 8;
+    size_t i = op.n && op.s[0] == '-';
+    if (i == op.n || op.n - i > 10) return false;
+    uint64_t v = 0;
+    for (; i < op.n; i++) {
+        if (op.s[i] < '0' || op.s[i] > '9') return false;
+        v = v * 10 + (uint64_t)(op.s[i] - '0');
+    }
+    return v <= (op.s[0] == '-' ? (uint64_t)INT32_MAX + 1 : (uint64_t)INT32_MAX);
+}
+
+static Span trim(const char* s, const char* e) {
+    while (s < e && *s == ' ') s++;
+    while (e > s && e[-1] == ' ') e--;
+    return (Span){s, (size_t)(e - s)};
+}
+
+static bool parse(const PeepLine* L, Insn* I) {
+    if (L->barrier || L->deleted || L->len < 5 || memcmp(L->text, "    ", 4) != 0 || L->text[4] == ' ') return false;
+    const char* s = L->text + 4;
+    const char* e = L->text + L->len;
+    const char* m = s;
+    while (m < e && *m != ' ') m++;
+    I->mn = (Span){s, (size_t)(m - s)};
+    I->nops = 0;
+    for (const char* p = m; p < e;) {
+        const char* comma = (const char*)memchr(p, ',', (size_t)(e - p));
+        if (!comma) comma = e;
+        if (I->nops == 2 || memchr(p, ';', (size_t)(comma - p))) return false;
+        I->op[I->nops++] = trim(p, comma);
+        p = comma < e ? comma + 1 : e;
+    }
+    return true;
+}
+
+static void set_line(PeepLine* L, Arena* arena, const char* mn, Span a, Span b) {
+    size_t mn_len = strlen(mn);
+    size_t len = 4 + mn_len + 1 + a.n + (b.n ? 2 + b.n : 0);
+    char* t = (char*)arena_alloc(arena, len);
+    char* p = t;
+    memcpy(p, "    ", 4);
+    p += 4;
+    memcpy(p, mn, mn_len);
+    p += mn_len;
+    *p++ = ' ';
+    memcpy(p, a.s, a.n);
+    p += a.n;
+    if (b.n) {
+        memcpy(p, ", ", 2);
+        memcpy(p + 2, b.s, b.n);
+    }
+    L->text = t;
+    L->len = len;
+}
+
+static size_t next_line(const PeepLine* lines, size_t count, size_t i) {
+    do i++;
+    while (i < count && lines[i].deleted);
+    return i;
+}
+
+// The next `n` lines after i as instructions; false at a barrier or the end.
+static bool window(const PeepLine* lines, size_t count, size_t i, Insn* out, size_t* at, int n) {
+    for (int k = 0; k < n; k++) {
+        i = next_line(lines, count, i);
+        if (i >= count || !parse(&lines[i], &out[k])) return false;
+        at[k] = i;
+    }
+    return true;
+}
+
+// Whether the value in a register family may still be read after line i.
+// Only an overwrite that reads nothing of it, a few lines ahead, proves it
+// dead; calls count as reads of everything but rax, since the argument
+// registers and callee-saved ones are not tracked. At the function's exit
+// rbx counts as dead: it is the emitter's scratch register, and a rewrite
+// only ever drops writes to it, so no caller sees more of it clobbered.
+static bool live_after(const PeepLine* lines, size_t count, size_t i, int family) {
+    int budget = 16;
+    for (i = next_line(lines, count, i); i < count && budget-- > 0; i = next_line(lines, count, i)) {
+        Insn I;
+        if (!parse(&lines[i], &I)) return true;
+        if (is(I.mn, "call")) return family != RAX;
+        if (is(I.mn, "leave") || is(I.mn, "ret")) return family != RBX;
+        bool known = is(I.mn, "mov") || is(I.mn, "movzx") || is(I.mn, "movsx") || is(I.mn, "movsxd") || is(I.mn, "lea")
+                     || is(I.mn, "add") || is(I.mn, "sub") || is(I.mn, "xor") || is(I.mn, "neg") || is(I.mn, "push")
+                     || is(I.mn, "pop");
+        if (!known) return true;
+        int sz;
+        bool overwrites = false;
+        if (I.nops == 2 && (is(I.mn, "mov") || is(I.mn, "movzx") || is(I.mn, "movsx") || is(I.mn, "movsxd")
+                            || is(I.mn, "lea") || (is(I.mn, "xor") && same(I.op[0], I.op[1])))) {
+            overwrites = reg_of(I.op[0], &sz) == family && sz >= 4;
+        } else if (I.nops == 1 && is(I.mn, "pop")) {
+            overwrites = reg_of(I.op[0], &sz) == family && sz == 8;
+        }
+        if (overwrites && is(I.mn, "xor")) return false;
+        for (int k = 0; k < I.nops; k++) {
+            if (k == 0 && overwrites) continue;
+            if (mentions(I.op[k], family)) return true;
+        }
+        if (overwrites) return false;
+    }
+    return true;
+}
+
+// A narrow value, from memory or from part of rax, extended into a register:
+// its width in bytes and whether it is signed.
+typedef struct {
+    int width;
+    bool sign;
+    Span dst;
+    Span src;
+} Extend;
+
+static bool extension(const Insn* I, Extend* X) {
+    if (I->nops != 2) return false;
+    int dsz;
+    int ssz;
+    Span addr;
+    if (reg_of(I->op[0], &dsz) < 0) return false;
+    int src_family = reg_of(I->op[1], &ssz);
+    if (src_family < 0) {
+        ssz = mem_size(I->op[1], &addr);
+        if (!ssz) return false;
+    } else if (src_family != RAX) {
+        return false;
+    }
+    X->dst = I->op[0];
+    X->src = I->op[1];
+    X->width = ssz;
+    if (is(I->mn, "movsx") || is(I->mn, "movsxd")) {
+        X->sign = true;
+        return dsz == 8 && ssz < 8 && (ssz == 4) == is(I->mn, "movsxd");
+    }
+    X->sign = false;
+    if (is(I->mn, "movzx")) return dsz >= 4 && ssz <= 2;
+    return is(I->mn, "mov") && dsz == 4 && ssz == 4;
+}
+
+// The same extension, of the part of rax it stored, into rax itself.
+static void extend_rax(PeepLine* L, Arena* arena, const Extend* X) {
+    Span part = reg(RAX, X->width);
+    if (!X->sign) set_line(L, arena, X->width == 4 ? "mov" : "movzx", span("eax"), part);
+    else set_line(L, arena, X->width == 4 ? "movsxd" : "movsx", span("rax"), part);
+}
+
+static bool rewrite(PeepLine* lines, size_t count, size_t i, Arena* arena) {
+    PeepLine* L = &lines[i];
+    Insn I;
+    if (!parse(L, &I)) return false;
+    int sz;
+    int fam = I.nops >= 1 ? reg_of(I.op[0], &sz) : -1;
+
+    // mov r, 0 -> xor r32, r32, which also covers the 64-bit register.
+    if (fam >= 0 && sz >= 4 && I.nops == 2
+        && ((is(I.mn, "mov") && is(I.op[1], "0")) || (is(I.mn, "xor") && sz == 8 && same(I.op[0], I.op[1])))) {
+        set_line(L, arena, "xor", reg(fam, 4), reg(fam, 4));
+        timing_count(COUNT_PEEP_ZERO_IDIOMS, 1);
+        return true;
+    }
+    // Only the 64-bit form: mov eax, eax clears the upper half.
+    if (is(I.mn, "mov") && I.nops == 2 && fam >= 0 && sz == 8 && same(I.op[0], I.op[1])) {
+        L->deleted = true;
+        timing_count(COUNT_PEEP_MOVES, 1);
+        return true;
+    }
+
+    Insn W[3];
+    size_t at[3];
+    if (!window(lines, count, i, W, at, 1)) return false;
+    Insn* J = &W[0];
+    PeepLine* JL = &lines[at[0]];
+    int jsz;
+    int jfam = J->nops >= 1 ? reg_of(J->op[0], &jsz) : -1;
+
+    if (is(I.mn, "mov") && I.nops == 2 && is(J->mn, "mov") && J->nops == 2) {
+        // A copy straight back: mov a, b; mov b, a.
+        int ssz;
+        if (fam >= 0 && sz == 8 && reg_of(I.op[1], &ssz) >= 0 && ssz == 8 && same(I.op[0], J->op[1])
+            && same(I.op[1], J->op[0])) {
+            JL->deleted = true;
+            timing_count(COUNT_PEEP_MOVES, 1);
+            return true;
+        }
+        // A value passed through rax on its way elsewhere.
+        if (fam == RAX && sz == 8 && !mentions(I.op[1], RAX) && jfam > RAX && jsz == 8 && is(J->op[1], "rax")
+            && !live_after(lines, count, at[0], RAX)) {
+            set_line(L, arena, "mov", J->op[0], I.op[1]);
+            JL->deleted = true;
+            timing_count(COUNT_PEEP_MOVES, 1);
+            return true;
+        }
+    }
+    if (is(I.mn, "xor") && is(I.op[0], "eax") && is(I.op[1], "eax") && J->nops == 2) {
+        int ssz;
+        Span addr;
+        if (is(J->mn, "mov") && jfam > RAX && jsz == 8 && is(J->op[1], "rax")
+            && !live_after(lines, count, at[0], RAX)) {
+            set_line(L, arena, "xor", reg(jfam, 4), reg(jfam, 4));
+            JL->deleted = true;
+            timing_count(COUNT_PEEP_MOVES, 1);
+            return true;
+        }
+        // A zero stored to memory needs no register.
+        if (is(J->mn, "mov") && mem_size(J->op[0], &addr) && reg_of(J->op[1], &ssz) == RAX
+            && ssz == mem_size(J->op[0], &addr) && !live_after(lines, count, at[0], RAX)) {
+            set_line(JL, arena, "mov", J->op[0], span("0"));
+            L->deleted = true;
+            timing_count(COUNT_PEEP_ZERO_STORES, 1);
+            return true;
+        }
+    }
+
+    // A store, and the load of the same place right after it: the value is
+    // still in rax. A narrow load extends what was stored, in rax.
+    Span store_addr;
+    Span load_addr;
+    int ssz;
+    int store_size = is(I.mn, "mov") && I.nops == 2 ? mem_size(I.op[0], &store_addr) : 0;
+    if (store_size && reg_of(I.op[1], &ssz) == RAX && ssz == store_size && jfam == RAX && jsz == 8 && J->nops == 2
+        && mem_size(J->op[1], &load_addr) == store_size && same(store_addr, load_addr)) {
+        Extend X = {store_size, !is(J->mn, "movzx"), J->op[0], J->op[1]};
+        if (is(J->mn, "mov") && store_size == 8) JL->deleted = true;
+        else if (is(J->mn, "movzx") || is(J->mn, "movsx") || is(J->mn, "movsxd")) extend_rax(JL, arena, &X);
+        else return false;
+        timing_count(COUNT_PEEP_STORE_LOADS, 1);
+        return true;
+    }
+    // An extension into a register, then a copy of it back to rax: rax can
+    // extend its own low part instead.
+    Extend X;
+    Extend Y;
+    if (extension(&I, &X) && reg_of(X.src, &ssz) == RAX && fam > RAX && is(J->mn, "mov") && J->nops == 2
+        && is(J->op[0], "rax") && same(J->op[1], reg(fam, 8))) {
+        extend_rax(JL, arena, &X);
+        timing_count(COUNT_PEEP_MOVES, 1);
+        return true;
+    }
+
+    // Extending what is already extended, maybe with stores of it in between:
+    // zero-extended bits stay zero, and a sign-extended value keeps its sign,
+    // at any larger width.
+    if (extension(&I, &X) && fam == RAX) {
+        Insn K = *J;
+        size_t k = at[0];
+        for (int skipped = 0; skipped < 4 && is(K.mn, "mov") && K.nops == 2 && mem_size(K.op[0], &store_addr)
+                              && reg_of(K.op[1], &ssz) >= 0;
+             skipped++) {
+            Insn next;
+            size_t next_at;
+            if (!window(lines, count, k, &next, &next_at, 1)) break;
+            K = next;
+            k = next_at;
+        }
+        int ksz;
+        int kfam = K.nops == 2 ? reg_of(K.op[0], &ksz) : -1;
+        if (extension(&K, &Y) && reg_of(Y.src, &ssz) == RAX) {
+            bool copy = Y.sign ? X.width < Y.width || (X.sign && X.width == Y.width) : !X.sign && X.width <= Y.width;
+            if (copy) {
+                if (kfam == RAX) lines[k].deleted = true;
+                else set_line(&lines[k], arena, "mov", reg(kfam, 8), span("rax"));
+                timing_count(COUNT_PEEP_EXTENSIONS, 1);
+                return true;
+            }
+        }
+    }
+
+    // An operand parked in rbx while the other one is loaded into rax, then
+    // combined: mov rbx, a; mov rax, b; add rax, rbx -> mov rax, a; add rax, b,
+    // and the same for sub, which ends in sub rbx, rax; mov rax, rbx.
+    if (is(I.mn, "mov") && I.nops == 2 && fam == RBX && sz == 8 && !mentions(I.op[1], RBX)
+        && (is(I.op[1], "rax") || !mentions(I.op[1], RAX)) && is(J->mn, "mov") && J->nops == 2
+        && is(J->op[0], "rax") && plain_source(J->op[1]) && !mentions(J->op[1], RAX) && !mentions(J->op[1], RBX)
+        && window(lines, count, at[0], &W[1], &at[1], 1)) {
+        Insn* K = &W[1];
+        bool add = is(K->mn, "add") && is(K->op[0], "rax") && is(K->op[1], "rbx");
+        bool sub = is(K->mn, "sub") && is(K->op[0], "rbx") && is(K->op[1], "rax")
+                   && window(lines, count, at[1], &W[2], &at[2], 1) && is(W[2].mn, "mov") && is(W[2].op[0], "rax")
+                   && is(W[2].op[1], "rbx");
+        size_t last = sub ? at[2] : at[1];
+        if ((add || sub) && !live_after(lines, count, last, RBX)) {
+            if (is(I.op[1], "rax")) L->deleted = true;
+            else set_line(L, arena, "mov", span("rax"), I.op[1]);
+            JL->deleted = true;
+            if (sub) lines[at[1]].deleted = true;
+            set_line(&lines[last], arena, add ? "add" : "sub", span("rax"), J->op[1]);
+            timing_count(COUNT_PEEP_OPERANDS, 1);
+            return true;
+        }
+    }
+    return false;
+}
+
+void peephole(PeepLine* lines, size_t count, Arena* arena) {
+    // One rewrite often exposes another; a few passes catch nearly all.
+    bool changed = true;
+    for (int pass = 0; pass < 4 && changed; pass++) {
+        changed = false;
+        for (size_t i = 0; i < count; i++) {
+            if (lines[i].deleted) continue;
+            while (!lines[i].deleted && rewrite(lines, count, i, arena)) changed = true;
+        }
+    }
+}
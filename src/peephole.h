@@ -0,0 +1,29 @@
+#ifndef CHASMC_PEEPHOLE_H
+#define CHASMC_PEEPHOLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "arena.h"
+
+// One line of a function's assembly, for the -O1 peephole pass.
+typedef struct {
+    const char* text;  // without its newline
+    size_t len;
+    // Labels, directives, @asm text and macro uses: never rewritten, and no
+    // pattern is matched across one.
+    bool barrier;
+    bool deleted;
+} PeepLine;
+
+// Rewrites a function's instructions through a window of a few lines:
+// moves through rax and reg-to-reg copies that undo each other, a store
+// followed by a load of the same place, operands parked in rbx only to be
+// added or subtracted back, `mov reg, 0`, zero stores, and extensions of an
+// already extended value. A register is only assumed dead when a later
+// instruction in the window overwrites it unread, or, for rbx, at the
+// function's exit. Replacement text lives in `arena`. Each rewrite is
+// counted by pattern (see timing.h).
+void peephole(PeepLine* lines, size_t count, Arena* arena);
+
+#endif
@@ -0,0 +1,87 @@
+#include "pool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "util.h"
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t* tasks;
+    size_t top;     // oldest task; thieves take from here
+    size_t bottom;  // one past the newest; the owner takes from here
+} Deque;
+
+typedef struct {
+    Deque* deques;
+    size_t nworkers;
+    void (*task)(size_t i, void* ctx);
+    void* ctx;
+} Pool;
+
+typedef struct {
+    Pool* pool;
+    size_t self;
+} Worker;
+
+static bool take(Deque* d, bool own, size_t* task) {
+    pthread_mutex_lock(&d->lock);
+    bool found = d->bottom > d->top;
+    if (found) *task = own ? d->tasks[--d->bottom] : d->tasks[d->top++];
+    pthread_mutex_unlock(&d->lock);
+    return found;
+}
+
+// Tasks never submit more tasks, so a worker that finds every deque empty
+// is done.
+static void* work(void* arg) {
+    Worker* w = (Worker*)arg;
+    Pool* p = w->pool;
+    for (;;) {
+        size_t task;
+        bool found = take(&p->deques[w->self], true, &task);
+        for (size_t k = 1; k < p->nworkers && !found; k++) {
+            found = take(&p->deques[(w->self + k) % p->nworkers], false, &task);
+        }
+        if (!found) return NULL;
+        p->task(task, p->ctx);
+    }
+}
+
+void pool_run(size_t count, int workers, void (*task)(size_t i, void* ctx), void* ctx) {
+    size_t n = (workers > 1) ? (size_t)workers : 1;
+    if (n > count) n = count;
+    if (n == 0) return;
+
+    Pool p = {NULL, n, task, ctx};
+    p.deques = (Deque*)calloc(n, sizeof(Deque));
+    Worker* ws = (Worker*)malloc(n * sizeof(Worker));
+    pthread_t* threads = (pthread_t*)malloc(n * sizeof(pthread_t));
+    if (!p.deques || !ws || !threads) die("oom");
+    for (size_t w = 0; w < n; w++) {
+        pthread_mutex_init(&p.deques[w].lock, NULL);
+        p.deques[w].tasks = (size_t*)malloc((count / n + 1) * sizeof(size_t));
+        if (!p.deques[w].tasks) die("oom");
+        ws[w] = (Worker){&p, w};
+    }
+    // Dealt in reverse, so each owner starts with its earliest task.
+    for (size_t i = count; i-- > 0;) {
+        Deque* d = &p.deques[i % n];
+        d->tasks[d->bottom++] = i;
+    }
+
+    for (size_t w = 1; w < n; w++) {
+        if (pthread_create(&threads[w], NULL, work, &ws[w]) != 0) die("failed to start worker thread");
+    }
+    work(&ws[0]);
+    for (size_t w = 1; w < n; w++) pthread_join(threads[w], NULL);
+
+    for (size_t w = 0; w < n; w++) {
+        pthread_mutex_destroy(&p.deques[w].lock);
+        free(p.deques[w].tasks);
+    }
+    free(p.deques);
+    free(ws);
+    free(threads);
+}
@@ -0,0 +1,14 @@
+#ifndef CHASMC_POOL_H
+#define CHASMC_POOL_H
+
+#include <stddef.h>
+
+// Runs task(i, ctx) for every i in [0, count) on up to `workers` threads, the
+// calling thread included, and returns once all of them have finished.
+//
+// Tasks are dealt round-robin to one deque per worker. A worker takes the
+// newest task from its own deque and, when that is empty, steals the oldest
+// from another worker's, so a few long tasks do not leave the rest idle.
+void pool_run(size_t count, int workers, void (*task)(size_t i, void* ctx), void* ctx);
+
+#endif
@@ -0,0 +1,98 @@
+#include "regalloc.h"
+
+#include <limits.h>
+#include <stdlib.h>
+
+typedef struct {
+    int slot;
+    int start;  // instruction index; -1 for a parameter, defined on entry
+    int end;
+    bool crosses_call;
+} Interval;
+
+static int by_start(const void* a, const void* b) {
+    const Interval* x = (const Interval*)a;
+    const Interval* y = (const Interval*)b;
+    if (x->start != y->start) return x->start < y->start ? -1 : 1;
+    return x->slot - y->slot;
+}
+
+static bool reg_allowed(const Interval* iv, Reg r) { return !iv->crosses_call || reg_callee_saved(r); }
+
+void allocate_registers(IrFunc* fn) {
+    for (size_t i = 0; i < fn->ninsts; i++) {
+        if (fn->insts[i].op == IR_ASM || fn->insts[i].op == IR_MACRO) return;
+    }
+    size_t n = fn->nlocals;
+    if (n == 0) return;
+
+    // Live ranges. ChASM has no control flow yet, so instruction order is
+    // execution order and a range is just [first use, last use].
+    Interval* all = (Interval*)arena_alloc(fn->arena, n * sizeof(Interval));
+    for (size_t s = 0; s < n; s++) {
+        bool param = (int)s < fn->nparams;
+        all[s] = (Interval){(int)s, param ? -1 : INT_MAX, -1, false};
+    }
+    int* calls_before = (int*)arena_alloc(fn->arena, (fn->ninsts + 1) * sizeof(int));
+    calls_before[0] = 0;
+    for (size_t i = 0; i < fn->ninsts; i++) {
+        const IrInst* in = &fn->insts[i];
+        calls_before[i + 1] = calls_before[i] + (in->op == IR_CALL);
+        if (in->op != IR_LOAD_LOCAL && in->op != IR_STORE_LOCAL) continue;
+        Interval* iv = &all[in->slot];
+        if ((int)i < iv->start) iv->start = (int)i;
+        iv->end = (int)i;
+    }
+
+    Interval* live = (Interval*)arena_alloc(fn->arena, n * sizeof(Interval));
+    size_t nlive = 0;
+    for (size_t s = 0; s < n; s++) {
+        fn->locals[s].rbp_off = 0;
+        Interval iv = all[s];
+        if (iv.end < 0) continue;  // never used
+        iv.crosses_call = calls_before[iv.end] > calls_before[iv.start + 1];
+        live[nlive++] = iv;
+    }
+    qsort(live, nlive, sizeof(Interval), by_start);
+
+    // Active intervals, by register. Caller-saved registers come first, so
+    // they are preferred whenever the interval allows them.
+    Interval* active[REG_COUNT] = {0};
+    for (size_t k = 0; k < nlive; k++) {
+        Interval* cur = &live[k];
+        for (int r = 0; r < REG_COUNT; r++) {
+            if (active[r] && active[r]->end < cur->start) active[r] = NULL;
+        }
+        Reg pick = REG_NONE;
+        for (int r = 0; r < REG_COUNT && pick == REG_NONE; r++) {
+            if (!active[r] && reg_allowed(cur, (Reg)r)) pick = (Reg)r;
+        }
+        if (pick == REG_NONE) {
+            // Under pressure, the interval that ends last gives up its
+            // register, which may be the current one.
+            Reg victim = REG_NONE;
+            for (int r = 0; r < REG_COUNT; r++) {
+                if (!reg_allowed(cur, (Reg)r)) continue;
+                if (victim == REG_NONE || active[r]->end > active[victim]->end) victim = (Reg)r;
+            }
+            if (victim == REG_NONE || active[victim]->end <= cur->end) continue;
+            fn->locals[active[victim]->slot].reg = REG_NONE;
+            pick = victim;
+        }
+        active[pick] = cur;
+        fn->locals[cur->slot].reg = pick;
+    }
+
+    // What stays in memory gets a slot of its own, inside the frame.
+    fn->frame_size = 0;
+    fn->saved_regs = 0;
+    for (size_t k = 0; k < nlive; k++) {
+        IrLocal* L = &fn->locals[live[k].slot];
+        if (L->reg != REG_NONE) {
+            if (reg_callee_saved(L->reg)) fn->saved_regs |= 1u << L->reg;
+            continue;
+        }
+        fn->frame_size += 8;
+        L->rbp_off = -fn->frame_size;
+    }
+}
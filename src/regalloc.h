@@ -0,0 +1,15 @@
+#ifndef CHASMC_REGALLOC_H
+#define CHASMC_REGALLOC_H
+
+#include "ir.h"
+
+// Linear-scan register allocation of a function's locals and parameters, at
+// -O1. Each local is live from its first to its last use; one that is live
+// across a call only gets a callee-saved register. Locals left over under
+// pressure stay in the frame, which is re-laid out to hold just those.
+//
+// Functions with inline asm or macro uses are left alone: their text may use
+// any register or address the frame directly.
+void allocate_registers(IrFunc* fn);
+
+#endif
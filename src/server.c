@@ -0,0 +1,420 @@
+#define _GNU_SOURCE
+
+#include "server.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "emit.h"
+#include "source.h"
+#include "util.h"
+
+#define MAX_WORKERS 64
+#define MAX_REQUEST (1u << 20)
+#define REQUEST_TIMEOUT_SEC 5
+#define WATCH_EVENTS (IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ATTRIB)
+
+// A request is a u32 payload length, sent together with the client's stdin,
+// stdout and stderr as SCM_RIGHTS, followed by the payload: the working
+// directory and each argument, NUL-terminated. The reply is the exit status
+// as an i32.
+
+typedef struct {
+    pid_t pid;
+    int client;
+    int report;   // read end of the worker's cache report pipe
+    Out reports;  // absorbed once the worker is done
+} Worker;
+
+typedef struct {
+    int wd;
+    char* dir;
+} Watch;
+
+typedef struct {
+    Cache* cache;
+    CompileFn compile;
+    int listen_fd;
+    int inotify_fd;
+    Worker workers[MAX_WORKERS];
+    size_t nworkers;
+    Watch* watches;
+    size_t nwatches;
+    size_t watches_cap;
+} Server;
+
+static volatile sig_atomic_t stopping;
+static Server* active;  // for the cache_absorb callback
+
+static void on_stop_signal(int sig) {
+    (void)sig;
+    stopping = 1;
+}
+
+static bool socket_address(const char* path, struct sockaddr_un* addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) return false;
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+static bool send_all(int fd, const void* data, size_t len) {
+    const char* p = (const char*)data;
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static bool recv_all(int fd, void* data, size_t len) {
+    char* p = (char*)data;
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+// Lexing a file caught mid-edit may die(); the trap turns that into a
+// skipped preload, and the next worker lexes the file itself.
+static void preload(const char* path) {
+    jmp_buf trap;
+    if (setjmp(trap) == 0) {
+        die_set_trap(&trap);
+        source_preload(path);
+    }
+    die_set_trap(NULL);
+}
+
+// Directories rather than files are watched, so editors that save by
+// writing a new file and renaming it over the old one are seen too.
+static void watch_dir_of(Server* s, const char* path) {
+    if (s->inotify_fd < 0) return;
+    const char* slash = strrchr(path, '/');
+    if (!slash) return;
+    size_t len = (slash == path) ? 1 : (size_t)(slash - path);
+    for (size_t i = 0; i < s->nwatches; i++) {
+        if (strlen(s->watches[i].dir) == len && memcmp(s->watches[i].dir, path, len) == 0) return;
+    }
+    char dir[4096];
+    if (len >= sizeof(dir)) return;
+    memcpy(dir, path, len);
+    dir[len] = 0;
+    int wd = inotify_add_watch(s->inotify_fd, dir, WATCH_EVENTS);
+    if (wd < 0) return;
+    if (s->nwatches == s->watches_cap) {
+        s->watches_cap = s->watches_cap ? s->watches_cap * 2 : 16;
+        s->watches = (Watch*)realloc(s->watches, s->watches_cap * sizeof(Watch));
+        if (!s->watches) die("oom");
+    }
+    s->watches[s->nwatches++] = (Watch){wd, xstrdup(dir)};
+}
+
+static void on_source(const char* real_path) {
+    preload(real_path);
+    watch_dir_of(active, real_path);
+}
+
+static const char* watched_dir(const Server* s, int wd) {
+    for (size_t i = 0; i < s->nwatches; i++) {
+        if (s->watches[i].wd == wd) return s->watches[i].dir;
+    }
+    return NULL;
+}
+
+// Re-lexes preloaded files that changed, so the next request finds them
+// ready. Files that were never preloaded are not interesting.
+static void handle_file_events(Server* s) {
+    if (s->inotify_fd < 0) return;
+    _Alignas(struct inotify_event) char buf[16384];
+    for (;;) {
+        ssize_t n = read(s->inotify_fd, buf, sizeof(buf));
+        if (n <= 0) return;
+        for (char* p = buf; p < buf + n;) {
+            const struct inotify_event* ev = (const struct inotify_event*)p;
+            p += sizeof(*ev) + ev->len;
+            const char* dir = ev->len ? watched_dir(s, ev->wd) : NULL;
+            if (!dir) continue;
+            char path[4096];
+            snprintf(path, sizeof(path), "%s%s%s", dir, strcmp(dir, "/") == 0 ? "" : "/", ev->name);
+            if (!source_forget(path)) continue;
+            if (!(ev->mask & (IN_DELETE | IN_MOVED_FROM))) preload(path);
+        }
+    }
+}
+
+static void close_fds(int* fds, int count) {
+    for (int i = 0; i < count; i++) close(fds[i]);
+}
+
+static bool read_request(int client, Out* payload, int fds[3]) {
+    struct timeval timeout = {REQUEST_TIMEOUT_SEC, 0};
+    setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    uint32_t len = 0;
+    union {
+        char buf[CMSG_SPACE(3 * sizeof(int))];
+        struct cmsghdr align;
+    } control;
+    struct iovec iov = {&len, sizeof(len)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    ssize_t n = recvmsg(client, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+
+    int got = 0;
+    struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+    if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+        got = (int)((cm->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        if (got > 3) got = 3;
+        memcpy(fds, CMSG_DATA(cm), (size_t)got * sizeof(int));
+    }
+    if (n != (ssize_t)sizeof(len) || got != 3 || len == 0 || len > MAX_REQUEST) {
+        close_fds(fds, got);
+        return false;
+    }
+    out_reserve(payload, len);
+    if (!recv_all(client, payload->data, len) || payload->data[len - 1] != 0) {
+        close_fds(fds, 3);
+        return false;
+    }
+    payload->len = len;
+    return true;
+}
+
+static void reply(int client, int status) {
+    int32_t code = status;
+    send_all(client, &code, sizeof(code));
+    close(client);
+}
+
+static _Noreturn void run_worker(Server* s, const Out* payload, const int fds[3], int report_fd) {
+    close(s->listen_fd);
+    if (s->inotify_fd >= 0) close(s->inotify_fd);
+    for (size_t i = 0; i < s->nworkers; i++) {
+        close(s->workers[i].client);
+        close(s->workers[i].report);
+    }
+    // Move the client's streams out of the way first: if the server runs
+    // with a standard stream closed, one of them may already be 0..2.
+    int high[3];
+    for (int i = 0; i < 3; i++) high[i] = fcntl(fds[i], F_DUPFD_CLOEXEC, 3);
+    for (int i = 0; i < 3; i++) {
+        if (high[i] < 0 || dup2(high[i], i) < 0) _exit(1);
+        close(high[i]);
+        if (fds[i] > 2) close(fds[i]);
+    }
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    const char* p = payload->data;
+    const char* end = payload->data + payload->len;
+    if (chdir(p) != 0) die("cannot enter the client's working directory");
+    int argc = 1;
+    for (const char* q = p + strlen(p) + 1; q < end; q += strlen(q) + 1) argc++;
+    char** argv = (char**)calloc((size_t)argc + 1, sizeof(char*));
+    if (!argv) die("oom");
+    argv[0] = "chasmc";
+    int i = 1;
+    for (const char* q = p + strlen(p) + 1; q < end; q += strlen(q) + 1) argv[i++] = (char*)q;
+
+    s->cache->report_fd = report_fd;
+    exit(s->compile(argc, argv, s->cache));
+}
+
+static void start_worker(Server* s, int client) {
+    Out payload = {0};
+    int fds[3];
+    if (!read_request(client, &payload, fds)) {
+        close(client);
+        out_free(&payload);
+        return;
+    }
+    // Edits saved before the request was sent are queued by now.
+    handle_file_events(s);
+
+    int pipefd[2];
+    pid_t pid = -1;
+    if (pipe2(pipefd, O_CLOEXEC) == 0) {
+        pid = fork();
+        if (pid == 0) run_worker(s, &payload, fds, pipefd[1]);
+        close(pipefd[1]);
+        if (pid < 0) close(pipefd[0]);
+    }
+    close_fds(fds, 3);
+    out_free(&payload);
+    if (pid < 0) {
+        fprintf(stderr, "chasmc: cannot start a worker: %s\n", strerror(errno));
+        reply(client, 1);
+        return;
+    }
+    s->workers[s->nworkers++] = (Worker){pid, client, pipefd[0], {0}};
+}
+
+static void finish_worker(Server* s, size_t index) {
+    Worker* w = &s->workers[index];
+    cache_absorb(s->cache, w->reports.data, w->reports.len, on_source);
+    int status = 0;
+    while (waitpid(w->pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    reply(w->client, WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+    close(w->report);
+    out_free(&w->reports);
+    *w = s->workers[--s->nworkers];
+}
+
+// Returns false once the worker has closed its end and been finished.
+static bool read_reports(Server* s, size_t index) {
+    Worker* w = &s->workers[index];
+    out_reserve(&w->reports, 64 * 1024);
+    ssize_t n = read(w->report, w->reports.data + w->reports.len, w->reports.cap - w->reports.len);
+    if (n > 0) {
+        w->reports.len += (size_t)n;
+        return true;
+    }
+    if (n < 0 && errno == EINTR) return true;
+    finish_worker(s, index);
+    return false;
+}
+
+// A stale socket file from a server that exited uncleanly is replaced; a
+// live one is left alone.
+static int listen_on(const char* path) {
+    struct sockaddr_un addr;
+    if (!socket_address(path, &addr)) die("server socket path is too long");
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) die("cannot create the server socket");
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) die("a compile server is already listening there");
+    close(fd);
+    unlink(path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) die("cannot create the server socket");
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 64) != 0) {
+        die("cannot listen on the server socket");
+    }
+    return fd;
+}
+
+int server_run(const char* socket_path, Cache* cache, CompileFn compile) {
+    Server s = {0};
+    s.cache = cache;
+    s.compile = compile;
+    s.listen_fd = listen_on(socket_path);
+    // Without inotify the stat check in source_load still keeps builds
+    // correct; changed files are just re-lexed by the worker.
+    s.inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    active = &s;
+
+    struct sigaction sa = {0};
+    sa.sa_handler = on_stop_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "chasmc: serving on %s\n", socket_path);
+
+    struct pollfd pfd[MAX_WORKERS + 2];
+    while (!stopping) {
+        pfd[0] = (struct pollfd){s.listen_fd, s.nworkers < MAX_WORKERS ? POLLIN : 0, 0};
+        pfd[1] = (struct pollfd){s.inotify_fd, POLLIN, 0};
+        for (size_t i = 0; i < s.nworkers; i++) pfd[2 + i] = (struct pollfd){s.workers[i].report, POLLIN, 0};
+        if (poll(pfd, 2 + s.nworkers, -1) < 0) {
+            if (errno == EINTR) continue;
+            die("poll failed");
+        }
+        if (pfd[1].revents) handle_file_events(&s);
+        // Backwards, because finishing a worker moves the last one into its
+        // slot, and that one has already been looked at.
+        for (size_t i = s.nworkers; i-- > 0;) {
+            if (pfd[2 + i].revents) read_reports(&s, i);
+        }
+        if (pfd[0].revents & POLLIN) {
+            int client = accept4(s.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (client >= 0) start_worker(&s, client);
+        }
+    }
+
+    close(s.listen_fd);
+    unlink(socket_path);
+    while (s.nworkers > 0) {
+        while (read_reports(&s, s.nworkers - 1)) {
+        }
+    }
+    if (s.inotify_fd >= 0) close(s.inotify_fd);
+    for (size_t i = 0; i < s.nwatches; i++) free(s.watches[i].dir);
+    free(s.watches);
+    return 0;
+}
+
+bool server_forward(const char* socket_path, int argc, char** argv, int* status) {
+    struct sockaddr_un addr;
+    if (!socket_address(socket_path, &addr)) return false;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return false;
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return false;
+    }
+
+    char* cwd = getcwd(NULL, 0);
+    if (!cwd) die("cannot determine the working directory");
+    Out payload = {0};
+    out_mem(&payload, cwd, strlen(cwd) + 1);
+    for (int i = 1; i < argc; i++) out_mem(&payload, argv[i], strlen(argv[i]) + 1);
+    free(cwd);
+
+    uint32_t len = (uint32_t)payload.len;
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    union {
+        char buf[CMSG_SPACE(sizeof(fds))];
+        struct cmsghdr align;
+    } control;
+    memset(&control, 0, sizeof(control));
+    struct iovec iov = {&len, sizeof(len)};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    struct cmsghdr* cm = CMSG_FIRSTHDR(&msg);
+    cm->cmsg_level = SOL_SOCKET;
+    cm->cmsg_type = SCM_RIGHTS;
+    cm->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cm), fds, sizeof(fds));
+
+    // Until the request is sent, local compilation is still a safe fallback.
+    if (sendmsg(fd, &msg, MSG_NOSIGNAL) != (ssize_t)sizeof(len)) {
+        close(fd);
+        out_free(&payload);
+        return false;
+    }
+    int32_t code = 0;
+    if (!send_all(fd, payload.data, payload.len) || !recv_all(fd, &code, sizeof(code))) {
+        die("lost the connection to the compile server");
+    }
+    close(fd);
+    out_free(&payload);
+    *status = code;
+    return true;
+}
@@ -0,0 +1,24 @@
+#ifndef CHASMC_SERVER_H
+#define CHASMC_SERVER_H
+
+#include <stdbool.h>
+
+#include "cache.h"
+
+// Runs one compilation from a driver command line (argv[1] is the input).
+// The cache is the server's, and overrides any --cache-dir in argv.
+typedef int (*CompileFn)(int argc, char** argv, Cache* cache);
+
+// Compile server: accepts requests on a Unix socket and runs each one in a
+// forked worker. Workers inherit the server's in-memory cache and preloaded
+// source files; what they compile is reported back and kept for the next
+// request. Source files are watched with inotify and re-lexed when they
+// change. Returns on SIGINT or SIGTERM.
+int server_run(const char* socket_path, Cache* cache, CompileFn compile);
+
+// Thin client: hands argv, the working directory and the standard streams to
+// the server and waits for the exit status. False when no server is
+// listening, so the caller can compile locally instead.
+bool server_forward(const char* socket_path, int argc, char** argv, int* status);
+
+#endif
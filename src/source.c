@@ -0,0 +1,261 @@
+#define _DEFAULT_SOURCE
+
+#include "source.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "timing.h"
+
+static const char* inode_key(const struct stat* st) {
+    uint64_t key[2] = {(uint64_t)st->st_dev, (uint64_t)st->st_ino};
+    return intern((const char*)key, sizeof(key));
+}
+
+typedef struct {
+    const char* path;  // NULL once forgotten
+    struct stat st;
+    FileView view;     // a private copy: an in-place edit must not change it
+    TokenBuffer toks;
+    CacheKey hash;
+} Preloaded;
+
+static Preloaded* preloaded;
+static size_t npreloaded;
+static size_t preloaded_cap;
+static NameMap preload_by_path;
+static NameMap preload_by_inode;
+static bool share_lexed;
+static pthread_mutex_t preload_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool preload_current(const Preloaded* p, const struct stat* st) {
+    return p->path && p->st.st_dev == st->st_dev && p->st.st_ino == st->st_ino && p->st.st_size == st->st_size &&
+           p->st.st_mtim.tv_sec == st->st_mtim.tv_sec && p->st.st_mtim.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+static Preloaded* find_preloaded(const NameMap* map, const char* key) {
+    size_t* slot = name_map_find(map, key);
+    return slot ? &preloaded[*slot] : NULL;
+}
+
+static void release_preloaded(Preloaded* p) {
+    file_view_close(&p->view);
+    token_buffer_free(&p->toks);
+    *p = (Preloaded){0};
+}
+
+// stat comes first, so the copy is never older than the recorded mtime.
+static bool read_preloaded(const char* path, const struct stat* st, Preloaded* p) {
+    FileView mapped;
+    if (!file_view_try_open(&mapped, path)) return false;
+    char* copy = (char*)malloc(mapped.len ? mapped.len : 1);
+    if (!copy) die("oom");
+    memcpy(copy, mapped.data, mapped.len);
+    *p = (Preloaded){path, *st, {copy, mapped.len, 0}, {0}, cache_key(mapped.data, mapped.len)};
+    file_view_close(&mapped);
+    lex_buffer(&p->toks, path, p->view.data, p->view.len);
+    timing_count(COUNT_TOKENS, p->toks.count);
+    return true;
+}
+
+// Replaces old, or appends when it is NULL. Called with preload_lock held.
+static Preloaded* store_preloaded(Preloaded* old, Preloaded p) {
+    if (old) {
+        release_preloaded(old);
+        *old = p;
+    } else {
+        if (npreloaded == preloaded_cap) {
+            preloaded_cap = preloaded_cap ? preloaded_cap * 2 : 16;
+            preloaded = (Preloaded*)realloc(preloaded, preloaded_cap * sizeof(Preloaded));
+            if (!preloaded) die("oom");
+        }
+        old = &preloaded[npreloaded];
+        *old = p;
+        name_map_put(&preload_by_path, p.path, npreloaded++);
+    }
+    name_map_put(&preload_by_inode, inode_key(&p.st), (size_t)(old - preloaded));
+    return old;
+}
+
+void source_preload(const char* real_path) {
+    const char* path = intern_cstr(real_path);
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) return;
+    pthread_mutex_lock(&preload_lock);
+    Preloaded* old = find_preloaded(&preload_by_path, path);
+    bool current = old && preload_current(old, &st);
+    pthread_mutex_unlock(&preload_lock);
+    Preloaded p;
+    if (current || !read_preloaded(path, &st, &p)) return;
+    pthread_mutex_lock(&preload_lock);
+    store_preloaded(find_preloaded(&preload_by_path, path), p);
+    pthread_mutex_unlock(&preload_lock);
+}
+
+void source_share_lexed(void) { share_lexed = true; }
+
+bool source_forget(const char* real_path) {
+    pthread_mutex_lock(&preload_lock);
+    Preloaded* p = find_preloaded(&preload_by_path, intern_cstr(real_path));
+    bool found = p && p->path;
+    if (found) release_preloaded(p);
+    pthread_mutex_unlock(&preload_lock);
+    return found;
+}
+
+bool source_preloaded_hash(const char* real_path, CacheKey* key) {
+    struct stat st;
+    if (stat(real_path, &st) != 0) return false;
+    pthread_mutex_lock(&preload_lock);
+    Preloaded* p = npreloaded ? find_preloaded(&preload_by_path, intern_cstr(real_path)) : NULL;
+    bool current = p && preload_current(p, &st);
+    if (current) *key = p->hash;
+    pthread_mutex_unlock(&preload_lock);
+    return current;
+}
+
+static SourceFile* add_file(SourceSet* set, const char* path, const char* key) {
+    SourceFile* file = (SourceFile*)calloc(1, sizeof(SourceFile));
+    if (!file) die("oom");
+    file->id = set->count;
+    file->path = path;
+    if (set->count + 1 > set->cap) {
+        set->cap = (set->cap == 0) ? 16 : set->cap * 2;
+        set->files = (SourceFile**)realloc(set->files, set->cap * sizeof(SourceFile*));
+        if (!set->files) die("oom");
+    }
+    name_map_put(&set->by_path, path, set->count);
+    if (key) name_map_put(&set->by_inode, key, set->count);
+    set->files[set->count++] = file;
+    return file;
+}
+
+static bool borrow_preloaded(SourceFile* file, const char* key, const struct stat* st) {
+    Preloaded* pre = npreloaded ? find_preloaded(&preload_by_inode, key) : NULL;
+    if (!pre || !preload_current(pre, st)) return false;
+    file->view = pre->view;
+    file->toks = pre->toks;
+    file->preloaded = true;
+    return true;
+}
+
+// The first batch job to read a file leaves it in the preload table for the
+// others. Entries are never replaced while jobs may be borrowing them, so a
+// file that changes mid-batch is lexed privately from then on.
+static bool lex_shared(SourceFile* file, const char* key, const struct stat* st) {
+    pthread_mutex_lock(&preload_lock);
+    bool known = npreloaded && find_preloaded(&preload_by_inode, key);
+    bool found = borrow_preloaded(file, key, st);
+    pthread_mutex_unlock(&preload_lock);
+    if (found || known) return found;
+
+    char* real = xrealpath(file->path);
+    Preloaded p;
+    bool ok = real && S_ISREG(st->st_mode) && read_preloaded(intern_cstr(real), st, &p);
+    free(real);
+    if (!ok) return false;
+    pthread_mutex_lock(&preload_lock);
+    if (npreloaded && find_preloaded(&preload_by_inode, key)) release_preloaded(&p);  // another job won
+    else store_preloaded(NULL, p);
+    found = borrow_preloaded(file, key, st);
+    pthread_mutex_unlock(&preload_lock);
+    return found;
+}
+
+static void lex_file(SourceFile* file, const char* key, const struct stat* st) {
+    TimingMark start = timing_start();
+    bool found;
+    if (share_lexed) {
+        found = lex_shared(file, key, st);
+    } else {
+        pthread_mutex_lock(&preload_lock);
+        found = borrow_preloaded(file, key, st);
+        pthread_mutex_unlock(&preload_lock);
+    }
+    if (!found) {
+        file_view_open(&file->view, file->path);
+        lex_buffer(&file->toks, file->path, file->view.data, file->view.len);
+        timing_count(COUNT_TOKENS, file->toks.count);
+    }
+    timing_stop(PHASE_LEX, file->path, start);
+}
+
+SourceFile* source_load(SourceSet* set, const char* path) {
+    size_t* hit = name_map_find(&set->by_path, path);
+    if (hit) return set->files[*hit];
+
+    struct stat st;
+    int rc = (strcmp(path, "-") == 0) ? fstat(STDIN_FILENO, &st) : stat(path, &st);
+    if (rc != 0) die("cannot open input file");
+    const char* key = inode_key(&st);
+    hit = name_map_find(&set->by_inode, key);
+    if (hit) {
+        name_map_put(&set->by_path, path, *hit);
+        return set->files[*hit];
+    }
+
+    SourceFile* file = add_file(set, path, key);
+    lex_file(file, key, &st);
+    return file;
+}
+
+const char* source_identity(const char* path) {
+    struct stat st;
+    return stat(path, &st) == 0 ? inode_key(&st) : NULL;
+}
+
+SourceFile* source_add(SourceSet* set, const char* path) {
+    size_t* hit = name_map_find(&set->by_path, path);
+    if (hit) return set->files[*hit];
+    struct stat st;
+    const char* key = (stat(path, &st) == 0) ? inode_key(&st) : NULL;
+    hit = key ? name_map_find(&set->by_inode, key) : NULL;
+    if (hit) {
+        name_map_put(&set->by_path, path, *hit);
+        return set->files[*hit];
+    }
+    return add_file(set, path, key);
+}
+
+void source_lex(SourceFile* file) {
+    struct stat st;
+    if (stat(file->path, &st) != 0) die("cannot open input file");
+    lex_file(file, inode_key(&st), &st);
+}
+
+SourceFile* source_find(const SourceSet* set, const char* path) {
+    size_t* hit = name_map_find(&set->by_path, path);
+    return hit ? set->files[*hit] : NULL;
+}
+
+void source_add_import(SourceFile* file, SourceFile* dep) {
+    for (size_t i = 0; i < file->nimports; i++) {
+        if (file->imports[i] == dep) return;
+    }
+    if (file->nimports + 1 > file->imports_cap) {
+        file->imports_cap = (file->imports_cap == 0) ? 8 : file->imports_cap * 2;
+        file->imports = (SourceFile**)realloc(file->imports, file->imports_cap * sizeof(SourceFile*));
+        if (!file->imports) die("oom");
+    }
+    file->imports[file->nimports++] = dep;
+}
+
+void free_source_set(SourceSet* set) {
+    for (size_t i = 0; i < set->count; i++) {
+        SourceFile* file = set->files[i];
+        if (!file->preloaded) {
+            if (file->view.data) file_view_close(&file->view);
+            token_buffer_free(&file->toks);
+        }
+        if (file->iface.data) file_view_close(&file->iface);
+        free(file->imports);
+        free(file);
+    }
+    free(set->files);
+    name_map_free(&set->by_path);
+    name_map_free(&set->by_inode);
+}
@@ -0,0 +1,69 @@
+#ifndef CHASMC_SOURCE_H
+#define CHASMC_SOURCE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "cache.h"
+#include "intern.h"
+#include "lexer.h"
+#include "util.h"
+
+// A source file loaded and lexed once per compilation. Files are identified
+// by device and inode, so different spellings of the same path share one entry.
+typedef struct SourceFile {
+    size_t id;  // index in SourceSet.files
+    const char* path;
+    FileView view;
+    TokenBuffer toks;  // empty until lexed
+
+    struct SourceFile** imports;
+    size_t nimports;
+    size_t imports_cap;
+
+    // Libraries imported through a precompiled interface (.rvi) are not
+    // read or lexed unless the interface turns out not to fit the program.
+    const char* iface_path;
+    FileView iface;
+
+    bool scanned;
+    bool emitted;
+    bool preloaded;  // view and toks belong to the preload table
+} SourceFile;
+
+typedef struct {
+    SourceFile** files;
+    size_t count;
+    size_t cap;
+    NameMap by_path;
+    NameMap by_inode;
+} SourceSet;
+
+SourceFile* source_load(SourceSet* set, const char* path);
+// The device and inode key files are identified by, interned; NULL when the
+// file cannot be stat'ed.
+const char* source_identity(const char* path);
+// Registers a file, which need not exist, without reading it; an existing
+// entry for the same path or inode is returned as is.
+SourceFile* source_add(SourceSet* set, const char* path);
+// Reads and lexes a file registered with source_add.
+void source_lex(SourceFile* file);
+// Lookup only; never loads. Safe to call concurrently once loading is done.
+SourceFile* source_find(const SourceSet* set, const char* path);
+void source_add_import(SourceFile* file, SourceFile* dep);
+void free_source_set(SourceSet* set);
+
+// Files the compile server keeps read and lexed between compilations, by
+// canonical path. source_load borrows an entry only while the file's inode,
+// size and mtime still match, so a missed change notification costs a
+// re-lex, never a stale build. A normal run has none.
+void source_preload(const char* real_path);
+// Drops the entry; false if there was none.
+bool source_forget(const char* real_path);
+// Content hash of a preloaded file that is still current.
+bool source_preloaded_hash(const char* real_path, CacheKey* key);
+// Batch mode: every file lexed from now on is added to the preload table, so
+// concurrent compilations importing the same library lex it only once.
+void source_share_lexed(void);
+
+#endif
@@ -0,0 +1,239 @@
+#include "static_link.h"
+
+#include <elf.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "intern.h"
+#include "util.h"
+
+#define LINK_BASE 0x400000ull
+#define LINK_PAGE 0x1000ull
+#define LINK_ENTRY "_start"
+
+typedef struct {
+    const ObjFile* objs;
+    size_t nobjs;
+    uint64_t* place;                 // [obj * OBJ_NSECTIONS + section]: offset in the merged section
+    uint64_t size[OBJ_NSECTIONS];    // merged section sizes
+    uint64_t addr[OBJ_NSECTIONS];    // merged section addresses
+    uint64_t offset[OBJ_NSECTIONS];  // file offsets (unused for .bss)
+    NameMap globals;                 // name -> address of the defining symbol
+} Link;
+
+static uint64_t align_up(uint64_t v, uint64_t a) { return (v + a - 1) & ~(a - 1); }
+
+static void die_symbol(const char* what, const char* name) {
+    char msg[512];
+    snprintf(msg, sizeof(msg), "%s '%s'", what, name);
+    die(msg);
+}
+
+static uint64_t section_base(const Link* k, size_t obj, int section) {
+    return k->addr[section] + k->place[obj * OBJ_NSECTIONS + (size_t)section];
+}
+
+static uint64_t symbol_address(const Link* k, size_t obj, size_t sym) {
+    const ObjSymbol* s = &k->objs[obj].syms[sym];
+    if (s->section >= 0) return section_base(k, obj, s->section) + s->value;
+    size_t* addr = name_map_find(&k->globals, s->name);
+    if (!addr) die_symbol("undefined symbol", s->name);
+    return *addr;
+}
+
+// Same-kind sections of every object are concatenated, each at its own
+// alignment, like ld's default script does for .text/.rodata/.data/.bss.
+static void merge_sections(Link* k) {
+    for (int s = 0; s < OBJ_NSECTIONS; s++) {
+        uint64_t size = 0;
+        for (size_t i = 0; i < k->nobjs; i++) {
+            size = align_up(size, obj_section_align(s));
+            k->place[i * OBJ_NSECTIONS + (size_t)s] = size;
+            size += k->objs[i].sections[s].size;
+        }
+        k->size[s] = size;
+    }
+}
+
+static int count_segments(const Link* k) {
+    int n = 2;  // R+X text and the GNU stack marker
+    if (k->size[OBJ_RODATA]) n++;
+    if (k->size[OBJ_DATA] || k->size[OBJ_BSS]) n++;
+    return n;
+}
+
+// Every loadable segment starts on its own page with vaddr == base + file
+// offset, so the kernel can map the file directly.
+static void layout(Link* k, int nphdrs) {
+    uint64_t pos = sizeof(Elf64_Ehdr) + (uint64_t)nphdrs * sizeof(Elf64_Phdr);
+    pos = align_up(pos, obj_section_align(OBJ_TEXT));
+    k->offset[OBJ_TEXT] = pos;
+    pos += k->size[OBJ_TEXT];
+    if (k->size[OBJ_RODATA]) pos = align_up(pos, LINK_PAGE);
+    k->offset[OBJ_RODATA] = pos;
+    pos += k->size[OBJ_RODATA];
+    pos = align_up(pos, LINK_PAGE);
+    k->offset[OBJ_DATA] = pos;
+    for (int s = 0; s < OBJ_BSS; s++) k->addr[s] = LINK_BASE + k->offset[s];
+    k->addr[OBJ_BSS] = align_up(k->addr[OBJ_DATA] + k->size[OBJ_DATA], obj_section_align(OBJ_BSS));
+}
+
+static void collect_globals(Link* k) {
+    for (size_t i = 0; i < k->nobjs; i++) {
+        const ObjFile* obj = &k->objs[i];
+        for (size_t j = 0; j < obj->nsyms; j++) {
+            const ObjSymbol* s = &obj->syms[j];
+            if (!s->global || s->section < 0) continue;
+            if (name_map_find(&k->globals, s->name)) die_symbol("duplicate symbol", s->name);
+            name_map_put(&k->globals, s->name, (size_t)symbol_address(k, i, j));
+        }
+    }
+}
+
+static void apply_relocs(const Link* k, char* image) {
+    for (size_t i = 0; i < k->nobjs; i++) {
+        const ObjFile* obj = &k->objs[i];
+        for (size_t j = 0; j < obj->nrelocs; j++) {
+            const ObjReloc* r = &obj->relocs[j];
+            const char* name = obj->syms[r->symbol].name;
+            uint64_t target = symbol_address(k, i, r->symbol) + (uint64_t)r->addend;
+            uint64_t at = section_base(k, i, r->section) + r->offset;
+            char* field = image + k->offset[r->section] + (at - k->addr[r->section]);
+            if (r->kind == OBJ_RELOC_ABS64) {
+                memcpy(field, &target, 8);
+                continue;
+            }
+            if (r->kind == OBJ_RELOC_PC32) {
+                int64_t rel = (int64_t)(target - at);
+                if (rel < INT32_MIN || rel > INT32_MAX) die_symbol("relocation out of range for", name);
+                int32_t v = (int32_t)rel;
+                memcpy(field, &v, 4);
+                continue;
+            }
+            if (target > UINT32_MAX) die_symbol("relocation out of range for", name);
+            uint32_t v = (uint32_t)target;
+            memcpy(field, &v, 4);
+        }
+    }
+}
+
+static void put_phdr(Out* out, uint32_t type, uint32_t flags, uint64_t offset, uint64_t vaddr, uint64_t filesz,
+                     uint64_t memsz) {
+    Elf64_Phdr ph = {0};
+    ph.p_type = type;
+    ph.p_flags = flags;
+    ph.p_offset = offset;
+    ph.p_vaddr = vaddr;
+    ph.p_paddr = vaddr;
+    ph.p_filesz = filesz;
+    ph.p_memsz = memsz;
+    ph.p_align = (type == PT_LOAD) ? LINK_PAGE : 16;
+    out_mem(out, (const char*)&ph, sizeof(ph));
+}
+
+static void pad_to(Out* out, uint64_t pos) {
+    static const char zeros[256];
+    while (out->len < pos) {
+        size_t n = (size_t)(pos - out->len);
+        out_mem(out, zeros, n < sizeof(zeros) ? n : sizeof(zeros));
+    }
+}
+
+// Section headers are not needed to run the program, but objdump and gdb
+// expect them.
+static void put_section_headers(const Link* k, Out* out, Elf64_Ehdr* eh) {
+    Out names = {0};
+    out_char(&names, 0);
+    Elf64_Shdr sh[OBJ_NSECTIONS + 2];
+    memset(sh, 0, sizeof(sh));
+    int n = 1;
+    for (int s = 0; s < OBJ_NSECTIONS; s++) {
+        if (!k->size[s]) continue;
+        Elf64_Shdr* h = &sh[n++];
+        h->sh_name = (uint32_t)names.len;
+        out_mem(&names, obj_section_name(s), strlen(obj_section_name(s)) + 1);
+        h->sh_type = (s == OBJ_BSS) ? SHT_NOBITS : SHT_PROGBITS;
+        h->sh_flags = SHF_ALLOC | (s == OBJ_TEXT ? SHF_EXECINSTR : 0) | (s == OBJ_DATA || s == OBJ_BSS ? SHF_WRITE : 0);
+        h->sh_addr = k->addr[s];
+        h->sh_offset = (s == OBJ_BSS) ? k->offset[OBJ_DATA] + k->size[OBJ_DATA] : k->offset[s];
+        h->sh_size = k->size[s];
+        h->sh_addralign = obj_section_align(s);
+    }
+    Elf64_Shdr* h = &sh[n];
+    h->sh_name = (uint32_t)names.len;
+    out_mem(&names, ".shstrtab", sizeof(".shstrtab"));
+    h->sh_type = SHT_STRTAB;
+    h->sh_offset = out->len;
+    h->sh_size = names.len;
+    h->sh_addralign = 1;
+    out_mem(out, names.data, names.len);
+    out_free(&names);
+
+    pad_to(out, align_up(out->len, 8));
+    eh->e_shoff = out->len;
+    eh->e_shnum = (uint16_t)(n + 1);
+    eh->e_shstrndx = (uint16_t)n;
+    eh->e_shentsize = sizeof(Elf64_Shdr);
+    out_mem(out, (const char*)sh, (size_t)(n + 1) * sizeof(Elf64_Shdr));
+}
+
+void link_static(const ObjFile* objs, size_t nobjs, Out* out) {
+    Link k = {0};
+    k.objs = objs;
+    k.nobjs = nobjs;
+    k.place = (uint64_t*)calloc(nobjs ? nobjs * OBJ_NSECTIONS : 1, sizeof(uint64_t));
+    if (!k.place) die("oom");
+    merge_sections(&k);
+    int nphdrs = count_segments(&k);
+    layout(&k, nphdrs);
+    collect_globals(&k);
+    size_t* entry = name_map_find(&k.globals, intern_cstr(LINK_ENTRY));
+    if (!entry) die_symbol("undefined entry symbol", LINK_ENTRY);
+
+    out->len = 0;
+    Elf64_Ehdr eh = {0};
+    memcpy(eh.e_ident, ELFMAG, SELFMAG);
+    eh.e_ident[EI_CLASS] = ELFCLASS64;
+    eh.e_ident[EI_DATA] = ELFDATA2LSB;
+    eh.e_ident[EI_VERSION] = EV_CURRENT;
+    eh.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+    eh.e_type = ET_EXEC;
+    eh.e_machine = EM_X86_64;
+    eh.e_version = EV_CURRENT;
+    eh.e_entry = *entry;
+    eh.e_phoff = sizeof(Elf64_Ehdr);
+    eh.e_ehsize = sizeof(Elf64_Ehdr);
+    eh.e_phentsize = sizeof(Elf64_Phdr);
+    eh.e_phnum = (uint16_t)nphdrs;
+    out_mem(out, (const char*)&eh, sizeof(eh));
+
+    uint64_t text_end = k.offset[OBJ_TEXT] + k.size[OBJ_TEXT];
+    put_phdr(out, PT_LOAD, PF_R | PF_X, 0, LINK_BASE, text_end, text_end);
+    if (k.size[OBJ_RODATA]) {
+        put_phdr(out, PT_LOAD, PF_R, k.offset[OBJ_RODATA], k.addr[OBJ_RODATA], k.size[OBJ_RODATA],
+                 k.size[OBJ_RODATA]);
+    }
+    if (k.size[OBJ_DATA] || k.size[OBJ_BSS]) {
+        uint64_t memsz = k.addr[OBJ_BSS] + k.size[OBJ_BSS] - k.addr[OBJ_DATA];
+        put_phdr(out, PT_LOAD, PF_R | PF_W, k.offset[OBJ_DATA], k.addr[OBJ_DATA], k.size[OBJ_DATA], memsz);
+    }
+    put_phdr(out, PT_GNU_STACK, PF_R | PF_W, 0, 0, 0, 0);
+
+    for (int s = 0; s < OBJ_BSS; s++) {
+        if (!k.size[s]) continue;
+        for (size_t i = 0; i < nobjs; i++) {
+            const Out* data = &objs[i].sections[s].data;
+            pad_to(out, k.offset[s] + k.place[i * OBJ_NSECTIONS + (size_t)s]);
+            out_mem(out, data->data, data->len);
+        }
+        pad_to(out, k.offset[s] + k.size[s]);
+    }
+    apply_relocs(&k, out->data);
+    put_section_headers(&k, out, &eh);
+    memcpy(out->data, &eh, sizeof(eh));
+
+    name_map_free(&k.globals);
+    free(k.place);
+}
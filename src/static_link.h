@@ -0,0 +1,15 @@
+#ifndef CHASMC_STATIC_LINK_H
+#define CHASMC_STATIC_LINK_H
+
+#include <stddef.h>
+
+#include "emit.h"
+#include "objfile.h"
+
+// Links in-memory objects into a static, non-PIE x86-64 executable entered
+// at _start, laid out the way `ld` does by default: headers and .text in an
+// R+X segment at 0x400000, then .rodata (R) and .data/.bss (RW) on their own
+// pages. Dies on undefined or duplicate symbols and out-of-range relocations.
+void link_static(const ObjFile* objs, size_t nobjs, Out* out);
+
+#endif
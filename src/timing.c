@@ -0,0 +1,195 @@
+#define _DEFAULT_SOURCE
+
+#include "timing.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "intern.h"
+#include "util.h"
+
+bool timing_enabled;
+atomic_uint_least64_t timing_counters[COUNTER_COUNT];
+
+typedef struct {
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+} PhaseTime;
+
+typedef struct {
+    const char* path;
+    PhaseTime phases[PHASE_COUNT];
+} ModuleTimes;
+
+static pthread_mutex_t timing_lock = PTHREAD_MUTEX_INITIALIZER;
+static ModuleTimes* modules;
+static size_t nmodules;
+static size_t modules_cap;
+static NameMap module_index;
+static PhaseTime program[PHASE_COUNT];
+// Where "total" starts: wall, process CPU and reaped children's CPU time at
+// timing_enable, so startup before option parsing is not counted.
+static uint64_t enabled_at_ns;
+static uint64_t enabled_cpu_ns;
+static uint64_t enabled_child_cpu_ns;
+static _Thread_local uint64_t child_cpu_ns;
+
+static const char* const phase_name[PHASE_COUNT] = {"lex", "scan", "parse/emit", "assemble", "link"};
+// From COUNT_PEEP_MOVES on.
+static const char* const peephole_name[] = {"moves", "store_loads", "operands", "zero_idioms", "zero_stores",
+                                            "extensions"};
+static const char* const phase_key[PHASE_COUNT] = {"lex", "scan", "emit", "assemble", "link"};
+
+static uint64_t clock_ns(clockid_t id) {
+    struct timespec ts;
+    clock_gettime(id, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t timeval_ns(struct timeval tv) {
+    return (uint64_t)tv.tv_sec * 1000000000ull + (uint64_t)tv.tv_usec * 1000ull;
+}
+
+static uint64_t children_cpu_ns(void) {
+    struct rusage children;
+    getrusage(RUSAGE_CHILDREN, &children);
+    return timeval_ns(children.ru_utime) + timeval_ns(children.ru_stime);
+}
+
+void timing_enable(void) {
+    timing_enabled = true;
+    enabled_at_ns = clock_ns(CLOCK_MONOTONIC);
+    enabled_cpu_ns = clock_ns(CLOCK_PROCESS_CPUTIME_ID);
+    enabled_child_cpu_ns = children_cpu_ns();
+}
+
+TimingMark timing_start(void) {
+    if (!timing_enabled) return (TimingMark){0};
+    return (TimingMark){clock_ns(CLOCK_MONOTONIC), clock_ns(CLOCK_THREAD_CPUTIME_ID), child_cpu_ns};
+}
+
+void timing_add_child_cpu(uint64_t cpu_ns) {
+    if (timing_enabled) child_cpu_ns += cpu_ns;
+}
+
+static ModuleTimes* module_times(const char* path) {
+    size_t* idx = name_map_find(&module_index, path);
+    if (idx) return &modules[*idx];
+    if (nmodules == modules_cap) {
+        modules_cap = modules_cap ? modules_cap * 2 : 16;
+        modules = (ModuleTimes*)realloc(modules, modules_cap * sizeof(ModuleTimes));
+        if (!modules) die("oom");
+    }
+    modules[nmodules] = (ModuleTimes){path, {{0}}};
+    name_map_put(&module_index, path, nmodules);
+    return &modules[nmodules++];
+}
+
+void timing_stop(Phase phase, const char* module, TimingMark start) {
+    if (!timing_enabled) return;
+    uint64_t wall = clock_ns(CLOCK_MONOTONIC) - start.wall_ns;
+    uint64_t cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID) - start.cpu_ns + (child_cpu_ns - start.child_cpu_ns);
+    pthread_mutex_lock(&timing_lock);
+    PhaseTime* t = module ? &module_times(module)->phases[phase] : &program[phase];
+    t->wall_ns += wall;
+    t->cpu_ns += cpu;
+    pthread_mutex_unlock(&timing_lock);
+}
+
+static double ms(uint64_t ns) { return (double)ns / 1e6; }
+
+static void json_string(FILE* out, const char* s) {
+    fputc('"', out);
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (c == '"' || c == '\\') fprintf(out, "\\%c", c);
+        else if (c < 0x20) fprintf(out, "\\u%04x", c);
+        else fputc(c, out);
+    }
+    fputc('"', out);
+}
+
+static void json_phases(FILE* out, const PhaseTime* phases) {
+    fputc('{', out);
+    for (int p = 0; p < PHASE_COUNT; p++) {
+        fprintf(out, "%s\"%s\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f}", p ? ", " : "", phase_key[p],
+                ms(phases[p].wall_ns), ms(phases[p].cpu_ns));
+    }
+    fputc('}', out);
+}
+
+void timing_print(FILE* out, bool json) {
+    pthread_mutex_lock(&timing_lock);
+    // Per-phase totals: every module plus the program-wide share.
+    PhaseTime totals[PHASE_COUNT];
+    memcpy(totals, program, sizeof(totals));
+    for (size_t i = 0; i < nmodules; i++) {
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            totals[p].wall_ns += modules[i].phases[p].wall_ns;
+            totals[p].cpu_ns += modules[i].phases[p].cpu_ns;
+        }
+    }
+    struct rusage self;
+    getrusage(RUSAGE_SELF, &self);
+    uint64_t cpu = clock_ns(CLOCK_PROCESS_CPUTIME_ID) - enabled_cpu_ns + (children_cpu_ns() - enabled_child_cpu_ns);
+    uint64_t wall = clock_ns(CLOCK_MONOTONIC) - enabled_at_ns;
+    uint64_t c[COUNTER_COUNT];
+    for (int i = 0; i < COUNTER_COUNT; i++) c[i] = atomic_load(&timing_counters[i]);
+    double probe_len = c[COUNT_LOOKUPS] ? (double)c[COUNT_PROBES] / (double)c[COUNT_LOOKUPS] : 0.0;
+    long peak_rss_kb = self.ru_maxrss;
+
+    if (json) {
+        fprintf(out, "{\"wall_ms\": %.3f, \"cpu_ms\": %.3f, \"phases\": ", ms(wall), ms(cpu));
+        json_phases(out, totals);
+        fprintf(out, ", \"modules\": [");
+        for (size_t i = 0; i < nmodules; i++) {
+            fprintf(out, "%s{\"path\": ", i ? ", " : "");
+            json_string(out, modules[i].path);
+            fprintf(out, ", \"phases\": ");
+            json_phases(out, modules[i].phases);
+            fputc('}', out);
+        }
+        fprintf(out, "], \"counters\": {\"tokens_lexed\": %llu, \"symbol_lookups\": %llu, \"avg_probe_length\": %.3f, "
+                     "\"macro_expansions\": %llu, \"bytes_emitted\": %llu, \"allocations\": %llu, "
+                     "\"allocated_bytes\": %llu, \"peak_rss_kb\": %ld, \"peephole\": {",
+                (unsigned long long)c[COUNT_TOKENS], (unsigned long long)c[COUNT_LOOKUPS], probe_len,
+                (unsigned long long)c[COUNT_MACRO_EXPANSIONS], (unsigned long long)c[COUNT_BYTES_EMITTED],
+                (unsigned long long)c[COUNT_ALLOCATIONS], (unsigned long long)c[COUNT_ALLOCATED_BYTES], peak_rss_kb);
+        for (int i = COUNT_PEEP_MOVES; i < COUNTER_COUNT; i++) {
+            fprintf(out, "%s\"%s\": %llu", i > COUNT_PEEP_MOVES ? ", " : "", peephole_name[i - COUNT_PEEP_MOVES],
+                    (unsigned long long)c[i]);
+        }
+        fprintf(out, "}}}\n");
+    } else {
+        fprintf(out, "time report (ms)        wall        cpu\n");
+        for (int p = 0; p < PHASE_COUNT; p++) {
+            fprintf(out, "  %-16s %10.3f %10.3f\n", phase_name[p], ms(totals[p].wall_ns), ms(totals[p].cpu_ns));
+        }
+        fprintf(out, "  %-16s %10.3f %10.3f\n", "total", ms(wall), ms(cpu));
+        if (nmodules) fprintf(out, "per module (wall/cpu ms)\n");
+        for (size_t i = 0; i < nmodules; i++) {
+            fprintf(out, "  %s\n   ", modules[i].path);
+            for (int p = 0; p <= PHASE_EMIT; p++) {
+                fprintf(out, " %s %.3f/%.3f", phase_name[p], ms(modules[i].phases[p].wall_ns),
+                        ms(modules[i].phases[p].cpu_ns));
+            }
+            fputc('\n', out);
+        }
+        fprintf(out, "counters\n");
+        fprintf(out, "  %-20s %12llu\n", "tokens lexed", (unsigned long long)c[COUNT_TOKENS]);
+        fprintf(out, "  %-20s %12llu (avg probe length %.2f)\n", "symbol lookups", (unsigned long long)c[COUNT_LOOKUPS],
+                probe_len);
+        fprintf(out, "  %-20s %12llu\n", "macro expansions", (unsigned long long)c[COUNT_MACRO_EXPANSIONS]);
+        fprintf(out, "  %-20s %12llu\n", "bytes emitted", (unsigned long long)c[COUNT_BYTES_EMITTED]);
+        fprintf(out, "  %-20s %12llu (%llu bytes)\n", "allocations", (unsigned long long)c[COUNT_ALLOCATIONS],
+                (unsigned long long)c[COUNT_ALLOCATED_BYTES]);
+        fprintf(out, "  %-20s %12ld KiB\n", "peak RSS", peak_rss_kb);
+        for (int i = COUNT_PEEP_MOVES; i < COUNTER_COUNT; i++) {
+            fprintf(out, "  peephole %-11s %12llu\n", peephole_name[i - COUNT_PEEP_MOVES], (unsigned long long)c[i]);
+        }
+    }
+    pthread_mutex_unlock(&timing_lock);
+}
@@ -0,0 +1,62 @@
+#ifndef CHASMC_TIMING_H
+#define CHASMC_TIMING_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// --time-report: wall and CPU time per compiler phase, split by source
+// module, plus a few counters. Everything here is a no-op until
+// timing_enable, so the hooks cost a predictable branch in a normal run.
+typedef enum {
+    PHASE_LEX,
+    PHASE_SCAN,      // symbol scan, or reading the tables of an interface
+    PHASE_EMIT,      // parse and emit; for the program, splicing modules together
+    PHASE_ASSEMBLE,  // nasm or the built-in assembler
+    PHASE_LINK,      // ld or the built-in linker
+    PHASE_COUNT,
+} Phase;
+
+typedef enum {
+    COUNT_TOKENS,
+    COUNT_LOOKUPS,  // symbol table lookups
+    COUNT_PROBES,   // hash slots visited by those lookups
+    COUNT_MACRO_EXPANSIONS,
+    COUNT_BYTES_EMITTED,
+    COUNT_ALLOCATIONS,  // arena allocations
+    COUNT_ALLOCATED_BYTES,
+    // -O1 peephole rewrites, by pattern (see peephole.h)
+    COUNT_PEEP_MOVES,
+    COUNT_PEEP_STORE_LOADS,
+    COUNT_PEEP_OPERANDS,
+    COUNT_PEEP_ZERO_IDIOMS,
+    COUNT_PEEP_ZERO_STORES,
+    COUNT_PEEP_EXTENSIONS,
+    COUNTER_COUNT,
+} Counter;
+
+extern bool timing_enabled;
+extern atomic_uint_least64_t timing_counters[COUNTER_COUNT];
+
+static inline void timing_count(Counter c, uint64_t n) {
+    if (timing_enabled) atomic_fetch_add_explicit(&timing_counters[c], n, memory_order_relaxed);
+}
+
+typedef struct {
+    uint64_t wall_ns;
+    uint64_t cpu_ns;
+    uint64_t child_cpu_ns;
+} TimingMark;
+
+void timing_enable(void);
+TimingMark timing_start(void);
+// Charges the time since `start` to a phase of `module` (an interned source
+// path), or of the whole program when module is NULL. CPU time is the
+// calling thread's plus that of child processes it waited for.
+void timing_stop(Phase phase, const char* module, TimingMark start);
+// CPU time of a child process reaped by this thread, from wait4.
+void timing_add_child_cpu(uint64_t cpu_ns);
+void timing_print(FILE* out, bool json);
+
+#endif
@@ -1,28 +1,151 @@
+#define _DEFAULT_SOURCE
+
 #include "util.h"
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static _Thread_local jmp_buf* die_trap;
+static _Thread_local DieContext die_context;
+static _Thread_local bool die_quiet;
 
 void die(const char* msg) {
-    fprintf(stderr, "chasmc error: %s\n", msg);
+    char where[512] = "";
+    DieContext context = die_context;
+    die_context = (DieContext){0};
+    if (die_quiet) longjmp(*die_trap, 1);
+    if (context.describe) context.describe(context.ctx, where, sizeof(where));
+    fprintf(stderr, "chasmc error: %s%s\n", where, msg);
+    if (die_trap) longjmp(*die_trap, 1);
     exit(1);
 }
 
-char* read_file_all(const char* path, size_t* out_len) {
-    FILE *f = fopen(path, "rb");
-    if (!f) die("cannot open input file");
-    fseek(f, 0, SEEK_END);
-    long sz = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    if (sz < 0) die ("ftell failed");
-    char *buf = (char *)malloc((size_t)sz + 1);
+void die_set_trap(jmp_buf* trap) { die_trap = trap; }
+
+bool die_quietly(void (*fn)(void* arg), void* arg) {
+    jmp_buf trap;
+    jmp_buf* outer = die_trap;
+    bool outer_quiet = die_quiet;
+    DieContext outer_context = die_context;
+    die_trap = &trap;
+    die_quiet = true;
+    if (setjmp(trap) == 0) {
+        fn(arg);
+        die_trap = outer;
+        die_quiet = outer_quiet;
+        return true;
+    }
+    die_trap = outer;
+    die_quiet = outer_quiet;
+    die_context = outer_context;
+    return false;
+}
+
+DieContext die_set_context(DieContext context) {
+    DieContext previous = die_context;
+    die_context = context;
+    return previous;
+}
+
+static void read_fd_all(FileView* view, int fd) {
+    size_t cap = 64 * 1024;
+    size_t len = 0;
+    char* buf = (char*)malloc(cap);
     if (!buf) die("Fatal: Out of Memory");
-    size_t got = fread(buf, 1, (size_t)sz, f);
-    fclose(f);
-    buf[got] = 0;
-    if (out_len) *out_len = got;
-    return buf;
+    for (;;) {
+        if (len == cap) {
+            cap *= 2;
+            buf = (char*)realloc(buf, cap);
+            if (!buf) die("Fatal: Out of Memory");
+        }
+        ssize_t got = read(fd, buf + len, cap - len);
+        if (got < 0) die("read failed");
+        if (got == 0) break;
+        len += (size_t)got;
+    }
+    view->data = buf;
+    view->len = len;
+    view->map_len = 0;
+}
+
+void file_view_open(FileView* view, const char* path) {
+    if (!file_view_try_open(view, path)) die("cannot open input file");
+}
+
+bool file_view_try_open(FileView* view, const char* path) {
+    int is_stdin = strcmp(path, "-") == 0;
+    int fd = is_stdin ? STDIN_FILENO : open(path, O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        size_t size = (size_t)st.st_size;
+        void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            madvise(map, size, MADV_SEQUENTIAL);
+            view->data = (const char*)map;
+            view->len = size;
+            view->map_len = size;
+            if (!is_stdin) close(fd);
+            return true;
+        }
+    }
+
+    read_fd_all(view, fd);
+    if (!is_stdin) close(fd);
+    return true;
+}
+
+void file_view_close(FileView* view) {
+    if (view->map_len) munmap((void*)view->data, view->map_len);
+    else free((void*)view->data);
+    view->data = NULL;
+    view->len = 0;
+    view->map_len = 0;
+}
+
+// Upper bound for a single write(); keeps each syscall bounded on huge outputs.
+#define WRITE_CHUNK (8 * 1024 * 1024)
+
+void write_fd_all(int fd, const void* data, size_t len) {
+    const char* p = (const char*)data;
+    while (len > 0) {
+        size_t chunk = (len > WRITE_CHUNK) ? WRITE_CHUNK : len;
+        ssize_t n = write(fd, p, chunk);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            die("write failed");
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+}
+
+void write_file_all(const char* path, const void* data, size_t len) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) die("cannot open output file");
+    write_fd_all(fd, data, len);
+    if (close(fd) != 0) die("write failed");
+}
+
+// Like ld, replaces rather than truncates the output so it is created with
+// execute permission whatever the old file's mode was.
+void write_executable(const char* path, const void* data, size_t len) {
+    if (unlink(path) != 0 && errno != ENOENT) die("cannot replace output file");
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0777);
+    if (fd < 0) die("cannot open output file");
+    write_fd_all(fd, data, len);
+    if (close(fd) != 0) die("write failed");
+}
+
+char* xrealpath(const char* path) {
+    return realpath(path, NULL);
 }
 
 char* xstrdup(const char* src) {
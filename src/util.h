@@ -1,10 +1,45 @@
 #ifndef CHASMC_UTIL_H
 #define CHASMC_UTIL_H
 
+#include <setjmp.h>
+#include <stdbool.h>
 #include <stddef.h>
 
+// Read-only view of a file's contents. Regular files are memory-mapped;
+// pipes and stdin ("-") fall back to a buffered read.
+typedef struct {
+    const char* data;
+    size_t len;
+    size_t map_len;
+} FileView;
+
 void die(const char* msg);
-char *read_file_all(const char* path, size_t* out_len);
+// While a trap is set, die() reports the message and longjmps to it instead
+// of exiting. For work a long-lived process can abandon, such as the compile
+// server lexing a file that is half-way through an edit, or one program of a
+// batch. The trap is per thread.
+void die_set_trap(jmp_buf* trap);
+// Runs fn(arg) and returns false, without reporting anything, if it dies.
+// For speculative work that is redone the ordinary way when it fails, so the
+// error is then reported as usual. Any trap already set is kept.
+bool die_quietly(void (*fn)(void* arg), void* arg);
+// Where the current work is in its input. While set, die() asks describe for
+// a prefix such as "path:line:col: ", so positions are only computed for the
+// error that is actually reported. Per thread; returns the previous context,
+// which the caller restores when done. die() clears it.
+typedef struct {
+    void (*describe)(const void* ctx, char* buf, size_t cap);
+    const void* ctx;
+} DieContext;
+DieContext die_set_context(DieContext context);
+void file_view_open(FileView* view, const char* path);
+bool file_view_try_open(FileView* view, const char* path);
+void file_view_close(FileView* view);
+void write_fd_all(int fd, const void* data, size_t len);
+void write_file_all(const char* path, const void* data, size_t len);
+void write_executable(const char* path, const void* data, size_t len);
 char *xstrdup(const char* src);
+// Canonical absolute path (malloc'd), or NULL if it does not resolve.
+char* xrealpath(const char* path);
 
 #endif
@@ -0,0 +1,1051 @@
+#include "x86_asm.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+#define NO_SYM SIZE_MAX
+#define MAX_OPERANDS 3
+#define MAX_WORD 16
+
+typedef enum { OP_NONE, OP_REG, OP_IMM, OP_MEM } OpKind;
+
+typedef struct {
+    OpKind kind;
+    int size;       // 1, 2, 4 or 8; 0 when a memory operand has no size keyword
+    int reg;        // OP_REG register, or OP_MEM base (-1 for none)
+    bool byte_rex;  // spl/bpl/sil/dil: only encodable with a REX prefix
+    bool high;      // ah/ch/dh/bh: only encodable without one
+    int index;      // OP_MEM index register, -1 for none
+    int scale;
+    bool rip;
+    int64_t value;  // OP_IMM value or OP_MEM displacement
+    size_t sym;     // symbol the value is relative to, NO_SYM for none
+} Operand;
+
+// A rel32 field (call/jmp/jcc target or [rel sym] displacement) resolved once
+// every label is known.
+typedef struct {
+    int section;
+    size_t offset;  // of the 4-byte field
+    size_t end;     // of the instruction, which rel32 is relative to
+    size_t symbol;
+    int64_t addend;
+} Fixup;
+
+typedef struct {
+    ObjFile* obj;
+    int section;
+    bool default_rel;
+    const char* scope;  // last non-local label, prefix for .local labels
+    Fixup* fixups;
+    size_t nfixups;
+    size_t fixups_cap;
+} Asm;
+
+typedef struct {
+    const char* p;
+    const char* end;
+} Cursor;
+
+static const char* const reg_names[4][16] = {
+    {"al", "cl", "dl", "bl", "spl", "bpl", "sil", "dil", "r8b", "r9b", "r10b", "r11b", "r12b", "r13b", "r14b", "r15b"},
+    {"ax", "cx", "dx", "bx", "sp", "bp", "si", "di", "r8w", "r9w", "r10w", "r11w", "r12w", "r13w", "r14w", "r15w"},
+    {"eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi", "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d",
+     "r15d"},
+    {"rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi", "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15"},
+};
+static const char* const high_names[4] = {"ah", "ch", "dh", "bh"};
+static const uint8_t scale_bits[9] = {0, 0, 1, 0, 2, 0, 0, 0, 3};
+
+// Condition code suffixes for jcc/setcc/cmovcc, by encoding.
+static const char* const cc_names[][4] = {
+    {"o"}, {"no"}, {"b", "c", "nae"}, {"ae", "nb", "nc"}, {"e", "z"}, {"ne", "nz"}, {"be", "na"}, {"a", "nbe"},
+    {"s"}, {"ns"}, {"p", "pe"}, {"np", "po"}, {"l", "nge"}, {"ge", "nl"}, {"le", "ng"}, {"g", "nle"},
+};
+
+static bool is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+static bool is_alpha(char c) { return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z'); }
+
+static bool is_digit(char c) { return c >= '0' && c <= '9'; }
+
+static bool is_ident_start(char c) { return is_alpha(c) || c == '_' || c == '.' || c == '?'; }
+
+static bool is_ident_char(char c) {
+    return is_alpha(c) || is_digit(c) || c == '_' || c == '.' || c == '?' || c == '$' || c == '#' || c == '@' ||
+           c == '~';
+}
+
+static char to_lower(char c) { return (c >= 'A' && c <= 'Z') ? (char)(c - 'A' + 'a') : c; }
+
+static void skip_space(Cursor* c) {
+    while (c->p < c->end && is_space(*c->p)) c->p++;
+}
+
+static void trim(const char** s, const char** e) {
+    while (*s < *e && is_space(**s)) (*s)++;
+    while (*e > *s && is_space((*e)[-1])) (*e)--;
+}
+
+// Lower-cased copy of [s, e) for keyword lookups; false if it is too long to
+// be a keyword.
+static bool lower_word(const char* s, const char* e, char* buf) {
+    size_t n = (size_t)(e - s);
+    if (n == 0 || n >= MAX_WORD) return false;
+    for (size_t i = 0; i < n; i++) buf[i] = to_lower(s[i]);
+    buf[n] = 0;
+    return true;
+}
+
+static const char* ident_end(const char* s, const char* e) {
+    if (s >= e || !is_ident_start(*s)) return s;
+    while (s < e && is_ident_char(*s)) s++;
+    return s;
+}
+
+static bool find_register(const char* s, const char* e, Operand* op) {
+    char w[MAX_WORD];
+    if (e - s < 2 || e - s > 4 || !lower_word(s, e, w)) return false;
+    for (int size = 0; size < 4; size++) {
+        for (int r = 0; r < 16; r++) {
+            if (strcmp(w, reg_names[size][r]) != 0) continue;
+            *op = (Operand){.kind = OP_REG, .size = 1 << size, .reg = r, .index = -1, .sym = NO_SYM};
+            op->byte_rex = size == 0 && r >= 4 && r < 8;
+            return true;
+        }
+    }
+    for (int r = 0; r < 4; r++) {
+        if (strcmp(w, high_names[r]) != 0) continue;
+        *op = (Operand){.kind = OP_REG, .size = 1, .reg = r + 4, .high = true, .index = -1, .sym = NO_SYM};
+        return true;
+    }
+    return false;
+}
+
+static int find_cc(const char* suffix) {
+    for (int cc = 0; cc < 16; cc++) {
+        for (int i = 0; i < 4 && cc_names[cc][i]; i++) {
+            if (strcmp(suffix, cc_names[cc][i]) == 0) return cc;
+        }
+    }
+    return -1;
+}
+
+// Symbols named in the text. ".name" is local to the previous plain label,
+// as in nasm.
+static size_t symbol_ref(Asm* A, const char* s, const char* e) {
+    const char* name;
+    if (*s == '.' && !(e - s > 1 && s[1] == '.') && A->scope) {
+        name = intern_concat(A->scope, strlen(A->scope), s, (size_t)(e - s), "", 0);
+    } else {
+        name = intern(s, (size_t)(e - s));
+    }
+    return obj_symbol(A->obj, name);
+}
+
+// ---- Expressions ----
+// Integer constants, character constants and at most one symbol, combined
+// with + - * / and parentheses. Anything else is left to nasm.
+
+typedef struct {
+    int64_t value;
+    size_t sym;
+} Expr;
+
+static bool parse_sum(Asm* A, Cursor* c, Expr* out);
+
+static bool parse_number(Cursor* c, int64_t* out) {
+    char buf[72];
+    size_t n = 0;
+    while (c->p < c->end && (is_alpha(*c->p) || is_digit(*c->p) || *c->p == '_')) {
+        if (*c->p != '_') {
+            if (n + 1 >= sizeof(buf)) return false;
+            buf[n++] = to_lower(*c->p);
+        }
+        c->p++;
+    }
+    buf[n] = 0;
+    int base = 10;
+    char* digits = buf;
+    if (n > 2 && buf[0] == '0' && (buf[1] == 'x' || buf[1] == 'h')) {
+        base = 16;
+        digits += 2;
+    } else if (n > 1 && buf[n - 1] == 'h') {
+        base = 16;
+        buf[--n] = 0;
+    } else if (n > 2 && buf[0] == '0' && (buf[1] == 'b' || buf[1] == 'y')) {
+        base = 2;
+        digits += 2;
+    } else if (n > 2 && buf[0] == '0' && (buf[1] == 'o' || buf[1] == 'q')) {
+        base = 8;
+        digits += 2;
+    } else if (n > 2 && buf[0] == '0' && (buf[1] == 'd' || buf[1] == 't')) {
+        digits += 2;
+    } else if (n > 1 && (buf[n - 1] == 'b' || buf[n - 1] == 'y')) {
+        base = 2;
+        buf[--n] = 0;
+    } else if (n > 1 && (buf[n - 1] == 'o' || buf[n - 1] == 'q')) {
+        base = 8;
+        buf[--n] = 0;
+    } else if (n > 1 && (buf[n - 1] == 'd' || buf[n - 1] == 't')) {
+        buf[--n] = 0;
+    }
+    if (!*digits) return false;
+    uint64_t v = 0;
+    for (char* d = digits; *d; d++) {
+        int digit = is_digit(*d) ? *d - '0' : (*d >= 'a' && *d <= 'f') ? *d - 'a' + 10 : 99;
+        if (digit >= base) return false;
+        v = v * (uint64_t)base + (uint64_t)digit;
+    }
+    *out = (int64_t)v;
+    return true;
+}
+
+// 'ab' and "ab" are the little-endian integer of their bytes.
+static bool parse_char_const(Cursor* c, int64_t* out) {
+    char q = *c->p++;
+    const char* s = c->p;
+    while (c->p < c->end && *c->p != q) c->p++;
+    if (c->p >= c->end) return false;
+    size_t n = (size_t)(c->p - s);
+    c->p++;
+    if (n > 8) return false;
+    uint64_t v = 0;
+    for (size_t i = 0; i < n; i++) v |= (uint64_t)(unsigned char)s[i] << (8 * i);
+    *out = (int64_t)v;
+    return true;
+}
+
+static bool parse_primary(Asm* A, Cursor* c, Expr* out) {
+    skip_space(c);
+    if (c->p >= c->end) return false;
+    char ch = *c->p;
+    *out = (Expr){0, NO_SYM};
+    if (ch == '(') {
+        c->p++;
+        if (!parse_sum(A, c, out)) return false;
+        skip_space(c);
+        if (c->p >= c->end || *c->p != ')') return false;
+        c->p++;
+        return true;
+    }
+    if (is_digit(ch)) return parse_number(c, &out->value);
+    if (ch == '\'' || ch == '"') return parse_char_const(c, &out->value);
+    const char* e = ident_end(c->p, c->end);
+    if (e == c->p) return false;
+    Operand reg;
+    if (find_register(c->p, e, &reg)) return false;
+    out->sym = symbol_ref(A, c->p, e);
+    c->p = e;
+    return true;
+}
+
+static bool parse_unary(Asm* A, Cursor* c, Expr* out) {
+    skip_space(c);
+    if (c->p < c->end && (*c->p == '-' || *c->p == '+' || *c->p == '~')) {
+        char op = *c->p++;
+        if (!parse_unary(A, c, out)) return false;
+        if (op == '+') return true;
+        if (out->sym != NO_SYM) return false;
+        out->value = (op == '-') ? (int64_t)(0 - (uint64_t)out->value) : ~out->value;
+        return true;
+    }
+    return parse_primary(A, c, out);
+}
+
+static bool parse_product(Asm* A, Cursor* c, Expr* out) {
+    if (!parse_unary(A, c, out)) return false;
+    for (;;) {
+        skip_space(c);
+        if (c->p >= c->end || (*c->p != '*' && *c->p != '/')) return true;
+        char op = *c->p++;
+        // "//" (signed division) and friends are not in the subset.
+        if (c->p < c->end && *c->p == '/') return false;
+        Expr rhs;
+        if (!parse_unary(A, c, &rhs)) return false;
+        if (out->sym != NO_SYM || rhs.sym != NO_SYM) return false;
+        if (op == '*') {
+            out->value = (int64_t)((uint64_t)out->value * (uint64_t)rhs.value);
+        } else {
+            if (rhs.value == 0) return false;
+            out->value = (int64_t)((uint64_t)out->value / (uint64_t)rhs.value);
+        }
+    }
+}
+
+static bool parse_sum(Asm* A, Cursor* c, Expr* out) {
+    if (!parse_product(A, c, out)) return false;
+    for (;;) {
+        skip_space(c);
+        if (c->p >= c->end || (*c->p != '+' && *c->p != '-')) return true;
+        char op = *c->p++;
+        Expr rhs;
+        if (!parse_product(A, c, &rhs)) return false;
+        if (rhs.sym != NO_SYM) {
+            if (op == '-' || out->sym != NO_SYM) return false;
+            out->sym = rhs.sym;
+        }
+        uint64_t v = (uint64_t)out->value;
+        out->value = (int64_t)((op == '+') ? v + (uint64_t)rhs.value : v - (uint64_t)rhs.value);
+    }
+}
+
+static bool parse_expr(Asm* A, const char* s, const char* e, Expr* out) {
+    Cursor c = {s, e};
+    if (!parse_sum(A, &c, out)) return false;
+    skip_space(&c);
+    return c.p == c.end;
+}
+
+// ---- Operands ----
+
+static bool fits_i8(int64_t v) { return v >= -128 && v <= 127; }
+
+static bool fits_i32(int64_t v) { return v >= INT32_MIN && v <= INT32_MAX; }
+
+static int64_t sign_extend(int64_t v, int size) {
+    if (size == 8) return v;
+    int shift = 64 - 8 * size;
+    return (int64_t)((uint64_t)v << shift) >> shift;
+}
+
+static bool parse_memory(Asm* A, const char* s, const char* e, Operand* op) {
+    op->kind = OP_MEM;
+    op->reg = -1;
+    op->index = -1;
+    op->scale = 1;
+    op->value = 0;
+    op->sym = NO_SYM;
+    Cursor c = {s, e};
+    skip_space(&c);
+    bool rel = A->default_rel;
+    const char* w = ident_end(c.p, c.end);
+    char word[MAX_WORD];
+    if (w < c.end && is_space(*w) && lower_word(c.p, w, word) &&
+        (strcmp(word, "rel") == 0 || strcmp(word, "abs") == 0)) {
+        rel = word[0] == 'r';
+        c.p = w;
+    }
+
+    bool negative = false;
+    for (;;) {
+        skip_space(&c);
+        if (c.p >= c.end) return false;
+        const char* id = ident_end(c.p, c.end);
+        Operand reg;
+        if (id > c.p && find_register(c.p, id, &reg)) {
+            if (negative || reg.size != 8) return false;
+            c.p = id;
+            skip_space(&c);
+            int scale = 0;
+            if (c.p < c.end && *c.p == '*') {
+                c.p++;
+                skip_space(&c);
+                int64_t n = 0;
+                if (c.p >= c.end || !is_digit(*c.p) || !parse_number(&c, &n)) return false;
+                if (n != 1 && n != 2 && n != 4 && n != 8) return false;
+                scale = (int)n;
+            }
+            if (scale == 0 && op->reg < 0) {
+                op->reg = reg.reg;
+            } else if (op->index < 0) {
+                op->index = reg.reg;
+                op->scale = scale ? scale : 1;
+            } else {
+                return false;
+            }
+        } else {
+            Expr term;
+            if (!parse_product(A, &c, &term)) return false;
+            if (term.sym != NO_SYM) {
+                if (negative || op->sym != NO_SYM) return false;
+                op->sym = term.sym;
+            }
+            uint64_t v = (uint64_t)op->value;
+            op->value = (int64_t)(negative ? v - (uint64_t)term.value : v + (uint64_t)term.value);
+        }
+        skip_space(&c);
+        if (c.p >= c.end) break;
+        if (*c.p != '+' && *c.p != '-') return false;
+        negative = *c.p == '-';
+        c.p++;
+    }
+
+    if (op->index == 4) {
+        // rsp cannot be an index; [rax+rsp] is encoded as [rsp+rax].
+        if (op->scale != 1 || op->reg == 4) return false;
+        op->index = op->reg;
+        op->reg = 4;
+    }
+    if (op->reg < 0 && op->index >= 0 && op->scale == 1) {
+        op->reg = op->index;
+        op->index = -1;
+    }
+    if (!fits_i32(op->value)) return false;
+    if (op->sym != NO_SYM) {
+        // Symbolic addresses are only supported RIP-relative.
+        if (op->reg >= 0 || op->index >= 0 || !rel) return false;
+        op->rip = true;
+        return true;
+    }
+    return op->reg >= 0 || op->index >= 0;
+}
+
+static bool parse_operand(Asm* A, const char* s, const char* e, Operand* op) {
+    *op = (Operand){.kind = OP_NONE, .reg = -1, .index = -1, .sym = NO_SYM};
+    trim(&s, &e);
+    if (s == e) return false;
+    int size = 0;
+    for (;;) {
+        const char* w = ident_end(s, e);
+        char word[MAX_WORD];
+        if (w == s || w == e || !lower_word(s, w, word)) break;
+        int kw_size = 0;
+        if (strcmp(word, "byte") == 0) kw_size = 1;
+        else if (strcmp(word, "word") == 0) kw_size = 2;
+        else if (strcmp(word, "dword") == 0) kw_size = 4;
+        else if (strcmp(word, "qword") == 0) kw_size = 8;
+        else if (strcmp(word, "near") != 0 && strcmp(word, "short") != 0) break;
+        if (kw_size) size = kw_size;
+        s = w;
+        trim(&s, &e);
+    }
+    if (*s == '[') {
+        if (e[-1] != ']') return false;
+        if (!parse_memory(A, s + 1, e - 1, op)) return false;
+        op->size = size;
+        return true;
+    }
+    if (find_register(s, e, op)) return size == 0;
+    Expr ex;
+    if (!parse_expr(A, s, e, &ex)) return false;
+    op->kind = OP_IMM;
+    op->size = size;
+    op->value = ex.value;
+    op->sym = ex.sym;
+    return true;
+}
+
+// Splits an operand list at top-level commas.
+static int split_operands(const char* s, const char* e, const char** starts, const char** ends) {
+    int n = 0;
+    int depth = 0;
+    char quote = 0;
+    const char* start = s;
+    for (const char* p = s; p <= e; p++) {
+        if (p < e && quote) {
+            if (*p == quote) quote = 0;
+            continue;
+        }
+        if (p < e && (*p == '\'' || *p == '"' || *p == '`')) {
+            quote = *p;
+        } else if (p < e && (*p == '[' || *p == '(')) {
+            depth++;
+        } else if (p < e && (*p == ']' || *p == ')')) {
+            depth--;
+        } else if (p == e || (*p == ',' && depth == 0)) {
+            if (n == MAX_OPERANDS) return -1;
+            starts[n] = start;
+            ends[n] = p;
+            n++;
+            start = p + 1;
+        }
+    }
+    return quote ? -1 : n;
+}
+
+// ---- Encoding ----
+
+static bool put_bytes(Asm* A, const uint8_t* b, size_t n) {
+    if (A->section == OBJ_BSS) return false;
+    ObjSection* sec = &A->obj->sections[A->section];
+    out_mem(&sec->data, (const char*)b, n);
+    sec->size = sec->data.len;
+    sec->used = true;
+    return true;
+}
+
+static size_t section_offset(const Asm* A) { return A->obj->sections[A->section].size; }
+
+static void add_fixup(Asm* A, size_t offset, size_t end, size_t symbol, int64_t addend) {
+    if (A->nfixups == A->fixups_cap) {
+        A->fixups_cap = A->fixups_cap ? A->fixups_cap * 2 : 64;
+        A->fixups = (Fixup*)realloc(A->fixups, A->fixups_cap * sizeof(Fixup));
+        if (!A->fixups) die("oom");
+    }
+    A->fixups[A->nfixups++] = (Fixup){A->section, offset, end, symbol, addend};
+}
+
+static void put_le(uint8_t* b, int* n, uint64_t v, int size) {
+    for (int i = 0; i < size; i++) b[(*n)++] = (uint8_t)(v >> (8 * i));
+}
+
+static void put_opcode(uint8_t* b, int* n, uint32_t opcode) {
+    if (opcode > 0xFFFF) b[(*n)++] = (uint8_t)(opcode >> 16);
+    if (opcode > 0xFF) b[(*n)++] = (uint8_t)(opcode >> 8);
+    b[(*n)++] = (uint8_t)opcode;
+}
+
+// [66] [REX] opcode ModRM [SIB] [disp] [imm]. `size` 2 adds the operand-size
+// prefix and 8 sets REX.W; instructions that default to 64-bit pass 0. `reg`
+// is the ModRM reg field (a register number or an opcode extension) and
+// `rop` the register operand it came from, if any.
+static bool emit_rm(Asm* A, int size, uint32_t opcode, int reg, const Operand* rop, const Operand* rm, int imm_size,
+                    int64_t imm) {
+    uint8_t b[16];
+    int n = 0;
+    int rex = (size == 8 ? 8 : 0) | ((reg & 8) ? 4 : 0);
+    bool force_rex = rop && rop->byte_rex;
+    bool high = rop && rop->high;
+    if (rm->kind == OP_REG) {
+        if (rm->reg & 8) rex |= 1;
+        force_rex = force_rex || rm->byte_rex;
+        high = high || rm->high;
+    } else {
+        if (rm->reg >= 0 && (rm->reg & 8)) rex |= 1;
+        if (rm->index >= 0 && (rm->index & 8)) rex |= 2;
+    }
+    if ((rex || force_rex) && high) return false;
+
+    if (size == 2) b[n++] = 0x66;
+    if (rex || force_rex) b[n++] = (uint8_t)(0x40 | rex);
+    put_opcode(b, &n, opcode);
+    int disp_at = -1;
+    if (rm->kind == OP_REG) {
+        b[n++] = (uint8_t)(0xC0 | (reg & 7) << 3 | (rm->reg & 7));
+    } else if (rm->rip) {
+        b[n++] = (uint8_t)((reg & 7) << 3 | 5);
+        disp_at = n;
+        put_le(b, &n, 0, 4);
+    } else if (rm->reg < 0) {
+        b[n++] = (uint8_t)((reg & 7) << 3 | 4);
+        b[n++] = (uint8_t)(scale_bits[rm->scale] << 6 | (rm->index & 7) << 3 | 5);
+        put_le(b, &n, (uint64_t)rm->value, 4);
+    } else {
+        int mod = 2;
+        if (rm->value == 0 && (rm->reg & 7) != 5) mod = 0;
+        else if (fits_i8(rm->value)) mod = 1;
+        bool sib = rm->index >= 0 || (rm->reg & 7) == 4;
+        b[n++] = (uint8_t)(mod << 6 | (reg & 7) << 3 | (sib ? 4 : (rm->reg & 7)));
+        if (sib) {
+            int index = rm->index >= 0 ? rm->index : 4;
+            b[n++] = (uint8_t)(scale_bits[rm->scale] << 6 | (index & 7) << 3 | (rm->reg & 7));
+        }
+        if (mod == 1) put_le(b, &n, (uint64_t)rm->value, 1);
+        if (mod == 2) put_le(b, &n, (uint64_t)rm->value, 4);
+    }
+    put_le(b, &n, (uint64_t)imm, imm_size);
+
+    size_t start = section_offset(A);
+    if (!put_bytes(A, b, (size_t)n)) return false;
+    if (disp_at >= 0) add_fixup(A, start + (size_t)disp_at, start + (size_t)n, rm->sym, rm->value);
+    return true;
+}
+
+// Register-in-opcode forms: push/pop r64, mov r, imm.
+static bool emit_opreg(Asm* A, int size, uint8_t opcode, const Operand* r, int imm_size, int64_t imm, size_t sym) {
+    uint8_t b[16];
+    int n = 0;
+    int rex = (size == 8 ? 8 : 0) | ((r->reg & 8) ? 1 : 0);
+    if ((rex || r->byte_rex) && r->high) return false;
+    if (size == 2) b[n++] = 0x66;
+    if (rex || r->byte_rex) b[n++] = (uint8_t)(0x40 | rex);
+    b[n++] = (uint8_t)(opcode + (r->reg & 7));
+    int imm_at = n;
+    put_le(b, &n, (uint64_t)imm, imm_size);
+    size_t start = section_offset(A);
+    if (!put_bytes(A, b, (size_t)n)) return false;
+    if (sym != NO_SYM) {
+        ObjReloc rel = {A->section, start + (size_t)imm_at, sym, imm_size == 8 ? OBJ_RELOC_ABS64 : OBJ_RELOC_ABS32,
+                        imm};
+        obj_add_reloc(A->obj, rel);
+    }
+    return true;
+}
+
+static bool emit_branch(Asm* A, uint32_t opcode, const Operand* target) {
+    if (target->kind != OP_IMM || target->sym == NO_SYM) return false;
+    uint8_t b[8];
+    int n = 0;
+    put_opcode(b, &n, opcode);
+    int field = n;
+    put_le(b, &n, 0, 4);
+    size_t start = section_offset(A);
+    if (!put_bytes(A, b, (size_t)n)) return false;
+    add_fixup(A, start + (size_t)field, start + (size_t)n, target->sym, target->value);
+    return true;
+}
+
+static bool emit_plain(Asm* A, uint32_t opcode, int size) {
+    uint8_t b[4];
+    int n = 0;
+    if (size == 8) b[n++] = 0x48;
+    put_opcode(b, &n, opcode);
+    return put_bytes(A, b, (size_t)n);
+}
+
+static bool is_rm(const Operand* op) { return op->kind == OP_REG || op->kind == OP_MEM; }
+
+// Operand size of a two-operand instruction: both sides must agree where
+// both are known, as nasm requires.
+static int pair_size(const Operand* a, const Operand* b) {
+    if (a->size && b->kind != OP_IMM && b->size && a->size != b->size) return 0;
+    return a->size ? a->size : (b->kind != OP_IMM ? b->size : 0);
+}
+
+static int imm_size_for(int size) { return size == 8 ? 4 : size; }
+
+static bool imm_fits(int size, int64_t v) {
+    if (size == 8) return fits_i32(v);
+    return true;  // nasm truncates narrower immediates with a warning
+}
+
+static bool encode_mov(Asm* A, const Operand* d, const Operand* s) {
+    if (d->kind == OP_REG && s->kind == OP_IMM) {
+        if (s->sym != NO_SYM) {
+            if (d->size == 8) return emit_opreg(A, 8, 0xB8, d, 8, s->value, s->sym);
+            if (d->size == 4) return emit_opreg(A, 4, 0xB8, d, 4, s->value, s->sym);
+            return false;
+        }
+        if (d->size == 1) return emit_opreg(A, 1, 0xB0, d, 1, s->value, NO_SYM);
+        if (d->size != 8) return emit_opreg(A, d->size, 0xB8, d, d->size, s->value, NO_SYM);
+        // Shortest form with the same result, as nasm picks under -Ox.
+        if (s->value >= 0 && s->value <= (int64_t)UINT32_MAX) return emit_opreg(A, 4, 0xB8, d, 4, s->value, NO_SYM);
+        if (fits_i32(s->value)) return emit_rm(A, 8, 0xC7, 0, NULL, d, 4, s->value);
+        return emit_opreg(A, 8, 0xB8, d, 8, s->value, NO_SYM);
+    }
+    if (d->kind == OP_MEM && s->kind == OP_IMM) {
+        if (!d->size || s->sym != NO_SYM || !imm_fits(d->size, s->value)) return false;
+        return emit_rm(A, d->size, d->size == 1 ? 0xC6 : 0xC7, 0, NULL, d, imm_size_for(d->size), s->value);
+    }
+    int size = pair_size(d, s);
+    if (!size) return false;
+    if (s->kind == OP_REG && is_rm(d)) return emit_rm(A, size, size == 1 ? 0x88 : 0x89, s->reg, s, d, 0, 0);
+    if (d->kind == OP_REG && s->kind == OP_MEM) return emit_rm(A, size, size == 1 ? 0x8A : 0x8B, d->reg, d, s, 0, 0);
+    return false;
+}
+
+// add/or/adc/sbb/and/sub/xor/cmp share one layout; `op` is the group number.
+static bool encode_alu(Asm* A, int op, const Operand* d, const Operand* s) {
+    int size = pair_size(d, s);
+    if (!size || !is_rm(d)) return false;
+    if (s->kind == OP_IMM) {
+        if (s->sym != NO_SYM || !imm_fits(size, s->value)) return false;
+        if (size == 1) return emit_rm(A, 1, 0x80, op, NULL, d, 1, s->value);
+        int64_t v = sign_extend(s->value, size);
+        if (fits_i8(v)) return emit_rm(A, size, 0x83, op, NULL, d, 1, v);
+        return emit_rm(A, size, 0x81, op, NULL, d, imm_size_for(size), v);
+    }
+    uint32_t base = (uint32_t)op * 8;
+    if (s->kind == OP_REG) return emit_rm(A, size, base + (size == 1 ? 0 : 1), s->reg, s, d, 0, 0);
+    if (d->kind == OP_REG && s->kind == OP_MEM) return emit_rm(A, size, base + (size == 1 ? 2 : 3), d->reg, d, s, 0, 0);
+    return false;
+}
+
+static bool encode_test(Asm* A, const Operand* d, const Operand* s) {
+    int size = pair_size(d, s);
+    if (!size || !is_rm(d)) return false;
+    if (s->kind == OP_IMM) {
+        if (s->sym != NO_SYM || !imm_fits(size, s->value)) return false;
+        return emit_rm(A, size, size == 1 ? 0xF6 : 0xF7, 0, NULL, d, imm_size_for(size), s->value);
+    }
+    if (s->kind == OP_REG) return emit_rm(A, size, size == 1 ? 0x84 : 0x85, s->reg, s, d, 0, 0);
+    if (d->kind == OP_REG && s->kind == OP_MEM) return emit_rm(A, size, size == 1 ? 0x84 : 0x85, d->reg, d, s, 0, 0);
+    return false;
+}
+
+static bool encode_extend(Asm* A, bool sign, const Operand* d, const Operand* s) {
+    if (d->kind != OP_REG || !is_rm(s) || d->size == 1) return false;
+    if (s->size == 1 || s->size == 2) {
+        if (d->size <= s->size) return false;
+        uint32_t opcode = sign ? 0x0FBE : 0x0FB6;
+        return emit_rm(A, d->size, opcode + (s->size == 2 ? 1 : 0), d->reg, d, s, 0, 0);
+    }
+    // movsx r64, r/m32 is movsxd; nasm has no zero-extending form.
+    if (sign && s->size == 4 && d->size == 8) return emit_rm(A, 8, 0x63, d->reg, d, s, 0, 0);
+    return false;
+}
+
+static bool encode_unary(Asm* A, uint32_t opcode, int ext, const Operand* x) {
+    if (!is_rm(x) || !x->size) return false;
+    return emit_rm(A, x->size, x->size == 1 ? opcode : opcode + 1, ext, NULL, x, 0, 0);
+}
+
+static bool encode_shift(Asm* A, int ext, const Operand* d, const Operand* s) {
+    if (!is_rm(d) || !d->size) return false;
+    uint32_t wide = d->size == 1 ? 0 : 1;
+    if (s->kind == OP_REG && s->size == 1 && s->reg == 1 && !s->high) {
+        return emit_rm(A, d->size, 0xD2 + wide, ext, NULL, d, 0, 0);
+    }
+    if (s->kind != OP_IMM || s->sym != NO_SYM) return false;
+    if (s->value == 1) return emit_rm(A, d->size, 0xD0 + wide, ext, NULL, d, 0, 0);
+    return emit_rm(A, d->size, 0xC0 + wide, ext, NULL, d, 1, s->value);
+}
+
+static bool encode_push_pop(Asm* A, bool push, const Operand* x) {
+    if (x->kind == OP_REG) {
+        if (x->size != 8 && x->size != 2) return false;
+        return emit_opreg(A, x->size == 2 ? 2 : 0, push ? 0x50 : 0x58, x, 0, 0, NO_SYM);
+    }
+    if (x->kind == OP_MEM) {
+        if (x->size != 8 && x->size != 0) return false;
+        return push ? emit_rm(A, 0, 0xFF, 6, NULL, x, 0, 0) : emit_rm(A, 0, 0x8F, 0, NULL, x, 0, 0);
+    }
+    if (!push || x->sym != NO_SYM || !fits_i32(x->value)) return false;
+    uint8_t b[8];
+    int n = 0;
+    b[n++] = fits_i8(x->value) ? 0x6A : 0x68;
+    put_le(b, &n, (uint64_t)x->value, fits_i8(x->value) ? 1 : 4);
+    return put_bytes(A, b, (size_t)n);
+}
+
+static bool encode_call_jmp(Asm* A, bool call, const Operand* x) {
+    if (x->kind == OP_IMM) return emit_branch(A, call ? 0xE8 : 0xE9, x);
+    if ((x->kind == OP_REG && x->size == 8) || (x->kind == OP_MEM && (x->size == 8 || x->size == 0))) {
+        return emit_rm(A, 0, 0xFF, call ? 2 : 4, NULL, x, 0, 0);
+    }
+    return false;
+}
+
+static bool encode_imul(Asm* A, const Operand* ops, int n) {
+    if (n == 1) return encode_unary(A, 0xF6, 5, &ops[0]);
+    const Operand* d = &ops[0];
+    const Operand* s = &ops[1];
+    if (d->kind != OP_REG || d->size == 1 || !is_rm(s) || (s->size && s->size != d->size)) return false;
+    if (n == 2) return emit_rm(A, d->size, 0x0FAF, d->reg, d, s, 0, 0);
+    const Operand* k = &ops[2];
+    if (k->kind != OP_IMM || k->sym != NO_SYM || !imm_fits(d->size, k->value)) return false;
+    int64_t v = sign_extend(k->value, d->size);
+    if (fits_i8(v)) return emit_rm(A, d->size, 0x6B, d->reg, d, s, 1, v);
+    return emit_rm(A, d->size, 0x69, d->reg, d, s, imm_size_for(d->size), v);
+}
+
+static bool encode_instruction(Asm* A, const char* mn, const Operand* ops, int n) {
+    static const char* const alu[8] = {"add", "or", "adc", "sbb", "and", "sub", "xor", "cmp"};
+    static const char* const group3[8] = {NULL, NULL, "not", "neg", "mul", NULL, "div", "idiv"};
+    static const char* const shifts[8] = {"rol", "ror", "rcl", "rcr", "shl", "shr", "sal", "sar"};
+    static const struct {
+        const char* name;
+        uint32_t opcode;
+        int size;
+    } plain[] = {
+        {"ret", 0xC3, 0},   {"leave", 0xC9, 0}, {"syscall", 0x0F05, 0}, {"nop", 0x90, 0}, {"cqo", 0x99, 8},
+        {"cdq", 0x99, 0},   {"cdqe", 0x98, 8},  {"hlt", 0xF4, 0},       {"int3", 0xCC, 0}, {"ud2", 0x0F0B, 0},
+    };
+
+    if (n == 0) {
+        for (size_t i = 0; i < sizeof(plain) / sizeof(plain[0]); i++) {
+            if (strcmp(mn, plain[i].name) == 0) return emit_plain(A, plain[i].opcode, plain[i].size);
+        }
+        return false;
+    }
+    if (n == 2) {
+        if (strcmp(mn, "mov") == 0) return encode_mov(A, &ops[0], &ops[1]);
+        for (int i = 0; i < 8; i++) {
+            if (strcmp(mn, alu[i]) == 0) return encode_alu(A, i, &ops[0], &ops[1]);
+        }
+        for (int i = 0; i < 8; i++) {
+            // sal is shl (/4); sar is /7.
+            int ext = (i == 6) ? 4 : (i == 7) ? 7 : i;
+            if (strcmp(mn, shifts[i]) == 0) return encode_shift(A, ext, &ops[0], &ops[1]);
+        }
+        if (strcmp(mn, "movzx") == 0) return encode_extend(A, false, &ops[0], &ops[1]);
+        if (strcmp(mn, "movsx") == 0) return encode_extend(A, true, &ops[0], &ops[1]);
+        if (strcmp(mn, "movsxd") == 0) {
+            if (ops[1].size != 4 && ops[1].size != 0) return false;
+            Operand s = ops[1];
+            s.size = 4;
+            return encode_extend(A, true, &ops[0], &s);
+        }
+        if (strcmp(mn, "test") == 0) return encode_test(A, &ops[0], &ops[1]);
+        if (strcmp(mn, "lea") == 0) {
+            if (ops[0].kind != OP_REG || ops[0].size == 1 || ops[1].kind != OP_MEM) return false;
+            return emit_rm(A, ops[0].size, 0x8D, ops[0].reg, &ops[0], &ops[1], 0, 0);
+        }
+        if (strncmp(mn, "cmov", 4) == 0) {
+            int cc = find_cc(mn + 4);
+            const Operand* d = &ops[0];
+            if (cc < 0 || d->kind != OP_REG || d->size == 1 || !is_rm(&ops[1])) return false;
+            if (ops[1].size && ops[1].size != d->size) return false;
+            return emit_rm(A, d->size, 0x0F40 + (uint32_t)cc, d->reg, d, &ops[1], 0, 0);
+        }
+    }
+    if (strcmp(mn, "imul") == 0) return encode_imul(A, ops, n);
+    if (n != 1) return false;
+    if (strcmp(mn, "push") == 0) return encode_push_pop(A, true, &ops[0]);
+    if (strcmp(mn, "pop") == 0) return encode_push_pop(A, false, &ops[0]);
+    if (strcmp(mn, "call") == 0) return encode_call_jmp(A, true, &ops[0]);
+    if (strcmp(mn, "jmp") == 0) return encode_call_jmp(A, false, &ops[0]);
+    if (strcmp(mn, "inc") == 0) return encode_unary(A, 0xFE, 0, &ops[0]);
+    if (strcmp(mn, "dec") == 0) return encode_unary(A, 0xFE, 1, &ops[0]);
+    for (int i = 0; i < 8; i++) {
+        if (group3[i] && strcmp(mn, group3[i]) == 0) return encode_unary(A, 0xF6, i, &ops[0]);
+    }
+    if (strcmp(mn, "int") == 0) {
+        if (ops[0].kind != OP_IMM || ops[0].sym != NO_SYM) return false;
+        uint8_t b[2] = {0xCD, (uint8_t)ops[0].value};
+        return put_bytes(A, b, 2);
+    }
+    if (strcmp(mn, "ret") == 0) {
+        if (ops[0].kind != OP_IMM || ops[0].sym != NO_SYM) return false;
+        uint8_t b[3] = {0xC2, (uint8_t)ops[0].value, (uint8_t)(ops[0].value >> 8)};
+        return put_bytes(A, b, 3);
+    }
+    if (mn[0] == 'j') {
+        int cc = find_cc(mn + 1);
+        return cc >= 0 && emit_branch(A, 0x0F80 + (uint32_t)cc, &ops[0]);
+    }
+    if (strncmp(mn, "set", 3) == 0) {
+        int cc = find_cc(mn + 3);
+        if (cc < 0 || !is_rm(&ops[0]) || (ops[0].size != 1 && ops[0].size != 0)) return false;
+        return emit_rm(A, 0, 0x0F90 + (uint32_t)cc, 0, NULL, &ops[0], 0, 0);
+    }
+    return false;
+}
+
+// ---- Directives and data ----
+
+static bool define_label(Asm* A, const char* s, const char* e) {
+    if (*s != '.') A->scope = intern(s, (size_t)(e - s));
+    size_t idx = symbol_ref(A, s, e);
+    ObjSymbol* sym = &A->obj->syms[idx];
+    if (sym->section >= 0) return false;
+    sym->section = A->section;
+    sym->value = section_offset(A);
+    A->obj->sections[A->section].used = true;
+    return true;
+}
+
+// End of the comma-separated item starting at s.
+static const char* item_end(const char* s, const char* e) {
+    int depth = 0;
+    char quote = 0;
+    for (const char* p = s; p < e; p++) {
+        if (quote) {
+            if (*p == quote) quote = 0;
+        } else if (*p == '\'' || *p == '"' || *p == '`') {
+            quote = *p;
+        } else if (*p == '(') {
+            depth++;
+        } else if (*p == ')') {
+            depth--;
+        } else if (*p == ',' && depth == 0) {
+            return p;
+        }
+    }
+    return e;
+}
+
+static bool emit_data(Asm* A, int unit, const char* s, const char* e) {
+    if (A->section == OBJ_BSS) return false;
+    while (s < e) {
+        const char* ve = item_end(s, e);
+        const char* vs = s;
+        s = (ve < e) ? ve + 1 : e;
+        trim(&vs, &ve);
+        if (vs == ve) return false;
+        if (ve - vs >= 2 && (*vs == '\'' || *vs == '"') && ve[-1] == *vs &&
+            !memchr(vs + 1, *vs, (size_t)(ve - vs - 2))) {
+            // A lone string is its bytes, padded to a whole unit.
+            static const uint8_t zeros[8];
+            size_t len = (size_t)(ve - vs - 2);
+            size_t pad = ((size_t)unit - len % (size_t)unit) % (size_t)unit;
+            put_bytes(A, (const uint8_t*)vs + 1, len);
+            put_bytes(A, zeros, pad);
+            continue;
+        }
+        Expr ex;
+        if (!parse_expr(A, vs, ve, &ex)) return false;
+        uint8_t b[8];
+        int n = 0;
+        if (ex.sym != NO_SYM) {
+            if (unit != 8 && unit != 4) return false;
+            ObjReloc rel = {A->section, section_offset(A), ex.sym, unit == 8 ? OBJ_RELOC_ABS64 : OBJ_RELOC_ABS32,
+                            ex.value};
+            obj_add_reloc(A->obj, rel);
+            put_le(b, &n, 0, unit);
+        } else {
+            put_le(b, &n, (uint64_t)ex.value, unit);
+        }
+        put_bytes(A, b, (size_t)n);
+    }
+    return true;
+}
+
+static bool emit_reserve(Asm* A, int unit, const char* s, const char* e) {
+    Expr ex;
+    if (!parse_expr(A, s, e, &ex) || ex.sym != NO_SYM || ex.value < 0) return false;
+    uint64_t bytes = (uint64_t)ex.value * (uint64_t)unit;
+    ObjSection* sec = &A->obj->sections[A->section];
+    sec->used = true;
+    if (A->section == OBJ_BSS) {
+        sec->size += bytes;
+        return true;
+    }
+    // nasm zero-fills reservations outside .bss.
+    static const uint8_t zeros[64];
+    while (bytes > 0) {
+        size_t chunk = bytes < sizeof(zeros) ? (size_t)bytes : sizeof(zeros);
+        put_bytes(A, zeros, chunk);
+        bytes -= chunk;
+    }
+    return true;
+}
+
+static int data_unit(const char* w, char prefix) {
+    if (w[0] != prefix || !w[1] || w[2]) return 0;
+    switch (w[1]) {
+        case 'b': return 1;
+        case 'w': return 2;
+        case 'd': return 4;
+        case 'q': return 8;
+        default: return 0;
+    }
+}
+
+static bool directive_names(Asm* A, const char* s, const char* e, bool is_extern) {
+    const char* starts[MAX_OPERANDS];
+    const char* ends[MAX_OPERANDS];
+    int n = split_operands(s, e, starts, ends);
+    if (n <= 0) return false;
+    for (int i = 0; i < n; i++) {
+        const char* ns = starts[i];
+        const char* ne = ends[i];
+        trim(&ns, &ne);
+        if (ns == ne || ident_end(ns, ne) != ne) return false;
+        size_t idx = symbol_ref(A, ns, ne);
+        ObjSymbol* sym = &A->obj->syms[idx];
+        if (is_extern) sym->is_extern = true;
+        else sym->global = true;
+    }
+    return true;
+}
+
+static bool handle_section(Asm* A, const char* s, const char* e) {
+    trim(&s, &e);
+    static const char* const names[OBJ_NSECTIONS] = {".text", ".data", ".rodata", ".bss"};
+    for (int i = 0; i < OBJ_NSECTIONS; i++) {
+        if ((size_t)(e - s) == strlen(names[i]) && memcmp(s, names[i], (size_t)(e - s)) == 0) {
+            A->section = i;
+            A->obj->sections[i].used = true;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool assemble_line(Asm* A, const char* s, const char* e) {
+    // Strip the comment, minding quotes.
+    char quote = 0;
+    for (const char* p = s; p < e; p++) {
+        if (quote) {
+            if (*p == quote) quote = 0;
+        } else if (*p == '\'' || *p == '"' || *p == '`') {
+            quote = *p;
+        } else if (*p == ';') {
+            e = p;
+            break;
+        }
+    }
+    trim(&s, &e);
+    if (s == e) return true;
+
+    const char* w = ident_end(s, e);
+    if (w == s) return false;
+    char word[MAX_WORD];
+    bool is_word = lower_word(s, w, word);
+    const char* rest = w;
+    while (rest < e && is_space(*rest)) rest++;
+
+    if (rest < e && *rest == ':' && w > s) {
+        if (!define_label(A, s, w)) return false;
+        return assemble_line(A, rest + 1, e);
+    }
+    if (!is_word) return false;
+    if (w < e && !is_space(*w)) return false;
+
+    if (strcmp(word, "section") == 0 || strcmp(word, "segment") == 0) return handle_section(A, rest, e);
+    if (strcmp(word, "global") == 0) return directive_names(A, rest, e, false);
+    if (strcmp(word, "extern") == 0) return directive_names(A, rest, e, true);
+    if (strcmp(word, "default") == 0 || strcmp(word, "bits") == 0) {
+        char arg[MAX_WORD];
+        const char* ae = e;
+        if (!lower_word(rest, ae, arg)) return false;
+        if (word[0] == 'b') return strcmp(arg, "64") == 0;
+        if (strcmp(arg, "rel") == 0) A->default_rel = true;
+        else if (strcmp(arg, "abs") == 0) A->default_rel = false;
+        else return false;
+        return true;
+    }
+    int unit = data_unit(word, 'd');
+    if (unit) return emit_data(A, unit, rest, e);
+    if (strncmp(word, "res", 3) == 0 && (unit = data_unit(word + 2, 's')) != 0) return emit_reserve(A, unit, rest, e);
+
+    Operand ops[MAX_OPERANDS];
+    int n = 0;
+    if (rest < e) {
+        const char* starts[MAX_OPERANDS];
+        const char* ends[MAX_OPERANDS];
+        n = split_operands(rest, e, starts, ends);
+        if (n <= 0) return false;
+        for (int i = 0; i < n; i++) {
+            if (!parse_operand(A, starts[i], ends[i], &ops[i])) return false;
+        }
+    }
+    return encode_instruction(A, word, ops, n);
+}
+
+// Patches rel32 fields whose target is in the same section and turns the
+// rest into relocations; fails on symbols that are neither defined nor
+// declared extern.
+static bool resolve(Asm* A) {
+    ObjFile* obj = A->obj;
+    for (size_t i = 0; i < obj->nsyms; i++) {
+        ObjSymbol* sym = &obj->syms[i];
+        if (sym->is_extern && (sym->section >= 0 || sym->global)) return false;
+        if (sym->global && sym->section < 0) return false;
+    }
+    for (size_t i = 0; i < obj->nrelocs; i++) {
+        const ObjSymbol* sym = &obj->syms[obj->relocs[i].symbol];
+        if (sym->section < 0 && !sym->is_extern) return false;
+    }
+    for (size_t i = 0; i < A->nfixups; i++) {
+        const Fixup* f = &A->fixups[i];
+        const ObjSymbol* sym = &obj->syms[f->symbol];
+        if (sym->section < 0 && !sym->is_extern) return false;
+        if (sym->section == f->section) {
+            int64_t rel = (int64_t)sym->value + f->addend - (int64_t)f->end;
+            if (!fits_i32(rel)) return false;
+            uint8_t b[4];
+            int n = 0;
+            put_le(b, &n, (uint64_t)rel, 4);
+            memcpy(obj->sections[f->section].data.data + f->offset, b, 4);
+            continue;
+        }
+        ObjReloc rel = {f->section, f->offset, f->symbol, OBJ_RELOC_PC32,
+                        f->addend - (int64_t)(f->end - f->offset)};
+        obj_add_reloc(obj, rel);
+    }
+    return true;
+}
+
+bool x86_assemble(const char* text, size_t len, ObjFile* obj) {
+    Asm A = {0};
+    A.obj = obj;
+    A.section = OBJ_TEXT;
+    const char* p = text;
+    const char* end = text + len;
+    bool ok = true;
+    while (ok && p < end) {
+        const char* nl = (const char*)memchr(p, '\n', (size_t)(end - p));
+        if (!nl) nl = end;
+        ok = assemble_line(&A, p, nl);
+        p = nl + 1;
+    }
+    ok = ok && resolve(&A);
+    free(A.fixups);
+    return ok;
+}
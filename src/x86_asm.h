@@ -0,0 +1,18 @@
+#ifndef CHASMC_X86_ASM_H
+#define CHASMC_X86_ASM_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "objfile.h"
+
+// In-process assembler for the NASM subset chasmc emits: section/global/
+// extern/default directives, labels, db..dq and resb..resq data, and the
+// common integer instructions with register, immediate and [base+index*scale
+// +disp] or [rel symbol] operands. Returns false, leaving obj to be freed by
+// the caller, when the text uses anything else (macros, %% labels, odd
+// syntax); the caller then hands the file to nasm, which also reports any
+// real errors.
+bool x86_assemble(const char* text, size_t len, ObjFile* obj);
+
+#endif